@@ -17,18 +17,235 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "qemu/timer.h"
+#include "trace.h"
+#ifdef CONFIG_EPOLL_CREATE1
+#include <sys/epoll.h>
+#endif
 
 struct AioHandler
 {
     GPollFD pfd;
     IOHandler *io_read;
     IOHandler *io_write;
+    AioPollFn *io_poll;
     int deleted;
     int pollfds_idx;
     void *opaque;
     QLIST_ENTRY(AioHandler) node;
 };
 
+#ifdef CONFIG_EPOLL_CREATE1
+
+/*
+ * A context that watches many file descriptors switches from ppoll() to
+ * epoll, so that the kernel keeps the set of watched fds instead of
+ * getting all of them on every aio_poll().  While epoll is in use, the
+ * GSource only watches the epoll fd, too.
+ */
+#define EPOLL_ENABLE_THRESHOLD 64
+
+static int epoll_events_from_pfd(int pfd_events)
+{
+    return (pfd_events & G_IO_IN ? EPOLLIN : 0) |
+           (pfd_events & G_IO_OUT ? EPOLLOUT : 0) |
+           (pfd_events & G_IO_HUP ? EPOLLHUP : 0) |
+           (pfd_events & G_IO_ERR ? EPOLLERR : 0);
+}
+
+static int pfd_events_from_epoll(int epoll_events)
+{
+    return (epoll_events & EPOLLIN ? G_IO_IN : 0) |
+           (epoll_events & EPOLLOUT ? G_IO_OUT : 0) |
+           (epoll_events & EPOLLHUP ? G_IO_HUP : 0) |
+           (epoll_events & EPOLLERR ? G_IO_ERR : 0);
+}
+
+static bool aio_epoll_enabled(AioContext *ctx)
+{
+    return ctx->epoll_enabled;
+}
+
+/* Make the GSource watch either the handlers' fds or the epoll fd */
+static void aio_epoll_set_gsource(AioContext *ctx, bool epoll)
+{
+    AioHandler *node;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (node->deleted) {
+            continue;
+        }
+        if (epoll) {
+            g_source_remove_poll(&ctx->source, &node->pfd);
+        } else {
+            g_source_add_poll(&ctx->source, &node->pfd);
+        }
+    }
+
+    if (epoll) {
+        g_source_add_poll(&ctx->source, &ctx->epoll_pfd);
+    } else {
+        g_source_remove_poll(&ctx->source, &ctx->epoll_pfd);
+    }
+}
+
+/* Go back to ppoll() for good, e.g. because epoll_ctl() failed */
+static void aio_epoll_disable(AioContext *ctx)
+{
+    ctx->epoll_available = false;
+    if (ctx->epoll_enabled) {
+        ctx->epoll_enabled = false;
+        aio_epoll_set_gsource(ctx, false);
+    }
+    if (ctx->epollfd >= 0) {
+        close(ctx->epollfd);
+        ctx->epollfd = -1;
+    }
+}
+
+static bool aio_epoll_try_enable(AioContext *ctx)
+{
+    AioHandler *node;
+    struct epoll_event event;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (node->deleted || !node->pfd.events) {
+            continue;
+        }
+        event.events = epoll_events_from_pfd(node->pfd.events);
+        event.data.ptr = node;
+        if (epoll_ctl(ctx->epollfd, EPOLL_CTL_ADD, node->pfd.fd, &event)) {
+            return false;
+        }
+    }
+
+    ctx->epoll_enabled = true;
+    aio_epoll_set_gsource(ctx, true);
+    trace_aio_epoll_enable(ctx);
+    return true;
+}
+
+static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
+{
+    struct epoll_event event;
+
+    if (!ctx->epoll_enabled) {
+        return;
+    }
+
+    event.events = epoll_events_from_pfd(node->pfd.events);
+    event.data.ptr = node;
+    if (epoll_ctl(ctx->epollfd, is_new ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+                  node->pfd.fd, &event)) {
+        aio_epoll_disable(ctx);
+    }
+}
+
+static void aio_epoll_remove(AioContext *ctx, AioHandler *node)
+{
+    /* May fail if the fd was closed already, which removed it anyway */
+    epoll_ctl(ctx->epollfd, EPOLL_CTL_DEL, node->pfd.fd, NULL);
+}
+
+/* Decides whether aio_poll() uses epoll, given the number of fds to watch */
+static bool aio_epoll_check_poll(AioContext *ctx, unsigned npfd)
+{
+    if (!ctx->epoll_available) {
+        return false;
+    }
+    if (ctx->epoll_enabled) {
+        return true;
+    }
+    if (npfd >= EPOLL_ENABLE_THRESHOLD) {
+        if (aio_epoll_try_enable(ctx)) {
+            return true;
+        }
+        aio_epoll_disable(ctx);
+    }
+    return false;
+}
+
+/* Waits for events and stores them in the revents of the handlers */
+static int aio_epoll_wait(AioContext *ctx, int64_t timeout)
+{
+    struct epoll_event events[128];
+    AioHandler *node;
+    int i, ret;
+
+    if (timeout > 0) {
+        /* epoll_wait() only has millisecond resolution */
+        GPollFD pfd = {
+            .fd = ctx->epollfd,
+            .events = G_IO_IN,
+        };
+
+        ret = qemu_poll_ns(&pfd, 1, timeout);
+        if (ret <= 0) {
+            return ret;
+        }
+        timeout = 0;
+    }
+
+    ret = epoll_wait(ctx->epollfd, events, ARRAY_SIZE(events),
+                     timeout < 0 ? -1 : 0);
+    for (i = 0; i < ret; i++) {
+        node = events[i].data.ptr;
+        node->pfd.revents |= pfd_events_from_epoll(events[i].events);
+    }
+    return ret;
+}
+
+void aio_context_setup(AioContext *ctx)
+{
+    ctx->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    ctx->epoll_available = ctx->epollfd >= 0;
+    ctx->epoll_enabled = false;
+    ctx->epoll_pfd.fd = ctx->epollfd;
+    ctx->epoll_pfd.events = G_IO_IN;
+}
+
+void aio_context_destroy(AioContext *ctx)
+{
+    if (ctx->epollfd >= 0) {
+        close(ctx->epollfd);
+    }
+}
+
+#else
+
+static bool aio_epoll_enabled(AioContext *ctx)
+{
+    return false;
+}
+
+static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
+{
+}
+
+static void aio_epoll_remove(AioContext *ctx, AioHandler *node)
+{
+}
+
+static bool aio_epoll_check_poll(AioContext *ctx, unsigned npfd)
+{
+    return false;
+}
+
+static int aio_epoll_wait(AioContext *ctx, int64_t timeout)
+{
+    abort();
+}
+
+void aio_context_setup(AioContext *ctx)
+{
+}
+
+void aio_context_destroy(AioContext *ctx)
+{
+}
+
+#endif /* CONFIG_EPOLL_CREATE1 */
+
 static AioHandler *find_aio_handler(AioContext *ctx, int fd)
 {
     AioHandler *node;
@@ -49,13 +266,18 @@ void aio_set_fd_handler(AioContext *ctx,
                         void *opaque)
 {
     AioHandler *node;
+    bool is_new = false;
 
     node = find_aio_handler(ctx, fd);
 
     /* Are we deleting the fd handler? */
     if (!io_read && !io_write) {
         if (node) {
-            g_source_remove_poll(&ctx->source, &node->pfd);
+            if (aio_epoll_enabled(ctx)) {
+                aio_epoll_remove(ctx, node);
+            } else {
+                g_source_remove_poll(&ctx->source, &node->pfd);
+            }
 
             /* If the lock is held, just mark the node as deleted */
             if (ctx->walking_handlers) {
@@ -76,8 +298,11 @@ void aio_set_fd_handler(AioContext *ctx,
             node = g_malloc0(sizeof(AioHandler));
             node->pfd.fd = fd;
             QLIST_INSERT_HEAD(&ctx->aio_handlers, node, node);
+            is_new = true;
 
-            g_source_add_poll(&ctx->source, &node->pfd);
+            if (!aio_epoll_enabled(ctx)) {
+                g_source_add_poll(&ctx->source, &node->pfd);
+            }
         }
         /* Update handler with latest information */
         node->io_read = io_read;
@@ -87,6 +312,8 @@ void aio_set_fd_handler(AioContext *ctx,
 
         node->pfd.events = (io_read ? G_IO_IN | G_IO_HUP | G_IO_ERR : 0);
         node->pfd.events |= (io_write ? G_IO_OUT | G_IO_ERR : 0);
+
+        aio_epoll_update(ctx, node, is_new);
     }
 
     aio_notify(ctx);
@@ -100,10 +327,32 @@ void aio_set_event_notifier(AioContext *ctx,
                        (IOHandler *)io_read, NULL, notifier);
 }
 
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll)
+{
+    AioHandler *node;
+
+    node = find_aio_handler(ctx, fd);
+    assert(node);
+    node->io_poll = io_poll;
+}
+
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll)
+{
+    aio_set_fd_poll(ctx, event_notifier_get_fd(notifier), io_poll);
+}
+
 bool aio_pending(AioContext *ctx)
 {
     AioHandler *node;
 
+    /* The GSource only saw the epoll fd, fetch the actual events */
+    if (aio_epoll_enabled(ctx) && ctx->epoll_pfd.revents) {
+        ctx->epoll_pfd.revents = 0;
+        aio_epoll_wait(ctx, 0);
+    }
+
     QLIST_FOREACH(node, &ctx->aio_handlers, node) {
         int revents;
 
@@ -172,11 +421,108 @@ static bool aio_dispatch(AioContext *ctx)
     return progress;
 }
 
+/* Polling is only useful if it can see every event the context waits for */
+static bool aio_handlers_pollable(AioContext *ctx)
+{
+    AioHandler *node;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->pfd.events && !node->io_poll) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Calls the poll function of every handler once.  Handlers that report
+ * work are marked readable so that aio_dispatch() runs them.
+ */
+static bool run_poll_handlers_once(AioContext *ctx)
+{
+    AioHandler *node;
+    bool ready = false;
+
+    ctx->walking_handlers++;
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->io_poll && node->io_read &&
+            node->io_poll(node->opaque)) {
+            node->pfd.revents |= G_IO_IN;
+            ready = true;
+        }
+    }
+    ctx->walking_handlers--;
+
+    return ready;
+}
+
+/*
+ * Busy-waits for up to @max_ns nanoseconds for a handler to report work.
+ * Returns true if one did; ppoll() is then done without blocking.
+ */
+static bool run_poll_handlers(AioContext *ctx, int64_t max_ns)
+{
+    int64_t end_time;
+    bool ready;
+
+    if (!aio_handlers_pollable(ctx)) {
+        return false;
+    }
+
+    trace_run_poll_handlers_begin(ctx, max_ns);
+
+    end_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + max_ns;
+    do {
+        ready = run_poll_handlers_once(ctx);
+    } while (!ready && qemu_clock_get_ns(QEMU_CLOCK_REALTIME) < end_time);
+
+    trace_run_poll_handlers_end(ctx, ready);
+    return ready;
+}
+
+/*
+ * Adjusts the polling time after a blocking aio_poll() that took @block_ns
+ * to see an event.  If events arrive within the polling time, polling
+ * stays as it is; if they take longer than poll_max_ns, polling is
+ * wasted and shrinks; in between, polling grows until it catches them.
+ */
+static void aio_poll_adjust(AioContext *ctx, int64_t block_ns)
+{
+    int64_t old = ctx->poll_ns;
+
+    if (block_ns <= ctx->poll_ns) {
+        /* This is the sweet spot, no adjustment needed */
+        return;
+    } else if (block_ns > ctx->poll_max_ns) {
+        /* We'd have to poll for too long, poll less */
+        if (ctx->poll_shrink) {
+            ctx->poll_ns /= ctx->poll_shrink;
+        } else {
+            ctx->poll_ns = 0;
+        }
+        if (ctx->poll_ns != old) {
+            trace_poll_shrink(ctx, old, ctx->poll_ns);
+        }
+    } else if (ctx->poll_ns < ctx->poll_max_ns) {
+        /* There is room to grow, poll longer */
+        if (ctx->poll_ns == 0) {
+            ctx->poll_ns = AIO_POLL_INITIAL_NS;
+        } else {
+            ctx->poll_ns *= ctx->poll_grow ? ctx->poll_grow : 2;
+        }
+        if (ctx->poll_ns > ctx->poll_max_ns) {
+            ctx->poll_ns = ctx->poll_max_ns;
+        }
+        trace_poll_grow(ctx, old, ctx->poll_ns);
+    }
+}
+
 bool aio_poll(AioContext *ctx, bool blocking)
 {
     AioHandler *node;
     int ret;
-    bool progress;
+    bool progress, use_epoll;
+    int64_t timeout, start = 0;
 
     progress = false;
 
@@ -202,33 +548,58 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     g_array_set_size(ctx->pollfds, 0);
 
-    /* fill pollfds */
-    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
-        node->pollfds_idx = -1;
-        if (!node->deleted && node->pfd.events) {
-            GPollFD pfd = {
-                .fd = node->pfd.fd,
-                .events = node->pfd.events,
-            };
-            node->pollfds_idx = ctx->pollfds->len;
-            g_array_append_val(ctx->pollfds, pfd);
+    /* fill pollfds, unless epoll keeps track of them */
+    use_epoll = aio_epoll_enabled(ctx);
+    if (!use_epoll) {
+        QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+            node->pollfds_idx = -1;
+            if (!node->deleted && node->pfd.events) {
+                GPollFD pfd = {
+                    .fd = node->pfd.fd,
+                    .events = node->pfd.events,
+                };
+                node->pollfds_idx = ctx->pollfds->len;
+                g_array_append_val(ctx->pollfds, pfd);
+            }
         }
+        use_epoll = aio_epoll_check_poll(ctx, ctx->pollfds->len);
     }
 
     ctx->walking_handlers--;
 
+    timeout = blocking ? timerlistgroup_deadline_ns(&ctx->tlg) : 0;
+    if (timeout && ctx->poll_max_ns) {
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        if (ctx->poll_ns &&
+            run_poll_handlers(ctx, timeout < 0 ? ctx->poll_ns :
+                                   MIN(ctx->poll_ns, timeout))) {
+            timeout = 0;
+        } else if (timeout > 0) {
+            timeout = MAX(timeout - (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                                     start), 0);
+        }
+    }
+
     /* wait until next event */
-    ret = qemu_poll_ns((GPollFD *)ctx->pollfds->data,
-                         ctx->pollfds->len,
-                         blocking ? timerlistgroup_deadline_ns(&ctx->tlg) : 0);
+    if (use_epoll) {
+        ret = aio_epoll_wait(ctx, timeout);
+    } else {
+        ret = qemu_poll_ns((GPollFD *)ctx->pollfds->data,
+                             ctx->pollfds->len,
+                             timeout);
+    }
+
+    if (start) {
+        aio_poll_adjust(ctx, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
+    }
 
     /* if we have any readable fds, dispatch event */
-    if (ret > 0) {
+    if (ret > 0 && !use_epoll) {
         QLIST_FOREACH(node, &ctx->aio_handlers, node) {
             if (node->pollfds_idx != -1) {
                 GPollFD *pfd = &g_array_index(ctx->pollfds, GPollFD,
                                               node->pollfds_idx);
-                node->pfd.revents = pfd->revents;
+                node->pfd.revents |= pfd->revents;
             }
         }
     }
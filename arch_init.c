@@ -24,6 +24,8 @@
 #include <stdint.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <math.h>
+#include <zlib.h>
 #ifndef _WIN32
 #include <sys/types.h>
 #include <sys/mman.h>
@@ -33,6 +35,7 @@
 #include "sysemu/sysemu.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
+#include "qemu/hbitmap.h"
 #include "sysemu/arch_init.h"
 #include "audio/audio.h"
 #include "hw/i386/pc.h"
@@ -44,6 +47,7 @@
 #include "exec/address-spaces.h"
 #include "hw/audio/pcspk.h"
 #include "migration/page_cache.h"
+#include "migration/postcopy-ram.h"
 #include "qemu/config-file.h"
 #include "qemu/error-report.h"
 #include "qmp-commands.h"
@@ -52,6 +56,9 @@
 #include "exec/ram_addr.h"
 #include "hw/acpi/acpi.h"
 #include "qemu/host-utils.h"
+#include "qemu/sockets.h"
+#include "qemu/atomic.h"
+#include "hw/xen/xen.h"
 
 #ifdef DEBUG_ARCH_INIT
 #define DPRINTF(fmt, ...) \
@@ -107,16 +114,18 @@ int graphic_depth = 32;
 #endif
 
 const uint32_t arch_type = QEMU_ARCH;
-static bool mig_throttle_on;
-static int dirty_rate_high_cnt;
-static void check_guest_throttling(void);
+static int mig_throttle_percentage;
+static void mig_throttle_update(uint64_t dirty_pages, uint64_t bytes_xfer,
+                                int64_t period_ms);
+static void mig_throttle_stop(void);
 
 static uint64_t bitmap_sync_count;
 
 /***********************************************************/
 /* ram save/restore */
 
-#define RAM_SAVE_FLAG_FULL     0x01 /* Obsolete, not used anymore */
+/* 0x01 was RAM_SAVE_FLAG_FULL, which has not been sent since QEMU 0.13 */
+#define RAM_SAVE_FLAG_PAGES    0x01
 #define RAM_SAVE_FLAG_COMPRESS 0x02
 #define RAM_SAVE_FLAG_MEM_SIZE 0x04
 #define RAM_SAVE_FLAG_PAGE     0x08
@@ -124,6 +133,11 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_CONTINUE 0x20
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
+#define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+#define RAM_SAVE_FLAG_MULTIFD_SYNC     0x200
+
+/* Largest number of pages in a RAM_SAVE_FLAG_PAGES record */
+#define RAM_PAGE_RUN_MAX 64
 
 static struct defconfig_file {
     const char *filename;
@@ -195,7 +209,6 @@ static void XBZRLE_cache_unlock(void)
  */
 int64_t xbzrle_cache_resize(int64_t new_size)
 {
-    PageCache *new_cache;
     int64_t ret;
 
     if (new_size < TARGET_PAGE_SIZE) {
@@ -208,16 +221,12 @@ int64_t xbzrle_cache_resize(int64_t new_size)
         if (pow2floor(new_size) == migrate_xbzrle_cache_size()) {
             goto out_new_size;
         }
-        new_cache = cache_init(new_size / TARGET_PAGE_SIZE,
-                                        TARGET_PAGE_SIZE);
-        if (!new_cache) {
-            error_report("Error creating cache");
+        /* keep the most recently used pages across the resize */
+        if (cache_resize(XBZRLE.cache, new_size / TARGET_PAGE_SIZE) < 0) {
+            error_report("Error resizing cache");
             ret = -1;
             goto out;
         }
-
-        cache_fini(XBZRLE.cache);
-        XBZRLE.cache = new_cache;
     }
 
 out_new_size:
@@ -227,6 +236,62 @@ out:
     return ret;
 }
 
+/* Multi-thread compression.
+ *
+ * The migration thread hands each page to an idle compression thread,
+ * which deflates it into a private QEMUFile buffer.  The buffer is
+ * copied to the migration stream the next time the thread is picked,
+ * or when flush_compressed_data() drains all threads.  Compressed pages
+ * always carry their RAMBlock id, so only the order of pages across
+ * RAMBlock boundaries (and across iterations) has to be preserved.
+ */
+typedef struct CompressParam {
+    /* Protected by mutex */
+    bool quit;
+    uint8_t *p;
+    RAMBlock *block;
+    ram_addr_t offset;
+    QemuMutex mutex;
+    QemuCond cond;
+    /* Protected by comp_done_lock */
+    bool done;
+    /* Only touched by the thread while !done */
+    QEMUFile *file;
+    uint8_t *originbuf;
+} CompressParam;
+
+typedef struct DecompressParam {
+    /* Protected by mutex */
+    bool quit;
+    void *des;
+    int len;
+    QemuMutex mutex;
+    QemuCond cond;
+    /* Protected by decomp_done_lock */
+    bool done;
+    int ret;
+    /* Only touched by the thread while !done */
+    uint8_t *compbuf;
+} DecompressParam;
+
+static CompressParam *comp_param;
+static QemuThread *compress_threads;
+static int compress_thread_count;
+/* comp_done_cond is used to wake up the migration thread when
+ * one of the compression threads has finished the compression.
+ * comp_done_lock is used to co-work with comp_done_cond.
+ */
+static QemuMutex comp_done_lock;
+static QemuCond comp_done_cond;
+/* The empty QEMUFileOps will be used by file in CompressParam */
+static const QEMUFileOps empty_ops = { };
+
+static DecompressParam *decomp_param;
+static QemuThread *decompress_threads;
+static int decompress_thread_count;
+static QemuMutex decomp_done_lock;
+static QemuCond decomp_done_cond;
+
 /* accounting for migration statistics */
 typedef struct AccountingInfo {
     uint64_t dup_pages;
@@ -235,9 +300,18 @@ typedef struct AccountingInfo {
     uint64_t iterations;
     uint64_t xbzrle_bytes;
     uint64_t xbzrle_pages;
+    uint64_t xbzrle_cache_hit;
     uint64_t xbzrle_cache_miss;
+    uint64_t xbzrle_cache_eviction;
     double xbzrle_cache_miss_rate;
     uint64_t xbzrle_overflows;
+    uint64_t compress_pages;
+    /* Bytes put on the stream, for query-migrate-stats */
+    uint64_t dup_bytes;
+    uint64_t compress_bytes;
+    uint64_t throttle_events;
+    /* XBZRLE encoding time of the current ram_save_iterate, in ns */
+    int64_t xbzrle_encode_time;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
@@ -247,6 +321,19 @@ static void acct_clear(void)
     memset(&acct_info, 0, sizeof(acct_info));
 }
 
+void ram_page_stats(MigrationPageStats *stats)
+{
+    stats->zero_pages = acct_info.dup_pages;
+    stats->zero_bytes = acct_info.dup_bytes;
+    stats->normal_pages = acct_info.norm_pages;
+    stats->normal_bytes = acct_info.norm_pages * TARGET_PAGE_SIZE;
+    stats->xbzrle_pages = acct_info.xbzrle_pages;
+    stats->xbzrle_bytes = acct_info.xbzrle_bytes;
+    stats->compressed_pages = acct_info.compress_pages;
+    stats->compressed_bytes = acct_info.compress_bytes;
+    stats->throttle_events = acct_info.throttle_events;
+}
+
 uint64_t dup_mig_bytes_transferred(void)
 {
     return acct_info.dup_pages * TARGET_PAGE_SIZE;
@@ -287,16 +374,45 @@ uint64_t xbzrle_mig_pages_transferred(void)
     return acct_info.xbzrle_pages;
 }
 
+uint64_t xbzrle_mig_pages_cache_hit(void)
+{
+    return acct_info.xbzrle_cache_hit;
+}
+
 uint64_t xbzrle_mig_pages_cache_miss(void)
 {
     return acct_info.xbzrle_cache_miss;
 }
 
+uint64_t xbzrle_mig_pages_cache_eviction(void)
+{
+    return acct_info.xbzrle_cache_eviction;
+}
+
 double xbzrle_mig_cache_miss_rate(void)
 {
     return acct_info.xbzrle_cache_miss_rate;
 }
 
+RamBlockSyncStatsList *ram_block_sync_stats(void)
+{
+    RamBlockSyncStatsList *head = NULL, **tail = &head;
+    RAMBlock *block;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        RamBlockSyncStatsList *entry = g_malloc0(sizeof(*entry));
+
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->name = g_strdup(block->idstr);
+        entry->value->dirty_pages = block->sync_dirty_pages;
+        entry->value->sync_time = block->sync_time;
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    return head;
+}
+
 uint64_t xbzrle_mig_pages_overflow(void)
 {
     return acct_info.xbzrle_overflows;
@@ -319,17 +435,1179 @@ static size_t save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
     return size;
 }
 
+static uint64_t bytes_transferred;
+
+static void do_compress_ram_page(CompressParam *param)
+{
+    ssize_t blen;
+
+    /* deflate() may read its input more than once, so work on a private
+     * copy of the page; the guest keeps running and may modify it.
+     */
+    memcpy(param->originbuf, param->p, TARGET_PAGE_SIZE);
+
+    save_block_hdr(param->file, param->block, param->offset, 0,
+                   RAM_SAVE_FLAG_COMPRESS_PAGE);
+    blen = qemu_put_compression_data(param->file, param->originbuf,
+                                     TARGET_PAGE_SIZE,
+                                     migrate_compress_level());
+    if (blen == 0) {
+        qemu_file_set_error(param->file, -EIO);
+    }
+}
+
+static void *do_data_compress(void *opaque)
+{
+    CompressParam *param = opaque;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (param->block) {
+            qemu_mutex_unlock(&param->mutex);
+
+            do_compress_ram_page(param);
+
+            qemu_mutex_lock(&param->mutex);
+            param->block = NULL;
+            qemu_mutex_unlock(&param->mutex);
+
+            qemu_mutex_lock(&comp_done_lock);
+            param->done = true;
+            qemu_cond_signal(&comp_done_cond);
+            qemu_mutex_unlock(&comp_done_lock);
+
+            qemu_mutex_lock(&param->mutex);
+        } else {
+            qemu_cond_wait(&param->cond, &param->mutex);
+        }
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+void migrate_compress_threads_create(void)
+{
+    int i;
+
+    if (!migrate_use_compression()) {
+        return;
+    }
+    compress_thread_count = migrate_compress_threads();
+    compress_threads = g_new0(QemuThread, compress_thread_count);
+    comp_param = g_new0(CompressParam, compress_thread_count);
+    qemu_mutex_init(&comp_done_lock);
+    qemu_cond_init(&comp_done_cond);
+    for (i = 0; i < compress_thread_count; i++) {
+        /* comp_param[i].file is just used as a dummy buffer to save data,
+         * set its ops to empty.
+         */
+        comp_param[i].file = qemu_fopen_ops(NULL, &empty_ops);
+        comp_param[i].originbuf = g_malloc(TARGET_PAGE_SIZE);
+        comp_param[i].done = true;
+        qemu_mutex_init(&comp_param[i].mutex);
+        qemu_cond_init(&comp_param[i].cond);
+        qemu_thread_create(compress_threads + i, "compress",
+                           do_data_compress, comp_param + i,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+void migrate_compress_threads_join(void)
+{
+    int i;
+
+    if (!comp_param) {
+        return;
+    }
+    for (i = 0; i < compress_thread_count; i++) {
+        qemu_mutex_lock(&comp_param[i].mutex);
+        comp_param[i].quit = true;
+        qemu_cond_signal(&comp_param[i].cond);
+        qemu_mutex_unlock(&comp_param[i].mutex);
+    }
+    for (i = 0; i < compress_thread_count; i++) {
+        qemu_thread_join(compress_threads + i);
+        qemu_fclose(comp_param[i].file);
+        g_free(comp_param[i].originbuf);
+        qemu_mutex_destroy(&comp_param[i].mutex);
+        qemu_cond_destroy(&comp_param[i].cond);
+    }
+    qemu_mutex_destroy(&comp_done_lock);
+    qemu_cond_destroy(&comp_done_cond);
+    g_free(compress_threads);
+    g_free(comp_param);
+    compress_threads = NULL;
+    comp_param = NULL;
+    compress_thread_count = 0;
+}
+
+/* Copy the output of an idle compression thread to the migration stream.
+ * Returns the number of bytes written.
+ */
+static int compress_param_flush(QEMUFile *f, CompressParam *param)
+{
+    int ret = qemu_file_get_error(param->file);
+
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return 0;
+    }
+    ret = qemu_put_qemu_file(f, param->file);
+    acct_info.compress_bytes += ret;
+    return ret;
+}
+
+static void flush_compressed_data(QEMUFile *f)
+{
+    int idx;
+
+    if (!comp_param) {
+        return;
+    }
+
+    qemu_mutex_lock(&comp_done_lock);
+    for (idx = 0; idx < compress_thread_count; idx++) {
+        while (!comp_param[idx].done) {
+            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
+        }
+    }
+    qemu_mutex_unlock(&comp_done_lock);
+
+    for (idx = 0; idx < compress_thread_count; idx++) {
+        bytes_transferred += compress_param_flush(f, &comp_param[idx]);
+    }
+}
+
+/*
+ * compress_page_with_multi_thread: hand a page to an idle compression
+ * thread, waiting for one if all of them are busy.
+ *
+ * Returns: Number of bytes of previously compressed data written to f.
+ */
+static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
+                                           ram_addr_t offset, uint8_t *p)
+{
+    int idx, bytes_sent = -1;
+
+    qemu_mutex_lock(&comp_done_lock);
+    while (bytes_sent < 0) {
+        for (idx = 0; idx < compress_thread_count; idx++) {
+            if (comp_param[idx].done) {
+                comp_param[idx].done = false;
+                bytes_sent = compress_param_flush(f, &comp_param[idx]);
+
+                qemu_mutex_lock(&comp_param[idx].mutex);
+                comp_param[idx].block = block;
+                comp_param[idx].offset = offset;
+                comp_param[idx].p = p;
+                qemu_cond_signal(&comp_param[idx].cond);
+                qemu_mutex_unlock(&comp_param[idx].mutex);
+                break;
+            }
+        }
+        if (bytes_sent < 0) {
+            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
+        }
+    }
+    qemu_mutex_unlock(&comp_done_lock);
+
+    acct_info.compress_pages++;
+    return bytes_sent;
+}
+
+static void *do_data_decompress(void *opaque)
+{
+    DecompressParam *param = opaque;
+    unsigned long pagesize;
+    void *des;
+    int len, ret;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (param->des) {
+            des = param->des;
+            len = param->len;
+            param->des = NULL;
+            qemu_mutex_unlock(&param->mutex);
+
+            pagesize = TARGET_PAGE_SIZE;
+            ret = uncompress((Bytef *)des, &pagesize,
+                             (const Bytef *)param->compbuf, len);
+
+            qemu_mutex_lock(&decomp_done_lock);
+            if (ret != Z_OK || pagesize != TARGET_PAGE_SIZE) {
+                param->ret = -EINVAL;
+            }
+            param->done = true;
+            qemu_cond_signal(&decomp_done_cond);
+            qemu_mutex_unlock(&decomp_done_lock);
+
+            qemu_mutex_lock(&param->mutex);
+        } else {
+            qemu_cond_wait(&param->cond, &param->mutex);
+        }
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+void migrate_decompress_threads_create(void)
+{
+    int i;
+
+    if (!migrate_use_compression()) {
+        return;
+    }
+    decompress_thread_count = migrate_decompress_threads();
+    decompress_threads = g_new0(QemuThread, decompress_thread_count);
+    decomp_param = g_new0(DecompressParam, decompress_thread_count);
+    qemu_mutex_init(&decomp_done_lock);
+    qemu_cond_init(&decomp_done_cond);
+    for (i = 0; i < decompress_thread_count; i++) {
+        decomp_param[i].compbuf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
+        decomp_param[i].done = true;
+        qemu_mutex_init(&decomp_param[i].mutex);
+        qemu_cond_init(&decomp_param[i].cond);
+        qemu_thread_create(decompress_threads + i, "decompress",
+                           do_data_decompress, decomp_param + i,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+void migrate_decompress_threads_join(void)
+{
+    int i;
+
+    if (!decomp_param) {
+        return;
+    }
+    for (i = 0; i < decompress_thread_count; i++) {
+        qemu_mutex_lock(&decomp_param[i].mutex);
+        decomp_param[i].quit = true;
+        qemu_cond_signal(&decomp_param[i].cond);
+        qemu_mutex_unlock(&decomp_param[i].mutex);
+    }
+    for (i = 0; i < decompress_thread_count; i++) {
+        qemu_thread_join(decompress_threads + i);
+        qemu_mutex_destroy(&decomp_param[i].mutex);
+        qemu_cond_destroy(&decomp_param[i].cond);
+        g_free(decomp_param[i].compbuf);
+    }
+    qemu_mutex_destroy(&decomp_done_lock);
+    qemu_cond_destroy(&decomp_done_cond);
+    g_free(decompress_threads);
+    g_free(decomp_param);
+    decompress_threads = NULL;
+    decomp_param = NULL;
+    decompress_thread_count = 0;
+}
+
+/* Wait until every queued page has been decompressed into guest RAM.
+ * Returns 0 on success, negative errno if any page failed to decompress.
+ */
+static int wait_for_decompress_done(void)
+{
+    int idx, ret = 0;
+
+    if (!decomp_param) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&decomp_done_lock);
+    for (idx = 0; idx < decompress_thread_count; idx++) {
+        while (!decomp_param[idx].done) {
+            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+        }
+        if (decomp_param[idx].ret < 0) {
+            ret = decomp_param[idx].ret;
+        }
+    }
+    qemu_mutex_unlock(&decomp_done_lock);
+
+    return ret;
+}
+
+/* Read a compressed page of len bytes from f straight into the buffer of an
+ * idle decompression thread and let it inflate the page into host.
+ */
+static void decompress_data_with_multi_threads(QEMUFile *f, void *host,
+                                               int len)
+{
+    DecompressParam *param = NULL;
+    int idx;
+
+    qemu_mutex_lock(&decomp_done_lock);
+    while (!param) {
+        for (idx = 0; idx < decompress_thread_count; idx++) {
+            if (decomp_param[idx].done) {
+                decomp_param[idx].done = false;
+                param = &decomp_param[idx];
+                break;
+            }
+        }
+        if (!param) {
+            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+        }
+    }
+    qemu_mutex_unlock(&decomp_done_lock);
+
+    /* qemu_get_buffer() may yield, so do not hold any lock here */
+    qemu_get_buffer(f, param->compbuf, len);
+
+    qemu_mutex_lock(&param->mutex);
+    param->des = host;
+    param->len = len;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+}
+
+/*
+ * Multiple fd migration
+ *
+ * With the multifd capability, normal pages do not go through the main
+ * migration stream.  The migration thread collects them in batches of up to
+ * MULTIFD_PAGES_PER_PACKET pages of one RAMBlock and hands each batch to an
+ * idle channel thread, which writes it to its own TCP connection.  Zero
+ * pages, XBZRLE pages and all device state still use the main stream.
+ *
+ * Each channel carries a header (magic, version, channel count, channel id)
+ * followed by packets:
+ *
+ *   be32 flags, be32 number of pages,
+ *   and, if there are any pages: RAMBlock id, be64 offset of each page,
+ *   the page data.
+ *
+ * A page is sent at most once between two syncs of the dirty bitmap.  After
+ * every sync the source puts a SYNC packet on every channel and a
+ * RAM_SAVE_FLAG_MULTIFD_SYNC record on the main stream; the destination does
+ * not read past that record until all its channels have got their SYNC
+ * packet, so an old copy of a page can never overwrite a newer one.
+ */
+
+#define MULTIFD_MAGIC 0x4d554c54 /* "MULT" */
+#define MULTIFD_VERSION 1
+#define MULTIFD_PAGES_PER_PACKET 64
+
+#define MULTIFD_FLAG_SYNC 0x1
+#define MULTIFD_FLAG_EOS  0x2
+
+typedef struct MultiFDSendParam {
+    int id;
+    QemuThread thread;
+    QemuCond cond;
+    /* Protected by multifd_send_lock */
+    bool quit;
+    bool done;
+    bool error;
+    QEMUFile *file;
+    /* Only touched by the thread while !done */
+    uint32_t flags;
+    RAMBlock *block;
+    uint8_t *host;
+    int num;
+    ram_addr_t offset[MULTIFD_PAGES_PER_PACKET];
+} MultiFDSendParam;
+
+static MultiFDSendParam *multifd_send_param;
+static int multifd_send_count;
+/* The channel to try first for the next batch */
+static int multifd_send_next;
+/* multifd_send_done_cond wakes up the migration thread when a channel has
+ * finished sending its packet.
+ */
+static QemuMutex multifd_send_lock;
+static QemuCond multifd_send_done_cond;
+/* The batch being filled by the migration thread */
+static RAMBlock *multifd_pending_block;
+static uint8_t *multifd_pending_host;
+static int multifd_pending_num;
+static ram_addr_t multifd_pending_offset[MULTIFD_PAGES_PER_PACKET];
+/* Set when the dirty bitmap has been synced since the last SYNC */
+static bool multifd_need_sync;
+
+typedef struct MultiFDRecvParam {
+    int id;
+    QemuThread thread;
+    QemuSemaphore sem_release;
+    /* Protected by multifd_recv_lock */
+    QEMUFile *file;
+} MultiFDRecvParam;
+
+static MultiFDRecvParam *multifd_recv_param;
+static int multifd_recv_count;
+static int multifd_recv_listen_fd = -1;
+static QemuMutex multifd_recv_lock;
+/* Posted by every channel when it gets a SYNC packet or fails */
+static QemuSemaphore multifd_recv_sem_sync;
+static bool multifd_recv_quit;
+static int multifd_recv_error;
+
+static int multifd_send_packet(QEMUFile *f, uint32_t flags, RAMBlock *block,
+                               uint8_t *host, int num, ram_addr_t *offset)
+{
+    int i;
+
+    qemu_put_be32(f, flags);
+    qemu_put_be32(f, num);
+    if (num) {
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        for (i = 0; i < num; i++) {
+            qemu_put_be64(f, offset[i]);
+        }
+        for (i = 0; i < num; i++) {
+            qemu_put_buffer_async(f, host + offset[i], TARGET_PAGE_SIZE);
+        }
+    }
+    qemu_fflush(f);
+
+    return qemu_file_get_error(f);
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParam *p = opaque;
+    MigrationState *s = migrate_get_current();
+    Error *local_err = NULL;
+    QEMUFile *f = NULL;
+    bool send_eos;
+    int fd, ret;
+
+    fd = inet_connect(s->multifd_host_port, &local_err);
+    if (fd < 0) {
+        error_report("multifd channel %d: %s", p->id,
+                     error_get_pretty(local_err));
+        error_free(local_err);
+    } else {
+        f = qemu_fopen_socket(fd, "wb");
+        qemu_put_be32(f, MULTIFD_MAGIC);
+        qemu_put_be32(f, MULTIFD_VERSION);
+        qemu_put_be32(f, multifd_send_count);
+        qemu_put_be32(f, p->id);
+        qemu_fflush(f);
+    }
+
+    qemu_mutex_lock(&multifd_send_lock);
+    p->file = f;
+    p->error = !f || qemu_file_get_error(f);
+    p->done = true;
+    qemu_cond_signal(&multifd_send_done_cond);
+    while (!p->error) {
+        if (!p->done) {
+            qemu_mutex_unlock(&multifd_send_lock);
+
+            ret = multifd_send_packet(f, p->flags, p->block, p->host,
+                                      p->num, p->offset);
+
+            qemu_mutex_lock(&multifd_send_lock);
+            p->error = ret < 0;
+            p->done = true;
+            qemu_cond_signal(&multifd_send_done_cond);
+        } else if (p->quit) {
+            break;
+        } else {
+            qemu_cond_wait(&p->cond, &multifd_send_lock);
+        }
+    }
+    send_eos = !p->error;
+    qemu_mutex_unlock(&multifd_send_lock);
+
+    if (send_eos) {
+        multifd_send_packet(f, MULTIFD_FLAG_EOS, NULL, NULL, 0, NULL);
+    }
+
+    return NULL;
+}
+
+void migrate_multifd_send_threads_create(void)
+{
+    int i;
+
+    if (!migrate_use_multifd()) {
+        return;
+    }
+    multifd_send_count = migrate_multifd_channels();
+    multifd_send_param = g_new0(MultiFDSendParam, multifd_send_count);
+    multifd_send_next = 0;
+    multifd_pending_block = NULL;
+    multifd_pending_num = 0;
+    multifd_need_sync = false;
+    qemu_mutex_init(&multifd_send_lock);
+    qemu_cond_init(&multifd_send_done_cond);
+    for (i = 0; i < multifd_send_count; i++) {
+        multifd_send_param[i].id = i;
+        qemu_cond_init(&multifd_send_param[i].cond);
+        qemu_thread_create(&multifd_send_param[i].thread, "multifd_send",
+                           multifd_send_thread, multifd_send_param + i,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+void migrate_multifd_send_threads_join(void)
+{
+    MigrationState *s = migrate_get_current();
+    int i;
+
+    if (!multifd_send_param) {
+        return;
+    }
+    qemu_mutex_lock(&multifd_send_lock);
+    for (i = 0; i < multifd_send_count; i++) {
+        multifd_send_param[i].quit = true;
+        qemu_cond_signal(&multifd_send_param[i].cond);
+        /* Don't wait for a destination that is not reading any more */
+        if (!migration_has_finished(s) && multifd_send_param[i].file) {
+            qemu_file_shutdown(multifd_send_param[i].file);
+        }
+    }
+    qemu_mutex_unlock(&multifd_send_lock);
+    for (i = 0; i < multifd_send_count; i++) {
+        qemu_thread_join(&multifd_send_param[i].thread);
+        if (multifd_send_param[i].file) {
+            qemu_fclose(multifd_send_param[i].file);
+        }
+        qemu_cond_destroy(&multifd_send_param[i].cond);
+    }
+    qemu_mutex_destroy(&multifd_send_lock);
+    qemu_cond_destroy(&multifd_send_done_cond);
+    g_free(multifd_send_param);
+    multifd_send_param = NULL;
+    multifd_send_count = 0;
+}
+
+/* Give a packet to channel p, which must be idle.
+ * Called with multifd_send_lock held.
+ */
+static void multifd_send_start(MultiFDSendParam *p, uint32_t flags, int num)
+{
+    p->flags = flags;
+    p->block = multifd_pending_block;
+    p->host = multifd_pending_host;
+    p->num = num;
+    memcpy(p->offset, multifd_pending_offset, num * sizeof(ram_addr_t));
+    p->done = false;
+    qemu_cond_signal(&p->cond);
+}
+
+/* Hand the pending batch to the next idle channel, waiting for one if all
+ * of them are busy.
+ */
+static void multifd_send_flush(QEMUFile *f)
+{
+    MultiFDSendParam *p = NULL;
+    int i;
+
+    if (!multifd_pending_num) {
+        return;
+    }
+
+    qemu_mutex_lock(&multifd_send_lock);
+    while (!p) {
+        for (i = 0; i < multifd_send_count; i++) {
+            MultiFDSendParam *c = &multifd_send_param[(multifd_send_next + i) %
+                                                      multifd_send_count];
+            if (c->error) {
+                qemu_file_set_error(f, -EIO);
+                goto out;
+            }
+            if (c->done) {
+                p = c;
+                break;
+            }
+        }
+        if (!p) {
+            qemu_cond_wait(&multifd_send_done_cond, &multifd_send_lock);
+        }
+    }
+    multifd_send_next = (p->id + 1) % multifd_send_count;
+    multifd_send_start(p, 0, multifd_pending_num);
+out:
+    qemu_mutex_unlock(&multifd_send_lock);
+    multifd_pending_num = 0;
+}
+
+/* Send everything queued so far and mark the end of this round on every
+ * channel and on the main stream.
+ */
+static void multifd_send_sync(QEMUFile *f)
+{
+    int i;
+
+    multifd_send_flush(f);
+
+    qemu_mutex_lock(&multifd_send_lock);
+    for (i = 0; i < multifd_send_count; i++) {
+        MultiFDSendParam *p = &multifd_send_param[i];
+
+        while (!p->done) {
+            qemu_cond_wait(&multifd_send_done_cond, &multifd_send_lock);
+        }
+        if (p->error) {
+            qemu_file_set_error(f, -EIO);
+            break;
+        }
+        multifd_send_start(p, MULTIFD_FLAG_SYNC, 0);
+    }
+    qemu_mutex_unlock(&multifd_send_lock);
+
+    trace_multifd_send_sync(bitmap_sync_count);
+    multifd_need_sync = false;
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+    bytes_transferred += 8;
+    /* The destination waits for its channels when it reads the record,
+     * and they may be waiting for it; don't let it sit in our buffer.
+     */
+    qemu_fflush(f);
+}
+
+/*
+ * multifd_queue_page: add a page to the batch for the next channel
+ *
+ * Returns: Number of bytes that will be sent for the page.
+ */
+static int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
+{
+    /* Offset plus page; the packet header is small enough to ignore */
+    int bytes_sent = 8 + TARGET_PAGE_SIZE;
+
+    if (multifd_pending_num && block != multifd_pending_block) {
+        multifd_send_flush(f);
+    }
+    multifd_pending_block = block;
+    multifd_pending_host = memory_region_get_ram_ptr(block->mr);
+    multifd_pending_offset[multifd_pending_num++] = offset;
+    if (multifd_pending_num == MULTIFD_PAGES_PER_PACKET) {
+        multifd_send_flush(f);
+    }
+
+    /* Keep bandwidth calculation and rate limiting aware of the channels */
+    qemu_update_position(f, bytes_sent);
+    qemu_file_acct_rate_limit(f, bytes_sent);
+    acct_info.norm_pages++;
+
+    return bytes_sent;
+}
+
+static int multifd_recv_packet(QEMUFile *f, uint32_t *flags)
+{
+    ram_addr_t offset[MULTIFD_PAGES_PER_PACKET];
+    RAMBlock *block;
+    uint8_t *host;
+    char id[256];
+    int num, len, i, ret;
+
+    *flags = qemu_get_be32(f);
+    num = qemu_get_be32(f);
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        return ret;
+    }
+    if (num < 0 || num > MULTIFD_PAGES_PER_PACKET) {
+        error_report("multifd: invalid number of pages %d", num);
+        return -EINVAL;
+    }
+    if (!num) {
+        return 0;
+    }
+
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)id, len);
+    id[len] = 0;
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (!strncmp(id, block->idstr, sizeof(id))) {
+            break;
+        }
+    }
+    if (!block) {
+        error_report("multifd: unknown ramblock \"%s\"", id);
+        return -EINVAL;
+    }
+    host = memory_region_get_ram_ptr(block->mr);
+
+    for (i = 0; i < num; i++) {
+        offset[i] = qemu_get_be64(f);
+        if (offset[i] >= block->length || (offset[i] & ~TARGET_PAGE_MASK)) {
+            error_report("multifd: invalid offset " RAM_ADDR_FMT
+                         " in ramblock \"%s\"", offset[i], id);
+            return -EINVAL;
+        }
+    }
+    for (i = 0; i < num; i++) {
+        qemu_get_buffer(f, host + offset[i], TARGET_PAGE_SIZE);
+    }
+
+    return qemu_file_get_error(f);
+}
+
+static int multifd_recv_handshake(MultiFDRecvParam *p, QEMUFile *f)
+{
+    uint32_t magic, version, count, id;
+
+    magic = qemu_get_be32(f);
+    version = qemu_get_be32(f);
+    count = qemu_get_be32(f);
+    id = qemu_get_be32(f);
+    if (qemu_file_get_error(f)) {
+        return qemu_file_get_error(f);
+    }
+    if (magic != MULTIFD_MAGIC || version != MULTIFD_VERSION) {
+        error_report("multifd channel %d: bad magic %x or version %u",
+                     p->id, magic, version);
+        return -EINVAL;
+    }
+    if (count != multifd_recv_count || id >= count) {
+        error_report("multifd channel %d: source uses %u channels, "
+                     "expected %d", p->id, count, multifd_recv_count);
+        return -EINVAL;
+    }
+    trace_multifd_recv_channel(p->id, id);
+
+    return 0;
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvParam *p = opaque;
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    QEMUFile *f;
+    uint32_t flags;
+    bool quit;
+    int fd, ret;
+
+    do {
+        fd = qemu_accept(multifd_recv_listen_fd, (struct sockaddr *)&addr,
+                         &addrlen);
+        ret = -socket_error();
+    } while (fd < 0 && ret == -EINTR);
+    if (fd < 0) {
+        goto out;
+    }
+
+    qemu_set_block(fd);
+    f = qemu_fopen_socket(fd, "rb");
+    qemu_mutex_lock(&multifd_recv_lock);
+    p->file = f;
+    quit = multifd_recv_quit;
+    qemu_mutex_unlock(&multifd_recv_lock);
+    if (quit) {
+        return NULL;
+    }
+
+    ret = multifd_recv_handshake(p, f);
+    while (!ret) {
+        ret = multifd_recv_packet(f, &flags);
+        if (ret < 0 || (flags & MULTIFD_FLAG_EOS)) {
+            break;
+        }
+        if (flags & MULTIFD_FLAG_SYNC) {
+            qemu_sem_post(&multifd_recv_sem_sync);
+            qemu_sem_wait(&p->sem_release);
+            if (atomic_read(&multifd_recv_quit)) {
+                break;
+            }
+        }
+    }
+
+out:
+    if (ret < 0 && !atomic_read(&multifd_recv_quit)) {
+        error_report("multifd channel %d: receive failed: %s", p->id,
+                     strerror(-ret));
+        atomic_set(&multifd_recv_error, ret);
+        qemu_sem_post(&multifd_recv_sem_sync);
+    }
+
+    return NULL;
+}
+
+void migrate_multifd_recv_threads_create(int listen_fd)
+{
+    int i;
+
+    multifd_recv_count = migrate_multifd_channels();
+    multifd_recv_param = g_new0(MultiFDRecvParam, multifd_recv_count);
+    multifd_recv_listen_fd = listen_fd;
+    multifd_recv_quit = false;
+    multifd_recv_error = 0;
+    /* The channel threads wait in accept() */
+    qemu_set_block(listen_fd);
+    qemu_mutex_init(&multifd_recv_lock);
+    qemu_sem_init(&multifd_recv_sem_sync, 0);
+    for (i = 0; i < multifd_recv_count; i++) {
+        multifd_recv_param[i].id = i;
+        qemu_sem_init(&multifd_recv_param[i].sem_release, 0);
+        qemu_thread_create(&multifd_recv_param[i].thread, "multifd_recv",
+                           multifd_recv_thread, multifd_recv_param + i,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+void migrate_multifd_recv_threads_join(void)
+{
+    int i;
+
+    if (!multifd_recv_param) {
+        return;
+    }
+    qemu_mutex_lock(&multifd_recv_lock);
+    atomic_set(&multifd_recv_quit, true);
+    /* Wake up threads still in accept() or reading */
+    shutdown(multifd_recv_listen_fd, SHUT_RDWR);
+    for (i = 0; i < multifd_recv_count; i++) {
+        if (multifd_recv_param[i].file) {
+            qemu_file_shutdown(multifd_recv_param[i].file);
+        }
+        qemu_sem_post(&multifd_recv_param[i].sem_release);
+    }
+    qemu_mutex_unlock(&multifd_recv_lock);
+    for (i = 0; i < multifd_recv_count; i++) {
+        qemu_thread_join(&multifd_recv_param[i].thread);
+        if (multifd_recv_param[i].file) {
+            qemu_fclose(multifd_recv_param[i].file);
+        }
+        qemu_sem_destroy(&multifd_recv_param[i].sem_release);
+    }
+    closesocket(multifd_recv_listen_fd);
+    multifd_recv_listen_fd = -1;
+    qemu_mutex_destroy(&multifd_recv_lock);
+    qemu_sem_destroy(&multifd_recv_sem_sync);
+    g_free(multifd_recv_param);
+    multifd_recv_param = NULL;
+    multifd_recv_count = 0;
+}
+
+/* Wait until every channel has received all pages sent before the SYNC
+ * record just read from the main stream, then let them carry on.
+ */
+static int multifd_recv_sync(void)
+{
+    int i, ret;
+
+    if (!multifd_recv_param) {
+        error_report("multifd sync without multifd channels");
+        return -EINVAL;
+    }
+    for (i = 0; i < multifd_recv_count; i++) {
+        qemu_sem_wait(&multifd_recv_sem_sync);
+        ret = atomic_read(&multifd_recv_error);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    for (i = 0; i < multifd_recv_count; i++) {
+        qemu_sem_post(&multifd_recv_param[i].sem_release);
+    }
+
+    return 0;
+}
+
+/*
+ * Migration to a file
+ *
+ * With a file: URI guest pages do not go through the migration stream at
+ * all.  Every page has a fixed place in the file (see migration-file.c), so
+ * a pool of writer threads can pwrite() them in any order.  The migration
+ * thread collects runs of up to FILE_PAGES_PER_WRITE contiguous pages of
+ * one RAMBlock and hands each run to an idle writer.  A page dirtied again
+ * is simply written again in a later round; the pool is drained at the end
+ * of every iteration, so two copies of the same page are never in flight at
+ * the same time.
+ */
+
+#define FILE_PAGES_PER_WRITE 64
+
+typedef struct FileWriteParam {
+    QemuThread thread;
+    QemuCond cond;
+    /* Protected by file_write_lock */
+    bool quit;
+    bool done;
+    /* Only touched by the thread while !done */
+    uint8_t *host;
+    off_t pos;
+    size_t len;
+} FileWriteParam;
+
+static FileWriteParam *file_write_param;
+static int file_write_count;
+static int file_write_fd = -1;
+static int64_t file_write_ram_offset;
+/* file_write_done_cond wakes up the migration thread when a writer has
+ * finished its run.
+ */
+static QemuMutex file_write_lock;
+static QemuCond file_write_done_cond;
+/* First error of any writer, protected by file_write_lock */
+static int file_write_error;
+/* The run being collected by the migration thread */
+static RAMBlock *file_pending_block;
+static ram_addr_t file_pending_offset;
+static int file_pending_num;
+
+static int file_write_run(int fd, uint8_t *host, off_t pos, size_t len)
+{
+    ssize_t ret;
+
+    while (len) {
+        ret = pwrite(fd, host, len, pos);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        host += ret;
+        pos += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+static void *file_write_thread(void *opaque)
+{
+    FileWriteParam *p = opaque;
+    int ret;
+
+    qemu_mutex_lock(&file_write_lock);
+    while (true) {
+        if (!p->done) {
+            qemu_mutex_unlock(&file_write_lock);
+
+            ret = file_write_run(file_write_fd, p->host, p->pos, p->len);
+
+            qemu_mutex_lock(&file_write_lock);
+            if (ret < 0 && !file_write_error) {
+                file_write_error = ret;
+            }
+            p->done = true;
+            qemu_cond_signal(&file_write_done_cond);
+        } else if (p->quit) {
+            break;
+        } else {
+            qemu_cond_wait(&p->cond, &file_write_lock);
+        }
+    }
+    qemu_mutex_unlock(&file_write_lock);
+
+    return NULL;
+}
+
+static void ram_file_writers_create(int fd, int64_t ram_offset)
+{
+    int i;
+
+    file_write_count = migrate_file_threads();
+    file_write_param = g_new0(FileWriteParam, file_write_count);
+    file_write_fd = fd;
+    file_write_ram_offset = ram_offset;
+    file_write_error = 0;
+    file_pending_block = NULL;
+    file_pending_num = 0;
+    qemu_mutex_init(&file_write_lock);
+    qemu_cond_init(&file_write_done_cond);
+    for (i = 0; i < file_write_count; i++) {
+        file_write_param[i].done = true;
+        qemu_cond_init(&file_write_param[i].cond);
+        qemu_thread_create(&file_write_param[i].thread, "file_write",
+                           file_write_thread, file_write_param + i,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void ram_file_writers_join(void)
+{
+    int i;
+
+    if (!file_write_param) {
+        return;
+    }
+    qemu_mutex_lock(&file_write_lock);
+    for (i = 0; i < file_write_count; i++) {
+        file_write_param[i].quit = true;
+        qemu_cond_signal(&file_write_param[i].cond);
+    }
+    qemu_mutex_unlock(&file_write_lock);
+    for (i = 0; i < file_write_count; i++) {
+        qemu_thread_join(&file_write_param[i].thread);
+        qemu_cond_destroy(&file_write_param[i].cond);
+    }
+    qemu_mutex_destroy(&file_write_lock);
+    qemu_cond_destroy(&file_write_done_cond);
+    g_free(file_write_param);
+    file_write_param = NULL;
+    file_write_count = 0;
+    file_write_fd = -1;
+}
+
+/* Hand the pending run to an idle writer, waiting for one if all of them
+ * are busy.
+ */
+static void ram_file_flush(QEMUFile *f)
+{
+    FileWriteParam *p = NULL;
+    int i;
+
+    if (!file_pending_num) {
+        return;
+    }
+
+    qemu_mutex_lock(&file_write_lock);
+    while (!p && !file_write_error) {
+        for (i = 0; i < file_write_count; i++) {
+            if (file_write_param[i].done) {
+                p = &file_write_param[i];
+                break;
+            }
+        }
+        if (!p) {
+            qemu_cond_wait(&file_write_done_cond, &file_write_lock);
+        }
+    }
+    if (file_write_error) {
+        qemu_file_set_error(f, file_write_error);
+    } else {
+        p->host = memory_region_get_ram_ptr(file_pending_block->mr) +
+                  file_pending_offset;
+        p->pos = file_write_ram_offset + file_pending_block->offset +
+                 file_pending_offset;
+        p->len = (size_t)file_pending_num * TARGET_PAGE_SIZE;
+        p->done = false;
+        qemu_cond_signal(&p->cond);
+    }
+    qemu_mutex_unlock(&file_write_lock);
+    file_pending_num = 0;
+}
+
+/* Write out everything queued so far and wait for it to reach the file */
+static void ram_file_drain(QEMUFile *f)
+{
+    int i;
+
+    if (!file_write_param) {
+        return;
+    }
+    ram_file_flush(f);
+
+    qemu_mutex_lock(&file_write_lock);
+    for (i = 0; i < file_write_count; i++) {
+        while (!file_write_param[i].done) {
+            qemu_cond_wait(&file_write_done_cond, &file_write_lock);
+        }
+    }
+    if (file_write_error) {
+        qemu_file_set_error(f, file_write_error);
+    }
+    qemu_mutex_unlock(&file_write_lock);
+}
+
+/*
+ * ram_file_queue_page: add a page to the run for the next writer
+ *
+ * Returns: Number of bytes that will be written for the page.
+ */
+static int ram_file_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
+{
+    if (file_pending_num &&
+        (block != file_pending_block ||
+         offset != file_pending_offset +
+                   (ram_addr_t)file_pending_num * TARGET_PAGE_SIZE)) {
+        ram_file_flush(f);
+    }
+    if (!file_pending_num) {
+        file_pending_block = block;
+        file_pending_offset = offset;
+    }
+    if (++file_pending_num == FILE_PAGES_PER_WRITE) {
+        ram_file_flush(f);
+    }
+
+    /* Keep bandwidth calculation and rate limiting aware of the writers */
+    qemu_update_position(f, TARGET_PAGE_SIZE);
+    qemu_file_acct_rate_limit(f, TARGET_PAGE_SIZE);
+    acct_info.norm_pages++;
+
+    return TARGET_PAGE_SIZE;
+}
+
+/*
+ * Load a RAMBlock from a file written by a file: migration.  The block is
+ * mapped copy-on-write straight from the file where possible, so that only
+ * the pages the guest touches are ever read; otherwise it is read in.
+ */
+static int ram_file_load_block(RAMBlock *block, int fd, int64_t ram_offset,
+                               int64_t ram_size)
+{
+    uint8_t *host = memory_region_get_ram_ptr(block->mr);
+    off_t pos = ram_offset + block->offset;
+    ram_addr_t done;
+    ssize_t len;
+
+    if (block->offset + block->length > ram_size) {
+        error_report("RAM block %s is beyond the end of the migration file",
+                     block->idstr);
+        return -EINVAL;
+    }
+
+#ifndef _WIN32
+    /* File backed RAM (-mem-path) must keep its own backing */
+    if (!xen_enabled() && block->fd < 0 &&
+        !(((uintptr_t)host | pos | block->length) & (getpagesize() - 1)) &&
+        mmap(host, block->length, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_FIXED, fd, pos) != MAP_FAILED) {
+        trace_ram_file_load_block(block->idstr, true);
+        return 0;
+    }
+#endif
+
+    trace_ram_file_load_block(block->idstr, false);
+    for (done = 0; done < block->length; done += len) {
+        len = pread(fd, host + done, block->length - done, pos + done);
+        if (len < 0 && errno == EINTR) {
+            len = 0;
+            continue;
+        }
+        if (len <= 0) {
+            error_report("Failed to read RAM block %s from the migration file",
+                         block->idstr);
+            return len < 0 ? -errno : -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
 /* This is the last block that we have visited serching for dirty pages
  */
 static RAMBlock *last_seen_block;
 /* This is the last block from where we have sent data */
 static RAMBlock *last_sent_block;
 static ram_addr_t last_offset;
-static unsigned long *migration_bitmap;
-static uint64_t migration_dirty_pages;
+/* One bit per target page of ram_addr_t space; the upper levels of the
+ * HBitmap let us skip clean regions without scanning them.
+ */
+static HBitmap *migration_bitmap;
 static uint32_t last_version;
 static bool ram_bulk_stage;
 
+/*
+ * Pages the destination has faulted on during postcopy and asked for
+ * over the return path; they are sent ahead of the background walk of
+ * the dirty bitmap.
+ */
+typedef struct RAMSrcPageRequest {
+    char idstr[256];
+    ram_addr_t offset;
+    ram_addr_t len;
+    QSIMPLEQ_ENTRY(RAMSrcPageRequest) next_req;
+} RAMSrcPageRequest;
+
+static QemuMutex src_page_req_mutex;
+static QSIMPLEQ_HEAD(src_page_requests, RAMSrcPageRequest) src_page_requests =
+    QSIMPLEQ_HEAD_INITIALIZER(src_page_requests);
+
 /* Update the xbzrle cache to reflect a page that's been sent as all 0.
  * The important thing is that a stale (not-yet-0'd) page be replaced
  * by the new data.
@@ -344,7 +1622,9 @@ static void xbzrle_cache_zero_page(ram_addr_t current_addr)
 
     /* We don't care if this fails to allocate a new cache page
      * as long as it updated an old one */
-    cache_insert(XBZRLE.cache, current_addr, ZERO_TARGET_PAGE);
+    if (cache_insert(XBZRLE.cache, current_addr, ZERO_TARGET_PAGE) == 1) {
+        acct_info.xbzrle_cache_eviction++;
+    }
 }
 
 #define ENCODING_FLAG_XBZRLE 0x1
@@ -354,14 +1634,21 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
                             ram_addr_t offset, int cont, bool last_stage)
 {
     int encoded_len = 0, bytes_sent = -1;
+    int ret;
     uint8_t *prev_cached_page;
+    int64_t encode_start;
 
-    if (!cache_is_cached(XBZRLE.cache, current_addr)) {
+    prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
+    if (!prev_cached_page) {
         acct_info.xbzrle_cache_miss++;
         if (!last_stage) {
-            if (cache_insert(XBZRLE.cache, current_addr, *current_data) == -1) {
+            ret = cache_insert(XBZRLE.cache, current_addr, *current_data);
+            if (ret == -1) {
                 return -1;
             } else {
+                if (ret == 1) {
+                    acct_info.xbzrle_cache_eviction++;
+                }
                 /* update *current_data when the page has been
                    inserted into cache */
                 *current_data = get_cached_data(XBZRLE.cache, current_addr);
@@ -369,16 +1656,18 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
         }
         return -1;
     }
-
-    prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
+    acct_info.xbzrle_cache_hit++;
 
     /* save current buffer into memory */
     memcpy(XBZRLE.current_buf, *current_data, TARGET_PAGE_SIZE);
 
     /* XBZRLE encoding (if there is no overflow) */
+    encode_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     encoded_len = xbzrle_encode_buffer(prev_cached_page, XBZRLE.current_buf,
                                        TARGET_PAGE_SIZE, XBZRLE.encoded_buf,
                                        TARGET_PAGE_SIZE);
+    acct_info.xbzrle_encode_time +=
+        qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - encode_start;
     if (encoded_len == 0) {
         DPRINTF("Skipping unmodified page\n");
         return 0;
@@ -418,68 +1707,99 @@ ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
     unsigned long nr = base + (start >> TARGET_PAGE_BITS);
     uint64_t mr_size = TARGET_PAGE_ALIGN(memory_region_size(mr));
     unsigned long size = base + (mr_size >> TARGET_PAGE_BITS);
+    HBitmapIter hbi;
+    int64_t next;
 
-    unsigned long next;
+    if (nr >= size) {
+        return mr_size;
+    }
 
     if (ram_bulk_stage && nr > base) {
         next = nr + 1;
     } else {
-        next = find_next_bit(migration_bitmap, size, nr);
+        hbitmap_iter_init(&hbi, migration_bitmap, nr);
+        next = hbitmap_iter_next(&hbi);
+        if (next < 0 || next > size) {
+            next = size;
+        }
     }
 
     if (next < size) {
-        clear_bit(next, migration_bitmap);
-        migration_dirty_pages--;
+        hbitmap_reset(migration_bitmap, next, 1);
     }
     return (next - base) << TARGET_PAGE_BITS;
 }
 
+static inline bool migration_bitmap_test_and_reset_dirty(MemoryRegion *mr,
+                                                        ram_addr_t offset)
+{
+    uint64_t nr = (mr->ram_addr + offset) >> TARGET_PAGE_BITS;
+
+    if (!hbitmap_get(migration_bitmap, nr)) {
+        return false;
+    }
+    hbitmap_reset(migration_bitmap, nr, 1);
+    return true;
+}
+
 static inline bool migration_bitmap_set_dirty(ram_addr_t addr)
 {
-    bool ret;
-    int nr = addr >> TARGET_PAGE_BITS;
+    uint64_t nr = addr >> TARGET_PAGE_BITS;
 
-    ret = test_and_set_bit(nr, migration_bitmap);
+    if (hbitmap_get(migration_bitmap, nr)) {
+        return true;
+    }
+    hbitmap_set(migration_bitmap, nr, 1);
+    return false;
+}
+
+/* Move the dirty bit of one page from the global dirty log to the
+ * migration bitmap.  Returns true if the page became dirty there.
+ */
+static bool migration_bitmap_sync_page(unsigned long page)
+{
+    ram_addr_t addr = (ram_addr_t)page << TARGET_PAGE_BITS;
 
-    if (!ret) {
-        migration_dirty_pages++;
+    if (!cpu_physical_memory_get_dirty(addr, TARGET_PAGE_SIZE,
+                                       DIRTY_MEMORY_MIGRATION)) {
+        return false;
     }
-    return ret;
+    cpu_physical_memory_reset_dirty(addr, TARGET_PAGE_SIZE,
+                                    DIRTY_MEMORY_MIGRATION);
+    return !migration_bitmap_set_dirty(addr);
 }
 
-static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
+/*
+ * Move the dirty bits of a range of ram_addr_t space from the global
+ * dirty log to the migration bitmap.
+ *
+ * Returns: the number of pages that became dirty in the migration bitmap.
+ */
+static uint64_t migration_bitmap_sync_range(ram_addr_t start,
+                                            ram_addr_t length)
 {
-    ram_addr_t addr;
-    unsigned long page = BIT_WORD(start >> TARGET_PAGE_BITS);
-
-    /* start address is aligned at the start of a word? */
-    if (((page * BITS_PER_LONG) << TARGET_PAGE_BITS) == start) {
-        int k;
-        int nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
-        unsigned long *src = ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION];
-
-        for (k = page; k < page + nr; k++) {
-            if (src[k]) {
-                unsigned long new_dirty;
-                new_dirty = ~migration_bitmap[k];
-                migration_bitmap[k] |= src[k];
-                new_dirty &= src[k];
-                migration_dirty_pages += ctpopl(new_dirty);
-                src[k] = 0;
-            }
-        }
-    } else {
-        for (addr = 0; addr < length; addr += TARGET_PAGE_SIZE) {
-            if (cpu_physical_memory_get_dirty(start + addr,
-                                              TARGET_PAGE_SIZE,
-                                              DIRTY_MEMORY_MIGRATION)) {
-                cpu_physical_memory_reset_dirty(start + addr,
-                                                TARGET_PAGE_SIZE,
-                                                DIRTY_MEMORY_MIGRATION);
-                migration_bitmap_set_dirty(start + addr);
-            }
+    unsigned long page = start >> TARGET_PAGE_BITS;
+    unsigned long end = page + (length >> TARGET_PAGE_BITS);
+    unsigned long *src = ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION];
+    uint64_t num_dirty = 0;
+
+    /* Unaligned head and tail, one page at a time */
+    while (page < end && (page & (BITS_PER_LONG - 1))) {
+        num_dirty += migration_bitmap_sync_page(page++);
+    }
+    while (page < end && (end & (BITS_PER_LONG - 1))) {
+        num_dirty += migration_bitmap_sync_page(--end);
+    }
+
+    /* Whole words; clean words cost a single load */
+    for (page = BIT_WORD(page); page < BIT_WORD(end); page++) {
+        if (src[page]) {
+            num_dirty += hbitmap_set_word(migration_bitmap, page, src[page]);
+            src[page] = 0;
         }
     }
+
+    return num_dirty;
 }
 
 
@@ -488,17 +1808,19 @@ static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
 static void migration_bitmap_sync(void)
 {
     RAMBlock *block;
-    uint64_t num_dirty_pages_init = migration_dirty_pages;
+    uint64_t num_dirty_pages = 0;
     MigrationState *s = migrate_get_current();
     static int64_t start_time;
     static int64_t bytes_xfer_prev;
     static int64_t num_dirty_pages_period;
     int64_t end_time;
     int64_t bytes_xfer_now;
+    int64_t sync_start, block_start, block_end;
     static uint64_t xbzrle_cache_miss_prev;
     static uint64_t iterations_prev;
 
     bitmap_sync_count++;
+    multifd_need_sync = multifd_send_param != NULL;
 
     if (!bytes_xfer_prev) {
         bytes_xfer_prev = ram_bytes_transferred();
@@ -509,36 +1831,38 @@ static void migration_bitmap_sync(void)
     }
 
     trace_migration_bitmap_sync_start();
+    sync_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     address_space_sync_dirty_bitmap(&address_space_memory);
 
+    block_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        migration_bitmap_sync_range(block->mr->ram_addr, block->length);
+        block->sync_dirty_pages =
+            migration_bitmap_sync_range(block->mr->ram_addr, block->length);
+        block_end = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        block->sync_time = (block_end - block_start) / 1000;
+        trace_migration_bitmap_sync_block(block->idstr,
+                                          block->sync_dirty_pages,
+                                          block->sync_time);
+        num_dirty_pages += block->sync_dirty_pages;
+        block_start = block_end;
     }
-    trace_migration_bitmap_sync_end(migration_dirty_pages
-                                    - num_dirty_pages_init);
-    num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
+    s->dirty_sync_time = (block_start - sync_start) / 1000;
+    migration_phase_record(MIGRATION_PHASE_BITMAP_SYNC,
+                           block_start - sync_start);
+    trace_migration_bitmap_sync_end(num_dirty_pages);
+    num_dirty_pages_period += num_dirty_pages;
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
     /* more than 1 second = 1000 millisecons */
     if (end_time > start_time + 1000) {
         if (migrate_auto_converge()) {
-            /* The following detection logic can be refined later. For now:
-               Check to see if the dirtied bytes is 50% more than the approx.
-               amount of bytes that just got transferred since the last time we
-               were in this routine. If that happens >N times (for now N==4)
-               we turn on the throttle down logic */
             bytes_xfer_now = ram_bytes_transferred();
-            if (s->dirty_pages_rate &&
-               (num_dirty_pages_period * TARGET_PAGE_SIZE >
-                   (bytes_xfer_now - bytes_xfer_prev)/2) &&
-               (dirty_rate_high_cnt++ > 4)) {
-                    trace_migration_throttle();
-                    mig_throttle_on = true;
-                    dirty_rate_high_cnt = 0;
-             }
-             bytes_xfer_prev = bytes_xfer_now;
+            mig_throttle_update(num_dirty_pages_period,
+                                bytes_xfer_now - bytes_xfer_prev,
+                                end_time - start_time);
+            bytes_xfer_prev = bytes_xfer_now;
         } else {
-             mig_throttle_on = false;
+            mig_throttle_stop();
         }
         if (migrate_use_xbzrle()) {
             if (iterations_prev != 0) {
@@ -559,26 +1883,76 @@ static void migration_bitmap_sync(void)
     }
 }
 
+/*
+ * ram_save_page_run: Send the page at p together with the dirty, non-zero
+ * pages following it in the same RAMBlock as one RAM_SAVE_FLAG_PAGES
+ * record.  The pages are contiguous in guest RAM, so they reach the socket
+ * as a single iovec.
+ *
+ * Returns: Number of bytes written; *offset is moved to the last page sent.
+ */
+static int ram_save_page_run(QEMUFile *f, RAMBlock *block, ram_addr_t *offset,
+                             int cont, uint8_t *p)
+{
+    uint64_t nr = (block->mr->ram_addr + *offset) >> TARGET_PAGE_BITS;
+    uint64_t max = (block->length - *offset) >> TARGET_PAGE_BITS;
+    int pages = 1;
+    int bytes_sent;
+
+    while (pages < MIN(max, RAM_PAGE_RUN_MAX) &&
+           hbitmap_get(migration_bitmap, nr + pages) &&
+           !is_zero_range(p + pages * TARGET_PAGE_SIZE, TARGET_PAGE_SIZE)) {
+        pages++;
+    }
+    if (pages > 1) {
+        hbitmap_reset(migration_bitmap, nr + 1, pages - 1);
+    }
+
+    bytes_sent = save_block_hdr(f, block, *offset, cont, RAM_SAVE_FLAG_PAGES);
+    qemu_put_be32(f, pages);
+    qemu_put_buffer_async(f, p, pages * TARGET_PAGE_SIZE);
+    bytes_sent += 4 + pages * TARGET_PAGE_SIZE;
+    acct_info.norm_pages += pages;
+    *offset += (ram_addr_t)(pages - 1) * TARGET_PAGE_SIZE;
+
+    return bytes_sent;
+}
+
 /*
  * ram_save_page: Send the given page to the stream
  *
+ * With the page-runs capability the dirty pages following it may be sent
+ * along; *offset is then moved to the last page sent.
+ *
  * Returns: Number of bytes written.
  */
-static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
+static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t *offsetp,
                          bool last_stage)
 {
     int bytes_sent;
     int cont;
+    ram_addr_t offset = *offsetp;
     ram_addr_t current_addr;
     MemoryRegion *mr = block->mr;
     uint8_t *p;
     int ret;
     bool send_async = true;
+    bool send_run = false;
 
     cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
 
     p = memory_region_get_ram_ptr(mr) + offset;
 
+    if (file_write_param) {
+        /* The file has a place for every page; nothing goes on the stream */
+        if (ram_bulk_stage && is_zero_range(p, TARGET_PAGE_SIZE)) {
+            /* The file starts out empty, so leave a hole */
+            acct_info.dup_pages++;
+            return 0;
+        }
+        return ram_file_queue_page(f, block, offset);
+    }
+
     /* In doubt sent page as normal */
     bytes_sent = -1;
     ret = ram_control_save_page(f, block->offset,
@@ -601,10 +1975,13 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
                                     RAM_SAVE_FLAG_COMPRESS);
         qemu_put_byte(f, 0);
         bytes_sent++;
+        acct_info.dup_bytes += bytes_sent;
         /* Must let xbzrle know, otherwise a previous (now 0'd) cached
          * page would be stale
          */
         xbzrle_cache_zero_page(current_addr);
+    } else if (migration_in_postcopy(migrate_get_current())) {
+        /* The destination places whole pages, nothing can be encoded */
     } else if (!ram_bulk_stage && migrate_use_xbzrle()) {
         bytes_sent = save_xbzrle_page(f, &p, current_addr, block,
                                       offset, cont, last_stage);
@@ -614,10 +1991,28 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
              */
             send_async = false;
         }
+    } else if (comp_param) {
+        bytes_sent = compress_page_with_multi_thread(f, block, offset, p);
+        if (bytes_sent > 0) {
+            last_sent_block = block;
+        }
+        XBZRLE_cache_unlock();
+        return bytes_sent;
+    } else {
+        send_run = migrate_use_page_runs();
+    }
+
+    if (bytes_sent == -1 && send_async && multifd_send_param) {
+        /* Doesn't touch the main stream, so last_sent_block stays */
+        bytes_sent = multifd_queue_page(f, block, offset);
+        XBZRLE_cache_unlock();
+        return bytes_sent;
     }
 
-    /* XBZRLE overflow or normal page */
-    if (bytes_sent == -1) {
+    if (send_run) {
+        bytes_sent = ram_save_page_run(f, block, offsetp, cont, p);
+    } else if (bytes_sent == -1) {
+        /* XBZRLE overflow or normal page */
         bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
         if (send_async) {
             qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
@@ -627,12 +2022,121 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
         bytes_sent += TARGET_PAGE_SIZE;
         acct_info.norm_pages++;
     }
+    if (bytes_sent > 0) {
+        last_sent_block = block;
+    }
 
     XBZRLE_cache_unlock();
 
     return bytes_sent;
 }
 
+/*
+ * Queue the pages for transmission, e.g. a request from postcopy destination
+ *   rbname: The RAMBlock the request is for
+ *   start: Offset from the start of the RAMBlock
+ *   len: Length (in bytes) to send
+ *   Return: 0 on success
+ */
+int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len)
+{
+    RAMSrcPageRequest *new_entry;
+
+    trace_ram_save_queue_pages(rbname, start, len);
+    if (strlen(rbname) >= sizeof(new_entry->idstr)) {
+        error_report("ram_save_queue_pages: bad RAMBlock name");
+        return -1;
+    }
+
+    new_entry = g_malloc0(sizeof(*new_entry));
+    pstrcpy(new_entry->idstr, sizeof(new_entry->idstr), rbname);
+    new_entry->offset = start;
+    new_entry->len = len;
+
+    qemu_mutex_lock(&src_page_req_mutex);
+    QSIMPLEQ_INSERT_TAIL(&src_page_requests, new_entry, next_req);
+    qemu_mutex_unlock(&src_page_req_mutex);
+
+    return 0;
+}
+
+static void flush_page_queue(void)
+{
+    RAMSrcPageRequest *mspr, *next_mspr;
+
+    qemu_mutex_lock(&src_page_req_mutex);
+    QSIMPLEQ_FOREACH_SAFE(mspr, &src_page_requests, next_req, next_mspr) {
+        QSIMPLEQ_REMOVE_HEAD(&src_page_requests, next_req);
+        g_free(mspr);
+    }
+    qemu_mutex_unlock(&src_page_req_mutex);
+}
+
+/*
+ * Take one page off the request queue.
+ *
+ * Returns: the block the page is in, with *offset set, or NULL if the
+ *          queue is empty.  Requests that don't match a RAMBlock set an
+ *          error on f.
+ */
+static RAMBlock *unqueue_page(QEMUFile *f, ram_addr_t *offset)
+{
+    RAMSrcPageRequest *entry;
+    RAMBlock *block = NULL;
+
+    qemu_mutex_lock(&src_page_req_mutex);
+    while (!block && (entry = QSIMPLEQ_FIRST(&src_page_requests))) {
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            if (!strncmp(entry->idstr, block->idstr, sizeof(block->idstr))) {
+                break;
+            }
+        }
+        if (!block || entry->offset >= block->length) {
+            error_report("Bad page request %s+" RAM_ADDR_FMT,
+                         entry->idstr, entry->offset);
+            qemu_file_set_error(f, -EINVAL);
+            block = NULL;
+            QSIMPLEQ_REMOVE_HEAD(&src_page_requests, next_req);
+            g_free(entry);
+            continue;
+        }
+
+        *offset = entry->offset & TARGET_PAGE_MASK;
+        if (entry->len > TARGET_PAGE_SIZE) {
+            entry->len -= TARGET_PAGE_SIZE;
+            entry->offset += TARGET_PAGE_SIZE;
+        } else {
+            QSIMPLEQ_REMOVE_HEAD(&src_page_requests, next_req);
+            g_free(entry);
+        }
+    }
+    qemu_mutex_unlock(&src_page_req_mutex);
+
+    return block;
+}
+
+/*
+ * Send the first requested page that is still dirty.
+ *
+ * Returns:  The number of bytes written.
+ *           0 means no requested page needed sending
+ */
+static int ram_save_queued_page(QEMUFile *f, bool last_stage)
+{
+    RAMBlock *block;
+    ram_addr_t offset;
+    int bytes_sent = 0;
+
+    while (!bytes_sent && (block = unqueue_page(f, &offset))) {
+        /* Pages sent since the destination asked are not dirty any more */
+        if (migration_bitmap_test_and_reset_dirty(block->mr, offset)) {
+            bytes_sent = ram_save_page(f, block, &offset, last_stage);
+        }
+    }
+
+    return bytes_sent;
+}
+
 /*
  * ram_find_and_save_block: Finds a page to send and sends it to f
  *
@@ -648,6 +2152,14 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage)
     int bytes_sent = 0;
     MemoryRegion *mr;
 
+    /* Pages the postcopy destination is waiting for come first */
+    if (migration_in_postcopy(migrate_get_current())) {
+        bytes_sent = ram_save_queued_page(f, last_stage);
+        if (bytes_sent) {
+            return bytes_sent;
+        }
+    }
+
     if (!block)
         block = QTAILQ_FIRST(&ram_list.blocks);
 
@@ -666,12 +2178,20 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage)
                 complete_round = true;
                 ram_bulk_stage = false;
             }
+            if (comp_param) {
+                /* Pages still queued in the compression threads belong to
+                 * the previous block; they must reach the stream before any
+                 * page of the new one, and the destination's idea of the
+                 * current block is no longer known.
+                 */
+                flush_compressed_data(f);
+                last_sent_block = NULL;
+            }
         } else {
-            bytes_sent = ram_save_page(f, block, offset, last_stage);
+            bytes_sent = ram_save_page(f, block, &offset, last_stage);
 
             /* if page is unmodified, continue to the next */
             if (bytes_sent > 0) {
-                last_sent_block = block;
                 break;
             }
         }
@@ -682,8 +2202,6 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage)
     return bytes_sent;
 }
 
-static uint64_t bytes_transferred;
-
 void acct_update_position(QEMUFile *f, size_t size, bool zero)
 {
     uint64_t pages = size / TARGET_PAGE_SIZE;
@@ -698,7 +2216,7 @@ void acct_update_position(QEMUFile *f, size_t size, bool zero)
 
 static ram_addr_t ram_save_remaining(void)
 {
-    return migration_dirty_pages;
+    return hbitmap_count(migration_bitmap);
 }
 
 uint64_t ram_bytes_remaining(void)
@@ -722,6 +2240,12 @@ uint64_t ram_bytes_total(void)
     return total;
 }
 
+/* Size of the RAM area of a migration file, which is indexed by ram_addr_t */
+uint64_t ram_file_area_size(void)
+{
+    return last_ram_offset();
+}
+
 void free_xbzrle_decoded_buf(void)
 {
     g_free(xbzrle_decoded_buf);
@@ -730,9 +2254,13 @@ void free_xbzrle_decoded_buf(void)
 
 static void migration_end(void)
 {
+    flush_page_queue();
+    mig_throttle_stop();
+    ram_file_writers_join();
+
     if (migration_bitmap) {
         memory_global_dirty_log_stop();
-        g_free(migration_bitmap);
+        hbitmap_free(migration_bitmap);
         migration_bitmap = NULL;
     }
 
@@ -768,11 +2296,20 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
 {
     RAMBlock *block;
     int64_t ram_bitmap_pages; /* Size of bitmap in pages, including gaps */
+    int64_t file_ram_offset, file_ram_size;
+    int file_fd;
 
-    mig_throttle_on = false;
-    dirty_rate_high_cnt = 0;
     bitmap_sync_count = 0;
 
+    file_fd = migrate_file_ram_fd(&file_ram_offset, &file_ram_size);
+    if (file_fd >= 0) {
+        if (last_ram_offset() > file_ram_size) {
+            error_report("Guest RAM does not fit in the migration file");
+            return -1;
+        }
+        ram_file_writers_create(file_fd, file_ram_offset);
+    }
+
     if (migrate_use_xbzrle()) {
         XBZRLE_cache_lock();
         XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
@@ -799,29 +2336,27 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
             XBZRLE.encoded_buf = NULL;
             return -1;
         }
-
-        acct_clear();
     }
 
+    acct_clear();
+
     qemu_mutex_lock_iothread();
     qemu_mutex_lock_ramlist();
     bytes_transferred = 0;
     reset_ram_globals();
 
     ram_bitmap_pages = last_ram_offset() >> TARGET_PAGE_BITS;
-    migration_bitmap = bitmap_new(ram_bitmap_pages);
-    bitmap_set(migration_bitmap, 0, ram_bitmap_pages);
+    migration_bitmap = hbitmap_alloc(ram_bitmap_pages, 0);
 
     /*
-     * Count the total number of pages used by ram blocks not including any
-     * gaps due to alignment or unplugs.
+     * Everything starts dirty, except for gaps due to alignment or unplugs
+     * which would never be found and so never become clean.
      */
-    migration_dirty_pages = 0;
     QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        uint64_t block_pages;
-
-        block_pages = block->length >> TARGET_PAGE_BITS;
-        migration_dirty_pages += block_pages;
+        hbitmap_set(migration_bitmap, block->mr->ram_addr >> TARGET_PAGE_BITS,
+                    block->length >> TARGET_PAGE_BITS);
+        block->sync_dirty_pages = 0;
+        block->sync_time = 0;
     }
 
     memory_global_dirty_log_start();
@@ -861,6 +2396,10 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 
     ram_control_before_iterate(f, RAM_CONTROL_ROUND);
 
+    if (multifd_need_sync) {
+        multifd_send_sync(f);
+    }
+
     t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     i = 0;
     while ((ret = qemu_file_rate_limit(f)) == 0) {
@@ -873,7 +2412,6 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         }
         total_sent += bytes_sent;
         acct_info.iterations++;
-        check_guest_throttling();
         /* we want to check in the 1st loop, just in case it was the 1st time
            and we had to sync the dirty bitmap.
            qemu_get_clock_ns() is a bit expensive, so we only check each some
@@ -890,8 +2428,19 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         i++;
     }
 
+    flush_compressed_data(f);
+    multifd_send_flush(f);
+    ram_file_drain(f);
     qemu_mutex_unlock_ramlist();
 
+    migration_phase_record(MIGRATION_PHASE_RAM_ITERATE,
+                           qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - t0);
+    if (acct_info.xbzrle_encode_time) {
+        migration_phase_record(MIGRATION_PHASE_XBZRLE_ENCODE,
+                               acct_info.xbzrle_encode_time);
+        acct_info.xbzrle_encode_time = 0;
+    }
+
     /*
      * Must occur before EOS (or any QEMUFile operation)
      * because of RDMA protocol.
@@ -915,13 +2464,78 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     return total_sent;
 }
 
-static int ram_save_complete(QEMUFile *f, void *opaque)
+/*
+ * Called with the guest stopped when switching to postcopy: the pages that
+ * are still dirty must be fetched from the source by the destination, so
+ * it has to throw away the copy it received during precopy, if any.
+ */
+#define MAX_DISCARDS_PER_COMMAND 256
+
+void ram_postcopy_send_discard_bitmap(QEMUFile *f)
 {
+    RAMBlock *block;
+    uint64_t start_list[MAX_DISCARDS_PER_COMMAND];
+    uint64_t length_list[MAX_DISCARDS_PER_COMMAND];
+
     qemu_mutex_lock_ramlist();
     migration_bitmap_sync();
 
+    /* The bulk stage assumes every page is dirty; that's no longer true */
+    ram_bulk_stage = false;
+    /* The destination forgets our current block along with the pages */
+    last_sent_block = NULL;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        unsigned long first = block->mr->ram_addr >> TARGET_PAGE_BITS;
+        unsigned long last = first + (block->length >> TARGET_PAGE_BITS);
+        int64_t run_start, run_end, next;
+        uint16_t entries = 0;
+        HBitmapIter hbi;
+
+        hbitmap_iter_init(&hbi, migration_bitmap, first);
+        run_start = hbitmap_iter_next(&hbi);
+        while (run_start >= 0 && run_start < last) {
+            /* Extend the run as long as the dirty pages are contiguous */
+            run_end = run_start + 1;
+            while ((next = hbitmap_iter_next(&hbi)) == run_end &&
+                   run_end < last) {
+                run_end++;
+            }
+
+            start_list[entries] = (uint64_t)(run_start - first) <<
+                                  TARGET_PAGE_BITS;
+            length_list[entries] = (uint64_t)(run_end - run_start) <<
+                                   TARGET_PAGE_BITS;
+            if (++entries == MAX_DISCARDS_PER_COMMAND) {
+                qemu_savevm_send_postcopy_ram_discard(f, block->idstr,
+                                                      entries, start_list,
+                                                      length_list);
+                entries = 0;
+            }
+            run_start = next;
+        }
+        if (entries) {
+            qemu_savevm_send_postcopy_ram_discard(f, block->idstr, entries,
+                                                  start_list, length_list);
+        }
+    }
+
+    qemu_mutex_unlock_ramlist();
+}
+
+static int ram_save_complete(QEMUFile *f, void *opaque)
+{
+    qemu_mutex_lock_ramlist();
+    if (!migration_in_postcopy(migrate_get_current())) {
+        migration_bitmap_sync();
+    }
+
     ram_control_before_iterate(f, RAM_CONTROL_FINISH);
 
+    if (multifd_need_sync) {
+        multifd_send_sync(f);
+    }
+
     /* try transferring iterative blocks of memory */
 
     /* flush all remaining blocks regardless of rate limiting */
@@ -936,6 +2550,12 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         bytes_transferred += bytes_sent;
     }
 
+    flush_compressed_data(f);
+    if (multifd_send_param) {
+        /* All pages must be in place before the devices are loaded */
+        multifd_send_sync(f);
+    }
+    ram_file_drain(f);
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
     migration_end();
 
@@ -951,7 +2571,9 @@ static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
 
     remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
 
-    if (remaining_size < max_size) {
+    /* In postcopy the guest runs on the destination; nothing gets dirty */
+    if (remaining_size < max_size &&
+        !migration_in_postcopy(migrate_get_current())) {
         qemu_mutex_lock_iothread();
         migration_bitmap_sync();
         qemu_mutex_unlock_iothread();
@@ -995,9 +2617,7 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
     return 0;
 }
 
-static inline void *host_from_stream_offset(QEMUFile *f,
-                                            ram_addr_t offset,
-                                            int flags)
+static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
 {
     static RAMBlock *block = NULL;
     char id[256];
@@ -1006,10 +2626,8 @@ static inline void *host_from_stream_offset(QEMUFile *f,
     if (flags & RAM_SAVE_FLAG_CONTINUE) {
         if (!block) {
             error_report("Ack, bad migration stream!");
-            return NULL;
         }
-
-        return memory_region_get_ram_ptr(block->mr) + offset;
+        return block;
     }
 
     len = qemu_get_byte(f);
@@ -1018,13 +2636,25 @@ static inline void *host_from_stream_offset(QEMUFile *f,
 
     QTAILQ_FOREACH(block, &ram_list.blocks, next) {
         if (!strncmp(id, block->idstr, sizeof(id)))
-            return memory_region_get_ram_ptr(block->mr) + offset;
+            return block;
     }
 
     error_report("Can't find block %s!", id);
     return NULL;
 }
 
+static inline void *host_from_stream_offset(QEMUFile *f,
+                                            ram_addr_t offset,
+                                            int flags)
+{
+    RAMBlock *block = ram_block_from_stream(f, flags);
+
+    if (!block) {
+        return NULL;
+    }
+    return memory_region_get_ram_ptr(block->mr) + offset;
+}
+
 /*
  * If a page (or a whole RDMA chunk) has been
  * determined to be zero, then zap it.
@@ -1036,11 +2666,46 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
     }
 }
 
+/*
+ * Load a page during postcopy: it has to be placed atomically, since the
+ * guest may already be waiting on it.
+ */
+static int ram_load_postcopy_page(QEMUFile *f, MigrationIncomingState *mis,
+                                  void *host, int flags)
+{
+    void *page_buffer;
+    uint8_t ch;
+
+    if (flags & RAM_SAVE_FLAG_COMPRESS) {
+        ch = qemu_get_byte(f);
+        if (ch == 0) {
+            return postcopy_place_page_zero(mis, host);
+        }
+        page_buffer = postcopy_get_tmp_page(mis);
+        if (!page_buffer) {
+            return -ENOMEM;
+        }
+        memset(page_buffer, ch, TARGET_PAGE_SIZE);
+    } else {
+        page_buffer = postcopy_get_tmp_page(mis);
+        if (!page_buffer) {
+            return -ENOMEM;
+        }
+        qemu_get_buffer(f, page_buffer, TARGET_PAGE_SIZE);
+    }
+
+    return postcopy_place_page(mis, host, page_buffer);
+}
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     ram_addr_t addr;
     int flags, ret = 0;
     static uint64_t seq_iter;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    /* Pages arriving once the listen thread runs go through userfault */
+    bool postcopy_running =
+        postcopy_state_get(mis) >= POSTCOPY_INCOMING_LISTENING;
 
     seq_iter++;
 
@@ -1059,6 +2724,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             char id[256];
             ram_addr_t length;
             ram_addr_t total_ram_bytes = addr;
+            int64_t file_ram_offset, file_ram_size;
+            int file_fd = migrate_file_ram_fd(&file_ram_offset,
+                                              &file_ram_size);
 
             while (total_ram_bytes) {
                 RAMBlock *block;
@@ -1086,12 +2754,37 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                                  "accept migration", id);
                     ret = -EINVAL;
                 }
+                if (!ret && file_fd >= 0) {
+                    /* The pages are in the file, not in the stream */
+                    ret = ram_file_load_block(block, file_fd, file_ram_offset,
+                                              file_ram_size);
+                }
                 if (ret) {
                     break;
                 }
 
                 total_ram_bytes -= length;
             }
+        } else if (postcopy_running &&
+                   (flags & (RAM_SAVE_FLAG_COMPRESS | RAM_SAVE_FLAG_PAGE))) {
+            void *host = host_from_stream_offset(f, addr, flags);
+
+            if (!host) {
+                error_report("Illegal RAM offset " RAM_ADDR_FMT, addr);
+                ret = -EINVAL;
+                break;
+            }
+            ret = ram_load_postcopy_page(f, mis, host, flags);
+            if (ret) {
+                break;
+            }
+        } else if (postcopy_running &&
+                   (flags & (RAM_SAVE_FLAG_XBZRLE |
+                             RAM_SAVE_FLAG_COMPRESS_PAGE |
+                             RAM_SAVE_FLAG_PAGES))) {
+            error_report("Encoded page received during postcopy: %#x", flags);
+            ret = -EINVAL;
+            break;
         } else if (flags & RAM_SAVE_FLAG_COMPRESS) {
             void *host;
             uint8_t ch;
@@ -1116,6 +2809,20 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             }
 
             qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+        } else if (flags & RAM_SAVE_FLAG_PAGES) {
+            RAMBlock *block = ram_block_from_stream(f, flags);
+            uint32_t pages = qemu_get_be32(f);
+
+            if (!block || pages == 0 || pages > RAM_PAGE_RUN_MAX ||
+                addr + (ram_addr_t)pages * TARGET_PAGE_SIZE > block->length) {
+                error_report("Illegal RAM range " RAM_ADDR_FMT ", %u pages",
+                             addr, pages);
+                ret = -EINVAL;
+                break;
+            }
+
+            qemu_get_buffer(f, memory_region_get_ram_ptr(block->mr) + addr,
+                            pages * TARGET_PAGE_SIZE);
         } else if (flags & RAM_SAVE_FLAG_XBZRLE) {
             void *host = host_from_stream_offset(f, addr, flags);
             if (!host) {
@@ -1130,6 +2837,35 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 ret = -EINVAL;
                 break;
             }
+        } else if (flags & RAM_SAVE_FLAG_COMPRESS_PAGE) {
+            void *host = host_from_stream_offset(f, addr, flags);
+            int len;
+
+            if (!host) {
+                error_report("Illegal RAM offset " RAM_ADDR_FMT, addr);
+                ret = -EINVAL;
+                break;
+            }
+            if (!decomp_param) {
+                error_report("Received a compressed page, but the compress "
+                             "capability is not enabled");
+                ret = -EINVAL;
+                break;
+            }
+
+            len = qemu_get_be32(f);
+            if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+                error_report("Invalid compressed data length: %d", len);
+                ret = -EINVAL;
+                break;
+            }
+            decompress_data_with_multi_threads(f, host, len);
+        } else if (flags & RAM_SAVE_FLAG_MULTIFD_SYNC) {
+            trace_multifd_recv_sync();
+            ret = multifd_recv_sync();
+            if (ret) {
+                break;
+            }
         } else if (flags & RAM_SAVE_FLAG_HOOK) {
             ram_control_load_hook(f, flags);
         } else if (flags & RAM_SAVE_FLAG_EOS) {
@@ -1143,6 +2879,14 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         ret = qemu_file_get_error(f);
     }
 
+    /* A page may be sent again in the next round, so all of this round's
+     * compressed pages must have landed before we return.
+     */
+    if (wait_for_decompress_done() < 0 && !ret) {
+        error_report("Failed to decompress RAM page");
+        ret = -EINVAL;
+    }
+
     DPRINTF("Completed load of VM with exit code %d seq iteration "
             "%" PRIu64 "\n", ret, seq_iter);
     return ret;
@@ -1160,6 +2904,7 @@ static SaveVMHandlers savevm_ram_handlers = {
 void ram_mig_init(void)
 {
     qemu_mutex_init(&XBZRLE.lock);
+    qemu_mutex_init(&src_page_req_mutex);
     register_savevm_live(NULL, "ram", 0, 4, &savevm_ram_handlers, NULL);
 }
 
@@ -1368,51 +3113,142 @@ TargetInfo *qmp_query_target(Error **errp)
     return info;
 }
 
-/* Stub function that's gets run on the vcpu when its brought out of the
-   VM to run inside qemu via async_run_on_cpu()*/
+/*
+ * Auto-converge
+ *
+ * While throttled, every vCPU runs for MIG_THROTTLE_TIMESLICE_NS and then
+ * sleeps long enough to be stopped mig_throttle_percentage percent of the
+ * time.  The percentage is recomputed about once a second from the
+ * measured dirty rate and bandwidth, see mig_throttle_update().
+ */
+#define MIG_THROTTLE_TIMESLICE_NS 10000000 /* 10 ms */
+#define MIG_THROTTLE_MAX 99
+
+static QEMUTimer *mig_throttle_timer;
+/* vCPUs that have not finished the sleep queued by the last tick */
+static int mig_throttle_sleeps_pending;
+
+/* Runs on the vCPU when it is brought out of the VM via async_run_on_cpu() */
 static void mig_sleep_cpu(void *opq)
 {
-    qemu_mutex_unlock_iothread();
-    g_usleep(30*1000);
-    qemu_mutex_lock_iothread();
+    int percentage = atomic_read(&mig_throttle_percentage);
+    int64_t sleep_ns;
+
+    if (percentage) {
+        sleep_ns = MIG_THROTTLE_TIMESLICE_NS * percentage / (100 - percentage);
+
+        qemu_mutex_unlock_iothread();
+        g_usleep(sleep_ns / 1000);
+        qemu_mutex_lock_iothread();
+    }
+    atomic_dec(&mig_throttle_sleeps_pending);
 }
 
-/* To reduce the dirty rate explicitly disallow the VCPUs from spending
-   much time in the VM. The migration thread will try to catchup.
-   Workload will experience a performance drop.
-*/
-static void mig_throttle_guest_down(void)
+static void mig_throttle_timer_tick(void *opaque)
 {
+    int percentage = atomic_read(&mig_throttle_percentage);
     CPUState *cpu;
 
-    qemu_mutex_lock_iothread();
+    if (!percentage) {
+        return;
+    }
+
+    /* A vCPU that is still asleep would get its next sleep right after
+     * this one and never run; give it another timeslice instead.
+     */
+    if (atomic_read(&mig_throttle_sleeps_pending)) {
+        timer_mod(mig_throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                  MIG_THROTTLE_TIMESLICE_NS);
+        return;
+    }
+
     CPU_FOREACH(cpu) {
+        atomic_inc(&mig_throttle_sleeps_pending);
         async_run_on_cpu(cpu, mig_sleep_cpu, NULL);
     }
-    qemu_mutex_unlock_iothread();
+    /* One timeslice of running plus the sleep */
+    timer_mod(mig_throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+              MIG_THROTTLE_TIMESLICE_NS * 100 / (100 - percentage));
 }
 
-static void check_guest_throttling(void)
+/* Needs iothread lock when turning the throttle on */
+static void mig_throttle_set(int percentage)
 {
-    static int64_t t0;
-    int64_t        t1;
+    bool was_on = mig_throttle_percentage != 0;
 
-    if (!mig_throttle_on) {
+    if (percentage == mig_throttle_percentage) {
         return;
     }
+    trace_migration_throttle(percentage);
+    atomic_set(&mig_throttle_percentage, percentage);
+    acct_info.throttle_events++;
+
+    if (percentage && !was_on) {
+        if (!mig_throttle_timer) {
+            mig_throttle_timer = timer_new_ns(QEMU_CLOCK_REALTIME,
+                                              mig_throttle_timer_tick, NULL);
+        }
+        timer_mod(mig_throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                  MIG_THROTTLE_TIMESLICE_NS);
+    }
+}
+
+static void mig_throttle_stop(void)
+{
+    mig_throttle_set(0);
+    if (mig_throttle_timer) {
+        timer_del(mig_throttle_timer);
+        timer_free(mig_throttle_timer);
+        mig_throttle_timer = NULL;
+    }
+}
 
-    if (!t0)  {
-        t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+/*
+ * Pick the smallest throttle that lets the migration converge.
+ *
+ * Sending the P bytes that are dirty now takes P / B seconds at bandwidth
+ * B, and meanwhile the guest dirties D * P / B bytes again.  Those must be
+ * sendable within the allowed downtime T, i.e. fit into B * T, so the
+ * guest may dirty at most
+ *
+ *     D_max = B * B * T / P
+ *
+ * bytes per second.  The dirty rate measured over the last period was
+ * already reduced by the throttle in effect, so scale it back to the
+ * rate of an unthrottled guest first.
+ */
+static void mig_throttle_update(uint64_t dirty_pages, uint64_t bytes_xfer,
+                                int64_t period_ms)
+{
+    double throttled = mig_throttle_percentage / 100.0;
+    double downtime = migrate_max_downtime() / 1e9;
+    double pending = (double)ram_save_remaining() * TARGET_PAGE_SIZE;
+    double bandwidth, dirty_rate, max_rate;
+    int percentage = 0;
+
+    /* Everything is pending during the first pass, nothing to measure */
+    if (ram_bulk_stage || !bytes_xfer || period_ms <= 0) {
         return;
     }
 
-    t1 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    bandwidth = (double)bytes_xfer * 1000 / period_ms;
+    dirty_rate = (double)dirty_pages * TARGET_PAGE_SIZE * 1000 / period_ms /
+                 (1 - throttled);
 
-    /* If it has been more than 40 ms since the last time the guest
-     * was throttled then do it again.
-     */
-    if (40 < (t1-t0)/1000000) {
-        mig_throttle_guest_down();
-        t0 = t1;
+    if (pending > bandwidth * downtime) {
+        max_rate = bandwidth * bandwidth * downtime / pending;
+        if (dirty_rate > max_rate) {
+            percentage = ceil(100 * (1 - max_rate / dirty_rate));
+            percentage = MIN(percentage, MIG_THROTTLE_MAX);
+        }
     }
+
+    trace_migration_throttle_update(dirty_rate, bandwidth, pending,
+                                    percentage);
+    mig_throttle_set(percentage);
+}
+
+int migration_throttle_percentage(void)
+{
+    return atomic_read(&mig_throttle_percentage);
 }
@@ -25,6 +25,7 @@
 #include "qemu-common.h"
 #include "block/aio.h"
 #include "block/thread-pool.h"
+#include "qemu/atomic.h"
 #include "qemu/main-loop.h"
 
 /***********************************************************/
@@ -220,6 +221,7 @@ aio_ctx_finalize(GSource     *source)
     thread_pool_free(ctx->thread_pool);
     aio_set_event_notifier(ctx, &ctx->notifier, NULL);
     event_notifier_cleanup(&ctx->notifier);
+    aio_context_destroy(ctx);
     rfifolock_destroy(&ctx->lock);
     qemu_mutex_destroy(&ctx->bh_lock);
     g_array_free(ctx->pollfds, TRUE);
@@ -249,9 +251,47 @@ ThreadPool *aio_get_thread_pool(AioContext *ctx)
 
 void aio_notify(AioContext *ctx)
 {
+    /* Write the flag before the event, the notifier clears them in the
+     * opposite order.
+     */
+    atomic_mb_set(&ctx->notified, true);
     event_notifier_set(&ctx->notifier);
 }
 
+static void aio_context_notifier_cb(EventNotifier *e)
+{
+    AioContext *ctx = container_of(e, AioContext, notifier);
+
+    atomic_mb_set(&ctx->notified, false);
+    event_notifier_test_and_clear(e);
+}
+
+static bool aio_context_notifier_poll(void *opaque)
+{
+    EventNotifier *e = opaque;
+    AioContext *ctx = container_of(e, AioContext, notifier);
+
+    return atomic_read(&ctx->notified);
+}
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink,
+                                 Error **errp)
+{
+    if (max_ns < 0 || grow < 0 || shrink < 0) {
+        error_setg(errp, "polling parameters must not be negative");
+        return;
+    }
+
+    /* No thread synchronization here, it doesn't matter if an incorrect
+     * value is used once.
+     */
+    ctx->poll_max_ns = max_ns;
+    ctx->poll_ns = 0;
+    ctx->poll_grow = grow;
+    ctx->poll_shrink = shrink;
+}
+
 static void aio_timerlist_notify(void *opaque)
 {
     aio_notify(opaque);
@@ -267,14 +307,15 @@ AioContext *aio_context_new(void)
 {
     AioContext *ctx;
     ctx = (AioContext *) g_source_new(&aio_source_funcs, sizeof(AioContext));
+    aio_context_setup(ctx);
     ctx->pollfds = g_array_new(FALSE, FALSE, sizeof(GPollFD));
     ctx->thread_pool = NULL;
     qemu_mutex_init(&ctx->bh_lock);
     rfifolock_init(&ctx->lock, aio_rfifolock_cb, ctx);
     event_notifier_init(&ctx->notifier, false);
-    aio_set_event_notifier(ctx, &ctx->notifier, 
-                           (EventNotifierHandler *)
-                           event_notifier_test_and_clear);
+    aio_set_event_notifier(ctx, &ctx->notifier, aio_context_notifier_cb);
+    aio_set_event_notifier_poll(ctx, &ctx->notifier,
+                                aio_context_notifier_poll);
     timerlistgroup_init(&ctx->tlg, aio_timerlist_notify, ctx);
 
     return ctx;
@@ -52,6 +52,13 @@
 
 struct BdrvDirtyBitmap {
     HBitmap *bitmap;
+    int64_t size;               /* in sectors */
+    /* Collects writes while the bitmap is frozen, see
+     * bdrv_dirty_bitmap_create_successor() */
+    BdrvDirtyBitmap *successor;
+    bool is_successor;
+    char *name;                 /* NULL for bitmaps private to a job */
+    bool persistent;
     QLIST_ENTRY(BdrvDirtyBitmap) list;
 };
 
@@ -736,6 +743,31 @@ int bdrv_parse_discard_flags(const char *mode, int *flags)
     return 0;
 }
 
+/**
+ * Get the preallocation mode for the value of a "preallocation" option; no
+ * value means PREALLOC_MODE_OFF
+ *
+ * Return 0 on success, -1 if the preallocation mode was invalid.
+ */
+int bdrv_parse_prealloc_mode(const char *mode, PreallocMode *prealloc)
+{
+    int i;
+
+    if (!mode) {
+        *prealloc = PREALLOC_MODE_OFF;
+        return 0;
+    }
+
+    for (i = 0; i < PREALLOC_MODE_MAX; i++) {
+        if (!strcmp(mode, PreallocMode_lookup[i])) {
+            *prealloc = i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
 /**
  * Set open flags for a given cache mode
  *
@@ -1816,6 +1848,7 @@ void bdrv_close(BlockDriverState *bs)
             bdrv_unref(backing_hd);
         }
         bs->drv->bdrv_close(bs);
+        bdrv_release_named_dirty_bitmaps(bs);
         g_free(bs->opaque);
         bs->opaque = NULL;
         bs->drv = NULL;
@@ -1905,6 +1938,7 @@ void bdrv_drain_all(void)
             bool bs_busy;
 
             aio_context_acquire(aio_context);
+            bdrv_flush_io_queue(bs);
             bdrv_start_throttled_reqs(bs);
             bs_busy = bdrv_requests_pending(bs);
             bs_busy |= aio_poll(aio_context, bs_busy);
@@ -2075,9 +2109,9 @@ static void bdrv_delete(BlockDriverState *bs)
     assert(!bs->job);
     assert(bdrv_op_blocker_is_empty(bs));
     assert(!bs->refcnt);
-    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
 
     bdrv_close(bs);
+    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
 
     /* remove from list, if necessary */
     bdrv_make_anon(bs);
@@ -3479,6 +3513,10 @@ int bdrv_truncate(BlockDriverState *bs, int64_t offset)
         return -ENOTSUP;
     if (bs->read_only)
         return -EACCES;
+    /* Dirty bitmaps cover the current size and are not resized */
+    if (!QLIST_EMPTY(&bs->dirty_bitmaps)) {
+        return -EBUSY;
+    }
 
     ret = drv->bdrv_truncate(bs, offset);
     if (ret == 0) {
@@ -4109,20 +4147,95 @@ void bdrv_get_backing_filename(BlockDriverState *bs,
     pstrcpy(filename, filename_size, bs->backing_file);
 }
 
-int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                          const uint8_t *buf, int nb_sectors)
+bool bdrv_driver_can_write_compressed(BlockDriver *drv)
+{
+    return drv->bdrv_write_compressed || drv->bdrv_co_write_compressed;
+}
+
+/*
+ * Writes one cluster of compressed data.  A request with nb_sectors == 0
+ * (and qiov == NULL) tells the driver that no more compressed data follows.
+ */
+int coroutine_fn bdrv_co_write_compressed(BlockDriverState *bs,
+                                          int64_t sector_num, int nb_sectors,
+                                          QEMUIOVector *qiov)
 {
     BlockDriver *drv = bs->drv;
-    if (!drv)
+
+    if (!drv) {
         return -ENOMEDIUM;
-    if (!drv->bdrv_write_compressed)
+    }
+    if (!bdrv_driver_can_write_compressed(drv)) {
         return -ENOTSUP;
-    if (bdrv_check_request(bs, sector_num, nb_sectors))
+    }
+    if (bdrv_check_request(bs, sector_num, nb_sectors)) {
         return -EIO;
+    }
 
-    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
+    /* Compressed writes bypass bdrv_aligned_pwritev() */
+    bdrv_set_dirty(bs, sector_num, nb_sectors);
+
+    if (drv->bdrv_co_write_compressed) {
+        return drv->bdrv_co_write_compressed(bs, sector_num, nb_sectors, qiov);
+    }
+
+    if (nb_sectors && qiov->niov != 1) {
+        return -ENOTSUP;
+    }
+    return drv->bdrv_write_compressed(bs, sector_num,
+                                      nb_sectors ? qiov->iov[0].iov_base : NULL,
+                                      nb_sectors);
+}
+
+typedef struct WriteCompressedCo {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    int nb_sectors;
+    QEMUIOVector *qiov;
+    int ret;
+} WriteCompressedCo;
+
+static void coroutine_fn bdrv_write_compressed_co_entry(void *opaque)
+{
+    WriteCompressedCo *wco = opaque;
+
+    wco->ret = bdrv_co_write_compressed(wco->bs, wco->sector_num,
+                                        wco->nb_sectors, wco->qiov);
+}
 
-    return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
+int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
+                          const uint8_t *buf, int nb_sectors)
+{
+    Coroutine *co;
+    QEMUIOVector qiov;
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = nb_sectors * BDRV_SECTOR_SIZE,
+    };
+    WriteCompressedCo wco = {
+        .bs = bs,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .qiov = nb_sectors ? &qiov : NULL,
+        .ret = NOT_DONE,
+    };
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    if (qemu_in_coroutine()) {
+        /* Fast-path if already in coroutine context */
+        bdrv_write_compressed_co_entry(&wco);
+    } else {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
+        co = qemu_coroutine_create(bdrv_write_compressed_co_entry);
+        qemu_coroutine_enter(co, &wco);
+        while (wco.ret == NOT_DONE) {
+            aio_poll(aio_context, true);
+        }
+    }
+
+    return wco.ret;
 }
 
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
@@ -5124,6 +5237,38 @@ int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
     return rwco.ret;
 }
 
+/*
+ * Reserves host storage for nb_sectors starting at sector_num without
+ * changing the data or the length of the file, so that later writes to the
+ * range do not have to allocate.  Unlike other requests, the range may lie
+ * beyond the end of the image.  The request is tracked, so bdrv_drain_all()
+ * waits for it.
+ */
+int coroutine_fn bdrv_co_preallocate(BlockDriverState *bs, int64_t sector_num,
+                                     int nb_sectors)
+{
+    BdrvTrackedRequest req;
+    int ret;
+
+    if (!bs->drv) {
+        return -ENOMEDIUM;
+    } else if (sector_num < 0 || nb_sectors < 0 ||
+               nb_sectors > (UINT_MAX >> BDRV_SECTOR_BITS)) {
+        return -EIO;
+    } else if (bs->read_only) {
+        return -EROFS;
+    } else if (!bs->drv->bdrv_co_preallocate) {
+        return -ENOTSUP;
+    }
+
+    tracked_request_begin(&req, bs, sector_num << BDRV_SECTOR_BITS,
+                          nb_sectors << BDRV_SECTOR_BITS, true);
+    ret = bs->drv->bdrv_co_preallocate(bs, sector_num, nb_sectors);
+    tracked_request_end(&req);
+
+    return ret;
+}
+
 /**************************************************************/
 /* removable device support */
 
@@ -5240,13 +5385,18 @@ bool bdrv_qiov_is_aligned(BlockDriverState *bs, QEMUIOVector *qiov)
 }
 
 BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs, int granularity,
-                                          Error **errp)
+                                          const char *name, Error **errp)
 {
     int64_t bitmap_size;
     BdrvDirtyBitmap *bitmap;
 
     assert((granularity & (granularity - 1)) == 0);
 
+    if (name && bdrv_find_dirty_bitmap(bs, name)) {
+        error_setg(errp, "Bitmap already exists: %s", name);
+        return NULL;
+    }
+
     granularity >>= BDRV_SECTOR_BITS;
     assert(granularity);
     bitmap_size = bdrv_getlength(bs);
@@ -5258,23 +5408,156 @@ BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs, int granularity,
     bitmap_size >>= BDRV_SECTOR_BITS;
     bitmap = g_malloc0(sizeof(BdrvDirtyBitmap));
     bitmap->bitmap = hbitmap_alloc(bitmap_size, ffs(granularity) - 1);
+    bitmap->size = bitmap_size;
+    bitmap->name = g_strdup(name);
     QLIST_INSERT_HEAD(&bs->dirty_bitmaps, bitmap, list);
     return bitmap;
 }
 
+BdrvDirtyBitmap *bdrv_find_dirty_bitmap(BlockDriverState *bs, const char *name)
+{
+    BdrvDirtyBitmap *bm;
+
+    QLIST_FOREACH(bm, &bs->dirty_bitmaps, list) {
+        if (bm->name && !strcmp(name, bm->name)) {
+            return bm;
+        }
+    }
+    return NULL;
+}
+
+BdrvDirtyBitmap *bdrv_next_dirty_bitmap(BlockDriverState *bs,
+                                        BdrvDirtyBitmap *bitmap)
+{
+    return bitmap ? QLIST_NEXT(bitmap, list) : QLIST_FIRST(&bs->dirty_bitmaps);
+}
+
+static void bdrv_free_dirty_bitmap(BdrvDirtyBitmap *bitmap)
+{
+    assert(!bitmap->successor);
+    QLIST_REMOVE(bitmap, list);
+    hbitmap_free(bitmap->bitmap);
+    g_free(bitmap->name);
+    g_free(bitmap);
+}
+
 void bdrv_release_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
 {
     BdrvDirtyBitmap *bm, *next;
     QLIST_FOREACH_SAFE(bm, &bs->dirty_bitmaps, list, next) {
         if (bm == bitmap) {
-            QLIST_REMOVE(bitmap, list);
-            hbitmap_free(bitmap->bitmap);
-            g_free(bitmap);
+            bdrv_free_dirty_bitmap(bitmap);
             return;
         }
     }
 }
 
+/* Named bitmaps belong to the BlockDriverState; the driver may have stored
+ * the persistent ones in the image when this is called.
+ */
+void bdrv_release_named_dirty_bitmaps(BlockDriverState *bs)
+{
+    BdrvDirtyBitmap *bm, *next;
+    QLIST_FOREACH_SAFE(bm, &bs->dirty_bitmaps, list, next) {
+        if (bm->name) {
+            bdrv_free_dirty_bitmap(bm);
+        }
+    }
+}
+
+const char *bdrv_dirty_bitmap_name(const BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->name;
+}
+
+int64_t bdrv_dirty_bitmap_granularity(const BdrvDirtyBitmap *bitmap)
+{
+    return (int64_t) BDRV_SECTOR_SIZE << hbitmap_granularity(bitmap->bitmap);
+}
+
+bool bdrv_dirty_bitmap_frozen(const BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->successor != NULL;
+}
+
+bool bdrv_dirty_bitmap_get_persistent(const BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->persistent;
+}
+
+void bdrv_dirty_bitmap_set_persistent(BdrvDirtyBitmap *bitmap, bool persistent)
+{
+    bitmap->persistent = persistent;
+}
+
+uint64_t bdrv_dirty_bitmap_serialization_size(const BdrvDirtyBitmap *bitmap)
+{
+    return hbitmap_serialization_size(bitmap->bitmap);
+}
+
+void bdrv_dirty_bitmap_serialize(const BdrvDirtyBitmap *bitmap, uint8_t *buf)
+{
+    hbitmap_serialize(bitmap->bitmap, buf);
+}
+
+void bdrv_dirty_bitmap_deserialize(BdrvDirtyBitmap *bitmap, const uint8_t *buf)
+{
+    hbitmap_deserialize(bitmap->bitmap, buf);
+}
+
+/* Freeze @bitmap for a job that consumes it, such as an incremental backup.
+ * From now on writes are recorded in an anonymous successor instead; when
+ * the job ends, bdrv_dirty_bitmap_abdicate or bdrv_dirty_bitmap_reclaim
+ * folds the successor back into @bitmap.
+ */
+int bdrv_dirty_bitmap_create_successor(BlockDriverState *bs,
+                                       BdrvDirtyBitmap *bitmap, Error **errp)
+{
+    BdrvDirtyBitmap *child;
+
+    if (bitmap->successor) {
+        error_setg(errp, "Bitmap '%s' is in use by another job",
+                   bitmap->name ?: "");
+        return -EBUSY;
+    }
+
+    child = bdrv_create_dirty_bitmap(bs, bdrv_dirty_bitmap_granularity(bitmap),
+                                     NULL, errp);
+    if (!child) {
+        return -EINVAL;
+    }
+    child->is_successor = true;
+    bitmap->successor = child;
+    return 0;
+}
+
+/* The job succeeded: @bitmap only keeps what was written since it started */
+void bdrv_dirty_bitmap_abdicate(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
+{
+    BdrvDirtyBitmap *successor = bitmap->successor;
+    HBitmap *hb;
+
+    assert(successor);
+    hb = bitmap->bitmap;
+    bitmap->bitmap = successor->bitmap;
+    successor->bitmap = hb;
+    bitmap->successor = NULL;
+    bdrv_release_dirty_bitmap(bs, successor);
+}
+
+/* The job failed: @bitmap gets back what was written since it started */
+void bdrv_dirty_bitmap_reclaim(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
+{
+    BdrvDirtyBitmap *successor = bitmap->successor;
+    bool merged;
+
+    assert(successor);
+    merged = hbitmap_merge(bitmap->bitmap, successor->bitmap);
+    assert(merged);
+    bitmap->successor = NULL;
+    bdrv_release_dirty_bitmap(bs, successor);
+}
+
 BlockDirtyInfoList *bdrv_query_dirty_bitmaps(BlockDriverState *bs)
 {
     BdrvDirtyBitmap *bm;
@@ -5285,8 +5568,15 @@ BlockDirtyInfoList *bdrv_query_dirty_bitmaps(BlockDriverState *bs)
         BlockDirtyInfo *info = g_malloc0(sizeof(BlockDirtyInfo));
         BlockDirtyInfoList *entry = g_malloc0(sizeof(BlockDirtyInfoList));
         info->count = bdrv_get_dirty_count(bs, bm);
-        info->granularity =
-            ((int64_t) BDRV_SECTOR_SIZE << hbitmap_granularity(bm->bitmap));
+        info->granularity = bdrv_dirty_bitmap_granularity(bm);
+        if (bm->name) {
+            info->has_name = true;
+            info->name = g_strdup(bm->name);
+            info->has_persistent = true;
+            info->persistent = bm->persistent;
+            info->has_frozen = true;
+            info->frozen = bdrv_dirty_bitmap_frozen(bm);
+        }
         entry->value = info;
         *plist = entry;
         plist = &entry->next;
@@ -5315,18 +5605,43 @@ void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector,
 {
     BdrvDirtyBitmap *bitmap;
     QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
-        hbitmap_set(bitmap->bitmap, cur_sector, nr_sectors);
+        /* frozen bitmaps pass writes on to their successor */
+        if (!bdrv_dirty_bitmap_frozen(bitmap)) {
+            hbitmap_set(bitmap->bitmap, cur_sector, nr_sectors);
+        }
     }
 }
 
+/* Called for discarded sectors.  Jobs need not copy them, but for named
+ * bitmaps (and the successors of frozen ones) discarded data has changed
+ * like any other: an incremental backup must pick it up.
+ */
 void bdrv_reset_dirty(BlockDriverState *bs, int64_t cur_sector, int nr_sectors)
 {
     BdrvDirtyBitmap *bitmap;
     QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
-        hbitmap_reset(bitmap->bitmap, cur_sector, nr_sectors);
+        if (bdrv_dirty_bitmap_frozen(bitmap)) {
+            continue;
+        }
+        if (bitmap->name || bitmap->is_successor) {
+            hbitmap_set(bitmap->bitmap, cur_sector, nr_sectors);
+        } else {
+            hbitmap_reset(bitmap->bitmap, cur_sector, nr_sectors);
+        }
     }
 }
 
+void bdrv_reset_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                             int64_t cur_sector, int nr_sectors)
+{
+    hbitmap_reset(bitmap->bitmap, cur_sector, nr_sectors);
+}
+
+void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap)
+{
+    hbitmap_reset(bitmap->bitmap, 0, bitmap->size);
+}
+
 int64_t bdrv_get_dirty_count(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
 {
     return hbitmap_count(bitmap->bitmap);
@@ -5782,3 +6097,33 @@ BlockDriverState *check_to_replace_node(const char *node_name, Error **errp)
 
     return to_replace_bs;
 }
+
+void bdrv_io_plug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+    if (drv && drv->bdrv_io_plug) {
+        drv->bdrv_io_plug(bs);
+    } else if (bs->file) {
+        bdrv_io_plug(bs->file);
+    }
+}
+
+void bdrv_io_unplug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+    if (drv && drv->bdrv_io_unplug) {
+        drv->bdrv_io_unplug(bs);
+    } else if (bs->file) {
+        bdrv_io_unplug(bs->file);
+    }
+}
+
+void bdrv_flush_io_queue(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+    if (drv && drv->bdrv_flush_io_queue) {
+        drv->bdrv_flush_io_queue(bs);
+    } else if (bs->file) {
+        bdrv_flush_io_queue(bs->file);
+    }
+}
@@ -38,6 +38,7 @@ typedef struct BackupBlockJob {
     BlockJob common;
     BlockDriverState *target;
     MirrorSyncMode sync_mode;
+    BdrvDirtyBitmap *sync_bitmap;
     RateLimit limit;
     BlockdevOnError on_source_error;
     BlockdevOnError on_target_error;
@@ -227,6 +228,100 @@ static BlockErrorAction backup_error_action(BackupBlockJob *job,
     }
 }
 
+/* Yield for the rate limit or at least once per cluster, and return
+ * whether the job was cancelled in the meantime.
+ */
+static bool coroutine_fn backup_yield_and_check(BackupBlockJob *job)
+{
+    if (block_job_is_cancelled(&job->common)) {
+        return true;
+    }
+
+    /* we need to yield so that qemu_aio_flush() returns.
+     * (without, VM does not reboot)
+     */
+    if (job->common.speed) {
+        uint64_t delay_ns = ratelimit_calculate_delay(
+                &job->limit, job->sectors_read);
+        job->sectors_read = 0;
+        block_job_sleep_ns(&job->common, QEMU_CLOCK_REALTIME, delay_ns);
+    } else {
+        block_job_sleep_ns(&job->common, QEMU_CLOCK_REALTIME, 0);
+    }
+
+    return block_job_is_cancelled(&job->common);
+}
+
+/* Mark every cluster that is clean in the sync bitmap as already copied,
+ * both for the loop in backup_run_incremental and for guest writes, and
+ * return the number of clusters left to copy.
+ */
+static int64_t backup_init_incremental(BackupBlockJob *job, int64_t end)
+{
+    BlockDriverState *bs = job->common.bs;
+    int64_t sectors_per_bit, sector, first, last;
+    int64_t clusters = 0;
+    HBitmapIter hbi;
+
+    sectors_per_bit = bdrv_dirty_bitmap_granularity(job->sync_bitmap) >>
+                      BDRV_SECTOR_BITS;
+
+    hbitmap_set(job->bitmap, 0, end);
+    bdrv_dirty_iter_init(bs, job->sync_bitmap, &hbi);
+    while ((sector = hbitmap_iter_next(&hbi)) != -1) {
+        first = sector / BACKUP_SECTORS_PER_CLUSTER;
+        last = DIV_ROUND_UP(sector + sectors_per_bit,
+                            BACKUP_SECTORS_PER_CLUSTER);
+        last = MIN(last, end);
+        for (; first < last; first++) {
+            if (hbitmap_get(job->bitmap, first)) {
+                hbitmap_reset(job->bitmap, first, 1);
+                clusters++;
+            }
+        }
+    }
+    return clusters;
+}
+
+/* Copy the clusters that backup_init_incremental left clear.  The sync
+ * bitmap is frozen, so it does not change under our feet.
+ */
+static int coroutine_fn backup_run_incremental(BackupBlockJob *job,
+                                               int64_t end)
+{
+    BlockDriverState *bs = job->common.bs;
+    HBitmapIter hbi;
+    int64_t sector, cluster, last;
+    int64_t sectors_per_bit;
+    bool error_is_read;
+    int ret;
+
+    sectors_per_bit = bdrv_dirty_bitmap_granularity(job->sync_bitmap) >>
+                      BDRV_SECTOR_BITS;
+
+    bdrv_dirty_iter_init(bs, job->sync_bitmap, &hbi);
+    while ((sector = hbitmap_iter_next(&hbi)) != -1) {
+        cluster = sector / BACKUP_SECTORS_PER_CLUSTER;
+        last = DIV_ROUND_UP(sector + sectors_per_bit,
+                            BACKUP_SECTORS_PER_CLUSTER);
+        last = MIN(last, end);
+        for (; cluster < last; cluster++) {
+            do {
+                if (backup_yield_and_check(job)) {
+                    return 0;
+                }
+                ret = backup_do_cow(bs, cluster * BACKUP_SECTORS_PER_CLUSTER,
+                                    BACKUP_SECTORS_PER_CLUSTER, &error_is_read);
+                if (ret < 0 && backup_error_action(job, error_is_read, -ret) ==
+                               BLOCK_ERROR_ACTION_REPORT) {
+                    return ret;
+                }
+            } while (ret < 0);
+        }
+    }
+    return 0;
+}
+
 static void coroutine_fn backup_run(void *opaque)
 {
     BackupBlockJob *job = opaque;
@@ -247,6 +342,12 @@ static void coroutine_fn backup_run(void *opaque)
                        BACKUP_SECTORS_PER_CLUSTER);
 
     job->bitmap = hbitmap_alloc(end, 0);
+    if (job->sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
+        /* Progress only counts the clusters that are to be copied */
+        job->common.len = MIN(job->common.len,
+                              backup_init_incremental(job, end) *
+                              BACKUP_CLUSTER_SIZE);
+    }
 
     bdrv_set_enable_write_cache(target, true);
     bdrv_set_on_error(target, on_target_error, on_target_error);
@@ -262,28 +363,14 @@ static void coroutine_fn backup_run(void *opaque)
             qemu_coroutine_yield();
             job->common.busy = true;
         }
+    } else if (job->sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
+        ret = backup_run_incremental(job, end);
     } else {
         /* Both FULL and TOP SYNC_MODE's require copying.. */
         for (; start < end; start++) {
             bool error_is_read;
 
-            if (block_job_is_cancelled(&job->common)) {
-                break;
-            }
-
-            /* we need to yield so that qemu_aio_flush() returns.
-             * (without, VM does not reboot)
-             */
-            if (job->common.speed) {
-                uint64_t delay_ns = ratelimit_calculate_delay(
-                        &job->limit, job->sectors_read);
-                job->sectors_read = 0;
-                block_job_sleep_ns(&job->common, QEMU_CLOCK_REALTIME, delay_ns);
-            } else {
-                block_job_sleep_ns(&job->common, QEMU_CLOCK_REALTIME, 0);
-            }
-
-            if (block_job_is_cancelled(&job->common)) {
+            if (backup_yield_and_check(job)) {
                 break;
             }
 
@@ -343,6 +430,15 @@ static void coroutine_fn backup_run(void *opaque)
 
     hbitmap_free(job->bitmap);
 
+    if (job->sync_bitmap) {
+        if (ret < 0 || block_job_is_cancelled(&job->common)) {
+            /* Nothing was lost, the next backup copies everything again */
+            bdrv_dirty_bitmap_reclaim(bs, job->sync_bitmap);
+        } else {
+            bdrv_dirty_bitmap_abdicate(bs, job->sync_bitmap);
+        }
+    }
+
     bdrv_iostatus_disable(target);
     bdrv_unref(target);
 
@@ -351,6 +447,7 @@ static void coroutine_fn backup_run(void *opaque)
 
 void backup_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, MirrorSyncMode sync_mode,
+                  BdrvDirtyBitmap *sync_bitmap,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockDriverCompletionFunc *cb, void *opaque,
@@ -376,9 +473,20 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
         return;
     }
 
+    /* Writes from now on go to the next incremental backup */
+    if (sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
+        assert(sync_bitmap);
+        if (bdrv_dirty_bitmap_create_successor(bs, sync_bitmap, errp) < 0) {
+            return;
+        }
+    }
+
     BackupBlockJob *job = block_job_create(&backup_job_driver, bs, speed,
                                            cb, opaque, errp);
     if (!job) {
+        if (sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
+            bdrv_dirty_bitmap_reclaim(bs, sync_bitmap);
+        }
         return;
     }
 
@@ -386,6 +494,8 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
     job->on_target_error = on_target_error;
     job->target = target;
     job->sync_mode = sync_mode;
+    job->sync_bitmap = sync_mode == MIRROR_SYNC_MODE_INCREMENTAL ?
+                       sync_bitmap : NULL;
     job->common.len = len;
     job->common.co = qemu_coroutine_create(backup_run);
     qemu_coroutine_enter(job->common.co, job);
@@ -19,6 +19,10 @@
 
 #define SLICE_TIME    100000000ULL /* ns */
 #define MAX_IN_FLIGHT 16
+/* Period over which the copy and dirty rates are measured */
+#define RATE_WINDOW   1000000000ULL /* ns */
+/* Largest write_zeroes request issued for areas that are zero on the source */
+#define MAX_ZERO_SECTORS ((1024 * 1024 * 1024) >> BDRV_SECTOR_BITS)
 
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
@@ -55,6 +59,22 @@ typedef struct MirrorBlockJob {
     unsigned long *in_flight_bitmap;
     int in_flight;
     int ret;
+
+    /* Largest operation, in chunks, and the average length of the dirty
+     * runs it is derived from.
+     */
+    int max_op_chunks;
+    int avg_run_chunks;
+
+    /* Sectors taken from the dirty bitmap and sectors written to the
+     * target since rate_start_ns, used to compute the rates below.
+     */
+    int64_t rate_start_ns;
+    int64_t rate_start_cnt;
+    int64_t rate_issued;
+    int64_t rate_copied;
+    int64_t copy_rate;
+    int64_t dirty_rate;
 } MirrorBlockJob;
 
 typedef struct MirrorOp {
@@ -96,10 +116,13 @@ static void mirror_iteration_done(MirrorOp *op, int ret)
 
     sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
     chunk_num = op->sector_num / sectors_per_chunk;
-    nb_chunks = op->nb_sectors / sectors_per_chunk;
+    nb_chunks = DIV_ROUND_UP(op->nb_sectors, sectors_per_chunk);
     bitmap_clear(s->in_flight_bitmap, chunk_num, nb_chunks);
-    if (s->cow_bitmap && ret >= 0) {
-        bitmap_set(s->cow_bitmap, chunk_num, nb_chunks);
+    if (ret >= 0) {
+        if (s->cow_bitmap) {
+            bitmap_set(s->cow_bitmap, chunk_num, nb_chunks);
+        }
+        s->rate_copied += op->nb_sectors;
     }
 
     qemu_iovec_destroy(&op->qiov);
@@ -152,12 +175,73 @@ static void mirror_read_complete(void *opaque, int ret)
                     mirror_write_complete, op);
 }
 
+/* Keep a running average of the length of the dirty runs met by
+ * mirror_iteration, and size operations after it: scattered writes are
+ * then copied with many small operations in parallel instead of a few that
+ * tie up the whole buffer, while long sequential runs still get large ones.
+ */
+static void mirror_update_op_size(MirrorBlockJob *s, int run_chunks)
+{
+    int buf_chunks = s->buf_size / s->granularity;
+
+    s->avg_run_chunks = (3 * s->avg_run_chunks + run_chunks + 3) / 4;
+    s->max_op_chunks = MIN(buf_chunks, 2 * s->avg_run_chunks);
+    s->max_op_chunks = MAX(s->max_op_chunks, buf_chunks / MAX_IN_FLIGHT);
+    s->max_op_chunks = MAX(s->max_op_chunks, 1);
+}
+
+/* Copy the dirty chunks starting at sector_num, which read as zeroes on the
+ * source for at least max_sectors sectors, by writing zeroes to the target.
+ * This needs no buffer and no read from the source.
+ */
+static void mirror_do_zero(MirrorBlockJob *s, int64_t sector_num,
+                           int max_sectors)
+{
+    BlockDriverState *source = s->common.bs;
+    int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    int64_t next_chunk = sector_num / sectors_per_chunk;
+    int nb_sectors = 0;
+    MirrorOp *op;
+
+    for (;;) {
+        bitmap_set(s->in_flight_bitmap, next_chunk, 1);
+        nb_sectors += MIN(sectors_per_chunk, max_sectors - nb_sectors);
+        next_chunk++;
+
+        if (nb_sectors >= max_sectors ||
+            !bdrv_get_dirty(source, s->dirty_bitmap, sector_num + nb_sectors) ||
+            test_bit(next_chunk, s->in_flight_bitmap)) {
+            break;
+        }
+
+        /* Advance the HBitmapIter past the chunks we take, like the copy
+         * path does.
+         */
+        hbitmap_iter_next(&s->hbi);
+    }
+
+    bdrv_reset_dirty_bitmap(source, s->dirty_bitmap, sector_num, nb_sectors);
+    s->rate_issued += nb_sectors;
+
+    op = g_slice_new(MirrorOp);
+    op->s = s;
+    op->sector_num = sector_num;
+    op->nb_sectors = nb_sectors;
+    qemu_iovec_init(&op->qiov, 1);
+
+    s->in_flight++;
+    trace_mirror_zero_iteration(s, sector_num, nb_sectors);
+    bdrv_aio_write_zeroes(s->target, sector_num, nb_sectors, 0,
+                          mirror_write_complete, op);
+}
+
 static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
 {
     BlockDriverState *source = s->common.bs;
-    int nb_sectors, sectors_per_chunk, nb_chunks;
+    int nb_sectors, sectors_per_chunk, nb_chunks, tries;
     int64_t end, sector_num, next_chunk, next_sector, hbitmap_next_sector;
-    uint64_t delay_ns;
+    uint64_t delay_ns = 0;
+    bool run_known = false;
     MirrorOp *op;
 
     s->sector_num = hbitmap_iter_next(&s->hbi);
@@ -169,11 +253,26 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
         assert(s->sector_num >= 0);
     }
 
-    hbitmap_next_sector = s->sector_num;
-    sector_num = s->sector_num;
     sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
     end = s->common.len >> BDRV_SECTOR_BITS;
 
+    /* If the first dirty chunk is still being copied by a previous
+     * iteration, move on to the next one instead of waiting.  It stays
+     * dirty and is picked up on the next pass over the bitmap.
+     */
+    for (tries = 0; tries < MAX_IN_FLIGHT &&
+         test_bit(s->sector_num / sectors_per_chunk, s->in_flight_bitmap);
+         tries++) {
+        int64_t next = hbitmap_iter_next(&s->hbi);
+        if (next < 0) {
+            break;
+        }
+        s->sector_num = next;
+    }
+
+    hbitmap_next_sector = s->sector_num;
+    sector_num = s->sector_num;
+
     /* Extend the QEMUIOVector to include all adjacent blocks that will
      * be copied in this operation.
      *
@@ -198,12 +297,35 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
         qemu_coroutine_yield();
     }
 
+    /* Areas that read as zeroes on the source need not be read at all.
+     * Skip this when doing COW, because then the whole target cluster has
+     * to be written with the data around the dirty chunks.
+     */
+    if (!s->cow_bitmap) {
+        int64_t ret;
+        int pnum;
+
+        ret = bdrv_get_block_status(source, sector_num,
+                                    MIN(end - sector_num, MAX_ZERO_SECTORS),
+                                    &pnum);
+        if (ret >= 0 && (ret & BDRV_BLOCK_ZERO)) {
+            if (sector_num + pnum < end) {
+                pnum = QEMU_ALIGN_DOWN(pnum, sectors_per_chunk);
+            }
+            if (pnum > 0) {
+                mirror_do_zero(s, sector_num, pnum);
+                return 0;
+            }
+        }
+    }
+
     do {
         int added_sectors, added_chunks;
 
         if (!bdrv_get_dirty(source, s->dirty_bitmap, next_sector) ||
             test_bit(next_chunk, s->in_flight_bitmap)) {
             assert(nb_sectors > 0);
+            run_known = true;
             break;
         }
 
@@ -226,6 +348,14 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
         added_sectors = MIN(added_sectors, end - (sector_num + nb_sectors));
         added_chunks = (added_sectors + sectors_per_chunk - 1) / sectors_per_chunk;
 
+        /* Do not let a single operation grow much beyond the dirty runs
+         * seen so far, so that other regions can be copied in parallel.
+         */
+        if (nb_chunks > 0 && nb_chunks + added_chunks > s->max_op_chunks) {
+            run_known = true;
+            break;
+        }
+
         /* When doing COW, it may happen that there is not enough space for
          * a full cluster.  Wait if that is the case.
          */
@@ -252,6 +382,10 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
         }
     } while (delay_ns == 0 && next_sector < end);
 
+    if (run_known || next_sector >= end) {
+        mirror_update_op_size(s, nb_chunks);
+    }
+
     /* Allocate a MirrorOp that is used as an AIO callback.  */
     op = g_slice_new(MirrorOp);
     op->s = s;
@@ -280,7 +414,8 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
         next_sector += sectors_per_chunk;
     }
 
-    bdrv_reset_dirty(source, sector_num, nb_sectors);
+    bdrv_reset_dirty_bitmap(source, s->dirty_bitmap, sector_num, nb_sectors);
+    s->rate_issued += nb_sectors;
 
     /* Copy the dirty cluster.  */
     s->in_flight++;
@@ -290,6 +425,31 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     return delay_ns;
 }
 
+/* Sample the dirty and copy rates once per RATE_WINDOW.  Sectors that are
+ * dirty now or were taken from the bitmap during the window, but were not
+ * dirty when it started, were written by the guest in the meantime.
+ */
+static void mirror_update_rates(MirrorBlockJob *s, int64_t cnt)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t elapsed_ms = (now - s->rate_start_ns) / SCALE_MS;
+    int64_t dirtied;
+
+    if (now - s->rate_start_ns < RATE_WINDOW) {
+        return;
+    }
+
+    dirtied = MAX(cnt - s->rate_start_cnt + s->rate_issued, 0);
+    s->dirty_rate = dirtied * BDRV_SECTOR_SIZE * 1000 / elapsed_ms;
+    s->copy_rate = s->rate_copied * BDRV_SECTOR_SIZE * 1000 / elapsed_ms;
+    trace_mirror_rates(s, cnt, s->copy_rate, s->dirty_rate, s->max_op_chunks);
+
+    s->rate_start_ns = now;
+    s->rate_start_cnt = cnt;
+    s->rate_issued = 0;
+    s->rate_copied = 0;
+}
+
 static void mirror_free_init(MirrorBlockJob *s)
 {
     int granularity = s->granularity;
@@ -369,6 +529,10 @@ static void coroutine_fn mirror_run(void *opaque)
     sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
     mirror_free_init(s);
 
+    /* Start out with operations as large as the buffer, as before */
+    s->max_op_chunks = s->buf_size / s->granularity;
+    s->avg_run_chunks = s->max_op_chunks / 2;
+
     if (!s->is_none_mode) {
         /* First part, loop on the sectors and initialize the dirty bitmap.  */
         BlockDriverState *base = s->base;
@@ -393,6 +557,8 @@ static void coroutine_fn mirror_run(void *opaque)
 
     bdrv_dirty_iter_init(bs, s->dirty_bitmap, &s->hbi);
     last_pause_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    s->rate_start_ns = last_pause_ns;
+    s->rate_start_cnt = bdrv_get_dirty_count(bs, s->dirty_bitmap);
     for (;;) {
         uint64_t delay_ns = 0;
         int64_t cnt;
@@ -404,6 +570,7 @@ static void coroutine_fn mirror_run(void *opaque)
         }
 
         cnt = bdrv_get_dirty_count(bs, s->dirty_bitmap);
+        mirror_update_rates(s, cnt);
 
         /* Note that even when no rate limit is applied we need to yield
          * periodically with no pending I/O so that qemu_aio_flush() returns.
@@ -584,12 +751,26 @@ static void mirror_complete(BlockJob *job, Error **errp)
     block_job_resume(job);
 }
 
+static void mirror_query(BlockJob *job, BlockJobInfo *info)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+
+    info->has_remaining = true;
+    info->remaining = bdrv_get_dirty_count(job->bs, s->dirty_bitmap) *
+                      BDRV_SECTOR_SIZE;
+    info->has_copy_rate = true;
+    info->copy_rate = s->copy_rate;
+    info->has_dirty_rate = true;
+    info->dirty_rate = s->dirty_rate;
+}
+
 static const BlockJobDriver mirror_job_driver = {
     .instance_size = sizeof(MirrorBlockJob),
     .job_type      = BLOCK_JOB_TYPE_MIRROR,
     .set_speed     = mirror_set_speed,
     .iostatus_reset= mirror_iostatus_reset,
     .complete      = mirror_complete,
+    .query         = mirror_query,
 };
 
 static const BlockJobDriver commit_active_job_driver = {
@@ -599,6 +780,7 @@ static const BlockJobDriver commit_active_job_driver = {
     .iostatus_reset
                    = mirror_iostatus_reset,
     .complete      = mirror_complete,
+    .query         = mirror_query,
 };
 
 static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
@@ -650,7 +832,7 @@ static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
     s->granularity = granularity;
     s->buf_size = MAX(buf_size, granularity);
 
-    s->dirty_bitmap = bdrv_create_dirty_bitmap(bs, granularity, errp);
+    s->dirty_bitmap = bdrv_create_dirty_bitmap(bs, granularity, NULL, errp);
     if (!s->dirty_bitmap) {
         return;
     }
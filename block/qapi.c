@@ -325,6 +325,11 @@ static BlockStats *bdrv_query_stats(const BlockDriverState *bs)
         s->backing = bdrv_query_stats(bs->backing_hd);
     }
 
+    if (bs->drv && bs->drv->bdrv_get_cache_stats) {
+        s->metadata_caches = bs->drv->bdrv_get_cache_stats(bs);
+        s->has_metadata_caches = s->metadata_caches != NULL;
+    }
+
     return s;
 }
 
@@ -0,0 +1,426 @@
+/*
+ * Persistent dirty bitmaps for the QCOW version 2 format
+ *
+ * Copyright (c) 2014 The QEMU Project Developers
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Persistent bitmaps are only written to the image when it is closed, and
+ * they are taken out of the image again as soon as it is opened read/write.
+ * The QCOW2_AUTOCLEAR_DIRTY_BITMAPS bit is set together with the bitmap
+ * directory; any other program that writes to the image clears it, which
+ * tells us that the stored bitmaps no longer describe the disk contents.
+ * If QEMU crashes, the bitmaps are simply lost.
+ */
+
+#include "qemu-common.h"
+#include "qemu/error-report.h"
+#include "block/block_int.h"
+#include "block/qcow2.h"
+#include "trace.h"
+
+void qcow2_free_bitmap_directory(Qcow2Bitmap *bitmaps, int nb_bitmaps)
+{
+    int i;
+
+    for (i = 0; i < nb_bitmaps; i++) {
+        g_free(bitmaps[i].name);
+    }
+    g_free(bitmaps);
+}
+
+/*
+ * Reads and validates the bitmap directory described by the header
+ * extension.  Returns the number of bitmaps or -errno.
+ */
+int qcow2_read_bitmap_directory(BlockDriverState *bs, Qcow2Bitmap **pbitmaps)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2BitmapHeader h;
+    Qcow2Bitmap *bitmaps, *bm;
+    int64_t offset, end;
+    int i, ret;
+
+    *pbitmaps = NULL;
+    if (s->nb_bitmaps == 0) {
+        return 0;
+    }
+
+    if (s->nb_bitmaps > QCOW_MAX_BITMAPS ||
+        s->bitmap_directory_size > QCOW_MAX_BITMAP_DIRECTORY_SIZE ||
+        offset_into_cluster(s, s->bitmap_directory_offset)) {
+        return -EINVAL;
+    }
+
+    offset = s->bitmap_directory_offset;
+    end = offset + s->bitmap_directory_size;
+    bitmaps = g_new0(Qcow2Bitmap, s->nb_bitmaps);
+
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        bm = &bitmaps[i];
+
+        offset = align_offset(offset, 8);
+        if (offset + sizeof(h) > end) {
+            ret = -EINVAL;
+            goto fail;
+        }
+        ret = bdrv_pread(bs->file, offset, &h, sizeof(h));
+        if (ret < 0) {
+            goto fail;
+        }
+        offset += sizeof(h);
+
+        bm->data_offset = be64_to_cpu(h.data_offset);
+        bm->data_size = be64_to_cpu(h.data_size);
+        bm->granularity_bits = be32_to_cpu(h.granularity_bits);
+        be16_to_cpus(&h.name_size);
+
+        if (h.name_size == 0 || offset + h.name_size > end ||
+            bm->granularity_bits < BDRV_SECTOR_BITS ||
+            bm->granularity_bits > 30 ||
+            offset_into_cluster(s, bm->data_offset)) {
+            ret = -EINVAL;
+            goto fail;
+        }
+
+        bm->name = g_malloc(h.name_size + 1);
+        ret = bdrv_pread(bs->file, offset, bm->name, h.name_size);
+        if (ret < 0) {
+            goto fail;
+        }
+        bm->name[h.name_size] = '\0';
+        offset += h.name_size;
+    }
+
+    *pbitmaps = bitmaps;
+    return s->nb_bitmaps;
+
+fail:
+    qcow2_free_bitmap_directory(bitmaps, s->nb_bitmaps);
+    return ret;
+}
+
+/*
+ * Removes the bitmap directory from the image header.  The clusters of
+ * bitmaps that are still valid are freed; those of stale bitmaps are not
+ * accounted for by qemu-img check, so they are left alone as leaks.
+ */
+static int qcow2_drop_stored_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Bitmap *bitmaps;
+    int nb_bitmaps, i;
+
+    if (s->autoclear_features & QCOW2_AUTOCLEAR_DIRTY_BITMAPS) {
+        nb_bitmaps = qcow2_read_bitmap_directory(bs, &bitmaps);
+        for (i = 0; i < nb_bitmaps; i++) {
+            qcow2_free_clusters(bs, bitmaps[i].data_offset,
+                                bitmaps[i].data_size, QCOW2_DISCARD_ALWAYS);
+        }
+        if (nb_bitmaps >= 0) {
+            qcow2_free_clusters(bs, s->bitmap_directory_offset,
+                                s->bitmap_directory_size, QCOW2_DISCARD_ALWAYS);
+            qcow2_free_bitmap_directory(bitmaps, nb_bitmaps);
+        }
+    }
+
+    s->nb_bitmaps = 0;
+    s->bitmap_directory_offset = 0;
+    s->bitmap_directory_size = 0;
+    s->autoclear_features &= ~QCOW2_AUTOCLEAR_DIRTY_BITMAPS;
+    return qcow2_update_header(bs);
+}
+
+static int qcow2_load_one_bitmap(BlockDriverState *bs, Qcow2Bitmap *bm)
+{
+    BdrvDirtyBitmap *bitmap;
+    Error *local_err = NULL;
+    uint8_t *buf;
+    int ret;
+
+    if (bdrv_find_dirty_bitmap(bs, bm->name)) {
+        /* Still there from before qcow2_invalidate_cache() */
+        return 0;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, 1 << bm->granularity_bits, bm->name,
+                                      &local_err);
+    if (!bitmap) {
+        error_report("%s", error_get_pretty(local_err));
+        error_free(local_err);
+        return -EINVAL;
+    }
+
+    if (bdrv_dirty_bitmap_serialization_size(bitmap) != bm->data_size) {
+        error_report("qcow2: dirty bitmap '%s' does not match the image size",
+                     bm->name);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    buf = g_malloc(bm->data_size);
+    ret = bdrv_pread(bs->file, bm->data_offset, buf, bm->data_size);
+    if (ret < 0) {
+        g_free(buf);
+        error_report("qcow2: could not read dirty bitmap '%s': %s", bm->name,
+                     strerror(-ret));
+        goto fail;
+    }
+    bdrv_dirty_bitmap_deserialize(bitmap, buf);
+    bdrv_dirty_bitmap_set_persistent(bitmap, true);
+    g_free(buf);
+
+    trace_qcow2_load_dirty_bitmap(bs, bm->name, bm->data_offset);
+    return 0;
+
+fail:
+    bdrv_release_dirty_bitmap(bs, bitmap);
+    return ret;
+}
+
+/*
+ * Creates a persistent dirty bitmap for every bitmap stored in the image.
+ * If the image is writable, the stored copies are dropped right away, as
+ * they become stale with the first guest write.  Failing to load bitmaps
+ * never fails the open; the next backup will just have to be a full one.
+ */
+void qcow2_load_dirty_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    bool writable = !bs->read_only && !(s->flags & BDRV_O_INCOMING);
+    Qcow2Bitmap *bitmaps;
+    int nb_bitmaps, i, ret;
+
+    if (s->nb_bitmaps == 0) {
+        return;
+    }
+
+    if (!(s->autoclear_features & QCOW2_AUTOCLEAR_DIRTY_BITMAPS)) {
+        error_report("qcow2: image was modified by a program that does not "
+                     "know about dirty bitmaps; discarding %" PRIu32 " stale "
+                     "bitmap(s)", s->nb_bitmaps);
+    } else {
+        nb_bitmaps = qcow2_read_bitmap_directory(bs, &bitmaps);
+        if (nb_bitmaps < 0) {
+            error_report("qcow2: could not read dirty bitmap directory: %s",
+                         strerror(-nb_bitmaps));
+            return;
+        }
+        for (i = 0; i < nb_bitmaps; i++) {
+            qcow2_load_one_bitmap(bs, &bitmaps[i]);
+        }
+        qcow2_free_bitmap_directory(bitmaps, nb_bitmaps);
+    }
+
+    if (writable) {
+        ret = qcow2_drop_stored_bitmaps(bs);
+        if (ret < 0) {
+            error_report("qcow2: could not remove dirty bitmaps from the "
+                         "image header: %s", strerror(-ret));
+        }
+    }
+}
+
+static int qcow2_write_bitmap_data(BlockDriverState *bs, Qcow2Bitmap *bm,
+                                   BdrvDirtyBitmap *bitmap)
+{
+    uint8_t *buf;
+    int64_t offset;
+    int ret;
+
+    bm->data_size = bdrv_dirty_bitmap_serialization_size(bitmap);
+    offset = qcow2_alloc_clusters(bs, bm->data_size);
+    if (offset < 0) {
+        return offset;
+    }
+    bm->data_offset = offset;
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, offset, bm->data_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    buf = g_malloc(bm->data_size);
+    bdrv_dirty_bitmap_serialize(bitmap, buf);
+    ret = bdrv_pwrite(bs->file, offset, buf, bm->data_size);
+    g_free(buf);
+
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Writes all persistent dirty bitmaps of @bs and a directory for them to
+ * the image, and points the header extension to it.  Called on close.
+ */
+int qcow2_store_dirty_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap = NULL;
+    Qcow2Bitmap *bitmaps = NULL;
+    Qcow2BitmapHeader h;
+    uint8_t *dir = NULL;
+    int64_t dir_offset, dir_size = 0, offset;
+    int nb_bitmaps = 0, i, ret;
+
+    if (bs->read_only || (bs->open_flags & BDRV_O_INCOMING)) {
+        return 0;
+    }
+
+    /* Only left over if the image was opened read-only or incoming */
+    if (s->nb_bitmaps) {
+        ret = qcow2_drop_stored_bitmaps(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    while ((bitmap = bdrv_next_dirty_bitmap(bs, bitmap))) {
+        if (bdrv_dirty_bitmap_get_persistent(bitmap)) {
+            nb_bitmaps++;
+        }
+    }
+    if (nb_bitmaps == 0) {
+        return 0;
+    }
+
+    if (s->qcow_version < 3 || nb_bitmaps > QCOW_MAX_BITMAPS) {
+        error_report("qcow2: cannot store dirty bitmaps in this image");
+        return -ENOTSUP;
+    }
+
+    /* Write the bitmaps themselves and compute the directory size */
+    bitmaps = g_new0(Qcow2Bitmap, nb_bitmaps);
+    i = 0;
+    while ((bitmap = bdrv_next_dirty_bitmap(bs, bitmap))) {
+        Qcow2Bitmap *bm = &bitmaps[i];
+
+        if (!bdrv_dirty_bitmap_get_persistent(bitmap)) {
+            continue;
+        }
+        i++;
+
+        bm->name = g_strdup(bdrv_dirty_bitmap_name(bitmap));
+        bm->granularity_bits = ctz64(bdrv_dirty_bitmap_granularity(bitmap));
+        ret = qcow2_write_bitmap_data(bs, bm, bitmap);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        dir_size = align_offset(dir_size, 8) + sizeof(h) + strlen(bm->name);
+        trace_qcow2_store_dirty_bitmap(bs, bm->name, bm->data_offset);
+    }
+
+    if (dir_size > QCOW_MAX_BITMAP_DIRECTORY_SIZE) {
+        ret = -EFBIG;
+        goto fail;
+    }
+
+    /* Build and write the directory */
+    dir = g_malloc0(dir_size);
+    offset = 0;
+    for (i = 0; i < nb_bitmaps; i++) {
+        Qcow2Bitmap *bm = &bitmaps[i];
+        size_t name_size = strlen(bm->name);
+
+        offset = align_offset(offset, 8);
+        h.data_offset = cpu_to_be64(bm->data_offset);
+        h.data_size = cpu_to_be64(bm->data_size);
+        h.granularity_bits = cpu_to_be32(bm->granularity_bits);
+        h.name_size = cpu_to_be16(name_size);
+        h.reserved = 0;
+        memcpy(dir + offset, &h, sizeof(h));
+        offset += sizeof(h);
+        memcpy(dir + offset, bm->name, name_size);
+        offset += name_size;
+    }
+
+    dir_offset = qcow2_alloc_clusters(bs, dir_size);
+    if (dir_offset < 0) {
+        ret = dir_offset;
+        goto fail;
+    }
+    ret = qcow2_pre_write_overlap_check(bs, 0, dir_offset, dir_size);
+    if (ret < 0) {
+        goto fail_dir;
+    }
+    ret = bdrv_pwrite(bs->file, dir_offset, dir, dir_size);
+    if (ret < 0) {
+        goto fail_dir;
+    }
+
+    /* The header may only point to the bitmaps once they are stable */
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        goto fail_dir;
+    }
+    ret = bdrv_flush(bs->file);
+    if (ret < 0) {
+        goto fail_dir;
+    }
+
+    s->nb_bitmaps = nb_bitmaps;
+    s->bitmap_directory_offset = dir_offset;
+    s->bitmap_directory_size = dir_size;
+    s->autoclear_features |= QCOW2_AUTOCLEAR_DIRTY_BITMAPS;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->nb_bitmaps = 0;
+        s->bitmap_directory_offset = 0;
+        s->bitmap_directory_size = 0;
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_DIRTY_BITMAPS;
+        goto fail_dir;
+    }
+
+    g_free(dir);
+    qcow2_free_bitmap_directory(bitmaps, nb_bitmaps);
+    return 0;
+
+fail_dir:
+    qcow2_free_clusters(bs, dir_offset, dir_size, QCOW2_DISCARD_ALWAYS);
+fail:
+    for (i = 0; i < nb_bitmaps; i++) {
+        if (bitmaps[i].data_offset) {
+            qcow2_free_clusters(bs, bitmaps[i].data_offset,
+                                bitmaps[i].data_size, QCOW2_DISCARD_ALWAYS);
+        }
+    }
+    g_free(dir);
+    qcow2_free_bitmap_directory(bitmaps, nb_bitmaps);
+    error_report("qcow2: could not store dirty bitmaps: %s", strerror(-ret));
+    return ret;
+}
+
+bool qcow2_can_store_dirty_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->qcow_version < 3) {
+        error_setg(errp, "Persistent dirty bitmaps require a qcow2 image with "
+                   "at least qemu 1.1 compatibility level");
+        return false;
+    }
+    if (bs->read_only) {
+        error_setg(errp, "Persistent dirty bitmaps cannot be stored in a "
+                   "read-only image");
+        return false;
+    }
+    return true;
+}
@@ -28,35 +28,173 @@
 #include "trace.h"
 
 typedef struct Qcow2CachedTable {
-    void*   table;
     int64_t offset;
     bool    dirty;
-    int     cache_hits;
+    bool    referenced;
     int     ref;
+    int     hash_next;
 } Qcow2CachedTable;
 
+/*
+ * All tables live in one contiguous buffer, so the index of a table follows
+ * from its address.  Cached offsets are found through a hash table of
+ * singly linked chains (hash_head[] and hash_next, -1 terminated); entries
+ * with offset 0 are unused and not hashed.  Replacement uses the CLOCK
+ * algorithm: a hit sets the referenced bit, and the hand clears it again on
+ * its way round, evicting the first unreferenced, unused entry it finds.
+ */
 struct Qcow2Cache {
     Qcow2CachedTable*       entries;
+    void*                   table_array;
+    int*                    hash_head;
+    unsigned                hash_mask;
     struct Qcow2Cache*      depends;
     int                     size;
+    int                     table_size;
+    int                     clock_hand;
+    uint64_t                hits;
+    uint64_t                misses;
     bool                    depends_on_flush;
 };
 
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
+static inline void *qcow2_cache_get_table_addr(BlockDriverState *bs,
+                    Qcow2Cache *c, int table)
 {
-    BDRVQcowState *s = bs->opaque;
-    Qcow2Cache *c;
+    return (uint8_t *) c->table_array + (size_t) table * c->table_size;
+}
+
+static inline int qcow2_cache_get_table_idx(BlockDriverState *bs,
+                  Qcow2Cache *c, void *table)
+{
+    ptrdiff_t table_offset = (uint8_t *) table - (uint8_t *) c->table_array;
+    int idx = table_offset / c->table_size;
+
+    if (table_offset < 0 || idx >= c->size ||
+        table_offset % c->table_size) {
+        return -1;
+    }
+    return idx;
+}
+
+static inline unsigned qcow2_cache_hash(BlockDriverState *bs, Qcow2Cache *c,
+                                        uint64_t offset)
+{
+    return (offset / c->table_size) & c->hash_mask;
+}
+
+static void qcow2_cache_hash_insert(BlockDriverState *bs, Qcow2Cache *c, int i)
+{
+    unsigned h = qcow2_cache_hash(bs, c, c->entries[i].offset);
+
+    c->entries[i].hash_next = c->hash_head[h];
+    c->hash_head[h] = i;
+}
+
+static void qcow2_cache_hash_remove(BlockDriverState *bs, Qcow2Cache *c, int i)
+{
+    int *link;
+
+    if (!c->entries[i].offset) {
+        return;
+    }
+
+    link = &c->hash_head[qcow2_cache_hash(bs, c, c->entries[i].offset)];
+    while (*link != i) {
+        assert(*link >= 0);
+        link = &c->entries[*link].hash_next;
+    }
+    *link = c->entries[i].hash_next;
+    c->entries[i].hash_next = -1;
+}
+
+static int qcow2_cache_lookup(BlockDriverState *bs, Qcow2Cache *c,
+                              uint64_t offset)
+{
+    int i;
+
+    for (i = c->hash_head[qcow2_cache_hash(bs, c, offset)]; i >= 0;
+         i = c->entries[i].hash_next) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* (Re)builds the hash table for the c->size entries of the cache */
+static void qcow2_cache_rehash(BlockDriverState *bs, Qcow2Cache *c)
+{
+    unsigned buckets;
     int i;
 
+    /* About one entry per bucket */
+    for (buckets = 1; buckets < c->size; buckets <<= 1) {
+        /* nothing */
+    }
+    c->hash_mask = buckets - 1;
+    g_free(c->hash_head);
+    c->hash_head = g_malloc(sizeof(*c->hash_head) * buckets);
+    for (i = 0; i < buckets; i++) {
+        c->hash_head[i] = -1;
+    }
+    for (i = 0; i < c->size; i++) {
+        c->entries[i].hash_next = -1;
+        if (c->entries[i].offset) {
+            qcow2_cache_hash_insert(bs, c, i);
+        }
+    }
+}
+
+/*
+ * Creates a cache of num_tables entries of table_size bytes each.  An entry
+ * doesn't have to cover a whole cluster; the L2 table cache holds slices of
+ * L2 tables.
+ */
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int table_size)
+{
+    Qcow2Cache *c;
+
     c = g_malloc0(sizeof(*c));
     c->size = num_tables;
+    c->table_size = table_size;
     c->entries = g_malloc0(sizeof(*c->entries) * num_tables);
+    c->table_array = qemu_blockalign(bs, (size_t) num_tables * table_size);
+    qcow2_cache_rehash(bs, c);
+
+    return c;
+}
 
+/*
+ * Grows the cache to num_tables entries, keeping the cached tables.  Tables
+ * move in memory, so this fails with -EBUSY while any of them is in use.
+ */
+int qcow2_cache_grow(BlockDriverState *bs, Qcow2Cache *c, int num_tables)
+{
+    void *table_array;
+    int i;
+
+    if (num_tables <= c->size) {
+        return 0;
+    }
     for (i = 0; i < c->size; i++) {
-        c->entries[i].table = qemu_blockalign(bs, s->cluster_size);
+        if (c->entries[i].ref) {
+            return -EBUSY;
+        }
     }
 
-    return c;
+    table_array = qemu_blockalign(bs, (size_t) num_tables * c->table_size);
+    memcpy(table_array, c->table_array, (size_t) c->size * c->table_size);
+    qemu_vfree(c->table_array);
+    c->table_array = table_array;
+
+    c->entries = g_realloc(c->entries, sizeof(*c->entries) * num_tables);
+    memset(&c->entries[c->size], 0,
+           sizeof(*c->entries) * (num_tables - c->size));
+    c->size = num_tables;
+    qcow2_cache_rehash(bs, c);
+
+    return 0;
 }
 
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
@@ -65,15 +203,24 @@ int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        qemu_vfree(c->entries[i].table);
     }
 
+    qemu_vfree(c->table_array);
+    g_free(c->hash_head);
     g_free(c->entries);
     g_free(c);
 
     return 0;
 }
 
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *size, uint64_t *hits,
+                           uint64_t *misses)
+{
+    *size = (uint64_t) c->size * c->table_size;
+    *hits = c->hits;
+    *misses = c->misses;
+}
+
 static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret;
@@ -116,13 +263,13 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
 
     if (c == s->refcount_block_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_REFCOUNT_BLOCK,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     } else if (c == s->l2_table_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_ACTIVE_L2,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     } else {
         ret = qcow2_pre_write_overlap_check(bs, 0,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     }
 
     if (ret < 0) {
@@ -135,8 +282,8 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
     }
 
-    ret = bdrv_pwrite(bs->file, c->entries[i].offset, c->entries[i].table,
-        s->cluster_size);
+    ret = bdrv_pwrite(bs->file, c->entries[i].offset,
+                      qcow2_cache_get_table_addr(bs, c, i), c->table_size);
     if (ret < 0) {
         return ret;
     }
@@ -211,8 +358,9 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
+        qcow2_cache_hash_remove(bs, c, i);
         c->entries[i].offset = 0;
-        c->entries[i].cache_hits = 0;
+        c->entries[i].referenced = false;
     }
 
     return 0;
@@ -220,32 +368,26 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 
 static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
 {
-    int i;
-    int min_count = INT_MAX;
-    int min_index = -1;
+    int i, n;
 
+    /* Two rounds are enough to clear every referenced bit once */
+    for (n = 0; n < 2 * c->size; n++) {
+        i = c->clock_hand;
+        c->clock_hand = (c->clock_hand + 1) % c->size;
 
-    for (i = 0; i < c->size; i++) {
         if (c->entries[i].ref) {
             continue;
         }
-
-        if (c->entries[i].cache_hits < min_count) {
-            min_index = i;
-            min_count = c->entries[i].cache_hits;
+        if (c->entries[i].referenced) {
+            c->entries[i].referenced = false;
+            continue;
         }
-
-        /* Give newer hits priority */
-        /* TODO Check how to optimize the replacement strategy */
-        c->entries[i].cache_hits /= 2;
+        return i;
     }
 
-    if (min_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
-    }
-    return min_index;
+    /* This can't happen in current synchronous code, but leave the check
+     * here as a reminder for whoever starts using AIO with the cache */
+    abort();
 }
 
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
@@ -259,11 +401,12 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
                           offset, read_from_disk);
 
     /* Check if the table is already cached */
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            goto found;
-        }
+    i = qcow2_cache_lookup(bs, c, offset);
+    if (i >= 0) {
+        c->hits++;
+        goto found;
     }
+    c->misses++;
 
     /* If not, write a table back and replace it */
     i = qcow2_cache_find_entry_to_replace(c);
@@ -280,28 +423,28 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
+    qcow2_cache_hash_remove(bs, c, i);
     c->entries[i].offset = 0;
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
-        ret = bdrv_pread(bs->file, offset, c->entries[i].table, s->cluster_size);
+        ret = bdrv_pread(bs->file, offset, qcow2_cache_get_table_addr(bs, c, i),
+                         c->table_size);
         if (ret < 0) {
             return ret;
         }
     }
 
-    /* Give the table some hits for the start so that it won't be replaced
-     * immediately. The number 32 is completely arbitrary. */
-    c->entries[i].cache_hits = 32;
     c->entries[i].offset = offset;
+    qcow2_cache_hash_insert(bs, c, i);
 
     /* And return the right table */
 found:
-    c->entries[i].cache_hits++;
+    c->entries[i].referenced = true;
     c->entries[i].ref++;
-    *table = c->entries[i].table;
+    *table = qcow2_cache_get_table_addr(bs, c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
@@ -323,16 +466,12 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 {
-    int i;
+    int i = qcow2_cache_get_table_idx(bs, c, *table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == *table) {
-            goto found;
-        }
+    if (i < 0) {
+        return -ENOENT;
     }
-    return -ENOENT;
 
-found:
     c->entries[i].ref--;
     *table = NULL;
 
@@ -340,17 +479,11 @@ found:
     return 0;
 }
 
-void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
+void qcow2_cache_entry_mark_dirty(BlockDriverState *bs, Qcow2Cache *c,
+                                  void *table)
 {
-    int i;
+    int i = qcow2_cache_get_table_idx(bs, c, table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == table) {
-            goto found;
-        }
-    }
-    abort();
-
-found:
+    assert(i >= 0);
     c->entries[i].dirty = true;
 }
@@ -28,6 +28,10 @@
 #include "qemu/range.h"
 #include "qapi/qmp/types.h"
 #include "qapi-event.h"
+#include "trace.h"
+
+/* Clusters allocated at once for concurrent allocating writes */
+#define QCOW2_DATA_POOL_SIZE (4 * 1024 * 1024)
 
 static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size);
 static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
@@ -266,7 +270,8 @@ static int alloc_refcount_block(BlockDriverState *bs,
 
     /* Now the new refcount block needs to be written to disk */
     BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_ALLOC_WRITE);
-    qcow2_cache_entry_mark_dirty(s->refcount_block_cache, *refcount_block);
+    qcow2_cache_entry_mark_dirty(bs, s->refcount_block_cache,
+                                 *refcount_block);
     ret = qcow2_cache_flush(bs, s->refcount_block_cache);
     if (ret < 0) {
         goto fail_block;
@@ -552,7 +557,8 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
         }
         old_table_index = table_index;
 
-        qcow2_cache_entry_mark_dirty(s->refcount_block_cache, refcount_block);
+        qcow2_cache_entry_mark_dirty(bs, s->refcount_block_cache,
+                                     refcount_block);
 
         /* we can update the count and save it */
         block_index = cluster_index &
@@ -731,6 +737,142 @@ int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     return i;
 }
 
+static void coroutine_fn qcow2_prealloc_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcowState *s = bs->opaque;
+    int64_t start, bytes;
+    int ret = 0;
+
+    while (s->prealloc_size && s->prealloc_end < s->prealloc_goal) {
+        start = s->prealloc_end;
+        bytes = MIN(s->prealloc_goal - start, s->prealloc_size);
+        trace_qcow2_prealloc(bs, start, bytes);
+
+        ret = bdrv_co_preallocate(bs->file, start >> BDRV_SECTOR_BITS,
+                                  bytes >> BDRV_SECTOR_BITS);
+        if (ret < 0) {
+            /* Not supported by the host (or out of space); writes will just
+             * allocate as they go */
+            s->prealloc_size = 0;
+            break;
+        }
+        s->prealloc_end = start + bytes;
+    }
+
+    trace_qcow2_prealloc_done(bs, s->prealloc_end, ret);
+    s->prealloc_co = NULL;
+}
+
+/*
+ * Makes sure that the host file has space reserved for at least half of
+ * prealloc_size beyond alloc_end.  The reservation runs in the background,
+ * so the allocating request doesn't wait for it.
+ */
+static void qcow2_prealloc(BlockDriverState *bs, int64_t alloc_end)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (!s->prealloc_size || alloc_end + s->prealloc_size / 2 <= s->prealloc_end)
+    {
+        return;
+    }
+
+    s->prealloc_goal = MAX(s->prealloc_goal, alloc_end + s->prealloc_size);
+    if (!s->prealloc_co) {
+        s->prealloc_co = qemu_coroutine_create(qcow2_prealloc_entry);
+        qemu_coroutine_enter(s->prealloc_co, bs);
+    }
+}
+
+/* Disables background preallocation and waits for it to stop */
+void qcow2_stop_prealloc(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    s->prealloc_size = 0;
+    while (s->prealloc_co) {
+        aio_poll(bdrv_get_aio_context(bs), true);
+    }
+}
+
+/*
+ * Allocates host clusters for guest data.  While other allocating requests
+ * are in flight, a whole range of clusters is allocated with a single
+ * refcount update and then handed out piece by piece, so that concurrent
+ * allocating writes mostly don't touch refcount blocks at all and don't
+ * have to wait for each other's metadata I/O under s->lock.
+ *
+ * If *host_offset is non-zero, clusters are only allocated at that offset.
+ * *nb_clusters is updated to the number of clusters actually allocated,
+ * which can be less than requested (and 0 if *host_offset can't be used).
+ */
+int qcow2_alloc_data_clusters(BlockDriverState *bs, uint64_t *host_offset,
+                              unsigned int *nb_clusters)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t offset;
+    int ret;
+
+    if (s->data_pool_clusters == 0 && *host_offset == 0 &&
+        !QLIST_EMPTY(&s->cluster_allocs))
+    {
+        int batch = MAX(*nb_clusters, QCOW2_DATA_POOL_SIZE >> s->cluster_bits);
+
+        /* If this fails (e.g. ENOSPC), try again without the extra clusters */
+        offset = qcow2_alloc_clusters(bs, (uint64_t) batch << s->cluster_bits);
+        if (offset >= 0) {
+            trace_qcow2_data_pool_refill(bs, offset, batch);
+            s->data_pool_offset = offset;
+            s->data_pool_clusters = batch;
+        }
+    }
+
+    if (s->data_pool_clusters > 0 &&
+        (*host_offset == 0 || *host_offset == s->data_pool_offset))
+    {
+        *nb_clusters = MIN(*nb_clusters, s->data_pool_clusters);
+        *host_offset = s->data_pool_offset;
+        s->data_pool_offset += (uint64_t) *nb_clusters << s->cluster_bits;
+        s->data_pool_clusters -= *nb_clusters;
+        qcow2_prealloc(bs, s->data_pool_offset +
+                       ((uint64_t) s->data_pool_clusters << s->cluster_bits));
+        return 0;
+    }
+
+    if (*host_offset == 0) {
+        offset = qcow2_alloc_clusters(bs,
+                                      (uint64_t) *nb_clusters << s->cluster_bits);
+        if (offset < 0) {
+            return offset;
+        }
+        *host_offset = offset;
+    } else {
+        ret = qcow2_alloc_clusters_at(bs, *host_offset, *nb_clusters);
+        if (ret < 0) {
+            return ret;
+        }
+        *nb_clusters = ret;
+    }
+
+    qcow2_prealloc(bs, *host_offset +
+                   ((uint64_t) *nb_clusters << s->cluster_bits));
+    return 0;
+}
+
+/* Frees the clusters that were allocated ahead but not used yet */
+void qcow2_release_data_pool(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->data_pool_clusters > 0) {
+        qcow2_free_clusters(bs, s->data_pool_offset,
+                            (uint64_t) s->data_pool_clusters << s->cluster_bits,
+                            QCOW2_DISCARD_NEVER);
+        s->data_pool_clusters = 0;
+    }
+}
+
 /* only used to allocate compressed sectors. We try to allocate
    contiguous sectors. size must be <= cluster_size */
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
@@ -849,7 +991,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     BDRVQcowState *s = bs->opaque;
     uint64_t *l1_table, *l2_table, l2_offset, offset, l1_size2, l1_allocated;
     int64_t old_offset, old_l2_offset;
-    int i, j, l1_modified = 0, nb_csectors, refcount;
+    int i, j, slice, l1_modified = 0, nb_csectors, refcount;
     int ret;
 
     l2_table = NULL;
@@ -884,82 +1026,88 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
             old_l2_offset = l2_offset;
             l2_offset &= L1E_OFFSET_MASK;
 
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                (void**) &l2_table);
-            if (ret < 0) {
-                goto fail;
-            }
+            for (slice = 0; slice < s->l2_size / s->l2_slice_size; slice++) {
+                ret = qcow2_cache_get(bs, s->l2_table_cache,
+                    l2_offset + slice * s->l2_slice_size * sizeof(uint64_t),
+                    (void**) &l2_table);
+                if (ret < 0) {
+                    goto fail;
+                }
 
-            for(j = 0; j < s->l2_size; j++) {
-                uint64_t cluster_index;
-
-                offset = be64_to_cpu(l2_table[j]);
-                old_offset = offset;
-                offset &= ~QCOW_OFLAG_COPIED;
-
-                switch (qcow2_get_cluster_type(offset)) {
-                    case QCOW2_CLUSTER_COMPRESSED:
-                        nb_csectors = ((offset >> s->csize_shift) &
-                                       s->csize_mask) + 1;
-                        if (addend != 0) {
-                            ret = update_refcount(bs,
-                                (offset & s->cluster_offset_mask) & ~511,
-                                nb_csectors * 512, addend,
-                                QCOW2_DISCARD_SNAPSHOT);
-                            if (ret < 0) {
-                                goto fail;
+                for(j = 0; j < s->l2_slice_size; j++) {
+                    uint64_t cluster_index;
+
+                    offset = be64_to_cpu(l2_table[j]);
+                    old_offset = offset;
+                    offset &= ~QCOW_OFLAG_COPIED;
+
+                    switch (qcow2_get_cluster_type(offset)) {
+                        case QCOW2_CLUSTER_COMPRESSED:
+                            nb_csectors = ((offset >> s->csize_shift) &
+                                           s->csize_mask) + 1;
+                            if (addend != 0) {
+                                ret = update_refcount(bs,
+                                    (offset & s->cluster_offset_mask) & ~511,
+                                    nb_csectors * 512, addend,
+                                    QCOW2_DISCARD_SNAPSHOT);
+                                if (ret < 0) {
+                                    goto fail;
+                                }
                             }
-                        }
-                        /* compressed clusters are never modified */
-                        refcount = 2;
-                        break;
-
-                    case QCOW2_CLUSTER_NORMAL:
-                    case QCOW2_CLUSTER_ZERO:
-                        cluster_index = (offset & L2E_OFFSET_MASK) >> s->cluster_bits;
-                        if (!cluster_index) {
-                            /* unallocated */
-                            refcount = 0;
+                            /* compressed clusters are never modified */
+                            refcount = 2;
                             break;
-                        }
-                        if (addend != 0) {
-                            refcount = qcow2_update_cluster_refcount(bs,
-                                    cluster_index, addend,
-                                    QCOW2_DISCARD_SNAPSHOT);
-                        } else {
-                            refcount = get_refcount(bs, cluster_index);
-                        }
 
-                        if (refcount < 0) {
-                            ret = refcount;
-                            goto fail;
-                        }
-                        break;
+                        case QCOW2_CLUSTER_NORMAL:
+                        case QCOW2_CLUSTER_ZERO:
+                            cluster_index =
+                                (offset & L2E_OFFSET_MASK) >> s->cluster_bits;
+                            if (!cluster_index) {
+                                /* unallocated */
+                                refcount = 0;
+                                break;
+                            }
+                            if (addend != 0) {
+                                refcount = qcow2_update_cluster_refcount(bs,
+                                        cluster_index, addend,
+                                        QCOW2_DISCARD_SNAPSHOT);
+                            } else {
+                                refcount = get_refcount(bs, cluster_index);
+                            }
 
-                    case QCOW2_CLUSTER_UNALLOCATED:
-                        refcount = 0;
-                        break;
+                            if (refcount < 0) {
+                                ret = refcount;
+                                goto fail;
+                            }
+                            break;
 
-                    default:
-                        abort();
-                }
+                        case QCOW2_CLUSTER_UNALLOCATED:
+                            refcount = 0;
+                            break;
 
-                if (refcount == 1) {
-                    offset |= QCOW_OFLAG_COPIED;
-                }
-                if (offset != old_offset) {
-                    if (addend > 0) {
-                        qcow2_cache_set_dependency(bs, s->l2_table_cache,
-                            s->refcount_block_cache);
+                        default:
+                            abort();
+                    }
+
+                    if (refcount == 1) {
+                        offset |= QCOW_OFLAG_COPIED;
+                    }
+                    if (offset != old_offset) {
+                        if (addend > 0) {
+                            qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                s->refcount_block_cache);
+                        }
+                        l2_table[j] = cpu_to_be64(offset);
+                        qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
+                                                     l2_table);
                     }
-                    l2_table[j] = cpu_to_be64(offset);
-                    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
                 }
-            }
 
-            ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
-            if (ret < 0) {
-                goto fail;
+                ret = qcow2_cache_put(bs, s->l2_table_cache,
+                                      (void**) &l2_table);
+                if (ret < 0) {
+                    goto fail;
+                }
             }
 
 
@@ -1529,6 +1677,27 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     inc_refcounts(bs, res, refcount_table, nb_clusters,
         s->snapshots_offset, s->snapshots_size);
 
+    /* stored dirty bitmaps; stale ones are leaked on purpose */
+    if (s->nb_bitmaps &&
+        (s->autoclear_features & QCOW2_AUTOCLEAR_DIRTY_BITMAPS)) {
+        Qcow2Bitmap *bitmaps;
+        int nb_bitmaps = qcow2_read_bitmap_directory(bs, &bitmaps);
+
+        if (nb_bitmaps < 0) {
+            fprintf(stderr, "ERROR cannot read dirty bitmap directory: %s\n",
+                    strerror(-nb_bitmaps));
+            res->corruptions++;
+        } else {
+            inc_refcounts(bs, res, refcount_table, nb_clusters,
+                s->bitmap_directory_offset, s->bitmap_directory_size);
+            for (i = 0; i < nb_bitmaps; i++) {
+                inc_refcounts(bs, res, refcount_table, nb_clusters,
+                    bitmaps[i].data_offset, bitmaps[i].data_size);
+            }
+            qcow2_free_bitmap_directory(bitmaps, nb_bitmaps);
+        }
+    }
+
     /* refcount data */
     inc_refcounts(bs, res, refcount_table, nb_clusters,
         s->refcount_table_offset,
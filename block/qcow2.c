@@ -31,6 +31,7 @@
 #include "qapi/qmp/qerror.h"
 #include "qapi/qmp/qbool.h"
 #include "trace.h"
+#include "block/thread-pool.h"
 #include "qemu/option_int.h"
 
 /*
@@ -58,6 +59,14 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_DIRTY_BITMAPS 0x23852875
+
+typedef struct QEMU_PACKED Qcow2BitmapExt {
+    uint32_t nb_bitmaps;
+    uint32_t reserved;
+    uint64_t bitmap_directory_size;
+    uint64_t bitmap_directory_offset;
+} Qcow2BitmapExt;
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -156,6 +165,28 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             break;
 
+        case QCOW2_EXT_MAGIC_DIRTY_BITMAPS:
+        {
+            Qcow2BitmapExt bitmap_ext;
+
+            if (ext.len != sizeof(bitmap_ext)) {
+                error_setg(errp, "ERROR: ext_dirty_bitmaps: invalid length");
+                return -EINVAL;
+            }
+            ret = bdrv_pread(bs->file, offset, &bitmap_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: ext_dirty_bitmaps: "
+                                 "Could not read extension");
+                return ret;
+            }
+            s->nb_bitmaps = be32_to_cpu(bitmap_ext.nb_bitmaps);
+            s->bitmap_directory_size =
+                be64_to_cpu(bitmap_ext.bitmap_directory_size);
+            s->bitmap_directory_offset =
+                be64_to_cpu(bitmap_ext.bitmap_directory_offset);
+            break;
+        }
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             {
@@ -431,6 +462,33 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "Check for unintended writes into an inactive L2 table",
         },
+        {
+            .name = QCOW2_OPT_L2_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum L2 table cache size",
+        },
+        {
+            .name = QCOW2_OPT_L2_CACHE_COVERAGE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size the L2 table cache to cover this much of the disk",
+        },
+        {
+            .name = QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the parts of L2 tables that are loaded into "
+                    "the cache (at most the cluster size)",
+        },
+        {
+            .name = QCOW2_OPT_REFCOUNT_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum refcount block cache size",
+        },
+        {
+            .name = QCOW2_OPT_PREALLOC_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Reserve host file space in chunks of this size ahead "
+                    "of allocating writes (0 = off)",
+        },
         { /* end of list */ }
     },
 };
@@ -446,6 +504,87 @@ static const char *overlap_bool_option_names[QCOW2_OL_MAX_BITNR] = {
     [QCOW2_OL_INACTIVE_L2_BITNR]    = QCOW2_OPT_OVERLAP_INACTIVE_L2,
 };
 
+/*
+ * Returns the number of L2 cache entries to use with an L1 table of l1_size
+ * entries.  Slices beyond those of one table per L1 entry would never be
+ * used, so the requested size is limited to that.
+ */
+static int qcow2_l2_cache_tables(BDRVQcowState *s, uint64_t l1_size)
+{
+    uint64_t slices_per_table = s->l2_size / s->l2_slice_size;
+    uint64_t n;
+
+    n = MIN(s->l2_cache_requested,
+            MAX(l1_size, L2_CACHE_SIZE) * slices_per_table);
+    return MAX(n, MIN_L2_CACHE_SIZE);
+}
+
+/*
+ * Returns the number of L2 table slices and refcount blocks to cache, as set
+ * by the l2-cache-size, l2-cache-coverage and refcount-cache-size options,
+ * and sets s->l2_slice_size from l2-cache-entry-size.  The sizes are rounded
+ * down to whole cache entries and clamped to what the image can actually use.
+ */
+static int read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
+                            int *l2_tables, int *refcount_tables,
+                            Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t l2_cache_size, l2_cache_coverage, refcount_cache_size;
+    uint64_t l2_entry_size, slices_per_table;
+    uint64_t n;
+
+    l2_entry_size = qemu_opt_get_size(opts, QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+                                      MIN(s->cluster_size,
+                                          DEFAULT_L2_SLICE_SIZE));
+    if (l2_entry_size < (1 << MIN_CLUSTER_BITS) ||
+        l2_entry_size > s->cluster_size ||
+        (l2_entry_size & (l2_entry_size - 1)))
+    {
+        error_setg(errp, "%s must be a power of two between %d and the "
+                   "cluster size (%d)", QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+                   1 << MIN_CLUSTER_BITS, s->cluster_size);
+        return -EINVAL;
+    }
+    s->l2_slice_size = l2_entry_size / sizeof(uint64_t);
+    slices_per_table = s->l2_size / s->l2_slice_size;
+
+    l2_cache_size = qemu_opt_get_size(opts, QCOW2_OPT_L2_CACHE_SIZE, 0);
+    l2_cache_coverage = qemu_opt_get_size(opts, QCOW2_OPT_L2_CACHE_COVERAGE,
+                                          0);
+    refcount_cache_size = qemu_opt_get_size(opts,
+                                            QCOW2_OPT_REFCOUNT_CACHE_SIZE, 0);
+
+    if (l2_cache_size && l2_cache_coverage) {
+        error_setg(errp, "%s and %s are mutually exclusive",
+                   QCOW2_OPT_L2_CACHE_SIZE, QCOW2_OPT_L2_CACHE_COVERAGE);
+        return -EINVAL;
+    }
+
+    if (l2_cache_size) {
+        n = l2_cache_size / l2_entry_size;
+    } else if (l2_cache_coverage) {
+        /* Each slice maps l2_slice_size clusters of the guest disk */
+        n = DIV_ROUND_UP(l2_cache_coverage,
+                         (uint64_t)s->cluster_size * s->l2_slice_size);
+    } else {
+        /* As much memory as L2_CACHE_SIZE whole tables */
+        n = L2_CACHE_SIZE * slices_per_table;
+    }
+    s->l2_cache_requested = n;
+    *l2_tables = qcow2_l2_cache_tables(s, s->l1_size);
+
+    if (refcount_cache_size) {
+        n = refcount_cache_size / s->cluster_size;
+        n = MIN(n, MAX(s->refcount_table_size, REFCOUNT_CACHE_SIZE));
+    } else {
+        n = REFCOUNT_CACHE_SIZE;
+    }
+    *refcount_tables = MAX(n, REFCOUNT_CACHE_SIZE);
+
+    return 0;
+}
+
 static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
                       Error **errp)
 {
@@ -453,9 +592,10 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     unsigned int len, i;
     int ret = 0;
     QCowHeader header;
-    QemuOpts *opts;
+    QemuOpts *opts = NULL;
     Error *local_err = NULL;
     uint64_t ext_end;
+    int l2_cache_tables, refcount_cache_tables;
     uint64_t l1_vm_state_index;
     const char *opt_overlap_check;
     int overlap_check_template = 0;
@@ -690,9 +830,26 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         }
     }
 
+    /* Parse driver-specific options */
+    opts = qemu_opts_create(&qcow2_runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    ret = read_cache_sizes(bs, opts, &l2_cache_tables, &refcount_cache_tables,
+                           errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
     /* alloc L2 table/refcount block cache */
-    s->l2_table_cache = qcow2_cache_create(bs, L2_CACHE_SIZE);
-    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE);
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_tables,
+                                           s->l2_slice_size * sizeof(uint64_t));
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_tables,
+                                                 s->cluster_size);
 
     s->cluster_cache = g_malloc(s->cluster_size);
     /* one more sector for decompressed data alignment */
@@ -746,8 +903,9 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     /* Clear unknown autoclear feature bits */
-    if (!bs->read_only && !(flags & BDRV_O_INCOMING) && s->autoclear_features) {
-        s->autoclear_features = 0;
+    if (!bs->read_only && !(flags & BDRV_O_INCOMING) &&
+        (s->autoclear_features & ~QCOW2_AUTOCLEAR_MASK)) {
+        s->autoclear_features &= QCOW2_AUTOCLEAR_MASK;
         ret = qcow2_update_header(bs);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Could not update qcow2 header");
@@ -757,6 +915,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
 
     /* Initialise locks */
     qemu_co_mutex_init(&s->lock);
+    qemu_co_queue_init(&s->compress_queue);
 
     /* Repair image if dirty */
     if (!(flags & (BDRV_O_CHECK | BDRV_O_INCOMING)) && !bs->read_only &&
@@ -771,14 +930,6 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     /* Enable lazy_refcounts according to image and command line options */
-    opts = qemu_opts_create(&qcow2_runtime_opts, NULL, 0, &error_abort);
-    qemu_opts_absorb_qdict(opts, options, &local_err);
-    if (local_err) {
-        error_propagate(errp, local_err);
-        ret = -EINVAL;
-        goto fail;
-    }
-
     s->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
 
@@ -792,6 +943,26 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     s->discard_passthrough[QCOW2_DISCARD_OTHER] =
         qemu_opt_get_bool(opts, QCOW2_OPT_DISCARD_OTHER, false);
 
+    s->prealloc_size = align_offset(qemu_opt_get_size(opts,
+                                                      QCOW2_OPT_PREALLOC_SIZE,
+                                                      0), s->cluster_size);
+    if (s->prealloc_size > INT_MAX) {
+        error_setg(errp, "%s must be less than 2 GB", QCOW2_OPT_PREALLOC_SIZE);
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (bs->read_only) {
+        s->prealloc_size = 0;
+    } else if (s->prealloc_size) {
+        s->prealloc_end = bdrv_getlength(bs->file);
+        if (s->prealloc_end < 0) {
+            s->prealloc_size = 0;
+        } else {
+            s->prealloc_end = align_offset(s->prealloc_end, s->cluster_size);
+            s->prealloc_goal = s->prealloc_end;
+        }
+    }
+
     opt_overlap_check = qemu_opt_get(opts, "overlap-check") ?: "cached";
     if (!strcmp(opt_overlap_check, "none")) {
         overlap_check_template = 0;
@@ -805,7 +976,6 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         error_setg(errp, "Unsupported value '%s' for qcow2 option "
                    "'overlap-check'. Allowed are either of the following: "
                    "none, constant, cached, all", opt_overlap_check);
-        qemu_opts_del(opts);
         ret = -EINVAL;
         goto fail;
     }
@@ -820,6 +990,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     qemu_opts_del(opts);
+    opts = NULL;
 
     if (s->use_lazy_refcounts && s->qcow_version < 3) {
         error_setg(errp, "Lazy refcounts require a qcow2 image with at least "
@@ -828,6 +999,8 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    qcow2_load_dirty_bitmaps(bs);
+
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
@@ -837,6 +1010,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     return ret;
 
  fail:
+    qemu_opts_del(opts);
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
     qcow2_free_snapshots(bs);
@@ -858,9 +1032,19 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
 static int qcow2_refresh_limits(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+    int64_t max_bulk;
 
     bs->bl.write_zeroes_alignment = s->cluster_sectors;
 
+    /* Zeroing and discarding only touch metadata, so let large requests
+     * through in one piece instead of the block layer's default chunks, but
+     * don't hold s->lock for more than a few L2 tables at a time */
+    max_bulk = (int64_t) QCOW2_MAX_BULK_L2_TABLES * s->cluster_sectors
+               << s->l2_bits;
+    max_bulk = MIN(max_bulk, INT_MAX) & ~((int64_t) s->cluster_sectors - 1);
+    bs->bl.max_discard = max_bulk;
+    bs->bl.max_write_zeroes = max_bulk;
+
     return 0;
 }
 
@@ -914,6 +1098,9 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
     int ret;
 
     if ((state->flags & BDRV_O_RDWR) == 0) {
+        qcow2_stop_prealloc(state->bs);
+        qcow2_release_data_pool(state->bs);
+
         ret = bdrv_flush(state->bs);
         if (ret < 0) {
             return ret;
@@ -1252,6 +1439,11 @@ fail:
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+
+    qcow2_stop_prealloc(bs);
+    qcow2_release_data_pool(bs);
+    qcow2_store_dirty_bitmaps(bs);
+
     g_free(s->l1_table);
     /* else pre-write overlap checks in cache_destroy may crash */
     s->l1_table = NULL;
@@ -1446,6 +1638,24 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Dirty bitmap directory */
+    if (s->nb_bitmaps) {
+        Qcow2BitmapExt bitmap_ext = {
+            .nb_bitmaps              = cpu_to_be32(s->nb_bitmaps),
+            .bitmap_directory_size   = cpu_to_be64(s->bitmap_directory_size),
+            .bitmap_directory_offset = cpu_to_be64(s->bitmap_directory_offset),
+        };
+
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_DIRTY_BITMAPS,
+                             &bitmap_ext, sizeof(bitmap_ext), buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Feature table */
     Qcow2Feature features[] = {
         {
@@ -1463,6 +1673,11 @@ int qcow2_update_header(BlockDriverState *bs)
             .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
             .name = "lazy refcounts",
         },
+        {
+            .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+            .bit  = QCOW2_AUTOCLEAR_DIRTY_BITMAPS_BITNR,
+            .name = "dirty bitmaps",
+        },
     };
 
     ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -1594,7 +1809,7 @@ static int preallocate(BlockDriverState *bs)
 
 static int qcow2_create2(const char *filename, int64_t total_size,
                          const char *backing_file, const char *backing_format,
-                         int flags, size_t cluster_size, int prealloc,
+                         int flags, size_t cluster_size, PreallocMode prealloc,
                          QemuOpts *opts, int version,
                          Error **errp)
 {
@@ -1627,6 +1842,57 @@ static int qcow2_create2(const char *filename, int64_t total_size,
     Error *local_err = NULL;
     int ret;
 
+    if (prealloc == PREALLOC_MODE_FULL || prealloc == PREALLOC_MODE_FALLOC) {
+        int64_t meta_size = 0;
+        uint64_t nreftablee, nrefblocke, nl1e, nl2e;
+        int64_t aligned_total_size = align_offset(total_size * BDRV_SECTOR_SIZE,
+                                                  cluster_size);
+
+        /* header: 1 cluster */
+        meta_size += cluster_size;
+
+        /* total size of L2 tables */
+        nl2e = aligned_total_size / cluster_size;
+        nl2e = align_offset(nl2e, cluster_size / sizeof(uint64_t));
+        meta_size += nl2e * sizeof(uint64_t);
+
+        /* total size of L1 tables */
+        nl1e = nl2e * sizeof(uint64_t) / cluster_size;
+        nl1e = align_offset(nl1e, cluster_size / sizeof(uint64_t));
+        meta_size += nl1e * sizeof(uint64_t);
+
+        /* total size of refcount blocks
+         *
+         * Every host cluster is refcounted, including the metadata and the
+         * refcount blocks themselves.  Let
+         *   a = guest disk size
+         *   m = metadata size without refcount blocks and refcount table
+         *   c = cluster size
+         *   y1 = number of refcount block entries
+         *   y2 = metadata size including everything
+         * then
+         *   y1 = (y2 + a) / c
+         *   y2 = y1 * sizeof(u16) + y1 * sizeof(u16) * sizeof(u64) / c + m
+         * and so
+         *   y1 = (a + m) / (c - sizeof(u16) - sizeof(u16) * sizeof(u64) / c)
+         */
+        nrefblocke = (aligned_total_size + meta_size + cluster_size) /
+            (cluster_size - sizeof(uint16_t) -
+             1.0 * sizeof(uint16_t) * sizeof(uint64_t) / cluster_size);
+        nrefblocke = align_offset(nrefblocke, cluster_size / sizeof(uint16_t));
+        meta_size += nrefblocke * sizeof(uint16_t);
+
+        /* total size of refcount table */
+        nreftablee = nrefblocke * sizeof(uint16_t) / cluster_size;
+        nreftablee = align_offset(nreftablee, cluster_size / sizeof(uint64_t));
+        meta_size += nreftablee * sizeof(uint64_t);
+
+        /* Let the protocol driver allocate the whole file up front */
+        qemu_opt_set_number(opts, BLOCK_OPT_SIZE,
+                            aligned_total_size + meta_size);
+        qemu_opt_set(opts, BLOCK_OPT_PREALLOC, PreallocMode_lookup[prealloc]);
+    }
+
     ret = bdrv_create_file(filename, opts, &local_err);
     if (ret < 0) {
         error_propagate(errp, local_err);
@@ -1732,7 +1998,7 @@ static int qcow2_create2(const char *filename, int64_t total_size,
     }
 
     /* And if we're supposed to preallocate metadata, do that now */
-    if (prealloc) {
+    if (prealloc != PREALLOC_MODE_OFF) {
         BDRVQcowState *s = bs->opaque;
         qemu_co_mutex_lock(&s->lock);
         ret = preallocate(bs);
@@ -1771,7 +2037,7 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
     uint64_t sectors = 0;
     int flags = 0;
     size_t cluster_size = DEFAULT_CLUSTER_SIZE;
-    int prealloc = 0;
+    PreallocMode prealloc;
     int version = 3;
     Error *local_err = NULL;
     int ret;
@@ -1786,11 +2052,7 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
     cluster_size = qemu_opt_get_size_del(opts, BLOCK_OPT_CLUSTER_SIZE,
                                          DEFAULT_CLUSTER_SIZE);
     buf = qemu_opt_get_del(opts, BLOCK_OPT_PREALLOC);
-    if (!buf || !strcmp(buf, "off")) {
-        prealloc = 0;
-    } else if (!strcmp(buf, "metadata")) {
-        prealloc = 1;
-    } else {
+    if (bdrv_parse_prealloc_mode(buf, &prealloc) < 0) {
         error_setg(errp, "Invalid preallocation mode: '%s'", buf);
         ret = -EINVAL;
         goto finish;
@@ -1813,7 +2075,7 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
         flags |= BLOCK_FLAG_LAZY_REFCOUNTS;
     }
 
-    if (backing_file && prealloc) {
+    if (backing_file && prealloc != PREALLOC_MODE_OFF) {
         error_setg(errp, "Backing file and preallocation cannot be used at "
                    "the same time");
         ret = -EINVAL;
@@ -1911,19 +2173,73 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
     }
 
     s->l1_vm_state_index = new_l1_size;
+
+    /* The L2 cache may have been limited by the old L1 table size.  If a
+     * table is in use right now, keep the smaller cache.
+     */
+    qcow2_cache_grow(bs, s->l2_table_cache,
+                     qcow2_l2_cache_tables(s, new_l1_size));
     return 0;
 }
 
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
-static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                  const uint8_t *buf, int nb_sectors)
+typedef struct Qcow2CompressData {
+    void *dest;
+    int dest_size;
+    const void *src;
+    int src_size;
+} Qcow2CompressData;
+
+/*
+ * Runs in a worker thread.  Returns the compressed size, or -ENOSPC if the
+ * data does not compress to less than dest_size.
+ */
+static int qcow2_compress_worker(void *opaque)
 {
-    BDRVQcowState *s = bs->opaque;
+    Qcow2CompressData *data = opaque;
     z_stream strm;
     int ret, out_len;
-    uint8_t *out_buf;
-    uint64_t cluster_offset;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != 0) {
+        return -EINVAL;
+    }
+
+    strm.avail_in = data->src_size;
+    strm.next_in = (uint8_t *)data->src;
+    strm.avail_out = data->dest_size;
+    strm.next_out = data->dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    out_len = strm.next_out - (uint8_t *)data->dest;
+    deflateEnd(&strm);
+
+    if (ret == Z_STREAM_END && out_len < data->dest_size) {
+        return out_len;
+    }
+    if (ret != Z_STREAM_END && ret != Z_OK) {
+        return -EINVAL;
+    }
+    return -ENOSPC;
+}
+
+static coroutine_fn int qcow2_co_write_compressed(BlockDriverState *bs,
+                                                  int64_t sector_num,
+                                                  int nb_sectors,
+                                                  QEMUIOVector *qiov)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CompressData data;
+    ThreadPool *pool;
+    int ret, out_len;
+    uint8_t *buf, *out_buf;
+    uint64_t cluster_offset = 0;
+    uint64_t seq;
 
     if (nb_sectors == 0) {
         /* align end of file to a sector boundary to ease reading with
@@ -1934,78 +2250,74 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
         return 0;
     }
 
-    if (nb_sectors != s->cluster_sectors) {
-        ret = -EINVAL;
-
-        /* Zero-pad last write if image size is not cluster aligned */
-        if (sector_num + nb_sectors == bs->total_sectors &&
-            nb_sectors < s->cluster_sectors) {
-            uint8_t *pad_buf = qemu_blockalign(bs, s->cluster_size);
-            memset(pad_buf, 0, s->cluster_size);
-            memcpy(pad_buf, buf, nb_sectors * BDRV_SECTOR_SIZE);
-            ret = qcow2_write_compressed(bs, sector_num,
-                                         pad_buf, s->cluster_sectors);
-            qemu_vfree(pad_buf);
-        }
-        return ret;
+    if (nb_sectors != s->cluster_sectors &&
+        !(sector_num + nb_sectors == bs->total_sectors &&
+          nb_sectors < s->cluster_sectors)) {
+        return -EINVAL;
     }
 
-    out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
-
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
+    /* Zero-pad last write if image size is not cluster aligned */
+    buf = qemu_blockalign(bs, s->cluster_size);
+    if (nb_sectors < s->cluster_sectors) {
+        memset(buf, 0, s->cluster_size);
     }
+    qemu_iovec_to_buf(qiov, 0, buf, nb_sectors * BDRV_SECTOR_SIZE);
 
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
+    out_buf = g_malloc(s->cluster_size);
 
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
-        goto fail;
-    }
-    out_len = strm.next_out - out_buf;
+    /* Compress in a worker thread so that several clusters can be
+     * compressed at the same time */
+    seq = s->compress_seq_next++;
+    data = (Qcow2CompressData) {
+        .dest       = out_buf,
+        .dest_size  = s->cluster_size,
+        .src        = buf,
+        .src_size   = s->cluster_size,
+    };
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    out_len = thread_pool_submit_co(pool, qcow2_compress_worker, &data);
 
-    deflateEnd(&strm);
+    /* Allocate in request order so that the image is laid out the same no
+     * matter which cluster finished compressing first */
+    while (s->compress_seq_done != seq) {
+        qemu_co_queue_wait(&s->compress_queue);
+    }
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    if (out_len == -ENOSPC) {
         /* could not compress: write normal cluster */
         ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
-        if (ret < 0) {
-            goto fail;
-        }
+    } else if (out_len < 0) {
+        ret = out_len;
     } else {
+        qemu_co_mutex_lock(&s->lock);
         cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
             sector_num << 9, out_len);
-        if (!cluster_offset) {
-            ret = -EIO;
-            goto fail;
-        }
-        cluster_offset &= s->cluster_offset_mask;
+        qemu_co_mutex_unlock(&s->lock);
+        ret = cluster_offset ? 0 : -EIO;
+    }
 
-        ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
-        if (ret < 0) {
-            goto fail;
-        }
+    s->compress_seq_done++;
+    qemu_co_queue_restart_all(&s->compress_queue);
 
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-        ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
-        if (ret < 0) {
-            goto fail;
-        }
+    if (ret < 0 || out_len < 0) {
+        goto fail;
+    }
+
+    cluster_offset &= s->cluster_offset_mask;
+    ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
+    ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
+    if (ret < 0) {
+        goto fail;
     }
 
     ret = 0;
 fail:
+    qemu_vfree(buf);
     g_free(out_buf);
     return ret;
 }
@@ -2071,6 +2383,34 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
     return spec_info;
 }
 
+static BlockCacheStatsList *qcow2_cache_stats_entry(Qcow2Cache *c,
+                                                   const char *name,
+                                                   BlockCacheStatsList *next)
+{
+    BlockCacheStatsList *entry = g_new0(BlockCacheStatsList, 1);
+    BlockCacheStats *stats = g_new0(BlockCacheStats, 1);
+    uint64_t size, hits, misses;
+
+    qcow2_cache_get_stats(c, &size, &hits, &misses);
+    stats->name = g_strdup(name);
+    stats->size = size;
+    stats->hits = hits;
+    stats->misses = misses;
+
+    entry->value = stats;
+    entry->next = next;
+    return entry;
+}
+
+static BlockCacheStatsList *qcow2_get_cache_stats(const BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    BlockCacheStatsList *list;
+
+    list = qcow2_cache_stats_entry(s->refcount_block_cache, "refcount", NULL);
+    return qcow2_cache_stats_entry(s->l2_table_cache, "l2", list);
+}
+
 #if 0
 static void dump_refcounts(BlockDriverState *bs)
 {
@@ -2374,7 +2714,7 @@ static QemuOptsList qcow2_create_opts = {
         {
             .name = BLOCK_OPT_PREALLOC,
             .type = QEMU_OPT_STRING,
-            .help = "Preallocation mode (allowed values: off, metadata)"
+            .help = "Preallocation mode (allowed values: off, metadata, falloc, full)"
         },
         {
             .name = BLOCK_OPT_LAZY_REFCOUNTS,
@@ -2405,7 +2745,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_co_write_zeroes   = qcow2_co_write_zeroes,
     .bdrv_co_discard        = qcow2_co_discard,
     .bdrv_truncate          = qcow2_truncate,
-    .bdrv_write_compressed  = qcow2_write_compressed,
+    .bdrv_co_write_compressed = qcow2_co_write_compressed,
 
     .bdrv_snapshot_create   = qcow2_snapshot_create,
     .bdrv_snapshot_goto     = qcow2_snapshot_goto,
@@ -2414,6 +2754,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_load_tmp = qcow2_snapshot_load_tmp,
     .bdrv_get_info          = qcow2_get_info,
     .bdrv_get_specific_info = qcow2_get_specific_info,
+    .bdrv_get_cache_stats   = qcow2_get_cache_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
@@ -2427,6 +2768,8 @@ static BlockDriver bdrv_qcow2 = {
     .create_opts         = &qcow2_create_opts,
     .bdrv_check          = qcow2_check,
     .bdrv_amend_options  = qcow2_amend_options,
+
+    .bdrv_can_store_dirty_bitmaps = qcow2_can_store_dirty_bitmaps,
 };
 
 static void bdrv_qcow2_init(void)
@@ -52,6 +52,10 @@
  * space for snapshot names and IDs */
 #define QCOW_MAX_SNAPSHOTS_SIZE (1024 * QCOW_MAX_SNAPSHOTS)
 
+/* Limits for the dirty bitmap directory; names are at most 1k */
+#define QCOW_MAX_BITMAPS 65535
+#define QCOW_MAX_BITMAP_DIRECTORY_SIZE (1024 * QCOW_MAX_BITMAPS)
+
 /* indicate that the refcount of the referenced cluster is exactly one. */
 #define QCOW_OFLAG_COPIED     (1ULL << 63)
 /* indicate that the cluster is compressed (they never have the copied flag) */
@@ -64,8 +68,16 @@
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
+/* Default number of cached L2 tables, unless set by the user */
 #define L2_CACHE_SIZE 16
 
+/* Must be at least 2 to cover COW */
+#define MIN_L2_CACHE_SIZE 2
+
+/* Default size in bytes of the L2 table slices that the cache loads and writes
+ * back, unless set by the user; smaller if the cluster size is smaller */
+#define DEFAULT_L2_SLICE_SIZE 4096
+
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define REFCOUNT_CACHE_SIZE 4
 
@@ -85,6 +97,14 @@
 #define QCOW2_OPT_OVERLAP_SNAPSHOT_TABLE "overlap-check.snapshot-table"
 #define QCOW2_OPT_OVERLAP_INACTIVE_L1 "overlap-check.inactive-l1"
 #define QCOW2_OPT_OVERLAP_INACTIVE_L2 "overlap-check.inactive-l2"
+#define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
+#define QCOW2_OPT_L2_CACHE_COVERAGE "l2-cache-coverage"
+#define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
+#define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
+#define QCOW2_OPT_PREALLOC_SIZE "prealloc-size"
+
+/* Number of L2 tables a single discard or write zeroes request may cover */
+#define QCOW2_MAX_BULK_L2_TABLES 32
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -183,6 +203,15 @@ enum {
     QCOW2_COMPAT_FEAT_MASK            = QCOW2_COMPAT_LAZY_REFCOUNTS,
 };
 
+/* Autoclear feature bits */
+enum {
+    QCOW2_AUTOCLEAR_DIRTY_BITMAPS_BITNR = 0,
+    QCOW2_AUTOCLEAR_DIRTY_BITMAPS       =
+        1 << QCOW2_AUTOCLEAR_DIRTY_BITMAPS_BITNR,
+
+    QCOW2_AUTOCLEAR_MASK                = QCOW2_AUTOCLEAR_DIRTY_BITMAPS,
+};
+
 enum qcow2_discard_type {
     QCOW2_DISCARD_NEVER = 0,
     QCOW2_DISCARD_ALWAYS,
@@ -198,6 +227,22 @@ typedef struct Qcow2Feature {
     char    name[46];
 } QEMU_PACKED Qcow2Feature;
 
+/* Dirty bitmap directory entry, followed by the name padded to 8 bytes */
+typedef struct QEMU_PACKED Qcow2BitmapHeader {
+    uint64_t data_offset;
+    uint64_t data_size;
+    uint32_t granularity_bits;
+    uint16_t name_size;
+    uint16_t reserved;
+} Qcow2BitmapHeader;
+
+typedef struct Qcow2Bitmap {
+    char *name;
+    uint64_t data_offset;
+    uint64_t data_size;
+    int granularity_bits;
+} Qcow2Bitmap;
+
 typedef struct Qcow2DiscardRegion {
     BlockDriverState *bs;
     uint64_t offset;
@@ -211,6 +256,7 @@ typedef struct BDRVQcowState {
     int cluster_sectors;
     int l2_bits;
     int l2_size;
+    int l2_slice_size; /* number of L2 entries per cache entry */
     int l1_size;
     int l1_vm_state_index;
     int csize_shift;
@@ -221,6 +267,8 @@ typedef struct BDRVQcowState {
 
     Qcow2Cache* l2_table_cache;
     Qcow2Cache* refcount_block_cache;
+    /* L2 cache entries asked for, before clamping to the L1 table size */
+    uint64_t l2_cache_requested;
 
     uint8_t *cluster_cache;
     uint8_t *cluster_data;
@@ -233,8 +281,27 @@ typedef struct BDRVQcowState {
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
 
+    /* Data clusters allocated ahead for concurrent allocating writes; their
+     * refcount is already 1, but they are not referenced by any L2 table */
+    uint64_t data_pool_offset;
+    int data_pool_clusters;
+
+    /* Host file space is reserved in chunks of prealloc_size bytes ahead of
+     * the allocated clusters (0 if disabled); everything up to prealloc_end
+     * is reserved already, prealloc_co extends this up to prealloc_goal */
+    int64_t prealloc_size;
+    int64_t prealloc_end;
+    int64_t prealloc_goal;
+    Coroutine *prealloc_co;
+
     CoMutex lock;
 
+    /* Compressed clusters are allocated in the order the writes came in,
+     * even though they are compressed in parallel */
+    uint64_t compress_seq_next;
+    uint64_t compress_seq_done;
+    CoQueue compress_queue;
+
     uint32_t crypt_method; /* current crypt method, 0 if no key yet */
     uint32_t crypt_method_header;
     AES_KEY aes_encrypt_key;
@@ -244,6 +311,11 @@ typedef struct BDRVQcowState {
     unsigned int nb_snapshots;
     QCowSnapshot *snapshots;
 
+    /* Dirty bitmaps stored in the image, valid only with the autoclear bit */
+    uint32_t nb_bitmaps;
+    uint64_t bitmap_directory_offset;
+    uint64_t bitmap_directory_size;
+
     int flags;
     int qcow_version;
     bool use_lazy_refcounts;
@@ -411,6 +483,11 @@ static inline int offset_to_l2_index(BDRVQcowState *s, int64_t offset)
     return (offset >> s->cluster_bits) & (s->l2_size - 1);
 }
 
+static inline int offset_to_l2_slice_index(BDRVQcowState *s, int64_t offset)
+{
+    return (offset >> s->cluster_bits) & (s->l2_slice_size - 1);
+}
+
 static inline int64_t align_offset(int64_t offset, int n)
 {
     offset = (offset + n - 1) & ~(n - 1);
@@ -478,6 +555,10 @@ int qcow2_update_cluster_refcount(BlockDriverState *bs, int64_t cluster_index,
 int64_t qcow2_alloc_clusters(BlockDriverState *bs, uint64_t size);
 int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     int nb_clusters);
+int qcow2_alloc_data_clusters(BlockDriverState *bs, uint64_t *host_offset,
+                              unsigned int *nb_clusters);
+void qcow2_release_data_pool(BlockDriverState *bs);
+void qcow2_stop_prealloc(BlockDriverState *bs);
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size);
 void qcow2_free_clusters(BlockDriverState *bs,
                           int64_t offset, int64_t size,
@@ -540,11 +621,23 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs,
 void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
+/* qcow2-bitmap.c functions */
+int qcow2_read_bitmap_directory(BlockDriverState *bs, Qcow2Bitmap **pbitmaps);
+void qcow2_free_bitmap_directory(Qcow2Bitmap *bitmaps, int nb_bitmaps);
+void qcow2_load_dirty_bitmaps(BlockDriverState *bs);
+int qcow2_store_dirty_bitmaps(BlockDriverState *bs);
+bool qcow2_can_store_dirty_bitmaps(BlockDriverState *bs, Error **errp);
+
 /* qcow2-cache.c functions */
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int table_size);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
+int qcow2_cache_grow(BlockDriverState *bs, Qcow2Cache *c, int num_tables);
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *size, uint64_t *hits,
+    uint64_t *misses);
 
-void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table);
+void qcow2_cache_entry_mark_dirty(BlockDriverState *bs, Qcow2Cache *c,
+     void *table);
 int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c);
 int qcow2_cache_set_dependency(BlockDriverState *bs, Qcow2Cache *c,
     Qcow2Cache *dependency);
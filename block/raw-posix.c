@@ -62,7 +62,7 @@
 #ifdef CONFIG_FIEMAP
 #include <linux/fiemap.h>
 #endif
-#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+#if defined(CONFIG_FALLOCATE) || defined(CONFIG_FALLOCATE_PUNCH_HOLE)
 #include <linux/falloc.h>
 #endif
 #if defined (__FreeBSD__) || defined(__FreeBSD_kernel__)
@@ -932,6 +932,26 @@ static ssize_t handle_aiocb_discard(RawPosixAIOData *aiocb)
     return ret;
 }
 
+static ssize_t handle_aiocb_preallocate(RawPosixAIOData *aiocb)
+{
+    int ret = -ENOTSUP;
+
+#if defined(CONFIG_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+    do {
+        if (fallocate(aiocb->aio_fildes, FALLOC_FL_KEEP_SIZE,
+                      aiocb->aio_offset, aiocb->aio_nbytes) == 0) {
+            return 0;
+        }
+    } while (errno == EINTR);
+
+    ret = -errno;
+    if (ret == -ENOSYS || ret == -EOPNOTSUPP) {
+        ret = -ENOTSUP;
+    }
+#endif
+    return ret;
+}
+
 static int aio_worker(void *arg)
 {
     RawPosixAIOData *aiocb = arg;
@@ -972,6 +992,9 @@ static int aio_worker(void *arg)
     case QEMU_AIO_WRITE_ZEROES:
         ret = handle_aiocb_write_zeroes(aiocb);
         break;
+    case QEMU_AIO_PREALLOCATE:
+        ret = handle_aiocb_preallocate(aiocb);
+        break;
     default:
         fprintf(stderr, "invalid aio request (0x%x)\n", aiocb->aio_type);
         ret = -EINVAL;
@@ -1057,6 +1080,36 @@ static BlockDriverAIOCB *raw_aio_submit(BlockDriverState *bs,
                        cb, opaque, type);
 }
 
+static void raw_aio_plug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+    if (s->use_aio) {
+        laio_io_plug(bs, s->aio_ctx);
+    }
+#endif
+}
+
+static void raw_aio_unplug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+    if (s->use_aio) {
+        laio_io_unplug(bs, s->aio_ctx, true);
+    }
+#endif
+}
+
+static void raw_aio_flush_io_queue(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+    if (s->use_aio) {
+        laio_io_unplug(bs, s->aio_ctx, false);
+    }
+#endif
+}
+
 static BlockDriverAIOCB *raw_aio_readv(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque)
@@ -1276,12 +1329,39 @@ static int64_t raw_get_allocated_file_size(BlockDriverState *bs)
     return (int64_t)st.st_blocks * 512;
 }
 
+/* Writes zeroes to the whole file so that all of it is allocated */
+static int raw_create_fill_zeroes(int fd, int64_t total_size)
+{
+    int64_t offset = 0;
+    int64_t chunk = 1 * 1024 * 1024;
+    char *buf = g_malloc0(chunk);
+    ssize_t len;
+    int ret = 0;
+
+    while (offset < total_size) {
+        len = pwrite(fd, buf, MIN(chunk, total_size - offset), offset);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ret = -errno;
+            break;
+        }
+        offset += len;
+    }
+
+    g_free(buf);
+    return ret;
+}
+
 static int raw_create(const char *filename, QemuOpts *opts, Error **errp)
 {
     int fd;
     int result = 0;
     int64_t total_size = 0;
     bool nocow = false;
+    PreallocMode prealloc;
+    char *buf;
 
     strstart(filename, "file:", &filename);
 
@@ -1289,6 +1369,21 @@ static int raw_create(const char *filename, QemuOpts *opts, Error **errp)
     total_size =
         qemu_opt_get_size_del(opts, BLOCK_OPT_SIZE, 0) / BDRV_SECTOR_SIZE;
     nocow = qemu_opt_get_bool(opts, BLOCK_OPT_NOCOW, false);
+    buf = qemu_opt_get_del(opts, BLOCK_OPT_PREALLOC);
+    result = bdrv_parse_prealloc_mode(buf, &prealloc);
+    if (result < 0 || prealloc == PREALLOC_MODE_METADATA) {
+        error_setg(errp, "Invalid preallocation mode: '%s'", buf);
+        g_free(buf);
+        return -EINVAL;
+    }
+    g_free(buf);
+#ifndef CONFIG_FALLOCATE
+    if (prealloc == PREALLOC_MODE_FALLOC) {
+        error_setg(errp, "Preallocation mode 'falloc' is not supported "
+                   "on this host");
+        return -ENOTSUP;
+    }
+#endif
 
     fd = qemu_open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY,
                    0644);
@@ -1314,6 +1409,20 @@ static int raw_create(const char *filename, QemuOpts *opts, Error **errp)
         if (ftruncate(fd, total_size * BDRV_SECTOR_SIZE) != 0) {
             result = -errno;
             error_setg_errno(errp, -result, "Could not resize file");
+        } else if (prealloc == PREALLOC_MODE_FALLOC) {
+#ifdef CONFIG_FALLOCATE
+            if (fallocate(fd, 0, 0, total_size * BDRV_SECTOR_SIZE) != 0) {
+                result = -errno;
+                error_setg_errno(errp, -result,
+                                 "Could not preallocate data for the new file");
+            }
+#endif
+        } else if (prealloc == PREALLOC_MODE_FULL) {
+            result = raw_create_fill_zeroes(fd, total_size * BDRV_SECTOR_SIZE);
+            if (result < 0) {
+                error_setg_errno(errp, -result,
+                                 "Could not preallocate data for the new file");
+            }
         }
         if (qemu_close(fd) != 0) {
             result = -errno;
@@ -1479,6 +1588,15 @@ static int coroutine_fn raw_co_write_zeroes(
     return -ENOTSUP;
 }
 
+static int coroutine_fn raw_co_preallocate(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors)
+{
+    BDRVRawState *s = bs->opaque;
+
+    return paio_submit_co(bs, s->fd, sector_num, NULL, nb_sectors,
+                          QEMU_AIO_PREALLOCATE);
+}
+
 static int raw_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
     BDRVRawState *s = bs->opaque;
@@ -1502,6 +1620,11 @@ static QemuOptsList raw_create_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "Turn off copy-on-write (valid only on btrfs)"
         },
+        {
+            .name = BLOCK_OPT_PREALLOC,
+            .type = QEMU_OPT_STRING,
+            .help = "Preallocation mode (allowed values: off, falloc, full)"
+        },
         { /* end of list */ }
     }
 };
@@ -1522,10 +1645,14 @@ static BlockDriver bdrv_file = {
     .bdrv_has_zero_init = bdrv_has_zero_init_1,
     .bdrv_co_get_block_status = raw_co_get_block_status,
     .bdrv_co_write_zeroes = raw_co_write_zeroes,
+    .bdrv_co_preallocate = raw_co_preallocate,
 
     .bdrv_aio_readv = raw_aio_readv,
     .bdrv_aio_writev = raw_aio_writev,
     .bdrv_aio_flush = raw_aio_flush,
+    .bdrv_io_plug = raw_aio_plug,
+    .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_flush_io_queue = raw_aio_flush_io_queue,
     .bdrv_aio_discard = raw_aio_discard,
     .bdrv_refresh_limits = raw_refresh_limits,
 
@@ -1925,6 +2052,9 @@ static BlockDriver bdrv_host_device = {
     .bdrv_aio_readv	= raw_aio_readv,
     .bdrv_aio_writev	= raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_io_plug = raw_aio_plug,
+    .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_flush_io_queue = raw_aio_flush_io_queue,
     .bdrv_aio_discard   = hdev_aio_discard,
     .bdrv_refresh_limits = raw_refresh_limits,
 
@@ -2071,6 +2201,9 @@ static BlockDriver bdrv_host_floppy = {
     .bdrv_aio_readv     = raw_aio_readv,
     .bdrv_aio_writev    = raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_io_plug = raw_aio_plug,
+    .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_flush_io_queue = raw_aio_flush_io_queue,
     .bdrv_refresh_limits = raw_refresh_limits,
 
     .bdrv_truncate      = raw_truncate,
@@ -2199,6 +2332,9 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_aio_readv     = raw_aio_readv,
     .bdrv_aio_writev    = raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_io_plug = raw_aio_plug,
+    .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_flush_io_queue = raw_aio_flush_io_queue,
     .bdrv_refresh_limits = raw_refresh_limits,
 
     .bdrv_truncate      = raw_truncate,
@@ -2333,6 +2469,9 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_aio_readv     = raw_aio_readv,
     .bdrv_aio_writev    = raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_io_plug = raw_aio_plug,
+    .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_flush_io_queue = raw_aio_flush_io_queue,
     .bdrv_refresh_limits = raw_refresh_limits,
 
     .bdrv_truncate      = raw_truncate,
@@ -1415,6 +1415,7 @@ static void drive_backup_prepare(BlkTransactionState *common, Error **errp)
     qmp_drive_backup(backup->device, backup->target,
                      backup->has_format, backup->format,
                      backup->sync,
+                     backup->has_bitmap, backup->bitmap,
                      backup->has_mode, backup->mode,
                      backup->has_speed, backup->speed,
                      backup->has_on_source_error, backup->on_source_error,
@@ -2016,6 +2017,7 @@ void qmp_block_commit(const char *device,
 void qmp_drive_backup(const char *device, const char *target,
                       bool has_format, const char *format,
                       enum MirrorSyncMode sync,
+                      bool has_bitmap, const char *bitmap,
                       bool has_mode, enum NewImageMode mode,
                       bool has_speed, int64_t speed,
                       bool has_on_source_error, BlockdevOnError on_source_error,
@@ -2025,6 +2027,7 @@ void qmp_drive_backup(const char *device, const char *target,
     BlockDriverState *bs;
     BlockDriverState *target_bs;
     BlockDriverState *source = NULL;
+    BdrvDirtyBitmap *sync_bitmap = NULL;
     BlockDriver *drv = NULL;
     Error *local_err = NULL;
     int flags;
@@ -2055,6 +2058,22 @@ void qmp_drive_backup(const char *device, const char *target,
         return;
     }
 
+    if (sync == MIRROR_SYNC_MODE_INCREMENTAL) {
+        if (!has_bitmap) {
+            error_setg(errp, "Sync mode 'incremental' requires a bitmap");
+            return;
+        }
+        sync_bitmap = bdrv_find_dirty_bitmap(bs, bitmap);
+        if (!sync_bitmap) {
+            error_setg(errp, "Dirty bitmap '%s' not found", bitmap);
+            return;
+        }
+    } else if (has_bitmap) {
+        error_setg(errp, "A bitmap can only be used with sync mode "
+                   "'incremental'");
+        return;
+    }
+
     if (!has_format) {
         format = mode == NEW_IMAGE_MODE_EXISTING ? NULL : bs->drv->format_name;
     }
@@ -2114,8 +2133,9 @@ void qmp_drive_backup(const char *device, const char *target,
         return;
     }
 
-    backup_start(bs, target_bs, speed, sync, on_source_error, on_target_error,
-                 block_job_cb, bs, &local_err);
+    backup_start(bs, target_bs, speed, sync, sync_bitmap,
+                 on_source_error, on_target_error, block_job_cb, bs,
+                 &local_err);
     if (local_err != NULL) {
         bdrv_unref(target_bs);
         error_propagate(errp, local_err);
@@ -2128,6 +2148,120 @@ BlockDeviceInfoList *qmp_query_named_block_nodes(Error **errp)
     return bdrv_named_nodes_list();
 }
 
+void qmp_block_dirty_bitmap_add(const char *node, const char *name,
+                                bool has_granularity, uint32_t granularity,
+                                bool has_persistent, bool persistent,
+                                Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bs = bdrv_lookup_bs(node, node, errp);
+    if (!bs) {
+        return;
+    }
+
+    if (!bdrv_is_inserted(bs)) {
+        error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, node);
+        return;
+    }
+
+    if (!name || name[0] == '\0') {
+        error_setg(errp, "Bitmap name cannot be empty");
+        return;
+    }
+
+    if (has_granularity) {
+        if (granularity < 512 || granularity > 1048576 * 64 ||
+            (granularity & (granularity - 1))) {
+            error_setg(errp, "Granularity must be a power of 2 between 512 "
+                       "and 64M");
+            return;
+        }
+    } else {
+        /* Default to the cluster size, but keep the bitmap small */
+        BlockDriverInfo bdi;
+        if (bdrv_get_info(bs, &bdi) >= 0 && bdi.cluster_size != 0) {
+            granularity = MAX(65536, bdi.cluster_size);
+            granularity = MIN(1048576 * 64, granularity);
+        } else {
+            granularity = 65536;
+        }
+    }
+
+    if (has_persistent && persistent) {
+        if (!bs->drv->bdrv_can_store_dirty_bitmaps) {
+            error_setg(errp, "Format '%s' used by '%s' cannot store dirty "
+                       "bitmaps", bs->drv->format_name, node);
+            return;
+        }
+        if (!bs->drv->bdrv_can_store_dirty_bitmaps(bs, errp)) {
+            return;
+        }
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (bitmap) {
+        bdrv_dirty_bitmap_set_persistent(bitmap, has_persistent && persistent);
+    }
+}
+
+static BdrvDirtyBitmap *find_dirty_bitmap(const char *node, const char *name,
+                                          BlockDriverState **pbs, Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bs = bdrv_lookup_bs(node, node, errp);
+    if (!bs) {
+        return NULL;
+    }
+
+    bitmap = bdrv_find_dirty_bitmap(bs, name);
+    if (!bitmap) {
+        error_setg(errp, "Dirty bitmap '%s' not found", name);
+        return NULL;
+    }
+    if (bdrv_dirty_bitmap_frozen(bitmap)) {
+        error_setg(errp, "Dirty bitmap '%s' is in use by a backup job", name);
+        return NULL;
+    }
+
+    *pbs = bs;
+    return bitmap;
+}
+
+void qmp_block_dirty_bitmap_remove(const char *node, const char *name,
+                                   Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bitmap = find_dirty_bitmap(node, name, &bs, errp);
+    if (!bitmap) {
+        return;
+    }
+
+    /* Persistent bitmaps are only written to the image on close, so
+     * dropping it here also drops it from the image.
+     */
+    bdrv_release_dirty_bitmap(bs, bitmap);
+}
+
+void qmp_block_dirty_bitmap_clear(const char *node, const char *name,
+                                  Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bitmap = find_dirty_bitmap(node, name, &bs, errp);
+    if (!bitmap) {
+        return;
+    }
+
+    bdrv_clear_dirty_bitmap(bitmap);
+}
+
 #define DEFAULT_MIRROR_BUF_SIZE   (10 << 20)
 
 void qmp_drive_mirror(const char *device, const char *target,
@@ -2170,6 +2304,11 @@ void qmp_drive_mirror(const char *device, const char *target,
     if (!has_buf_size) {
         buf_size = DEFAULT_MIRROR_BUF_SIZE;
     }
+    if (sync == MIRROR_SYNC_MODE_INCREMENTAL) {
+        error_setg(errp, "Sync mode 'incremental' is only supported by "
+                   "drive-backup");
+        return;
+    }
 
     if (granularity != 0 && (granularity < 512 || granularity > 1048576 * 64)) {
         error_set(errp, QERR_INVALID_PARAMETER, device);
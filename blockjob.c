@@ -235,6 +235,9 @@ BlockJobInfo *block_job_query(BlockJob *job)
     info->offset    = job->offset;
     info->speed     = job->speed;
     info->io_status = job->iostatus;
+    if (job->driver->query) {
+        job->driver->query(job, info);
+    }
     return info;
 }
 
@@ -1971,8 +1971,7 @@ int cpu_memory_rw_debug(CPUState *cpu, target_ulong addr,
 
 #else
 
-static void invalidate_and_set_dirty(hwaddr addr,
-                                     hwaddr length)
+void invalidate_and_set_dirty(hwaddr addr, hwaddr length)
 {
     if (cpu_physical_memory_is_clean(addr)) {
         /* invalidate code */
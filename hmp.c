@@ -172,6 +172,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "setup: %" PRIu64 " milliseconds\n",
                            info->setup_time);
         }
+        if (info->has_cpu_throttle_percentage) {
+            monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
+                           info->cpu_throttle_percentage);
+        }
     }
 
     if (info->has_ram) {
@@ -193,6 +197,8 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->ram->normal_bytes >> 10);
         monitor_printf(mon, "dirty sync count: %" PRIu64 "\n",
                        info->ram->dirty_sync_count);
+        monitor_printf(mon, "dirty sync time: %" PRIu64 " microseconds\n",
+                       info->ram->dirty_sync_time);
         if (info->ram->dirty_pages_rate) {
             monitor_printf(mon, "dirty pages rate: %" PRIu64 " pages\n",
                            info->ram->dirty_pages_rate);
@@ -215,10 +221,14 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->bytes >> 10);
         monitor_printf(mon, "xbzrle pages: %" PRIu64 " pages\n",
                        info->xbzrle_cache->pages);
+        monitor_printf(mon, "xbzrle cache hit: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_hit);
         monitor_printf(mon, "xbzrle cache miss: %" PRIu64 "\n",
                        info->xbzrle_cache->cache_miss);
         monitor_printf(mon, "xbzrle cache miss rate: %0.2f\n",
                        info->xbzrle_cache->cache_miss_rate);
+        monitor_printf(mon, "xbzrle cache eviction: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_eviction);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
     }
@@ -246,12 +256,90 @@ void hmp_info_migrate_capabilities(Monitor *mon, const QDict *qdict)
     qapi_free_MigrationCapabilityStatusList(caps);
 }
 
+void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
+{
+    MigrationParameters *params;
+
+    params = qmp_query_migrate_parameters(NULL);
+
+    if (params) {
+        monitor_printf(mon, "parameters:");
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_COMPRESS_LEVEL],
+            params->compress_level);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_COMPRESS_THREADS],
+            params->compress_threads);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_DECOMPRESS_THREADS],
+            params->decompress_threads);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_MULTIFD_CHANNELS],
+            params->multifd_channels);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_FILE_THREADS],
+            params->file_threads);
+        monitor_printf(mon, "\n");
+    }
+
+    qapi_free_MigrationParameters(params);
+}
+
 void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
 {
     monitor_printf(mon, "xbzrel cache size: %" PRId64 " kbytes\n",
                    qmp_query_migrate_cache_size(NULL) >> 10);
 }
 
+void hmp_info_migrate_stats(Monitor *mon, const QDict *qdict)
+{
+    MigrationDetailedStats *stats;
+    MigrationPhaseStatsList *phase;
+    MigrationPageStats *pages;
+    intList *bucket;
+    int i;
+
+    stats = qmp_query_migrate_stats(NULL);
+
+    monitor_printf(mon, "%-14s %8s %12s %10s  histogram (us)\n",
+                   "phase", "count", "total (us)", "max (us)");
+    for (phase = stats->phases; phase; phase = phase->next) {
+        monitor_printf(mon, "%-14s %8" PRId64 " %12" PRId64 " %10" PRId64 " ",
+                       MigrationPhase_lookup[phase->value->phase],
+                       phase->value->count, phase->value->total,
+                       phase->value->max);
+        /* Only the non-empty buckets, as "<limit>:count" */
+        for (bucket = phase->value->histogram, i = 0; bucket;
+             bucket = bucket->next, i++) {
+            if (!bucket->value) {
+                continue;
+            }
+            if (bucket->next) {
+                monitor_printf(mon, " <%" PRIu64 ":%" PRId64,
+                               (uint64_t)1 << i, bucket->value);
+            } else {
+                monitor_printf(mon, " >=%" PRIu64 ":%" PRId64,
+                               (uint64_t)1 << (i - 1), bucket->value);
+            }
+        }
+        monitor_printf(mon, "\n");
+    }
+
+    pages = stats->pages;
+    monitor_printf(mon, "zero pages: %" PRId64 " (%" PRId64 " bytes)\n",
+                   pages->zero_pages, pages->zero_bytes);
+    monitor_printf(mon, "normal pages: %" PRId64 " (%" PRId64 " bytes)\n",
+                   pages->normal_pages, pages->normal_bytes);
+    monitor_printf(mon, "xbzrle pages: %" PRId64 " (%" PRId64 " bytes)\n",
+                   pages->xbzrle_pages, pages->xbzrle_bytes);
+    monitor_printf(mon, "compressed pages: %" PRId64 " (%" PRId64 " bytes)\n",
+                   pages->compressed_pages, pages->compressed_bytes);
+    monitor_printf(mon, "throttle events: %" PRId64 "\n",
+                   pages->throttle_events);
+
+    qapi_free_MigrationDetailedStats(stats);
+}
+
 void hmp_info_cpus(Monitor *mon, const QDict *qdict)
 {
     CpuInfoList *cpu_list, *cpu;
@@ -677,6 +765,13 @@ void hmp_info_block_jobs(Monitor *mon, const QDict *qdict)
                            list->value->len,
                            list->value->speed);
         }
+        if (list->value->has_remaining) {
+            monitor_printf(mon, "    %" PRId64 " bytes remaining, copying at %"
+                           PRId64 " bytes/s, dirtied at %" PRId64 " bytes/s\n",
+                           list->value->remaining,
+                           list->value->copy_rate,
+                           list->value->dirty_rate);
+        }
         list = list->next;
     }
 }
@@ -964,7 +1059,8 @@ void hmp_drive_backup(Monitor *mon, const QDict *qdict)
 
     qmp_drive_backup(device, filename, !!format, format,
                      full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP,
-                     true, mode, false, 0, false, 0, false, 0, &err);
+                     false, NULL, true, mode, false, 0, false, 0, false, 0,
+                     &err);
     hmp_handle_error(mon, &err);
 }
 
@@ -1020,6 +1116,14 @@ void hmp_migrate_cancel(Monitor *mon, const QDict *qdict)
     qmp_migrate_cancel(NULL);
 }
 
+void hmp_migrate_start_postcopy(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_migrate_start_postcopy(&err);
+    hmp_handle_error(mon, &err);
+}
+
 void hmp_migrate_set_downtime(Monitor *mon, const QDict *qdict)
 {
     double value = qdict_get_double(qdict, "value");
@@ -1077,6 +1181,58 @@ void hmp_migrate_set_capability(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
+{
+    const char *param = qdict_get_str(qdict, "parameter");
+    int value = qdict_get_int(qdict, "value");
+    Error *err = NULL;
+    bool has_compress_level = false;
+    bool has_compress_threads = false;
+    bool has_decompress_threads = false;
+    bool has_multifd_channels = false;
+    bool has_file_threads = false;
+    int i;
+
+    for (i = 0; i < MIGRATION_PARAMETER_MAX; i++) {
+        if (strcmp(param, MigrationParameter_lookup[i]) == 0) {
+            switch (i) {
+            case MIGRATION_PARAMETER_COMPRESS_LEVEL:
+                has_compress_level = true;
+                break;
+            case MIGRATION_PARAMETER_COMPRESS_THREADS:
+                has_compress_threads = true;
+                break;
+            case MIGRATION_PARAMETER_DECOMPRESS_THREADS:
+                has_decompress_threads = true;
+                break;
+            case MIGRATION_PARAMETER_MULTIFD_CHANNELS:
+                has_multifd_channels = true;
+                break;
+            case MIGRATION_PARAMETER_FILE_THREADS:
+                has_file_threads = true;
+                break;
+            }
+            qmp_migrate_set_parameters(has_compress_level, value,
+                                       has_compress_threads, value,
+                                       has_decompress_threads, value,
+                                       has_multifd_channels, value,
+                                       has_file_threads, value,
+                                       &err);
+            break;
+        }
+    }
+
+    if (i == MIGRATION_PARAMETER_MAX) {
+        error_set(&err, QERR_INVALID_PARAMETER, param);
+    }
+
+    if (err) {
+        monitor_printf(mon, "migrate_set_parameter: %s\n",
+                       error_get_pretty(err));
+        error_free(err);
+    }
+}
+
 void hmp_set_password(Monitor *mon, const QDict *qdict)
 {
     const char *protocol  = qdict_get_str(qdict, "protocol");
@@ -1249,7 +1405,8 @@ static void hmp_migrate_status_cb(void *opaque)
 
     info = qmp_query_migrate(NULL);
     if (!info->has_status || strcmp(info->status, "active") == 0 ||
-        strcmp(info->status, "setup") == 0) {
+        strcmp(info->status, "setup") == 0 ||
+        strcmp(info->status, "postcopy-active") == 0) {
         if (info->has_disk) {
             int progress;
 
@@ -24,6 +24,20 @@
 #include "hw/virtio/virtio-bus.h"
 #include "qom/object_interfaces.h"
 
+typedef struct VirtIOBlockDataPlaneVq {
+    VirtIOBlockDataPlane *s;
+    VirtQueue *vq;
+    Vring vring;                    /* virtqueue vring */
+    EventNotifier *guest_notifier;  /* irq */
+
+    /* Note that this EventNotifier is assigned by value.  This is
+     * fine as long as you do not call event_notifier_cleanup on it
+     * (because you don't own the file descriptor or handle; you just
+     * use it).
+     */
+    EventNotifier host_notifier;    /* doorbell */
+} VirtIOBlockDataPlaneVq;
+
 struct VirtIOBlockDataPlane {
     bool started;
     bool starting;
@@ -32,18 +46,15 @@ struct VirtIOBlockDataPlane {
     VirtIOBlkConf *blk;
 
     VirtIODevice *vdev;
-    Vring vring;                    /* virtqueue vring */
-    EventNotifier *guest_notifier;  /* irq */
-
-    /* Note that these EventNotifiers are assigned by value.  This is
-     * fine as long as you do not call event_notifier_cleanup on them
-     * (because you don't own the file descriptor or handle; you just
-     * use it).
+    /* One per virtqueue; all of them are serviced by the IOThread that
+     * owns the BlockDriverState, but each raises its own interrupt.
      */
+    VirtIOBlockDataPlaneVq *vqs;
+    int num_queues;
+
     IOThread *iothread;
     IOThread internal_iothread_obj;
     AioContext *ctx;
-    EventNotifier host_notifier;    /* doorbell */
 
     /* Operation blocker on BDS */
     Error *blocker;
@@ -52,29 +63,32 @@ struct VirtIOBlockDataPlane {
 };
 
 /* Raise an interrupt to signal guest, if necessary */
-static void notify_guest(VirtIOBlockDataPlane *s)
+static void notify_guest(VirtIOBlockDataPlane *s, VirtIOBlockDataPlaneVq *vq)
 {
-    if (!vring_should_notify(s->vdev, &s->vring)) {
+    if (!vring_should_notify(s->vdev, &vq->vring)) {
         return;
     }
 
-    event_notifier_set(s->guest_notifier);
+    event_notifier_set(vq->guest_notifier);
 }
 
 static void complete_request_vring(VirtIOBlockReq *req, unsigned char status)
 {
+    VirtIOBlockDataPlane *s = req->dev->dataplane;
+    VirtIOBlockDataPlaneVq *vq = &s->vqs[virtio_get_queue_index(req->vq)];
+
     stb_p(&req->in->status, status);
 
-    vring_push(&req->dev->dataplane->vring, req->elem,
-               req->qiov.size + sizeof(*req->in));
-    notify_guest(req->dev->dataplane);
+    vring_push(&vq->vring, req->elem, req->qiov.size + sizeof(*req->in));
+    notify_guest(s, vq);
     g_slice_free(VirtIOBlockReq, req);
 }
 
 static void handle_notify(EventNotifier *e)
 {
-    VirtIOBlockDataPlane *s = container_of(e, VirtIOBlockDataPlane,
-                                           host_notifier);
+    VirtIOBlockDataPlaneVq *vq = container_of(e, VirtIOBlockDataPlaneVq,
+                                              host_notifier);
+    VirtIOBlockDataPlane *s = vq->s;
 
     VirtQueueElement *elem;
     VirtIOBlockReq *req;
@@ -83,13 +97,14 @@ static void handle_notify(EventNotifier *e)
         .num_writes = 0,
     };
 
-    event_notifier_test_and_clear(&s->host_notifier);
+    event_notifier_test_and_clear(&vq->host_notifier);
+    bdrv_io_plug(s->blk->conf.bs);
     for (;;) {
         /* Disable guest->host notifies to avoid unnecessary vmexits */
-        vring_disable_notification(s->vdev, &s->vring);
+        vring_disable_notification(s->vdev, &vq->vring);
 
         for (;;) {
-            ret = vring_pop(s->vdev, &s->vring, &elem);
+            ret = vring_pop(s->vdev, &vq->vring, &elem);
             if (ret < 0) {
                 assert(elem == NULL);
                 break; /* no more requests */
@@ -100,6 +115,7 @@ static void handle_notify(EventNotifier *e)
 
             req = g_slice_new(VirtIOBlockReq);
             req->dev = VIRTIO_BLK(s->vdev);
+            req->vq = vq->vq;
             req->elem = elem;
             virtio_blk_handle_request(req, &mrb);
         }
@@ -110,13 +126,23 @@ static void handle_notify(EventNotifier *e)
             /* Re-enable guest->host notifies and stop processing the vring.
              * But if the guest has snuck in more descriptors, keep processing.
              */
-            if (vring_enable_notification(s->vdev, &s->vring)) {
+            if (vring_enable_notification(s->vdev, &vq->vring)) {
                 break;
             }
         } else { /* fatal error */
             break;
         }
     }
+    bdrv_io_unplug(s->blk->conf.bs);
+}
+
+/* Lets the IOThread see new requests without waiting for a kick */
+static bool handle_notify_poll(void *opaque)
+{
+    VirtIOBlockDataPlaneVq *vq = container_of(opaque, VirtIOBlockDataPlaneVq,
+                                              host_notifier);
+
+    return !vq->vring.broken && vring_more_avail(&vq->vring);
 }
 
 /* Context: QEMU global mutex held */
@@ -129,6 +155,7 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
     Error *local_err = NULL;
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int i;
 
     *dataplane = NULL;
 
@@ -157,6 +184,12 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
     s = g_new0(VirtIOBlockDataPlane, 1);
     s->vdev = vdev;
     s->blk = blk;
+    s->num_queues = blk->num_queues;
+    s->vqs = g_new0(VirtIOBlockDataPlaneVq, s->num_queues);
+    for (i = 0; i < s->num_queues; i++) {
+        s->vqs[i].s = s;
+        s->vqs[i].vq = virtio_get_queue(vdev, i);
+    }
 
     if (blk->iothread) {
         s->iothread = blk->iothread;
@@ -193,6 +226,7 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
     bdrv_op_unblock_all(s->blk->conf.bs, s->blocker);
     error_free(s->blocker);
     object_unref(OBJECT(s->iothread));
+    g_free(s->vqs);
     g_free(s);
 }
 
@@ -201,7 +235,8 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
 {
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
-    VirtQueue *vq;
+    VirtIOBlockDataPlaneVq *vq;
+    int i;
 
     if (s->started) {
         return;
@@ -213,26 +248,33 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
 
     s->starting = true;
 
-    vq = virtio_get_queue(s->vdev, 0);
-    if (!vring_setup(&s->vring, s->vdev, 0)) {
-        s->starting = false;
-        return;
+    for (i = 0; i < s->num_queues; i++) {
+        if (!vring_setup(&s->vqs[i].vring, s->vdev, i)) {
+            while (--i >= 0) {
+                vring_teardown(&s->vqs[i].vring, s->vdev, i);
+            }
+            s->starting = false;
+            return;
+        }
     }
 
-    /* Set up guest notifier (irq) */
-    if (k->set_guest_notifiers(qbus->parent, 1, true) != 0) {
+    /* Set up guest notifiers (irq), one per virtqueue */
+    if (k->set_guest_notifiers(qbus->parent, s->num_queues, true) != 0) {
         fprintf(stderr, "virtio-blk failed to set guest notifier, "
                 "ensure -enable-kvm is set\n");
         exit(1);
     }
-    s->guest_notifier = virtio_queue_get_guest_notifier(vq);
 
     /* Set up virtqueue notify */
-    if (k->set_host_notifier(qbus->parent, 0, true) != 0) {
-        fprintf(stderr, "virtio-blk failed to set host notifier\n");
-        exit(1);
+    for (i = 0; i < s->num_queues; i++) {
+        vq = &s->vqs[i];
+        vq->guest_notifier = virtio_queue_get_guest_notifier(vq->vq);
+        if (k->set_host_notifier(qbus->parent, i, true) != 0) {
+            fprintf(stderr, "virtio-blk failed to set host notifier\n");
+            exit(1);
+        }
+        vq->host_notifier = *virtio_queue_get_host_notifier(vq->vq);
     }
-    s->host_notifier = *virtio_queue_get_host_notifier(vq);
 
     s->starting = false;
     s->started = true;
@@ -241,11 +283,18 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
     bdrv_set_aio_context(s->blk->conf.bs, s->ctx);
 
     /* Kick right away to begin processing requests already in vring */
-    event_notifier_set(virtio_queue_get_host_notifier(vq));
+    for (i = 0; i < s->num_queues; i++) {
+        event_notifier_set(virtio_queue_get_host_notifier(s->vqs[i].vq));
+    }
 
     /* Get this show started by hooking up our callbacks */
     aio_context_acquire(s->ctx);
-    aio_set_event_notifier(s->ctx, &s->host_notifier, handle_notify);
+    for (i = 0; i < s->num_queues; i++) {
+        aio_set_event_notifier(s->ctx, &s->vqs[i].host_notifier,
+                               handle_notify);
+        aio_set_event_notifier_poll(s->ctx, &s->vqs[i].host_notifier,
+                                    handle_notify_poll);
+    }
     aio_context_release(s->ctx);
 }
 
@@ -255,6 +304,8 @@ void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
     VirtIOBlock *vblk = VIRTIO_BLK(s->vdev);
+    int i;
+
     if (!s->started || s->stopping) {
         return;
     }
@@ -265,22 +316,26 @@ void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
     aio_context_acquire(s->ctx);
 
     /* Stop notifications for new requests from guest */
-    aio_set_event_notifier(s->ctx, &s->host_notifier, NULL);
+    for (i = 0; i < s->num_queues; i++) {
+        aio_set_event_notifier(s->ctx, &s->vqs[i].host_notifier, NULL);
+    }
 
     /* Drain and switch bs back to the QEMU main loop */
     bdrv_set_aio_context(s->blk->conf.bs, qemu_get_aio_context());
 
     aio_context_release(s->ctx);
 
-    /* Sync vring state back to virtqueue so that non-dataplane request
-     * processing can continue when we disable the host notifier below.
-     */
-    vring_teardown(&s->vring, s->vdev, 0);
+    for (i = 0; i < s->num_queues; i++) {
+        /* Sync vring state back to virtqueue so that non-dataplane request
+         * processing can continue when we disable the host notifier below.
+         */
+        vring_teardown(&s->vqs[i].vring, s->vdev, i);
 
-    k->set_host_notifier(qbus->parent, 0, false);
+        k->set_host_notifier(qbus->parent, i, false);
+    }
 
-    /* Clean up guest notifier (irq) */
-    k->set_guest_notifiers(qbus->parent, 1, false);
+    /* Clean up guest notifiers (irq) */
+    k->set_guest_notifiers(qbus->parent, s->num_queues, false);
 
     s->started = false;
     s->stopping = false;
@@ -29,10 +29,11 @@
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-access.h"
 
-static VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s)
+static VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s, VirtQueue *vq)
 {
     VirtIOBlockReq *req = g_slice_new0(VirtIOBlockReq);
     req->dev = s;
+    req->vq = vq;
     req->elem = g_slice_new0(VirtQueueElement);
     return req;
 }
@@ -54,8 +55,8 @@ static void virtio_blk_complete_request(VirtIOBlockReq *req,
     trace_virtio_blk_req_complete(req, status);
 
     stb_p(&req->in->status, status);
-    virtqueue_push(s->vq, req->elem, req->qiov.size + sizeof(*req->in));
-    virtio_notify(vdev, s->vq);
+    virtqueue_push(req->vq, req->elem, req->qiov.size + sizeof(*req->in));
+    virtio_notify(vdev, req->vq);
 }
 
 static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
@@ -115,11 +116,11 @@ static void virtio_blk_flush_complete(void *opaque, int ret)
     virtio_blk_free_request(req);
 }
 
-static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s)
+static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s, VirtQueue *vq)
 {
-    VirtIOBlockReq *req = virtio_blk_alloc_request(s);
+    VirtIOBlockReq *req = virtio_blk_alloc_request(s, vq);
 
-    if (!virtqueue_pop(s->vq, req->elem)) {
+    if (!virtqueue_pop(vq, req->elem)) {
         virtio_blk_free_request(req);
         return NULL;
     }
@@ -429,12 +430,16 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
     }
 #endif
 
-    while ((req = virtio_blk_get_request(s))) {
+    bdrv_io_plug(s->bs);
+
+    while ((req = virtio_blk_get_request(s, vq))) {
         virtio_blk_handle_request(req, &mrb);
     }
 
     virtio_submit_multiwrite(s->bs, &mrb);
 
+    bdrv_io_unplug(s->bs);
+
     /*
      * FIXME: Want to check for completions before returning to guest mode,
      * so cached reads and writes are reported as quickly as possible. But
@@ -514,6 +519,7 @@ static void virtio_blk_update_config(VirtIODevice *vdev, uint8_t *config)
     virtio_stl_p(vdev, &blkcfg.blk_size, blk_size);
     virtio_stw_p(vdev, &blkcfg.min_io_size, s->conf->min_io_size / blk_size);
     virtio_stw_p(vdev, &blkcfg.opt_io_size, s->conf->opt_io_size / blk_size);
+    virtio_stw_p(vdev, &blkcfg.num_queues, s->blk.num_queues);
     blkcfg.heads = s->conf->heads;
     /*
      * We must ensure that the block device capacity is a multiple of
@@ -563,6 +569,9 @@ static uint32_t virtio_blk_get_features(VirtIODevice *vdev, uint32_t features)
     if (s->blk.config_wce) {
         features |= (1 << VIRTIO_BLK_F_CONFIG_WCE);
     }
+    if (s->blk.num_queues > 1) {
+        features |= (1 << VIRTIO_BLK_F_MQ);
+    }
     if (bdrv_enable_write_cache(s->bs))
         features |= (1 << VIRTIO_BLK_F_WCE);
 
@@ -627,6 +636,9 @@ static void virtio_blk_save_device(VirtIODevice *vdev, QEMUFile *f)
 
     while (req) {
         qemu_put_sbyte(f, 1);
+        if (s->blk.num_queues > 1) {
+            qemu_put_be32(f, virtio_get_queue_index(req->vq));
+        }
         qemu_put_buffer(f, (unsigned char *)req->elem,
                         sizeof(VirtQueueElement));
         req = req->next;
@@ -651,7 +663,19 @@ static int virtio_blk_load_device(VirtIODevice *vdev, QEMUFile *f,
     VirtIOBlock *s = VIRTIO_BLK(vdev);
 
     while (qemu_get_sbyte(f)) {
-        VirtIOBlockReq *req = virtio_blk_alloc_request(s);
+        unsigned nvq = 0;
+        VirtIOBlockReq *req;
+
+        if (s->blk.num_queues > 1) {
+            nvq = qemu_get_be32(f);
+            if (nvq >= s->blk.num_queues) {
+                error_report("Invalid virtqueue index %u in request list "
+                             "(num-queues %u)", nvq, s->blk.num_queues);
+                return -EINVAL;
+            }
+        }
+
+        req = virtio_blk_alloc_request(s, virtio_get_queue(vdev, nvq));
         qemu_get_buffer(f, (unsigned char *)req->elem,
                         sizeof(VirtQueueElement));
         req->next = s->rq;
@@ -719,6 +743,7 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     Error *err = NULL;
 #endif
     static int virtio_blk_id;
+    int i;
 
     if (!blk->conf.bs) {
         error_setg(errp, "drive property not set");
@@ -735,6 +760,11 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
         error_setg(errp, "Error setting geometry");
         return;
     }
+    if (!blk->num_queues || blk->num_queues > VIRTIO_PCI_QUEUE_MAX) {
+        error_setg(errp, "num-queues must be between 1 and %d",
+                   VIRTIO_PCI_QUEUE_MAX);
+        return;
+    }
 
     virtio_init(vdev, "virtio-blk", VIRTIO_ID_BLOCK,
                 sizeof(struct virtio_blk_config));
@@ -744,7 +774,9 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     s->rq = NULL;
     s->sector_mask = (s->conf->logical_block_size / BDRV_SECTOR_SIZE) - 1;
 
-    s->vq = virtio_add_queue(vdev, 128, virtio_blk_handle_output);
+    for (i = 0; i < blk->num_queues; i++) {
+        virtio_add_queue(vdev, 128, virtio_blk_handle_output);
+    }
     s->complete_request = virtio_blk_complete_request;
 #ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
     virtio_blk_data_plane_create(vdev, blk, &s->dataplane, &err);
@@ -799,6 +831,7 @@ static Property virtio_blk_properties[] = {
     DEFINE_BLOCK_CHS_PROPERTIES(VirtIOBlock, blk.conf),
     DEFINE_PROP_STRING("serial", VirtIOBlock, blk.serial),
     DEFINE_PROP_BIT("config-wce", VirtIOBlock, blk.config_wce, 0, true),
+    DEFINE_PROP_UINT16("num-queues", VirtIOBlock, blk.num_queues, 1),
 #ifdef __linux__
     DEFINE_PROP_BIT("scsi", VirtIOBlock, blk.scsi, 0, true),
 #endif
@@ -0,0 +1,572 @@
+/*
+ * Dedicated thread for virtio-net packet processing
+ *
+ * Copyright (c) 2014 The QEMU Project Developers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "qemu/iov.h"
+#include "qemu/atomic.h"
+#include "qemu/error-report.h"
+#include "hw/virtio/dataplane/vring.h"
+#include "hw/virtio/virtio-net.h"
+#include "hw/virtio/virtio-access.h"
+#include "virtio-net.h"
+#include "block/aio.h"
+#include "net/net.h"
+#include "net/tap.h"
+#include "net/vhost_net.h"
+#include "hw/virtio/virtio-bus.h"
+
+/* One direction of a queue pair */
+typedef struct VirtIONetDataPlaneVq {
+    Vring vring;
+    EventNotifier host_notifier;    /* doorbell */
+    EventNotifier *guest_notifier;  /* irq */
+    bool masked;                    /* guest notifier masked by the guest */
+    bool pending;                   /* interrupt raised while masked */
+} VirtIONetDataPlaneVq;
+
+typedef struct VirtIONetDataPlaneQueue {
+    VirtIONetDataPlane *s;
+    NetClientState *nc;
+    VirtIONetDataPlaneVq rx;
+    VirtIONetDataPlaneVq tx;
+    QEMUBH *tx_bh;
+    /* Packet that the backend queued, completed by tx_complete() */
+    VirtQueueElement *async_tx_elem;
+    bool started;
+} VirtIONetDataPlaneQueue;
+
+struct VirtIONetDataPlane {
+    bool started;
+    bool starting;
+    bool stopping;
+
+    VirtIODevice *vdev;
+    IOThread *iothread;
+    AioContext *ctx;
+
+    int max_queues;
+    int queues;                     /* queue pairs handled while started */
+    VirtIONetDataPlaneQueue *vqs;
+};
+
+static VirtIONetDataPlaneVq *get_vq(VirtIONetDataPlane *s, int idx)
+{
+    VirtIONetDataPlaneQueue *q = &s->vqs[idx / 2];
+
+    assert(idx / 2 < s->max_queues);
+    return idx % 2 ? &q->tx : &q->rx;
+}
+
+/* Raise an interrupt to signal guest, if necessary */
+static void notify_guest(VirtIONetDataPlane *s, VirtIONetDataPlaneVq *vq)
+{
+    if (!vring_should_notify(s->vdev, &vq->vring)) {
+        return;
+    }
+
+    /* Leave the interrupt pending if the guest masked the vector; it is
+     * picked up by virtio_net_data_plane_notifier_pending() on unmask.
+     */
+    atomic_mb_set(&vq->pending, true);
+    if (!atomic_mb_read(&vq->masked) && atomic_xchg(&vq->pending, false)) {
+        event_notifier_set(vq->guest_notifier);
+    }
+}
+
+/* Context: QEMU global mutex held */
+void virtio_net_data_plane_notifier_mask(VirtIONetDataPlane *s, int idx,
+                                         bool mask)
+{
+    atomic_mb_set(&get_vq(s, idx)->masked, mask);
+}
+
+/* Context: QEMU global mutex held */
+bool virtio_net_data_plane_notifier_pending(VirtIONetDataPlane *s, int idx)
+{
+    return atomic_xchg(&get_vq(s, idx)->pending, false);
+}
+
+/* RX */
+
+/*
+ * Pops enough buffers for a packet that needs @needed bytes in the guest.
+ * Returns the number of elements, or 0 with nothing popped if the guest has
+ * not made enough buffers available yet.
+ */
+static int rx_pop_buffers(VirtIONetDataPlane *s, VirtIONetDataPlaneQueue *q,
+                          VirtQueueElement **elems, size_t needed)
+{
+    VirtQueueElement *elem;
+    size_t avail = 0;
+    int num = 0;
+
+    while (avail < needed) {
+        if (num == VIRTQUEUE_MAX_SIZE ||
+            vring_pop(s->vdev, &q->rx.vring, &elem) < 0) {
+            while (num > 0) {
+                vring_unpop(&q->rx.vring, elems[--num]);
+            }
+            return 0;
+        }
+
+        if (elem->in_num < 1) {
+            error_report("virtio-net receive queue contains no in buffers");
+            exit(1);
+        }
+
+        avail += iov_size(elem->in_sg, elem->in_num);
+        elems[num++] = elem;
+    }
+
+    return num;
+}
+
+/* Context: IOThread, called by the backend of @nc */
+ssize_t virtio_net_data_plane_receive(VirtIONetDataPlane *s,
+                                      NetClientState *nc,
+                                      const uint8_t *buf, size_t size)
+{
+    VirtIONet *n = VIRTIO_NET(s->vdev);
+    VirtIONetDataPlaneQueue *q = &s->vqs[nc->queue_index];
+    VirtQueueElement *elems[VIRTQUEUE_MAX_SIZE];
+    int lens[VIRTQUEUE_MAX_SIZE];
+    struct iovec mhdr_sg[VIRTQUEUE_MAX_SIZE];
+    struct virtio_net_hdr_mrg_rxbuf mhdr;
+    unsigned mhdr_cnt = 0;
+    size_t needed, offset, guest_offset;
+    int i, num;
+
+    if (!q->started) {
+        return -1;
+    }
+
+    if (!virtio_net_receive_filter(n, buf, size)) {
+        return size;
+    }
+
+    /* hdr_len refers to the header we supply to the guest */
+    needed = n->mergeable_rx_bufs ?
+             size + n->guest_hdr_len - n->host_hdr_len : 1;
+
+    num = rx_pop_buffers(s, q, elems, needed);
+    if (num == 0) {
+        /* To avoid a race condition where the guest makes buffers available
+         * just before notification is enabled, try again after enabling it.
+         */
+        vring_enable_notification(s->vdev, &q->rx.vring);
+        num = rx_pop_buffers(s, q, elems, needed);
+        if (num == 0) {
+            return 0;
+        }
+    }
+    vring_disable_notification(s->vdev, &q->rx.vring);
+
+    if (n->mergeable_rx_bufs) {
+        mhdr_cnt = iov_copy(mhdr_sg, ARRAY_SIZE(mhdr_sg),
+                            elems[0]->in_sg, elems[0]->in_num,
+                            offsetof(typeof(mhdr), num_buffers),
+                            sizeof(mhdr.num_buffers));
+    }
+    virtio_net_receive_header(n, elems[0]->in_sg, elems[0]->in_num,
+                              buf, size);
+
+    offset = n->host_hdr_len;
+    for (i = 0; i < num; i++) {
+        guest_offset = i == 0 ? n->guest_hdr_len : 0;
+        lens[i] = guest_offset +
+                  iov_from_buf(elems[i]->in_sg, elems[i]->in_num,
+                               guest_offset, buf + offset, size - offset);
+        offset += lens[i] - guest_offset;
+    }
+
+    /* If buffers can't be merged, the packet must fit into one; otherwise
+     * drop it and leave the buffer to the next packet.
+     */
+    if (offset < size) {
+        assert(!n->mergeable_rx_bufs);
+        vring_unpop(&q->rx.vring, elems[0]);
+        return size;
+    }
+
+    if (mhdr_cnt) {
+        virtio_stw_p(s->vdev, &mhdr.num_buffers, num);
+        iov_from_buf(mhdr_sg, mhdr_cnt, 0,
+                     &mhdr.num_buffers, sizeof mhdr.num_buffers);
+    }
+
+    trace_virtio_net_data_plane_receive(s, nc->queue_index, size, num);
+    for (i = 0; i < num; i++) {
+        vring_push(&q->rx.vring, elems[i], lens[i]);
+    }
+    notify_guest(s, &q->rx);
+
+    return size;
+}
+
+/* The guest added receive buffers, deliver packets waiting for them */
+static void handle_rx_notify(EventNotifier *e)
+{
+    VirtIONetDataPlaneQueue *q = container_of(e, VirtIONetDataPlaneQueue,
+                                              rx.host_notifier);
+
+    event_notifier_test_and_clear(e);
+    qemu_flush_queued_packets(q->nc);
+}
+
+/* TX */
+
+static void tx_complete(NetClientState *nc, ssize_t len)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetDataPlane *s = n->dataplane;
+    VirtIONetDataPlaneQueue *q = &s->vqs[nc->queue_index];
+
+    vring_push(&q->tx.vring, q->async_tx_elem, 0);
+    q->async_tx_elem = NULL;
+    notify_guest(s, &q->tx);
+
+    qemu_bh_schedule(q->tx_bh);
+}
+
+/* Returns the number of packets sent, or -EBUSY if the backend is full */
+static int flush_tx(VirtIONetDataPlaneQueue *q)
+{
+    VirtIONetDataPlane *s = q->s;
+    VirtIONet *n = VIRTIO_NET(s->vdev);
+    VirtQueueElement *elem;
+    struct iovec sg[VIRTQUEUE_MAX_SIZE];
+    struct iovec *out_sg;
+    unsigned int out_num;
+    int num_packets = 0;
+    ssize_t ret;
+
+    if (q->async_tx_elem) {
+        return -EBUSY;
+    }
+
+    while (num_packets < n->tx_burst &&
+           vring_pop(s->vdev, &q->tx.vring, &elem) >= 0) {
+        out_num = virtio_net_tx_prepare(n, elem, sg, &out_sg);
+
+        ret = qemu_sendv_packet_async(q->nc, out_sg, out_num, tx_complete);
+        if (ret == 0) {
+            q->async_tx_elem = elem;
+            num_packets = -EBUSY;
+            break;
+        }
+
+        vring_push(&q->tx.vring, elem, 0);
+        num_packets++;
+    }
+
+    notify_guest(s, &q->tx);
+    return num_packets;
+}
+
+static void tx_bh(void *opaque)
+{
+    VirtIONetDataPlaneQueue *q = opaque;
+    VirtIONetDataPlane *s = q->s;
+    VirtIONet *n = VIRTIO_NET(s->vdev);
+    int ret;
+
+    if (!q->started) {
+        return;
+    }
+
+    ret = flush_tx(q);
+    if (ret == -EBUSY) {
+        return; /* tx_complete() reschedules us */
+    }
+
+    /* If we flushed a full burst, assume there are more packets coming and
+     * give the other queues and the receive side a chance first.
+     */
+    if (ret >= n->tx_burst) {
+        qemu_bh_schedule(q->tx_bh);
+        return;
+    }
+
+    /* Re-enable guest->host notifies, but if the guest has snuck in more
+     * packets, keep processing.
+     */
+    if (!vring_enable_notification(s->vdev, &q->tx.vring)) {
+        vring_disable_notification(s->vdev, &q->tx.vring);
+        qemu_bh_schedule(q->tx_bh);
+    }
+}
+
+static void handle_tx_notify(EventNotifier *e)
+{
+    VirtIONetDataPlaneQueue *q = container_of(e, VirtIONetDataPlaneQueue,
+                                              tx.host_notifier);
+
+    event_notifier_test_and_clear(e);
+
+    /* Disable guest->host notifies to avoid unnecessary vmexits */
+    vring_disable_notification(q->s->vdev, &q->tx.vring);
+    tx_bh(q);
+}
+
+/* Context: QEMU global mutex held
+ *
+ * The receive filter and the offload settings are read by the IOThread, so
+ * the control virtqueue changes them with the AioContext held.
+ */
+void virtio_net_data_plane_acquire(VirtIONetDataPlane *s)
+{
+    aio_context_acquire(s->ctx);
+}
+
+/* Context: QEMU global mutex held */
+void virtio_net_data_plane_release(VirtIONetDataPlane *s)
+{
+    aio_context_release(s->ctx);
+}
+
+/* Context: QEMU global mutex held */
+void virtio_net_data_plane_create(VirtIODevice *vdev, virtio_net_conf *conf,
+                                  VirtIONetDataPlane **dataplane,
+                                  Error **errp)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    VirtIONetDataPlane *s;
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    NetClientState *peer;
+    int i;
+
+    *dataplane = NULL;
+
+    if (!conf->iothread) {
+        return;
+    }
+
+    /* Don't try if transport does not support notifiers. */
+    if (!k->set_guest_notifiers || !k->set_host_notifier) {
+        error_setg(errp,
+                   "device is incompatible with iothread "
+                   "(transport does not support notifiers)");
+        return;
+    }
+
+    /* Every queue needs a backend that can run in the IOThread */
+    for (i = 0; i < n->max_queues; i++) {
+        peer = n->nic_conf.peers.ncs[i];
+        if (!peer) {
+            error_setg(errp, "iothread requires a netdev");
+            return;
+        }
+        if (get_vhost_net(peer)) {
+            error_setg(errp, "iothread cannot be used with vhost");
+            return;
+        }
+        if (!qemu_can_set_net_aio_context(peer)) {
+            error_setg(errp, "netdev '%s' cannot be used with an iothread",
+                       peer->name);
+            return;
+        }
+    }
+
+    s = g_new0(VirtIONetDataPlane, 1);
+    s->vdev = vdev;
+    s->iothread = conf->iothread;
+    object_ref(OBJECT(s->iothread));
+    s->ctx = iothread_get_aio_context(s->iothread);
+
+    s->max_queues = n->max_queues;
+    s->vqs = g_new0(VirtIONetDataPlaneQueue, s->max_queues);
+    for (i = 0; i < s->max_queues; i++) {
+        s->vqs[i].s = s;
+        s->vqs[i].tx_bh = aio_bh_new(s->ctx, tx_bh, &s->vqs[i]);
+    }
+
+    *dataplane = s;
+}
+
+/* Context: QEMU global mutex held */
+void virtio_net_data_plane_destroy(VirtIONetDataPlane *s)
+{
+    int i;
+
+    if (!s) {
+        return;
+    }
+
+    virtio_net_data_plane_stop(s);
+    for (i = 0; i < s->max_queues; i++) {
+        qemu_bh_delete(s->vqs[i].tx_bh);
+    }
+    g_free(s->vqs);
+    object_unref(OBJECT(s->iothread));
+    g_free(s);
+}
+
+/* Context: QEMU global mutex held */
+void virtio_net_data_plane_start(VirtIONetDataPlane *s)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    VirtIONet *n = VIRTIO_NET(s->vdev);
+    VirtIONetDataPlaneQueue *q;
+    int i, nvqs;
+
+    if (s->started) {
+        return;
+    }
+
+    if (s->starting) {
+        return;
+    }
+
+    s->starting = true;
+    s->queues = n->multiqueue ? n->curr_queues : 1;
+    nvqs = s->queues * 2;
+
+    /* From here on, the main loop leaves the virtqueues alone and the
+     * guest notifier callbacks are routed to us.
+     */
+    n->dataplane_started = true;
+
+    for (i = 0; i < s->queues; i++) {
+        q = &s->vqs[i];
+        q->nc = qemu_get_subqueue(n->nic, i);
+
+        /* Complete the packet the backend holds for the main loop.  Purging
+         * does not call the sent callback, so give the buffer back first.
+         */
+        if (n->vqs[i].async_tx.elem.out_num) {
+            virtqueue_push(n->vqs[i].tx_vq, &n->vqs[i].async_tx.elem, 0);
+            virtio_notify(s->vdev, n->vqs[i].tx_vq);
+            n->vqs[i].async_tx.elem.out_num = n->vqs[i].async_tx.len = 0;
+        }
+        qemu_purge_queued_packets(q->nc);
+
+        if (!vring_setup(&q->rx.vring, s->vdev, 2 * i)) {
+            goto fail_vrings;
+        }
+        if (!vring_setup(&q->tx.vring, s->vdev, 2 * i + 1)) {
+            vring_teardown(&q->rx.vring, s->vdev, 2 * i);
+            goto fail_vrings;
+        }
+        q->rx.masked = q->tx.masked = false;
+        q->rx.pending = q->tx.pending = false;
+    }
+
+    /* Set up guest notifiers (irq) */
+    if (k->set_guest_notifiers(qbus->parent, nvqs, true) != 0) {
+        fprintf(stderr, "virtio-net failed to set guest notifier, "
+                "ensure -enable-kvm is set\n");
+        exit(1);
+    }
+
+    /* Set up virtqueue notify */
+    for (i = 0; i < nvqs; i++) {
+        VirtIONetDataPlaneVq *vq = get_vq(s, i);
+        VirtQueue *vvq = virtio_get_queue(s->vdev, i);
+
+        if (k->set_host_notifier(qbus->parent, i, true) != 0) {
+            fprintf(stderr, "virtio-net failed to set host notifier\n");
+            exit(1);
+        }
+        vq->host_notifier = *virtio_queue_get_host_notifier(vvq);
+        vq->guest_notifier = virtio_queue_get_guest_notifier(vvq);
+    }
+
+    s->starting = false;
+    s->started = true;
+    trace_virtio_net_data_plane_start(s, s->queues);
+
+    /* Get this show started by hooking up our callbacks and moving the
+     * backends over.  Kick right away to pick up packets and buffers that
+     * are already in the vrings.
+     */
+    aio_context_acquire(s->ctx);
+    for (i = 0; i < s->queues; i++) {
+        q = &s->vqs[i];
+        q->started = true;
+        qemu_set_net_aio_context(q->nc->peer, s->ctx);
+        aio_set_event_notifier(s->ctx, &q->rx.host_notifier, handle_rx_notify);
+        aio_set_event_notifier(s->ctx, &q->tx.host_notifier, handle_tx_notify);
+        event_notifier_set(&q->rx.host_notifier);
+        event_notifier_set(&q->tx.host_notifier);
+    }
+    aio_context_release(s->ctx);
+    return;
+
+fail_vrings:
+    while (--i >= 0) {
+        vring_teardown(&s->vqs[i].rx.vring, s->vdev, 2 * i);
+        vring_teardown(&s->vqs[i].tx.vring, s->vdev, 2 * i + 1);
+    }
+    n->dataplane_started = false;
+    s->starting = false;
+}
+
+/* Context: QEMU global mutex held */
+void virtio_net_data_plane_stop(VirtIONetDataPlane *s)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    VirtIONet *n = VIRTIO_NET(s->vdev);
+    VirtIONetDataPlaneQueue *q;
+    int i, nvqs = s->queues * 2;
+
+    if (!s->started || s->stopping) {
+        return;
+    }
+    s->stopping = true;
+    trace_virtio_net_data_plane_stop(s);
+
+    aio_context_acquire(s->ctx);
+    for (i = 0; i < s->queues; i++) {
+        q = &s->vqs[i];
+
+        /* Stop notifications for new packets from guest */
+        aio_set_event_notifier(s->ctx, &q->rx.host_notifier, NULL);
+        aio_set_event_notifier(s->ctx, &q->tx.host_notifier, NULL);
+
+        /* Switch the backend back to the QEMU main loop */
+        qemu_set_net_aio_context(q->nc->peer, NULL);
+
+        /* Give the packet the backend still holds back to the guest.
+         * Purging does not call tx_complete(), so push it here.
+         */
+        if (q->async_tx_elem) {
+            vring_push(&q->tx.vring, q->async_tx_elem, 0);
+            q->async_tx_elem = NULL;
+            notify_guest(s, &q->tx);
+        }
+        qemu_purge_queued_packets(q->nc);
+        qemu_bh_cancel(q->tx_bh);
+        q->started = false;
+    }
+    aio_context_release(s->ctx);
+
+    /* Sync vring state back to virtqueue so that non-dataplane packet
+     * processing can continue when we disable the host notifier below.
+     */
+    for (i = 0; i < s->queues; i++) {
+        vring_teardown(&s->vqs[i].rx.vring, s->vdev, 2 * i);
+        vring_teardown(&s->vqs[i].tx.vring, s->vdev, 2 * i + 1);
+    }
+
+    for (i = 0; i < nvqs; i++) {
+        k->set_host_notifier(qbus->parent, i, false);
+        virtio_queue_set_notification(virtio_get_queue(s->vdev, i), 1);
+    }
+
+    /* Clean up guest notifier (irq) */
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
+
+    n->dataplane_started = false;
+    s->started = false;
+    s->stopping = false;
+}
@@ -0,0 +1,34 @@
+/*
+ * Dedicated thread for virtio-net packet processing
+ *
+ * Copyright (c) 2014 The QEMU Project Developers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef HW_DATAPLANE_VIRTIO_NET_H
+#define HW_DATAPLANE_VIRTIO_NET_H
+
+#include "hw/virtio/virtio.h"
+#include "hw/virtio/virtio-net.h"
+
+typedef struct VirtIONetDataPlane VirtIONetDataPlane;
+
+void virtio_net_data_plane_create(VirtIODevice *vdev, virtio_net_conf *conf,
+                                  VirtIONetDataPlane **dataplane,
+                                  Error **errp);
+void virtio_net_data_plane_destroy(VirtIONetDataPlane *s);
+void virtio_net_data_plane_start(VirtIONetDataPlane *s);
+void virtio_net_data_plane_stop(VirtIONetDataPlane *s);
+ssize_t virtio_net_data_plane_receive(VirtIONetDataPlane *s,
+                                      NetClientState *nc,
+                                      const uint8_t *buf, size_t size);
+void virtio_net_data_plane_notifier_mask(VirtIONetDataPlane *s, int idx,
+                                         bool mask);
+bool virtio_net_data_plane_notifier_pending(VirtIONetDataPlane *s, int idx);
+void virtio_net_data_plane_acquire(VirtIONetDataPlane *s);
+void virtio_net_data_plane_release(VirtIONetDataPlane *s);
+
+#endif /* HW_DATAPLANE_VIRTIO_NET_H */
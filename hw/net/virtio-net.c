@@ -19,6 +19,10 @@
 #include "qemu/error-report.h"
 #include "qemu/timer.h"
 #include "hw/virtio/virtio-net.h"
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+# include "dataplane/virtio-net.h"
+# include "migration/migration.h"
+#endif
 #include "net/vhost_net.h"
 #include "hw/virtio/virtio-bus.h"
 #include "qapi/qmp/qjson.h"
@@ -142,6 +146,23 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
     }
 }
 
+static void virtio_net_data_plane_status(VirtIONet *n, uint8_t status)
+{
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    NetClientState *nc = qemu_get_queue(n->nic);
+
+    if (!n->dataplane) {
+        return;
+    }
+
+    if (virtio_net_started(n, status) && !nc->peer->link_down) {
+        virtio_net_data_plane_start(n->dataplane);
+    } else {
+        virtio_net_data_plane_stop(n->dataplane);
+    }
+#endif
+}
+
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -150,6 +171,7 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     uint8_t queue_status;
 
     virtio_net_vhost_status(n, status);
+    virtio_net_data_plane_status(n, status);
 
     for (i = 0; i < n->max_queues; i++) {
         q = &n->vqs[i];
@@ -164,7 +186,8 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             continue;
         }
 
-        if (virtio_net_started(n, queue_status) && !n->vhost_started) {
+        if (virtio_net_started(n, queue_status) && !n->vhost_started &&
+            !n->dataplane_started) {
             if (q->tx_timer) {
                 timer_mod(q->tx_timer,
                                qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + n->tx_timeout);
@@ -771,6 +794,14 @@ static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
     }
 
     n->curr_queues = queues;
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    /* The data plane handles curr_queues pairs; restart it with the new
+     * count, virtio_net_set_status() below starts it again.
+     */
+    if (n->dataplane) {
+        virtio_net_data_plane_stop(n->dataplane);
+    }
+#endif
     /* stop the backend before changing the number of queues to avoid handling a
      * disabled queue */
     virtio_net_set_status(vdev, vdev->status);
@@ -799,6 +830,12 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         iov_cnt = elem.out_num;
         s = iov_to_buf(iov, iov_cnt, 0, &ctrl, sizeof(ctrl));
         iov_discard_front(&iov, &iov_cnt, sizeof(ctrl));
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+        /* The data plane thread reads the state changed by the commands */
+        if (n->dataplane) {
+            virtio_net_data_plane_acquire(n->dataplane);
+        }
+#endif
         if (s != sizeof(ctrl)) {
             status = VIRTIO_NET_ERR;
         } else if (ctrl.class == VIRTIO_NET_CTRL_RX) {
@@ -814,6 +851,11 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         } else if (ctrl.class == VIRTIO_NET_CTRL_GUEST_OFFLOADS) {
             status = virtio_net_handle_offloads(n, ctrl.cmd, iov, iov_cnt);
         }
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+        if (n->dataplane) {
+            virtio_net_data_plane_release(n->dataplane);
+        }
+#endif
 
         s = iov_from_buf(elem.in_sg, elem.in_num, 0, &status, sizeof(status));
         assert(s == sizeof(status));
@@ -913,8 +955,8 @@ static void work_around_broken_dhclient(struct virtio_net_hdr *hdr,
     }
 }
 
-static void receive_header(VirtIONet *n, const struct iovec *iov, int iov_cnt,
-                           const void *buf, size_t size)
+void virtio_net_receive_header(VirtIONet *n, const struct iovec *iov,
+                               int iov_cnt, const void *buf, size_t size)
 {
     if (n->has_vnet_hdr) {
         /* FIXME this cast is evil */
@@ -932,7 +974,7 @@ static void receive_header(VirtIONet *n, const struct iovec *iov, int iov_cnt,
     }
 }
 
-static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
+int virtio_net_receive_filter(VirtIONet *n, const uint8_t *buf, int size)
 {
     static const uint8_t bcast[] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
     static const uint8_t vlan[] = {0x81, 0x00};
@@ -997,12 +1039,18 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
         return -1;
     }
 
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    if (n->dataplane_started) {
+        return virtio_net_data_plane_receive(n->dataplane, nc, buf, size);
+    }
+#endif
+
     /* hdr_len refers to the header we supply to the guest */
     if (!virtio_net_has_buffers(q, size + n->guest_hdr_len - n->host_hdr_len)) {
         return 0;
     }
 
-    if (!receive_filter(n, buf, size))
+    if (!virtio_net_receive_filter(n, buf, size))
         return size;
 
     offset = i = 0;
@@ -1039,7 +1087,7 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
                                     sizeof(mhdr.num_buffers));
             }
 
-            receive_header(n, sg, elem.in_num, buf, size);
+            virtio_net_receive_header(n, sg, elem.in_num, buf, size);
             offset = n->host_hdr_len;
             total += n->guest_hdr_len;
             guest_offset = n->guest_hdr_len;
@@ -1101,6 +1149,54 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 }
 
 /* TX */
+
+/*
+ * Swaps the virtio header of the packet in @elem for the backend and, if the
+ * backend wants a shorter header than the guest sends, builds an iovec
+ * without the extra bytes in @sg.  Returns the iovec to send in @out_sg and
+ * its number of entries.
+ */
+unsigned int virtio_net_tx_prepare(VirtIONet *n, VirtQueueElement *elem,
+                                   struct iovec *sg, struct iovec **out_sg)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    unsigned int out_num = elem->out_num;
+
+    *out_sg = &elem->out_sg[0];
+
+    if (out_num < 1) {
+        error_report("virtio-net header not in first element");
+        exit(1);
+    }
+
+    if (n->has_vnet_hdr) {
+        if (elem->out_sg[0].iov_len < n->guest_hdr_len) {
+            error_report("virtio-net header incorrect");
+            exit(1);
+        }
+        virtio_net_hdr_swap(vdev, (void *) elem->out_sg[0].iov_base);
+    }
+
+    /*
+     * If host wants to see the guest header as is, we can
+     * pass it on unchanged. Otherwise, copy just the parts
+     * that host is interested in.
+     */
+    assert(n->host_hdr_len <= n->guest_hdr_len);
+    if (n->host_hdr_len != n->guest_hdr_len) {
+        unsigned sg_num = iov_copy(sg, VIRTQUEUE_MAX_SIZE,
+                                   elem->out_sg, out_num,
+                                   0, n->host_hdr_len);
+        sg_num += iov_copy(sg + sg_num, VIRTQUEUE_MAX_SIZE - sg_num,
+                         elem->out_sg, out_num,
+                         n->guest_hdr_len, -1);
+        out_num = sg_num;
+        *out_sg = sg;
+    }
+
+    return out_num;
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
@@ -1112,6 +1208,11 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         return num_packets;
     }
 
+    /* The data plane owns the virtqueues while it runs */
+    if (n->dataplane_started) {
+        return num_packets;
+    }
+
     assert(vdev->vm_running);
 
     if (q->async_tx.elem.out_num) {
@@ -1121,39 +1222,11 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 
     while (virtqueue_pop(q->tx_vq, &elem)) {
         ssize_t ret, len;
-        unsigned int out_num = elem.out_num;
-        struct iovec *out_sg = &elem.out_sg[0];
+        unsigned int out_num;
+        struct iovec *out_sg;
         struct iovec sg[VIRTQUEUE_MAX_SIZE];
 
-        if (out_num < 1) {
-            error_report("virtio-net header not in first element");
-            exit(1);
-        }
-
-        if (n->has_vnet_hdr) {
-            if (out_sg[0].iov_len < n->guest_hdr_len) {
-                error_report("virtio-net header incorrect");
-                exit(1);
-            }
-            virtio_net_hdr_swap(vdev, (void *) out_sg[0].iov_base);
-        }
-
-        /*
-         * If host wants to see the guest header as is, we can
-         * pass it on unchanged. Otherwise, copy just the parts
-         * that host is interested in.
-         */
-        assert(n->host_hdr_len <= n->guest_hdr_len);
-        if (n->host_hdr_len != n->guest_hdr_len) {
-            unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
-                                       out_sg, out_num,
-                                       0, n->host_hdr_len);
-            sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
-                             out_sg, out_num,
-                             n->guest_hdr_len, -1);
-            out_num = sg_num;
-            out_sg = sg;
-        }
+        out_num = virtio_net_tx_prepare(n, &elem, sg, &out_sg);
 
         len = n->guest_hdr_len;
 
@@ -1521,6 +1594,11 @@ static bool virtio_net_guest_notifier_pending(VirtIODevice *vdev, int idx)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     NetClientState *nc = qemu_get_subqueue(n->nic, vq2q(idx));
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    if (n->dataplane_started) {
+        return virtio_net_data_plane_notifier_pending(n->dataplane, idx);
+    }
+#endif
     assert(n->vhost_started);
     return vhost_net_virtqueue_pending(get_vhost_net(nc->peer), idx);
 }
@@ -1530,6 +1608,12 @@ static void virtio_net_guest_notifier_mask(VirtIODevice *vdev, int idx,
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     NetClientState *nc = qemu_get_subqueue(n->nic, vq2q(idx));
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    if (n->dataplane_started) {
+        virtio_net_data_plane_notifier_mask(n->dataplane, idx, mask);
+        return;
+    }
+#endif
     assert(n->vhost_started);
     vhost_net_virtqueue_mask(get_vhost_net(nc->peer),
                              vdev, idx, mask);
@@ -1561,16 +1645,63 @@ void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
     n->netclient_type = g_strdup(type);
 }
 
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+/* Disable dataplane thread during live migration since it does not
+ * update the dirty memory bitmap yet.
+ */
+static void virtio_net_migration_state_changed(Notifier *notifier, void *data)
+{
+    VirtIONet *n = container_of(notifier, VirtIONet,
+                                migration_state_notifier);
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    MigrationState *mig = data;
+    Error *err = NULL;
+
+    if (migration_in_setup(mig)) {
+        if (!n->dataplane) {
+            return;
+        }
+        virtio_net_data_plane_destroy(n->dataplane);
+        n->dataplane = NULL;
+    } else if (migration_has_finished(mig) ||
+               migration_has_failed(mig)) {
+        if (n->dataplane) {
+            return;
+        }
+        virtio_net_data_plane_create(vdev, &n->net_conf, &n->dataplane, &err);
+        if (err != NULL) {
+            error_report("%s", error_get_pretty(err));
+            error_free(err);
+            return;
+        }
+        virtio_net_set_status(vdev, vdev->status);
+    }
+}
+#endif /* CONFIG_VIRTIO_NET_DATA_PLANE */
+
 static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIONet *n = VIRTIO_NET(dev);
     NetClientState *nc;
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    Error *err = NULL;
+#endif
     int i;
 
     virtio_init(vdev, "virtio-net", VIRTIO_ID_NET, n->config_size);
 
     n->max_queues = MAX(n->nic_conf.peers.queues, 1);
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    virtio_net_data_plane_create(vdev, &n->net_conf, &n->dataplane, &err);
+    if (err != NULL) {
+        error_propagate(errp, err);
+        virtio_cleanup(vdev);
+        return;
+    }
+    n->migration_state_notifier.notify = virtio_net_migration_state_changed;
+    add_migration_state_change_notifier(&n->migration_state_notifier);
+#endif
     n->vqs = g_malloc0(sizeof(VirtIONetQueue) * n->max_queues);
     n->vqs[0].rx_vq = virtio_add_queue(vdev, 256, virtio_net_handle_rx);
     n->curr_queues = 1;
@@ -1650,9 +1781,15 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
     VirtIONet *n = VIRTIO_NET(dev);
     int i;
 
-    /* This will stop vhost backend if appropriate. */
+    /* This will stop vhost backend or data plane if appropriate. */
     virtio_net_set_status(vdev, 0);
 
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    remove_migration_state_change_notifier(&n->migration_state_notifier);
+    virtio_net_data_plane_destroy(n->dataplane);
+    n->dataplane = NULL;
+#endif
+
     unregister_savevm(dev, "virtio-net", n);
 
     g_free(n->netclient_name);
@@ -1693,6 +1830,11 @@ static void virtio_net_instance_init(Object *obj)
      * Can be overriden with virtio_net_set_config_size.
      */
     n->config_size = sizeof(struct virtio_net_config);
+
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&n->net_conf.iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, NULL);
 }
 
 static Property virtio_net_properties[] = {
@@ -408,6 +408,15 @@ out:
     return ret;
 }
 
+/* Give back the last popped element without using it, e.g. because it is
+ * not big enough.  Elements must be given back in reverse order.
+ */
+void vring_unpop(Vring *vring, VirtQueueElement *elem)
+{
+    vring_free_element(elem);
+    vring->last_avail_idx--;
+}
+
 /* After we've used one of their buffers, we tell them about it.
  *
  * Stolen from linux/drivers/vhost/vhost.c.
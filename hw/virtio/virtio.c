@@ -66,9 +66,29 @@ typedef struct VRing
     hwaddr used;
 } VRing;
 
+/*
+ * Host mappings of the three parts of a vring.  A NULL pointer means that
+ * the part is not in RAM (or not mapped yet) and is accessed through the
+ * *_phys functions instead.
+ */
+typedef struct VRingCache
+{
+    /* Value of vring_map_generation when the rings were mapped, or 0 */
+    uint64_t generation;
+    MemoryRegion *desc_mr;
+    MemoryRegion *avail_mr;
+    MemoryRegion *used_mr;
+    VRingDesc *desc;
+    VRingAvail *avail;
+    VRingUsed *used;
+    /* Offset of the used ring in used_mr, for dirty tracking */
+    hwaddr used_offset;
+} VRingCache;
+
 struct VirtQueue
 {
     VRing vring;
+    VRingCache cache;
     hwaddr pa;
     uint16_t last_avail_idx;
     /* Last used index value we have signalled on */
@@ -91,6 +111,87 @@ struct VirtQueue
     EventNotifier host_notifier;
 };
 
+/* Incremented on every change of the memory map, making all VRingCaches
+ * stale.  They are remapped lazily on the next access to the ring.
+ */
+static uint64_t vring_map_generation = 1;
+
+static void vring_map_commit(MemoryListener *listener)
+{
+    vring_map_generation++;
+}
+
+static MemoryListener vring_map_listener = {
+    .commit = vring_map_commit,
+};
+
+static void *vring_cache_map(MemoryRegion **mr, hwaddr *offset, hwaddr pa,
+                             hwaddr len, bool is_write)
+{
+    MemoryRegionSection section = memory_region_find(get_system_memory(),
+                                                     pa, len);
+
+    if (!section.mr || int128_get64(section.size) < len) {
+        goto out;
+    }
+    if (is_write && section.readonly) {
+        goto out;
+    }
+    if (!memory_region_is_ram(section.mr)) {
+        goto out;
+    }
+
+    *mr = section.mr;
+    if (offset) {
+        *offset = section.offset_within_region;
+    }
+    return memory_region_get_ram_ptr(section.mr) + section.offset_within_region;
+
+out:
+    memory_region_unref(section.mr);
+    *mr = NULL;
+    return NULL;
+}
+
+static void vring_cache_invalidate(VirtQueue *vq)
+{
+    VRingCache *cache = &vq->cache;
+
+    memory_region_unref(cache->desc_mr);
+    memory_region_unref(cache->avail_mr);
+    memory_region_unref(cache->used_mr);
+    memset(cache, 0, sizeof(*cache));
+}
+
+static void vring_cache_update(VirtQueue *vq)
+{
+    VRingCache *cache = &vq->cache;
+    unsigned int num = vq->vring.num;
+
+    if (likely(cache->generation == vring_map_generation)) {
+        return;
+    }
+
+    vring_cache_invalidate(vq);
+    cache->generation = vring_map_generation;
+    if (!vq->vring.desc) {
+        return;
+    }
+
+    /* The event index fields are included even if the guest did not
+     * negotiate VIRTIO_RING_F_EVENT_IDX; the ring layout reserves them.
+     */
+    cache->desc = vring_cache_map(&cache->desc_mr, NULL, vq->vring.desc,
+                                  num * sizeof(VRingDesc), false);
+    cache->avail = vring_cache_map(&cache->avail_mr, NULL, vq->vring.avail,
+                                   offsetof(VRingAvail, ring[num]) +
+                                   sizeof(uint16_t), false);
+    cache->used = vring_cache_map(&cache->used_mr, &cache->used_offset,
+                                  vq->vring.used,
+                                  offsetof(VRingUsed, ring[num]) +
+                                  sizeof(uint16_t), true);
+}
+
 /* virt queue functions */
 static void virtqueue_init(VirtQueue *vq)
 {
@@ -101,58 +202,88 @@ static void virtqueue_init(VirtQueue *vq)
     vq->vring.used = vring_align(vq->vring.avail +
                                  offsetof(VRingAvail, ring[vq->vring.num]),
                                  vq->vring.align);
+    vring_cache_invalidate(vq);
 }
 
-static inline uint64_t vring_desc_addr(VirtIODevice *vdev, hwaddr desc_pa,
-                                       int i)
+/* Read descriptor i of the table at desc_pa, which is either the ring's
+ * own descriptor table or an indirect one.
+ */
+static void vring_desc_read(VirtQueue *vq, VRingDesc *desc, hwaddr desc_pa,
+                            int i)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, addr);
-    return virtio_ldq_phys(vdev, pa);
+    VirtIODevice *vdev = vq->vdev;
+
+    vring_cache_update(vq);
+    /* An indirect table may alias the ring but be larger, check the index */
+    if (desc_pa == vq->vring.desc && i < vq->vring.num && vq->cache.desc) {
+        *desc = vq->cache.desc[i];
+    } else {
+        cpu_physical_memory_read(desc_pa + sizeof(VRingDesc) * i,
+                                 desc, sizeof(VRingDesc));
+    }
+    virtio_tswap64s(vdev, &desc->addr);
+    virtio_tswap32s(vdev, &desc->len);
+    virtio_tswap16s(vdev, &desc->flags);
+    virtio_tswap16s(vdev, &desc->next);
 }
 
-static inline uint32_t vring_desc_len(VirtIODevice *vdev, hwaddr desc_pa, int i)
+static inline uint16_t vring_avail_lduw(VirtQueue *vq, hwaddr offset)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, len);
-    return virtio_ldl_phys(vdev, pa);
+    vring_cache_update(vq);
+    if (vq->cache.avail) {
+        return virtio_lduw_p(vq->vdev, (uint8_t *)vq->cache.avail + offset);
+    }
+    return virtio_lduw_phys(vq->vdev, vq->vring.avail + offset);
 }
 
-static inline uint16_t vring_desc_flags(VirtIODevice *vdev, hwaddr desc_pa,
-                                        int i)
+static inline uint16_t vring_used_lduw(VirtQueue *vq, hwaddr offset)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, flags);
-    return virtio_lduw_phys(vdev, pa);
+    vring_cache_update(vq);
+    if (vq->cache.used) {
+        return virtio_lduw_p(vq->vdev, (uint8_t *)vq->cache.used + offset);
+    }
+    return virtio_lduw_phys(vq->vdev, vq->vring.used + offset);
 }
 
-static inline uint16_t vring_desc_next(VirtIODevice *vdev, hwaddr desc_pa,
-                                       int i)
+static inline void vring_used_stw(VirtQueue *vq, hwaddr offset, uint16_t val)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, next);
-    return virtio_lduw_phys(vdev, pa);
+    vring_cache_update(vq);
+    if (vq->cache.used) {
+        virtio_stw_p(vq->vdev, (uint8_t *)vq->cache.used + offset, val);
+        memory_region_write_notify(vq->cache.used_mr,
+                                   vq->cache.used_offset + offset,
+                                   sizeof(val));
+        return;
+    }
+    virtio_stw_phys(vq->vdev, vq->vring.used + offset, val);
+}
+
+static inline void vring_used_stl(VirtQueue *vq, hwaddr offset, uint32_t val)
+{
+    vring_cache_update(vq);
+    if (vq->cache.used) {
+        virtio_stl_p(vq->vdev, (uint8_t *)vq->cache.used + offset, val);
+        memory_region_write_notify(vq->cache.used_mr,
+                                   vq->cache.used_offset + offset,
+                                   sizeof(val));
+        return;
+    }
+    virtio_stl_phys(vq->vdev, vq->vring.used + offset, val);
 }
 
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, flags);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_avail_lduw(vq, offsetof(VRingAvail, flags));
 }
 
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, idx);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_avail_lduw(vq, offsetof(VRingAvail, idx));
 }
 
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_avail_lduw(vq, offsetof(VRingAvail, ring[i]));
 }
 
 static inline uint16_t vring_used_event(VirtQueue *vq)
@@ -162,56 +293,44 @@ static inline uint16_t vring_used_event(VirtQueue *vq)
 
 static inline void vring_used_ring_id(VirtQueue *vq, int i, uint32_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].id);
-    virtio_stl_phys(vq->vdev, pa, val);
+    vring_used_stl(vq, offsetof(VRingUsed, ring[i].id), val);
 }
 
 static inline void vring_used_ring_len(VirtQueue *vq, int i, uint32_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].len);
-    virtio_stl_phys(vq->vdev, pa, val);
+    vring_used_stl(vq, offsetof(VRingUsed, ring[i].len), val);
 }
 
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_used_lduw(vq, offsetof(VRingUsed, idx));
 }
 
 static inline void vring_used_idx_set(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    virtio_stw_phys(vq->vdev, pa, val);
+    vring_used_stw(vq, offsetof(VRingUsed, idx), val);
 }
 
 static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
 {
-    VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) | mask);
+    hwaddr offset = offsetof(VRingUsed, flags);
+
+    vring_used_stw(vq, offset, vring_used_lduw(vq, offset) | mask);
 }
 
 static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
 {
-    VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) & ~mask);
+    hwaddr offset = offsetof(VRingUsed, flags);
+
+    vring_used_stw(vq, offset, vring_used_lduw(vq, offset) & ~mask);
 }
 
 static inline void vring_avail_event(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
     if (!vq->notification) {
         return;
     }
-    pa = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]);
-    virtio_stw_phys(vq->vdev, pa, val);
+    vring_used_stw(vq, offsetof(VRingUsed, ring[vq->vring.num]), val);
 }
 
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
@@ -328,18 +447,19 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     return head;
 }
 
-static unsigned virtqueue_next_desc(VirtIODevice *vdev, hwaddr desc_pa,
-                                    unsigned int i, unsigned int max)
+/* Read the descriptor that follows *desc in the chain into *desc */
+static unsigned virtqueue_next_desc(VirtQueue *vq, VRingDesc *desc,
+                                    hwaddr desc_pa, unsigned int max)
 {
     unsigned int next;
 
     /* If this descriptor says it doesn't chain, we're done. */
-    if (!(vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_NEXT)) {
+    if (!(desc->flags & VRING_DESC_F_NEXT)) {
         return max;
     }
 
     /* Check they're not leading us off end of descriptors. */
-    next = vring_desc_next(vdev, desc_pa, i);
+    next = desc->next;
     /* Make sure compiler knows to grab that: we don't want it changing! */
     smp_wmb();
 
@@ -348,6 +468,7 @@ static unsigned virtqueue_next_desc(VirtIODevice *vdev, hwaddr desc_pa,
         exit(1);
     }
 
+    vring_desc_read(vq, desc, desc_pa, next);
     return next;
 }
 
@@ -362,8 +483,8 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
 
     total_bufs = in_total = out_total = 0;
     while (virtqueue_num_heads(vq, idx)) {
-        VirtIODevice *vdev = vq->vdev;
         unsigned int max, num_bufs, indirect = 0;
+        VRingDesc desc;
         hwaddr desc_pa;
         int i;
 
@@ -371,9 +492,10 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
         num_bufs = total_bufs;
         i = virtqueue_get_head(vq, idx++);
         desc_pa = vq->vring.desc;
+        vring_desc_read(vq, &desc, desc_pa, i);
 
-        if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_INDIRECT) {
-            if (vring_desc_len(vdev, desc_pa, i) % sizeof(VRingDesc)) {
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (desc.len % sizeof(VRingDesc)) {
                 error_report("Invalid size for indirect buffer table");
                 exit(1);
             }
@@ -386,9 +508,10 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
 
             /* loop over the indirect descriptor table */
             indirect = 1;
-            max = vring_desc_len(vdev, desc_pa, i) / sizeof(VRingDesc);
-            desc_pa = vring_desc_addr(vdev, desc_pa, i);
+            max = desc.len / sizeof(VRingDesc);
+            desc_pa = desc.addr;
             num_bufs = i = 0;
+            vring_desc_read(vq, &desc, desc_pa, i);
         }
 
         do {
@@ -398,15 +521,15 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                 exit(1);
             }
 
-            if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_WRITE) {
-                in_total += vring_desc_len(vdev, desc_pa, i);
+            if (desc.flags & VRING_DESC_F_WRITE) {
+                in_total += desc.len;
             } else {
-                out_total += vring_desc_len(vdev, desc_pa, i);
+                out_total += desc.len;
             }
             if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
                 goto done;
             }
-        } while ((i = virtqueue_next_desc(vdev, desc_pa, i, max)) != max);
+        } while (virtqueue_next_desc(vq, &desc, desc_pa, max) != max);
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -458,6 +581,7 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
     unsigned int i, head, max;
     hwaddr desc_pa = vq->vring.desc;
     VirtIODevice *vdev = vq->vdev;
+    VRingDesc desc;
 
     if (!virtqueue_num_heads(vq, vq->last_avail_idx))
         return 0;
@@ -472,46 +596,48 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
         vring_avail_event(vq, vring_avail_idx(vq));
     }
 
-    if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_INDIRECT) {
-        if (vring_desc_len(vdev, desc_pa, i) % sizeof(VRingDesc)) {
+    vring_desc_read(vq, &desc, desc_pa, i);
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        if (desc.len % sizeof(VRingDesc)) {
             error_report("Invalid size for indirect buffer table");
             exit(1);
         }
 
         /* loop over the indirect descriptor table */
-        max = vring_desc_len(vdev, desc_pa, i) / sizeof(VRingDesc);
-        desc_pa = vring_desc_addr(vdev, desc_pa, i);
+        max = desc.len / sizeof(VRingDesc);
+        desc_pa = desc.addr;
         i = 0;
+        vring_desc_read(vq, &desc, desc_pa, i);
     }
 
     /* Collect all the descriptors */
     do {
         struct iovec *sg;
 
-        if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_WRITE) {
+        if (desc.flags & VRING_DESC_F_WRITE) {
             if (elem->in_num >= ARRAY_SIZE(elem->in_sg)) {
                 error_report("Too many write descriptors in indirect table");
                 exit(1);
             }
-            elem->in_addr[elem->in_num] = vring_desc_addr(vdev, desc_pa, i);
+            elem->in_addr[elem->in_num] = desc.addr;
             sg = &elem->in_sg[elem->in_num++];
         } else {
             if (elem->out_num >= ARRAY_SIZE(elem->out_sg)) {
                 error_report("Too many read descriptors in indirect table");
                 exit(1);
             }
-            elem->out_addr[elem->out_num] = vring_desc_addr(vdev, desc_pa, i);
+            elem->out_addr[elem->out_num] = desc.addr;
             sg = &elem->out_sg[elem->out_num++];
         }
 
-        sg->iov_len = vring_desc_len(vdev, desc_pa, i);
+        sg->iov_len = desc.len;
 
         /* If we've got too many, that implies a descriptor loop. */
         if ((elem->in_num + elem->out_num) > max) {
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_next_desc(vdev, desc_pa, i, max)) != max);
+    } while (virtqueue_next_desc(vq, &desc, desc_pa, max) != max);
 
     /* Now map what we have collected */
     virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
@@ -603,6 +729,7 @@ void virtio_reset(void *opaque)
         vdev->vq[i].vring.desc = 0;
         vdev->vq[i].vring.avail = 0;
         vdev->vq[i].vring.used = 0;
+        vring_cache_invalidate(&vdev->vq[i]);
         vdev->vq[i].last_avail_idx = 0;
         vdev->vq[i].pa = 0;
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
@@ -810,6 +937,7 @@ void virtio_del_queue(VirtIODevice *vdev, int n)
     }
 
     vdev->vq[n].vring.num = 0;
+    vring_cache_invalidate(&vdev->vq[n]);
 }
 
 void virtio_irq(VirtQueue *vq)
@@ -1097,6 +1225,11 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    int i;
+
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        vring_cache_invalidate(&vdev->vq[i]);
+    }
     qemu_del_vm_change_state_handler(vdev->vmstate);
     g_free(vdev->config);
     g_free(vdev->vq);
@@ -1126,7 +1259,13 @@ static void virtio_vmstate_change(void *opaque, int running, RunState state)
 void virtio_init(VirtIODevice *vdev, const char *name,
                  uint16_t device_id, size_t config_size)
 {
+    static bool vring_map_listener_registered;
     int i;
+
+    if (!vring_map_listener_registered) {
+        memory_listener_register(&vring_map_listener, &address_space_memory);
+        vring_map_listener_registered = true;
+    }
     vdev->device_id = device_id;
     vdev->status = 0;
     vdev->isr = 0;
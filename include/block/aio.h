@@ -21,6 +21,7 @@
 #include "qemu/thread.h"
 #include "qemu/rfifolock.h"
 #include "qemu/timer.h"
+#include "qapi/error.h"
 
 typedef struct BlockDriverAIOCB BlockDriverAIOCB;
 typedef void BlockDriverCompletionFunc(void *opaque, int ret);
@@ -44,6 +45,11 @@ void qemu_aio_release(void *p);
 typedef struct AioHandler AioHandler;
 typedef void QEMUBHFunc(void *opaque);
 typedef void IOHandler(void *opaque);
+/* Returns true if the handler has work to do, without blocking */
+typedef bool AioPollFn(void *opaque);
+
+/* First polling time tried once polling is found to be worthwhile */
+#define AIO_POLL_INITIAL_NS 4000
 
 struct AioContext {
     GSource source;
@@ -81,6 +87,25 @@ struct AioContext {
 
     /* TimerLists for calling timers - one per clock type */
     QEMUTimerListGroup tlg;
+
+    /* Set by aio_notify(), cleared when the notifier is handled; lets
+     * polling notice aio_notify() without reading the event notifier.
+     */
+    bool notified;
+
+    /* Adaptive polling, see aio_context_set_poll_params() */
+    int64_t poll_ns;        /* current polling time in nanoseconds */
+    int64_t poll_max_ns;    /* maximum polling time in nanoseconds */
+    int64_t poll_grow;      /* polling time growth factor */
+    int64_t poll_shrink;    /* polling time shrink factor */
+
+#ifdef CONFIG_EPOLL_CREATE1
+    /* epoll(7) state, used instead of ppoll() when there are many fds */
+    int epollfd;
+    bool epoll_enabled;
+    bool epoll_available;
+    GPollFD epoll_pfd;      /* what the GSource polls while epoll is used */
+#endif
 };
 
 /**
@@ -92,6 +117,12 @@ struct AioContext {
  */
 AioContext *aio_context_new(void);
 
+/* Set up and tear down the parts of an AioContext that depend on the host;
+ * for use by aio_context_new() and its finalizer only.
+ */
+void aio_context_setup(AioContext *ctx);
+void aio_context_destroy(AioContext *ctx);
+
 /**
  * aio_context_ref:
  * @ctx: The AioContext to operate on.
@@ -230,6 +261,16 @@ void aio_set_fd_handler(AioContext *ctx,
                         IOHandler *io_read,
                         IOHandler *io_write,
                         void *opaque);
+
+/* Add a poll function to the handler registered for @fd.  Before blocking,
+ * aio_poll() may busy-wait by calling the poll functions of all handlers;
+ * one returning true has its read callback invoked.  Polling is skipped
+ * while any handler of the context has no poll function.
+ *
+ * The handler must already be registered; registering it again with
+ * aio_set_fd_handler() keeps the poll function, removing it drops it.
+ */
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll);
 #endif
 
 /* Register an event notifier and associated callbacks.  Behaves very similarly
@@ -243,6 +284,28 @@ void aio_set_event_notifier(AioContext *ctx,
                             EventNotifier *notifier,
                             EventNotifierHandler *io_read);
 
+/* Like aio_set_fd_poll(), for an event notifier; @io_poll is called with
+ * the notifier as argument.  A no-op where polling is not supported.
+ */
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll);
+
+/**
+ * aio_context_set_poll_params:
+ * @ctx: the aio context
+ * @max_ns: how long to busy poll for, in nanoseconds; 0 disables polling
+ * @grow: polling time growth factor, 0 selects the default
+ * @shrink: polling time shrink factor, 0 selects the default
+ *
+ * The polling time adapts between 0 and @max_ns: it grows by @grow when
+ * events arrive shortly after polling gave up, and shrinks by @shrink (by
+ * default, drops to 0) when they take longer than @max_ns.
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink,
+                                 Error **errp);
+
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
  */
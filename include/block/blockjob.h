@@ -50,6 +50,12 @@ typedef struct BlockJobDriver {
      * manually.
      */
     void (*complete)(BlockJob *job, Error **errp);
+
+    /**
+     * Optional callback for job types that report more than the common
+     * fields in query-block-jobs.
+     */
+    void (*query)(BlockJob *job, BlockJobInfo *info);
 } BlockJobDriver;
 
 /**
@@ -309,6 +309,9 @@ typedef struct RAMBlock {
      */
     QTAILQ_ENTRY(RAMBlock) next;
     int fd;
+    /* Result of the last migration dirty bitmap sync, for statistics */
+    uint64_t sync_dirty_pages;
+    int64_t sync_time; /* microseconds */
 } RAMBlock;
 
 typedef struct RAMList {
@@ -604,6 +604,20 @@ bool memory_region_get_dirty(MemoryRegion *mr, hwaddr addr,
 void memory_region_set_dirty(MemoryRegion *mr, hwaddr addr,
                              hwaddr size);
 
+/**
+ * memory_region_write_notify: Account for a write to RAM through a host
+ *                             pointer.
+ *
+ * Does what a store through the memory API does after writing RAM: marks
+ * the range dirty and invalidates translated code in it.  For devices
+ * that keep a host pointer to guest memory.
+ *
+ * @mr: the memory region that was written.
+ * @addr: the address (relative to the start of the region) written to.
+ * @size: size of the range written.
+ */
+void memory_region_write_notify(MemoryRegion *mr, hwaddr addr, hwaddr size);
+
 /**
  * memory_region_test_and_clear_dirty: Check whether a range of bytes is dirty
  *                                     for a specified client. It clears them.
@@ -16,6 +16,7 @@
 
 #include "hw/virtio/virtio.h"
 #include "hw/pci/pci.h"
+#include "sysemu/iothread.h"
 
 #define TYPE_VIRTIO_NET "virtio-net-device"
 #define VIRTIO_NET(obj) \
@@ -72,6 +73,7 @@ typedef struct virtio_net_conf
     uint32_t txtimer;
     int32_t txburst;
     char *tx;
+    IOThread *iothread;
 } virtio_net_conf;
 
 /* Maximum packet size we can receive from tap device: header + 64k */
@@ -197,6 +199,11 @@ typedef struct VirtIONet {
     uint64_t curr_guest_offloads;
     QEMUTimer *announce_timer;
     int announce_counter;
+    bool dataplane_started;
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    Notifier migration_state_notifier;
+    struct VirtIONetDataPlane *dataplane;
+#endif
 } VirtIONet;
 
 #define VIRTIO_NET_CTRL_MAC    1
@@ -288,6 +295,11 @@ struct virtio_net_ctrl_mq {
     DEFINE_PROP_STRING("tx", _state, _field.tx)
 
 void virtio_net_set_config_size(VirtIONet *n, uint32_t host_features);
+int virtio_net_receive_filter(VirtIONet *n, const uint8_t *buf, int size);
+void virtio_net_receive_header(VirtIONet *n, const struct iovec *iov,
+                               int iov_cnt, const void *buf, size_t size);
+unsigned int virtio_net_tx_prepare(VirtIONet *n, VirtQueueElement *elem,
+                                   struct iovec *sg, struct iovec **out_sg);
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
                                    const char *type);
 
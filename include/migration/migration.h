@@ -18,6 +18,8 @@
 #include "qemu-common.h"
 #include "qemu/thread.h"
 #include "qemu/notify.h"
+#include "qemu/event_notifier.h"
+#include "qemu/queue.h"
 #include "qapi/error.h"
 #include "migration/vmstate.h"
 #include "qapi-types.h"
@@ -33,6 +35,58 @@
 #define QEMU_VM_SECTION_END          0x03
 #define QEMU_VM_SECTION_FULL         0x04
 #define QEMU_VM_SUBSECTION           0x05
+#define QEMU_VM_COMMAND              0x06
+
+/* Messages sent on the return path from destination to source */
+enum mig_rp_message_type {
+    MIG_RP_MSG_INVALID = 0,  /* Must be 0 */
+    MIG_RP_MSG_SHUT,         /* sibling will not send any more RP messages */
+    MIG_RP_MSG_REQ_PAGES,    /* data (start: be64, len: be32, id: string) */
+
+    MIG_RP_MSG_MAX
+};
+
+/* State of the destination side of a postcopy migration */
+typedef enum {
+    POSTCOPY_INCOMING_NONE = 0,  /* Initial state - no postcopy */
+    POSTCOPY_INCOMING_ADVISE,    /* Source may switch to postcopy */
+    POSTCOPY_INCOMING_DISCARD,   /* Discarding pages dirtied since sent */
+    POSTCOPY_INCOMING_LISTENING, /* Listen thread owns the stream */
+    POSTCOPY_INCOMING_RUNNING,   /* Guest is running on the destination */
+    POSTCOPY_INCOMING_END,       /* All pages have arrived */
+} PostcopyState;
+
+typedef struct LoadStateEntry LoadStateEntry;
+
+/* State for the incoming migration */
+typedef struct MigrationIncomingState {
+    QEMUFile *from_src_file;
+
+    /* Replies to the source, sent from the fault and listen threads */
+    QemuMutex rp_mutex;
+    QEMUFile *to_src_file;
+
+    PostcopyState postcopy_state;
+
+    bool have_fault_thread;
+    QemuThread fault_thread;
+    QemuSemaphore fault_thread_sem;
+    QemuThread listen_thread;
+    QemuSemaphore listen_thread_sem;
+
+    /* For the kernel to send us notifications */
+    int userfault_fd;
+    /* To tell the fault_thread to quit */
+    EventNotifier userfault_quit;
+    void *postcopy_tmp_page;
+
+    /* Sections started by the source, looked up by later parts */
+    QLIST_HEAD(, LoadStateEntry) loadvm_handlers;
+} MigrationIncomingState;
+
+MigrationIncomingState *migration_incoming_get_current(void);
+PostcopyState postcopy_state_get(MigrationIncomingState *mis);
+void postcopy_state_set(MigrationIncomingState *mis, PostcopyState state);
 
 struct MigrationParams {
     bool blk;
@@ -41,6 +95,16 @@ struct MigrationParams {
 
 typedef struct MigrationState MigrationState;
 
+/* Duration histogram of a MigrationPhase, see query-migrate-stats */
+#define MIGRATION_HISTOGRAM_BUCKETS 24
+
+typedef struct MigrationPhaseStat {
+    uint64_t count;
+    uint64_t total_us;
+    uint64_t max_us;
+    uint64_t buckets[MIGRATION_HISTOGRAM_BUCKETS];
+} MigrationPhaseStat;
+
 struct MigrationState
 {
     int64_t bandwidth_limit;
@@ -59,9 +123,27 @@ struct MigrationState
     int64_t dirty_pages_rate;
     int64_t dirty_bytes_rate;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
+    int parameters[MIGRATION_PARAMETER_MAX];
     int64_t xbzrle_cache_size;
     int64_t setup_time;
     int64_t dirty_sync_count;
+    int64_t dirty_sync_time;
+    /* Written by the migration thread only */
+    MigrationPhaseStat phase_stats[MIGRATION_PHASE_MAX];
+
+    /* Where the multifd channels connect to, NULL without multifd */
+    char *multifd_host_port;
+
+    /* Set by migrate-start-postcopy, read by the migration thread */
+    bool start_postcopy;
+
+    /* State of the return path from the destination */
+    struct {
+        QEMUFile *from_dst_file;
+        QemuThread rp_thread;
+        bool have_rp_thread;
+        bool error;
+    } rp_state;
 };
 
 void process_incoming_migration(QEMUFile *f);
@@ -70,6 +152,8 @@ void qemu_start_incoming_migration(const char *uri, Error **errp);
 
 uint64_t migrate_max_downtime(void);
 
+void migration_phase_record(MigrationPhase phase, int64_t ns);
+
 void do_info_migrate_print(Monitor *mon, const QObject *data);
 
 void do_info_migrate(Monitor *mon, QObject **ret_data);
@@ -90,12 +174,34 @@ void fd_start_incoming_migration(const char *path, Error **errp);
 
 void fd_start_outgoing_migration(MigrationState *s, const char *fdname, Error **errp);
 
+void file_start_incoming_migration(const char *filename, Error **errp);
+
+void file_start_outgoing_migration(MigrationState *s, const char *filename, Error **errp);
+
+#ifndef _WIN32
+int migrate_file_ram_fd(int64_t *ram_offset, int64_t *ram_size);
+#else
+static inline int migrate_file_ram_fd(int64_t *ram_offset, int64_t *ram_size)
+{
+    return -1;
+}
+#endif
+
 void rdma_start_outgoing_migration(void *opaque, const char *host_port, Error **errp);
 
 void rdma_start_incoming_migration(const char *host_port, Error **errp);
 
 void migrate_fd_error(MigrationState *s);
 
+void migrate_compress_threads_create(void);
+void migrate_compress_threads_join(void);
+void migrate_decompress_threads_create(void);
+void migrate_decompress_threads_join(void);
+void migrate_multifd_send_threads_create(void);
+void migrate_multifd_send_threads_join(void);
+void migrate_multifd_recv_threads_create(int listen_fd);
+void migrate_multifd_recv_threads_join(void);
+
 void migrate_fd_connect(MigrationState *s);
 
 int migrate_fd_close(MigrationState *s);
@@ -105,12 +211,17 @@ void remove_migration_state_change_notifier(Notifier *notify);
 bool migration_in_setup(MigrationState *);
 bool migration_has_finished(MigrationState *);
 bool migration_has_failed(MigrationState *);
+bool migration_in_postcopy(MigrationState *);
 MigrationState *migrate_get_current(void);
 
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
+uint64_t ram_file_area_size(void);
+void ram_page_stats(MigrationPageStats *stats);
 void free_xbzrle_decoded_buf(void);
+int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len);
+void ram_postcopy_send_discard_bitmap(QEMUFile *f);
 
 void acct_update_position(QEMUFile *f, size_t size, bool zero);
 
@@ -123,8 +234,12 @@ uint64_t norm_mig_pages_transferred(void);
 uint64_t xbzrle_mig_bytes_transferred(void);
 uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
+uint64_t xbzrle_mig_pages_cache_hit(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
+uint64_t xbzrle_mig_pages_cache_eviction(void);
 double xbzrle_mig_cache_miss_rate(void);
+RamBlockSyncStatsList *ram_block_sync_stats(void);
+int migration_throttle_percentage(void);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
 
@@ -146,6 +261,11 @@ bool migrate_rdma_pin_all(void);
 bool migrate_zero_blocks(void);
 
 bool migrate_auto_converge(void);
+bool migrate_postcopy_ram(void);
+
+void migrate_send_rp_shut(MigrationIncomingState *mis, uint32_t value);
+void migrate_send_rp_req_pages(MigrationIncomingState *mis, const char *rbname,
+                               ram_addr_t start, size_t len);
 
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
@@ -154,6 +274,17 @@ int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
 
+bool migrate_use_compression(void);
+int migrate_compress_level(void);
+int migrate_compress_threads(void);
+int migrate_decompress_threads(void);
+
+bool migrate_use_multifd(void);
+bool migrate_use_page_runs(void);
+int migrate_multifd_channels(void);
+
+int migrate_file_threads(void);
+
 int64_t xbzrle_cache_resize(int64_t new_size);
 
 void ram_control_before_iterate(QEMUFile *f, uint64_t flags);
@@ -47,20 +47,23 @@ void cache_fini(PageCache *cache);
 bool cache_is_cached(const PageCache *cache, uint64_t addr);
 
 /**
- * get_cached_data: Get the data cached for an addr
+ * get_cached_data: Get the data cached for an addr and mark the page
+ * as recently used
  *
  * Returns pointer to the data cached or NULL if not cached
  *
  * @cache pointer to the PageCache struct
  * @addr: page addr
  */
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr);
 
 /**
  * cache_insert: insert the page into the cache. the page cache
- * will dup the data on insert. the previous value will be overwritten
+ * will dup the data on insert. the previous value will be overwritten.
+ * If the page is not cached yet and its set is full, the least recently
+ * used page of the set is evicted.
  *
- * Returns -1 on error
+ * Returns -1 on error, 1 if another page was evicted, 0 otherwise
  *
  * @cache pointer to the PageCache struct
  * @addr: page address
@@ -69,8 +72,8 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata);
 
 /**
- * cache_resize: resize the page cache. In case of size reduction the extra
- * pages will be freed
+ * cache_resize: resize the page cache. In case of size reduction the least
+ * recently used pages will be freed
  *
  * Returns -1 on error new cache size on success
  *
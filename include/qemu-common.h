@@ -456,6 +456,12 @@ can_use_buffer_find_nonzero_offset(const void *buf, size_t len)
 }
 size_t buffer_find_nonzero_offset(const void *buf, size_t len);
 
+/*
+ * True if the host CPU and OS support AVX2 and QEMU was built with
+ * runtime-dispatched AVX2 code paths (CONFIG_AVX2_OPT).
+ */
+bool host_has_avx2(void);
+
 /*
  * helper to parse debug environment variables
  */
@@ -98,6 +98,19 @@ uint64_t hbitmap_count(const HBitmap *hb);
  */
 void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count);
 
+/**
+ * hbitmap_set_word:
+ * @hb: HBitmap to operate on.  Its granularity must be zero.
+ * @pos: Index of a word in the bottom level, i.e. the word holding bits
+ * @pos * BITS_PER_LONG to @pos * BITS_PER_LONG + BITS_PER_LONG - 1.
+ * @bits: Bits to set in that word.
+ *
+ * Set the bits in @bits in one word of the HBitmap, and return how many
+ * of them were clear before.  This is much cheaper than hbitmap_set when
+ * copying a plain bitmap into an HBitmap one word at a time.
+ */
+unsigned hbitmap_set_word(HBitmap *hb, size_t pos, unsigned long bits);
+
 /**
  * hbitmap_reset:
  * @hb: HBitmap to operate on.
@@ -117,6 +130,45 @@ void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count);
  */
 bool hbitmap_get(const HBitmap *hb, uint64_t item);
 
+/**
+ * hbitmap_merge:
+ * @a: HBitmap to operate on.
+ * @b: HBitmap whose bits are added to @a.
+ *
+ * Set in @a every bit that is set in @b.  Both bitmaps must have the same
+ * size and granularity; return false without touching @a otherwise.
+ */
+bool hbitmap_merge(HBitmap *a, const HBitmap *b);
+
+/**
+ * hbitmap_serialization_size:
+ * @hb: HBitmap to operate on.
+ *
+ * Return the number of bytes hbitmap_serialize writes for @hb.
+ */
+uint64_t hbitmap_serialization_size(const HBitmap *hb);
+
+/**
+ * hbitmap_serialize:
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer of hbitmap_serialization_size(@hb) bytes.
+ *
+ * Store the bits of @hb, one per group of 2^granularity items, in a
+ * format that does not depend on the host, e.g. to save them to disk.
+ */
+void hbitmap_serialize(const HBitmap *hb, uint8_t *buf);
+
+/**
+ * hbitmap_deserialize:
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer filled by hbitmap_serialize for a bitmap of the same size
+ * and granularity as @hb.
+ *
+ * Set the bits stored in @buf in @hb.  Bits that are already set in @hb
+ * stay set.
+ */
+void hbitmap_deserialize(HBitmap *hb, const uint8_t *buf);
+
 /**
  * hbitmap_free:
  * @hb: HBitmap to operate on.
@@ -1380,6 +1380,12 @@ void memory_region_set_dirty(MemoryRegion *mr, hwaddr addr,
     cpu_physical_memory_set_dirty_range(mr->ram_addr + addr, size);
 }
 
+void memory_region_write_notify(MemoryRegion *mr, hwaddr addr, hwaddr size)
+{
+    assert(mr->terminates);
+    invalidate_and_set_dirty(mr->ram_addr + addr, size);
+}
+
 bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
                                         hwaddr size, unsigned client)
 {
@@ -0,0 +1,236 @@
+/*
+ * QEMU live migration to and from a local file
+ *
+ * Copyright (c) 2014 The QEMU Project Developers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The file holds guest RAM at fixed offsets so that the RAM can be written
+ * by several threads in any order and mapped straight into the guest on
+ * restore.  Layout:
+ *
+ *   0                    header (MigrationFileHeader)
+ *   ram_offset           guest RAM, page N of ram_addr_t space at
+ *                        ram_offset + N * TARGET_PAGE_SIZE
+ *   stream_offset        the usual migration stream, without the pages
+ *
+ * Pages are only ever written by arch_init.c; pages that are never written
+ * stay holes, so the file is sparse.
+ */
+
+#include <fcntl.h>
+
+#include "qemu-common.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "migration/migration.h"
+#include "migration/qemu-file.h"
+
+//#define DEBUG_MIGRATION_FILE
+
+#ifdef DEBUG_MIGRATION_FILE
+#define DPRINTF(fmt, ...) \
+    do { printf("migration-file: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+#define MIGRATION_FILE_MAGIC   0x51534e50 /* "QSNP" */
+#define MIGRATION_FILE_VERSION 1
+/* Keeps the RAM area suitably aligned for mmap, even with huge pages */
+#define MIGRATION_FILE_ALIGN   (2 * 1024 * 1024)
+
+typedef struct QEMU_PACKED MigrationFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t ram_offset;
+    uint64_t ram_size;
+    uint64_t stream_offset;
+} MigrationFileHeader;
+
+typedef struct MigrationFile {
+    int fd;
+    int64_t ram_offset;
+    int64_t ram_size;
+    int64_t stream_offset;
+    /* Next stream byte to read or write, relative to stream_offset */
+    int64_t stream_pos;
+} MigrationFile;
+
+/* The file of the migration in progress, if any */
+static MigrationFile *current_file;
+
+int migrate_file_ram_fd(int64_t *ram_offset, int64_t *ram_size)
+{
+    if (!current_file) {
+        return -1;
+    }
+    *ram_offset = current_file->ram_offset;
+    *ram_size = current_file->ram_size;
+    return current_file->fd;
+}
+
+static int file_get_fd(void *opaque)
+{
+    MigrationFile *mf = opaque;
+
+    return mf->fd;
+}
+
+static int file_put_buffer(void *opaque, const uint8_t *buf, int64_t pos,
+                           int size)
+{
+    MigrationFile *mf = opaque;
+    ssize_t len;
+    int done = 0;
+
+    /* pos also counts pages written to the RAM area; use our own offset */
+    while (done < size) {
+        len = pwrite(mf->fd, buf + done, size - done,
+                     mf->stream_offset + mf->stream_pos);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        done += len;
+        mf->stream_pos += len;
+    }
+
+    return done;
+}
+
+static int file_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
+{
+    MigrationFile *mf = opaque;
+    ssize_t len;
+
+    do {
+        len = pread(mf->fd, buf, size, mf->stream_offset + mf->stream_pos);
+    } while (len < 0 && errno == EINTR);
+
+    if (len < 0) {
+        return -errno;
+    }
+    mf->stream_pos += len;
+    return len;
+}
+
+static int file_close(void *opaque)
+{
+    MigrationFile *mf = opaque;
+    int ret = 0;
+
+    DPRINTF("closing file\n");
+    if (qemu_fdatasync(mf->fd) < 0 && errno != EBADF && errno != EINVAL) {
+        ret = -errno;
+    }
+    if (close(mf->fd) < 0 && !ret) {
+        ret = -errno;
+    }
+    if (current_file == mf) {
+        current_file = NULL;
+    }
+    g_free(mf);
+    return ret;
+}
+
+static const QEMUFileOps file_write_ops = {
+    .get_fd =     file_get_fd,
+    .put_buffer = file_put_buffer,
+    .close =      file_close,
+};
+
+static const QEMUFileOps file_read_ops = {
+    .get_fd =     file_get_fd,
+    .get_buffer = file_get_buffer,
+    .close =      file_close,
+};
+
+void file_start_outgoing_migration(MigrationState *s, const char *filename,
+                                   Error **errp)
+{
+    MigrationFileHeader hdr;
+    MigrationFile *mf;
+    int fd;
+
+    fd = qemu_open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to open '%s'", filename);
+        return;
+    }
+
+    mf = g_new0(MigrationFile, 1);
+    mf->fd = fd;
+    mf->ram_offset = MIGRATION_FILE_ALIGN;
+    mf->ram_size = ram_file_area_size();
+    mf->stream_offset = ROUND_UP(mf->ram_offset + mf->ram_size,
+                                 MIGRATION_FILE_ALIGN);
+
+    hdr.magic = cpu_to_be32(MIGRATION_FILE_MAGIC);
+    hdr.version = cpu_to_be32(MIGRATION_FILE_VERSION);
+    hdr.ram_offset = cpu_to_be64(mf->ram_offset);
+    hdr.ram_size = cpu_to_be64(mf->ram_size);
+    hdr.stream_offset = cpu_to_be64(mf->stream_offset);
+    if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+        error_setg_errno(errp, errno, "failed to write '%s'", filename);
+        close(fd);
+        g_free(mf);
+        return;
+    }
+
+    DPRINTF("ram at %" PRId64 ", %" PRId64 " bytes, stream at %" PRId64 "\n",
+            mf->ram_offset, mf->ram_size, mf->stream_offset);
+    current_file = mf;
+    s->file = qemu_fopen_ops(mf, &file_write_ops);
+    migrate_fd_connect(s);
+}
+
+static void file_accept_incoming_migration(void *opaque)
+{
+    QEMUFile *f = opaque;
+
+    qemu_set_fd_handler2(qemu_get_fd(f), NULL, NULL, NULL, NULL);
+    process_incoming_migration(f);
+}
+
+void file_start_incoming_migration(const char *filename, Error **errp)
+{
+    MigrationFileHeader hdr;
+    MigrationFile *mf;
+    QEMUFile *f;
+    int fd;
+
+    fd = qemu_open(filename, O_RDONLY);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to open '%s'", filename);
+        return;
+    }
+
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        be32_to_cpu(hdr.magic) != MIGRATION_FILE_MAGIC) {
+        error_setg(errp, "'%s' is not a migration file", filename);
+        close(fd);
+        return;
+    }
+    if (be32_to_cpu(hdr.version) != MIGRATION_FILE_VERSION) {
+        error_setg(errp, "'%s': unsupported migration file version %u",
+                   filename, be32_to_cpu(hdr.version));
+        close(fd);
+        return;
+    }
+
+    mf = g_new0(MigrationFile, 1);
+    mf->fd = fd;
+    mf->ram_offset = be64_to_cpu(hdr.ram_offset);
+    mf->ram_size = be64_to_cpu(hdr.ram_size);
+    mf->stream_offset = be64_to_cpu(hdr.stream_offset);
+    current_file = mf;
+
+    /* A regular file is always readable, so this runs on the next poll */
+    f = qemu_fopen_ops(mf, &file_read_ops);
+    qemu_set_fd_handler2(fd, NULL, file_accept_incoming_migration, NULL, f);
+}
@@ -50,6 +50,10 @@ static void tcp_wait_for_connect(int fd, void *opaque)
 
 void tcp_start_outgoing_migration(MigrationState *s, const char *host_port, Error **errp)
 {
+    if (migrate_use_multifd()) {
+        /* The multifd channels connect to the same address */
+        s->multifd_host_port = g_strdup(host_port);
+    }
     inet_nonblocking_connect(host_port, tcp_wait_for_connect, s, errp);
 }
 
@@ -66,13 +70,13 @@ static void tcp_accept_incoming_migration(void *opaque)
         err = socket_error();
     } while (c < 0 && err == EINTR);
     qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
-    closesocket(s);
 
     DPRINTF("accepted migration\n");
 
     if (c < 0) {
         error_report("could not accept migration connection (%s)",
                      strerror(err));
+        closesocket(s);
         return;
     }
 
@@ -82,10 +86,18 @@ static void tcp_accept_incoming_migration(void *opaque)
         goto out;
     }
 
+    if (migrate_use_multifd()) {
+        /* The multifd threads accept the remaining connections */
+        migrate_multifd_recv_threads_create(s);
+    } else {
+        closesocket(s);
+    }
+
     process_incoming_migration(f);
     return;
 
 out:
+    closesocket(s);
     closesocket(c);
 }
 
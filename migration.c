@@ -23,6 +23,9 @@
 #include "qemu/sockets.h"
 #include "migration/block.h"
 #include "qemu/thread.h"
+#include "qemu/bswap.h"
+#include "qemu/error-report.h"
+#include "qemu/host-utils.h"
 #include "qmp-commands.h"
 #include "trace.h"
 
@@ -34,6 +37,7 @@ enum {
     MIG_STATE_CANCELLED,
     MIG_STATE_ACTIVE,
     MIG_STATE_COMPLETED,
+    MIG_STATE_POSTCOPY_ACTIVE,
 };
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration speed throttling */
@@ -46,6 +50,18 @@ enum {
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
 
+/* Default compression thread count */
+#define DEFAULT_MIGRATE_COMPRESS_THREAD_COUNT 8
+/* Default decompression thread count, usually decompression is at
+ * least 4 times as fast as compression.*/
+#define DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT 2
+/*0: means nocompress, 1: best speed, ... 9: best compress ratio */
+#define DEFAULT_MIGRATE_COMPRESS_LEVEL 1
+/* Default number of multifd connections */
+#define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+/* Default number of threads writing RAM to a file: URI */
+#define DEFAULT_MIGRATE_FILE_THREADS 4
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -60,11 +76,97 @@ MigrationState *migrate_get_current(void)
         .bandwidth_limit = MAX_THROTTLE,
         .xbzrle_cache_size = DEFAULT_MIGRATE_CACHE_SIZE,
         .mbps = -1,
+        .parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL] =
+                DEFAULT_MIGRATE_COMPRESS_LEVEL,
+        .parameters[MIGRATION_PARAMETER_COMPRESS_THREADS] =
+                DEFAULT_MIGRATE_COMPRESS_THREAD_COUNT,
+        .parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS] =
+                DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT,
+        .parameters[MIGRATION_PARAMETER_MULTIFD_CHANNELS] =
+                DEFAULT_MIGRATE_MULTIFD_CHANNELS,
+        .parameters[MIGRATION_PARAMETER_FILE_THREADS] =
+                DEFAULT_MIGRATE_FILE_THREADS,
     };
 
     return &current_migration;
 }
 
+MigrationIncomingState *migration_incoming_get_current(void)
+{
+    static bool once;
+    static MigrationIncomingState mis_current;
+
+    if (!once) {
+        mis_current.userfault_fd = -1;
+        QLIST_INIT(&mis_current.loadvm_handlers);
+        qemu_mutex_init(&mis_current.rp_mutex);
+        once = true;
+    }
+    return &mis_current;
+}
+
+PostcopyState postcopy_state_get(MigrationIncomingState *mis)
+{
+    return atomic_mb_read(&mis->postcopy_state);
+}
+
+void postcopy_state_set(MigrationIncomingState *mis, PostcopyState state)
+{
+    atomic_mb_set(&mis->postcopy_state, state);
+}
+
+/*
+ * Send a message on the return channel back to the source
+ * of the migration.
+ */
+static void migrate_send_rp_message(MigrationIncomingState *mis,
+                                    enum mig_rp_message_type message_type,
+                                    uint16_t len, const void *data)
+{
+    trace_migrate_send_rp_message((int)message_type, len);
+    qemu_mutex_lock(&mis->rp_mutex);
+    qemu_put_be16(mis->to_src_file, (unsigned int)message_type);
+    qemu_put_be16(mis->to_src_file, len);
+    qemu_put_buffer(mis->to_src_file, data, len);
+    qemu_fflush(mis->to_src_file);
+    qemu_mutex_unlock(&mis->rp_mutex);
+}
+
+/*
+ * Send a 'SHUT' message on the return channel with the given value
+ * to indicate that we've finished with the RP.  Non-0 value indicates
+ * error.
+ */
+void migrate_send_rp_shut(MigrationIncomingState *mis, uint32_t value)
+{
+    uint32_t buf;
+
+    buf = cpu_to_be32(value);
+    migrate_send_rp_message(mis, MIG_RP_MSG_SHUT, sizeof(buf), &buf);
+}
+
+/*
+ * Request pages from the source VM at the given start address.
+ *   rbname: Name of the RAMBlock to request the page in
+ *   start: Address offset within the RB
+ *   len: Length in bytes required - must be a multiple of pagesize
+ */
+void migrate_send_rp_req_pages(MigrationIncomingState *mis, const char *rbname,
+                               ram_addr_t start, size_t len)
+{
+    uint8_t bufc[12 + 1 + 255]; /* start (8), len (4), rbname upto 256 */
+    size_t msglen = 12;
+    size_t rbname_len = strlen(rbname);
+
+    assert(rbname_len < 256);
+    stq_be_p(bufc, (uint64_t)start);
+    stl_be_p(bufc + 8, (uint32_t)len);
+    bufc[msglen++] = rbname_len;
+    memcpy(bufc + msglen, rbname, rbname_len);
+    msglen += rbname_len;
+    migrate_send_rp_message(mis, MIG_RP_MSG_REQ_PAGES, msglen, bufc);
+}
+
 void qemu_start_incoming_migration(const char *uri, Error **errp)
 {
     const char *p;
@@ -82,6 +184,8 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     else if (strstart(uri, "fd:", &p))
         fd_start_incoming_migration(p, errp);
+    else if (strstart(uri, "file:", &p))
+        file_start_incoming_migration(p, errp);
 #endif
     else {
         error_setg(errp, "unknown migration protocol: %s", uri);
@@ -91,12 +195,29 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
 static void process_incoming_migration_co(void *opaque)
 {
     QEMUFile *f = opaque;
+    MigrationIncomingState *mis = migration_incoming_get_current();
     Error *local_err = NULL;
     int ret;
 
     ret = qemu_loadvm_state(f);
+
+    if (postcopy_state_get(mis) >= POSTCOPY_INCOMING_LISTENING) {
+        /*
+         * The postcopy listen thread owns the stream now; it finishes
+         * the migration on its own, and the guest is already running.
+         */
+        if (ret < 0) {
+            error_report("load of postcopy migration failed: %s",
+                         strerror(-ret));
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+
     qemu_fclose(f);
     free_xbzrle_decoded_buf();
+    migrate_decompress_threads_join();
+    migrate_multifd_recv_threads_join();
     if (ret < 0) {
         error_report("load of migration failed: %s", strerror(-ret));
         exit(EXIT_FAILURE);
@@ -125,6 +246,7 @@ void process_incoming_migration(QEMUFile *f)
     int fd = qemu_get_fd(f);
 
     assert(fd != -1);
+    migrate_decompress_threads_create();
     qemu_set_nonblock(fd);
     qemu_coroutine_enter(co, f);
 }
@@ -135,6 +257,55 @@ void process_incoming_migration(QEMUFile *f)
  * units must be in seconds */
 static uint64_t max_downtime = 300000000;
 
+/* Account ns spent in phase to the statistics of the current migration */
+void migration_phase_record(MigrationPhase phase, int64_t ns)
+{
+    MigrationPhaseStat *stat = &migrate_get_current()->phase_stats[phase];
+    uint64_t us = ns / 1000;
+    int bucket = us ? 64 - clz64(us) : 0;
+
+    stat->count++;
+    stat->total_us += us;
+    stat->max_us = MAX(stat->max_us, us);
+    stat->buckets[MIN(bucket, MIGRATION_HISTOGRAM_BUCKETS - 1)]++;
+    trace_migration_phase(MigrationPhase_lookup[phase], us);
+}
+
+MigrationDetailedStats *qmp_query_migrate_stats(Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    MigrationDetailedStats *stats = g_malloc0(sizeof(*stats));
+    MigrationPhaseStatsList **phase_next = &stats->phases;
+    int i, j;
+
+    for (i = 0; i < MIGRATION_PHASE_MAX; i++) {
+        MigrationPhaseStat *stat = &s->phase_stats[i];
+        MigrationPhaseStatsList *entry = g_malloc0(sizeof(*entry));
+        intList **bucket_next;
+
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->phase = i;
+        entry->value->count = stat->count;
+        entry->value->total = stat->total_us;
+        entry->value->max = stat->max_us;
+        bucket_next = &entry->value->histogram;
+        for (j = 0; j < MIGRATION_HISTOGRAM_BUCKETS; j++) {
+            intList *bucket = g_malloc0(sizeof(*bucket));
+
+            bucket->value = stat->buckets[j];
+            *bucket_next = bucket;
+            bucket_next = &bucket->next;
+        }
+        *phase_next = entry;
+        phase_next = &entry->next;
+    }
+
+    stats->pages = g_malloc0(sizeof(*stats->pages));
+    ram_page_stats(stats->pages);
+
+    return stats;
+}
+
 uint64_t migrate_max_downtime(void)
 {
     return max_downtime;
@@ -165,6 +336,24 @@ MigrationCapabilityStatusList *qmp_query_migrate_capabilities(Error **errp)
     return head;
 }
 
+MigrationParameters *qmp_query_migrate_parameters(Error **errp)
+{
+    MigrationParameters *params;
+    MigrationState *s = migrate_get_current();
+
+    params = g_malloc0(sizeof(*params));
+    params->compress_level = s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL];
+    params->compress_threads =
+            s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS];
+    params->decompress_threads =
+            s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
+    params->multifd_channels =
+            s->parameters[MIGRATION_PARAMETER_MULTIFD_CHANNELS];
+    params->file_threads = s->parameters[MIGRATION_PARAMETER_FILE_THREADS];
+
+    return params;
+}
+
 static void get_xbzrle_cache_stats(MigrationInfo *info)
 {
     if (migrate_use_xbzrle()) {
@@ -173,7 +362,9 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->cache_size = migrate_xbzrle_cache_size();
         info->xbzrle_cache->bytes = xbzrle_mig_bytes_transferred();
         info->xbzrle_cache->pages = xbzrle_mig_pages_transferred();
+        info->xbzrle_cache->cache_hit = xbzrle_mig_pages_cache_hit();
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
+        info->xbzrle_cache->cache_eviction = xbzrle_mig_pages_cache_eviction();
         info->xbzrle_cache->cache_miss_rate = xbzrle_mig_cache_miss_rate();
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
     }
@@ -195,8 +386,13 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         break;
     case MIG_STATE_ACTIVE:
     case MIG_STATE_CANCELLING:
+    case MIG_STATE_POSTCOPY_ACTIVE:
         info->has_status = true;
-        info->status = g_strdup("active");
+        if (s->state == MIG_STATE_POSTCOPY_ACTIVE) {
+            info->status = g_strdup("postcopy-active");
+        } else {
+            info->status = g_strdup("active");
+        }
         info->has_total_time = true;
         info->total_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME)
             - s->total_time;
@@ -217,6 +413,15 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->dirty_pages_rate = s->dirty_pages_rate;
         info->ram->mbps = s->mbps;
         info->ram->dirty_sync_count = s->dirty_sync_count;
+        info->ram->dirty_sync_time = s->dirty_sync_time;
+
+        info->has_ram_block_sync = true;
+        info->ram_block_sync = ram_block_sync_stats();
+
+        if (migrate_auto_converge()) {
+            info->has_cpu_throttle_percentage = true;
+            info->cpu_throttle_percentage = migration_throttle_percentage();
+        }
 
         if (blk_mig_active()) {
             info->has_disk = true;
@@ -251,6 +456,7 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->normal_bytes = norm_mig_bytes_transferred();
         info->ram->mbps = s->mbps;
         info->ram->dirty_sync_count = s->dirty_sync_count;
+        info->ram->dirty_sync_time = s->dirty_sync_time;
         break;
     case MIG_STATE_ERROR:
         info->has_status = true;
@@ -270,14 +476,112 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
 {
     MigrationState *s = migrate_get_current();
     MigrationCapabilityStatusList *cap;
+    bool new_caps[MIGRATION_CAPABILITY_MAX];
 
-    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP) {
+    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP ||
+        s->state == MIG_STATE_POSTCOPY_ACTIVE) {
         error_set(errp, QERR_MIGRATION_ACTIVE);
         return;
     }
 
+    memcpy(new_caps, s->enabled_capabilities, sizeof(new_caps));
     for (cap = params; cap; cap = cap->next) {
-        s->enabled_capabilities[cap->value->capability] = cap->value->state;
+        new_caps[cap->value->capability] = cap->value->state;
+    }
+
+    /* Compressed pages are sent on the main stream only */
+    if (new_caps[MIGRATION_CAPABILITY_COMPRESS] &&
+        new_caps[MIGRATION_CAPABILITY_MULTIFD]) {
+        error_setg(errp, "Compression can't be used with multifd");
+        return;
+    }
+
+    memcpy(s->enabled_capabilities, new_caps, sizeof(new_caps));
+}
+
+void qmp_migrate_start_postcopy(Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (!migrate_postcopy_ram()) {
+        error_setg(errp, "Enable postcopy with migrate_set_capability before"
+                         " the start of migration");
+        return;
+    }
+
+    if (s->state == MIG_STATE_NONE) {
+        error_setg(errp, "Postcopy must be started after migration has been"
+                         " started");
+        return;
+    }
+    /*
+     * we don't error if migration has finished since that would be racy
+     * with issuing this command.
+     */
+    atomic_set(&s->start_postcopy, true);
+}
+
+void qmp_migrate_set_parameters(bool has_compress_level,
+                                int64_t compress_level,
+                                bool has_compress_threads,
+                                int64_t compress_threads,
+                                bool has_decompress_threads,
+                                int64_t decompress_threads,
+                                bool has_multifd_channels,
+                                int64_t multifd_channels,
+                                bool has_file_threads,
+                                int64_t file_threads, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (has_compress_level && (compress_level < 0 || compress_level > 9)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress_level",
+                  "is invalid, it should be in the range of 0 to 9");
+        return;
+    }
+    if (has_compress_threads &&
+            (compress_threads < 1 || compress_threads > 255)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE,
+                  "compress_threads",
+                  "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_decompress_threads &&
+            (decompress_threads < 1 || decompress_threads > 255)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE,
+                  "decompress_threads",
+                  "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_multifd_channels &&
+            (multifd_channels < 1 || multifd_channels > 64)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE,
+                  "multifd_channels",
+                  "is invalid, it should be in the range of 1 to 64");
+        return;
+    }
+    if (has_file_threads && (file_threads < 1 || file_threads > 64)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE,
+                  "file_threads",
+                  "is invalid, it should be in the range of 1 to 64");
+        return;
+    }
+
+    if (has_compress_level) {
+        s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL] = compress_level;
+    }
+    if (has_compress_threads) {
+        s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS] = compress_threads;
+    }
+    if (has_decompress_threads) {
+        s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS] =
+                                                    decompress_threads;
+    }
+    if (has_multifd_channels) {
+        s->parameters[MIGRATION_PARAMETER_MULTIFD_CHANNELS] = multifd_channels;
+    }
+    if (has_file_threads) {
+        s->parameters[MIGRATION_PARAMETER_FILE_THREADS] = file_threads;
     }
 }
 
@@ -303,11 +607,16 @@ static void migrate_fd_cleanup(void *opaque)
         qemu_thread_join(&s->thread);
         qemu_mutex_lock_iothread();
 
+        migrate_compress_threads_join();
+        migrate_multifd_send_threads_join();
         qemu_fclose(s->file);
         s->file = NULL;
     }
+    g_free(s->multifd_host_port);
+    s->multifd_host_port = NULL;
 
     assert(s->state != MIG_STATE_ACTIVE);
+    assert(s->state != MIG_STATE_POSTCOPY_ACTIVE);
 
     if (s->state != MIG_STATE_COMPLETED) {
         qemu_savevm_state_cancel();
@@ -368,21 +677,29 @@ bool migration_has_failed(MigrationState *s)
             s->state == MIG_STATE_ERROR);
 }
 
+bool migration_in_postcopy(MigrationState *s)
+{
+    return s->state == MIG_STATE_POSTCOPY_ACTIVE;
+}
+
 static MigrationState *migrate_init(const MigrationParams *params)
 {
     MigrationState *s = migrate_get_current();
     int64_t bandwidth_limit = s->bandwidth_limit;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size = s->xbzrle_cache_size;
+    int parameters[MIGRATION_PARAMETER_MAX];
 
     memcpy(enabled_capabilities, s->enabled_capabilities,
            sizeof(enabled_capabilities));
+    memcpy(parameters, s->parameters, sizeof(parameters));
 
     memset(s, 0, sizeof(*s));
     s->params = *params;
     memcpy(s->enabled_capabilities, enabled_capabilities,
            sizeof(enabled_capabilities));
     s->xbzrle_cache_size = xbzrle_cache_size;
+    memcpy(s->parameters, parameters, sizeof(s->parameters));
 
     s->bandwidth_limit = bandwidth_limit;
     s->state = MIG_STATE_SETUP;
@@ -417,11 +734,37 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     params.shared = has_inc && inc;
 
     if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP ||
-        s->state == MIG_STATE_CANCELLING) {
+        s->state == MIG_STATE_CANCELLING ||
+        s->state == MIG_STATE_POSTCOPY_ACTIVE) {
         error_set(errp, QERR_MIGRATION_ACTIVE);
         return;
     }
 
+    if (params.blk && migrate_postcopy_ram()) {
+        error_setg(errp, "Block migration can't be used with postcopy");
+        return;
+    }
+
+    if (migrate_use_multifd()) {
+        if (migrate_postcopy_ram()) {
+            error_setg(errp, "Multifd can't be used with postcopy");
+            return;
+        }
+        if (migrate_use_compression()) {
+            error_setg(errp, "Multifd can't be used with compression");
+            return;
+        }
+        if (!strstart(uri, "tcp:", NULL)) {
+            error_setg(errp, "Multifd requires a tcp: migration URI");
+            return;
+        }
+    }
+
+    if (strstart(uri, "file:", NULL) && migrate_postcopy_ram()) {
+        error_setg(errp, "Postcopy can't be used with a file: migration URI");
+        return;
+    }
+
     if (runstate_check(RUN_STATE_INMIGRATE)) {
         error_setg(errp, "Guest is waiting for an incoming migration");
         return;
@@ -451,6 +794,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
 #endif
     } else {
         error_set(errp, QERR_INVALID_PARAMETER_VALUE, "uri", "a valid migration protocol");
@@ -547,6 +892,15 @@ bool migrate_auto_converge(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_AUTO_CONVERGE];
 }
 
+bool migrate_postcopy_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_RAM];
+}
+
 bool migrate_zero_blocks(void)
 {
     MigrationState *s;
@@ -574,8 +928,308 @@ int64_t migrate_xbzrle_cache_size(void)
     return s->xbzrle_cache_size;
 }
 
+bool migrate_use_compression(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS];
+}
+
+int migrate_compress_level(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL];
+}
+
+int migrate_compress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS];
+}
+
+int migrate_decompress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
+}
+
+bool migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD];
+}
+
+bool migrate_use_page_runs(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_PAGE_RUNS];
+}
+
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_MULTIFD_CHANNELS];
+}
+
+int migrate_file_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_FILE_THREADS];
+}
+
 /* migration thread support */
 
+/*
+ * Something bad happened to the RP stream, mark an error
+ * The caller shall print something to indicate why
+ */
+static void source_return_path_bad(MigrationState *s)
+{
+    s->rp_state.error = true;
+}
+
+/*
+ * Handles messages sent on the return path towards the source VM
+ */
+static void *source_return_path_thread(void *opaque)
+{
+    MigrationState *ms = opaque;
+    QEMUFile *rp = ms->rp_state.from_dst_file;
+    uint16_t header_len, header_type;
+    uint8_t buf[512];
+    uint32_t sibling_error;
+    ram_addr_t start;
+    size_t len;
+    char *rbname;
+    int res;
+
+    trace_source_return_path_thread_entry();
+    while (!ms->rp_state.error && !qemu_file_get_error(rp)) {
+        trace_source_return_path_thread_loop_top();
+        header_type = qemu_get_be16(rp);
+        header_len = qemu_get_be16(rp);
+
+        if (header_type >= MIG_RP_MSG_MAX ||
+            header_type == MIG_RP_MSG_INVALID) {
+            error_report("RP: Received invalid message 0x%04x length 0x%04x",
+                    header_type, header_len);
+            source_return_path_bad(ms);
+            goto out;
+        }
+        if (header_len > sizeof(buf)) {
+            error_report("RP: Received message 0x%04x with bad length 0x%04x",
+                    header_type, header_len);
+            source_return_path_bad(ms);
+            goto out;
+        }
+
+        /* We know we've got a valid header by this point */
+        res = qemu_get_buffer(rp, buf, header_len);
+        if (res != header_len) {
+            error_report("RP: Failed reading data for message 0x%04x"
+                         " read %d expected %d",
+                         header_type, res, header_len);
+            source_return_path_bad(ms);
+            goto out;
+        }
+
+        /* OK, we have the message and the data */
+        switch (header_type) {
+        case MIG_RP_MSG_SHUT:
+            if (header_len != sizeof(sibling_error)) {
+                error_report("RP: Bad SHUT message length %d", header_len);
+                source_return_path_bad(ms);
+                goto out;
+            }
+            sibling_error = ldl_be_p(buf);
+            trace_source_return_path_thread_shut(sibling_error);
+            if (sibling_error) {
+                error_report("RP: Sibling indicated error %d", sibling_error);
+                source_return_path_bad(ms);
+            }
+            /*
+             * We'll let the main thread deal with closing the RP
+             * we could do a shutdown(2) on it, but we're the only user
+             * anyway, so there's nothing gained.
+             */
+            goto out;
+
+        case MIG_RP_MSG_REQ_PAGES:
+            if (header_len < 13 || header_len < 13 + buf[12]) {
+                error_report("RP: Bad REQ_PAGES message length %d",
+                             header_len);
+                source_return_path_bad(ms);
+                goto out;
+            }
+            start = ldq_be_p(buf);
+            len = ldl_be_p(buf + 8);
+            rbname = (char *)buf + 13;
+            rbname[buf[12]] = '\0';
+            if (ram_save_queue_pages(rbname, start, len)) {
+                source_return_path_bad(ms);
+                goto out;
+            }
+            break;
+
+        default:
+            break;
+        }
+    }
+    if (qemu_file_get_error(rp)) {
+        trace_source_return_path_thread_bad_end();
+        source_return_path_bad(ms);
+    }
+
+out:
+    trace_source_return_path_thread_end();
+    return NULL;
+}
+
+static int open_return_path_on_source(MigrationState *ms)
+{
+    ms->rp_state.from_dst_file = qemu_file_get_return_path(ms->file);
+    if (!ms->rp_state.from_dst_file) {
+        return -1;
+    }
+
+    qemu_thread_create(&ms->rp_state.rp_thread, "return path",
+                       source_return_path_thread, ms, QEMU_THREAD_JOINABLE);
+    ms->rp_state.have_rp_thread = true;
+
+    return 0;
+}
+
+/* Returns 0 if the RP was ok, otherwise there was an error on the RP */
+static int await_return_path_close_on_source(MigrationState *ms)
+{
+    if (!ms->rp_state.have_rp_thread) {
+        return 0;
+    }
+
+    /*
+     * If this is a normal exit then the destination will send a SHUT and the
+     * rp_thread will exit, however if there's an error we need to cause
+     * it to exit.
+     */
+    if (ms->state != MIG_STATE_POSTCOPY_ACTIVE ||
+        qemu_file_get_error(ms->file)) {
+        qemu_file_shutdown(ms->rp_state.from_dst_file);
+        source_return_path_bad(ms);
+    }
+
+    qemu_thread_join(&ms->rp_state.rp_thread);
+    ms->rp_state.have_rp_thread = false;
+    qemu_fclose(ms->rp_state.from_dst_file);
+    ms->rp_state.from_dst_file = NULL;
+
+    return ms->rp_state.error;
+}
+
+/*
+ * Switch from precopy to postcopy mode: stop the guest, tell the
+ * destination which pages it has to drop and send it the device state,
+ * after which it starts running.  The remaining RAM follows in the
+ * background, and on demand when the destination faults on it.
+ */
+static int postcopy_start(MigrationState *ms, bool *old_vm_running)
+{
+    GByteArray *data;
+    QEMUFile *fb;
+    int ret;
+
+    if (open_return_path_on_source(ms)) {
+        error_report("Unable to open return path for postcopy; only tcp and"
+                     " unix migration support it");
+        migrate_set_state(ms, MIG_STATE_ACTIVE, MIG_STATE_ERROR);
+        return -1;
+    }
+
+    trace_postcopy_start();
+    qemu_mutex_lock_iothread();
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+    *old_vm_running = runstate_is_running();
+
+    ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+    if (ret < 0) {
+        migrate_set_state(ms, MIG_STATE_ACTIVE, MIG_STATE_ERROR);
+        goto out;
+    }
+
+    migrate_set_state(ms, MIG_STATE_ACTIVE, MIG_STATE_POSTCOPY_ACTIVE);
+    if (ms->state != MIG_STATE_POSTCOPY_ACTIVE) {
+        /* Cancelled while we were stopping the guest */
+        ret = -1;
+        goto out;
+    }
+
+    /*
+     * Every page still dirty has to be fetched from us, so the
+     * destination must drop its stale copy of it.
+     */
+    ram_postcopy_send_discard_bitmap(ms->file);
+
+    /*
+     * The device state travels as one package, which the destination
+     * loads from memory while its listen thread takes over the stream
+     * to receive the pages the devices may need during the load.
+     */
+    data = g_byte_array_new();
+    fb = qemu_bufopen("w", data);
+    qemu_savevm_send_postcopy_listen(fb);
+    qemu_savevm_state_devices(fb);
+    qemu_savevm_send_postcopy_run(fb);
+    qemu_put_byte(fb, QEMU_VM_EOF);
+    qemu_fflush(fb);
+
+    ret = qemu_savevm_send_packaged(ms->file, data->data, data->len);
+    qemu_fclose(fb);
+    g_byte_array_free(data, true);
+
+    /*
+     * The destination may be running the guest from here on, so the
+     * source must not be restarted whatever happens next.
+     */
+    *old_vm_running = false;
+
+    /* Outstanding pages are needed as fast as possible */
+    qemu_file_set_rate_limit(ms->file, INT64_MAX);
+
+    if (!ret) {
+        ret = qemu_file_get_error(ms->file);
+    }
+    if (ret) {
+        error_report("postcopy_start: Migration stream errored");
+        migrate_set_state(ms, MIG_STATE_POSTCOPY_ACTIVE, MIG_STATE_ERROR);
+    }
+
+out:
+    qemu_mutex_unlock_iothread();
+    return ret;
+}
+
 static void *migration_thread(void *opaque)
 {
     MigrationState *s = opaque;
@@ -585,26 +1239,61 @@ static void *migration_thread(void *opaque)
     int64_t max_size = 0;
     int64_t start_time = initial_time;
     bool old_vm_running = false;
+    /* The state we expect to be in while the migration is making progress */
+    int current_active_state = MIG_STATE_ACTIVE;
+    int64_t write_time = 0;
 
     qemu_savevm_state_begin(s->file, &s->params);
+    if (migrate_postcopy_ram()) {
+        /* Let the destination check it can do postcopy before any page */
+        qemu_savevm_send_postcopy_advise(s->file);
+    }
 
     s->setup_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) - setup_start;
     migrate_set_state(s, MIG_STATE_SETUP, MIG_STATE_ACTIVE);
 
-    while (s->state == MIG_STATE_ACTIVE) {
+    while (s->state == MIG_STATE_ACTIVE ||
+           s->state == MIG_STATE_POSTCOPY_ACTIVE) {
         int64_t current_time;
         uint64_t pending_size;
 
         if (!qemu_file_rate_limit(s->file)) {
             pending_size = qemu_savevm_state_pending(s->file, max_size);
             trace_migrate_pending(pending_size, max_size);
-            if (pending_size && pending_size >= max_size) {
+            if (current_active_state == MIG_STATE_POSTCOPY_ACTIVE) {
+                if (pending_size) {
+                    qemu_savevm_state_iterate(s->file);
+                } else {
+                    qemu_mutex_lock_iothread();
+                    qemu_savevm_state_complete_postcopy(s->file);
+                    qemu_mutex_unlock_iothread();
+
+                    if (!qemu_file_get_error(s->file) &&
+                        !await_return_path_close_on_source(s)) {
+                        migrate_set_state(s, MIG_STATE_POSTCOPY_ACTIVE,
+                                          MIG_STATE_COMPLETED);
+                        break;
+                    }
+                    migrate_set_state(s, MIG_STATE_POSTCOPY_ACTIVE,
+                                      MIG_STATE_ERROR);
+                    break;
+                }
+            } else if (pending_size && pending_size >= max_size) {
+                if (atomic_read(&s->start_postcopy)) {
+                    start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+                    if (!postcopy_start(s, &old_vm_running)) {
+                        current_active_state = MIG_STATE_POSTCOPY_ACTIVE;
+                    }
+                    continue;
+                }
                 qemu_savevm_state_iterate(s->file);
             } else {
+                int64_t stop_start;
                 int ret;
 
                 qemu_mutex_lock_iothread();
                 start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+                stop_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
                 qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
                 old_vm_running = runstate_is_running();
 
@@ -612,6 +1301,8 @@ static void *migration_thread(void *opaque)
                 if (ret >= 0) {
                     qemu_file_set_rate_limit(s->file, INT64_MAX);
                     qemu_savevm_state_complete(s->file);
+                    migration_phase_record(MIGRATION_PHASE_STOP_COPY,
+                        qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - stop_start);
                 }
                 qemu_mutex_unlock_iothread();
 
@@ -627,10 +1318,16 @@ static void *migration_thread(void *opaque)
             }
         }
 
-        if (qemu_file_get_error(s->file)) {
-            migrate_set_state(s, MIG_STATE_ACTIVE, MIG_STATE_ERROR);
+        if (qemu_file_get_error(s->file) || s->rp_state.error) {
+            migrate_set_state(s, current_active_state, MIG_STATE_ERROR);
             break;
         }
+        if (qemu_file_get_write_time(s->file) != write_time) {
+            migration_phase_record(MIGRATION_PHASE_STREAM_WRITE,
+                                   qemu_file_get_write_time(s->file) -
+                                   write_time);
+            write_time = qemu_file_get_write_time(s->file);
+        }
         current_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
         if (current_time >= initial_time + BUFFER_DELAY) {
             uint64_t transferred_bytes = qemu_ftell(s->file) - initial_bytes;
@@ -659,6 +1356,8 @@ static void *migration_thread(void *opaque)
         }
     }
 
+    await_return_path_close_on_source(s);
+
     qemu_mutex_lock_iothread();
     if (s->state == MIG_STATE_COMPLETED) {
         int64_t end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
@@ -696,6 +1395,8 @@ void migrate_fd_connect(MigrationState *s)
     /* Notify before starting migration thread */
     notifier_list_notify(&migration_state_notifiers, s);
 
+    migrate_compress_threads_create();
+    migrate_multifd_send_threads_create();
     qemu_thread_create(&s->thread, "migration", migration_thread, s,
                        QEMU_THREAD_JOINABLE);
 }
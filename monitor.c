@@ -2861,6 +2861,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show current migration capabilities",
         .mhandler.cmd = hmp_info_migrate_capabilities,
     },
+    {
+        .name       = "migrate_parameters",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show current migration parameters",
+        .mhandler.cmd = hmp_info_migrate_parameters,
+    },
     {
         .name       = "migrate_cache_size",
         .args_type  = "",
@@ -2868,6 +2875,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show current migration xbzrle cache size",
         .mhandler.cmd = hmp_info_migrate_cache_size,
     },
+    {
+        .name       = "migrate_stats",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show detailed migration statistics",
+        .mhandler.cmd = hmp_info_migrate_stats,
+    },
     {
         .name       = "balloon",
         .args_type  = "",
@@ -4553,6 +4567,24 @@ void migrate_set_capability_completion(ReadLineState *rs, int nb_args,
     }
 }
 
+void migrate_set_parameter_completion(ReadLineState *rs, int nb_args,
+                                      const char *str)
+{
+    size_t len;
+
+    len = strlen(str);
+    readline_set_completion_index(rs, len);
+    if (nb_args == 2) {
+        int i;
+        for (i = 0; i < MIGRATION_PARAMETER_MAX; i++) {
+            const char *name = MigrationParameter_lookup[i];
+            if (!strncmp(str, name, len)) {
+                readline_add_completion(rs, name);
+            }
+        }
+    }
+}
+
 void host_net_add_completion(ReadLineState *rs, int nb_args, const char *str)
 {
     int i;
@@ -450,6 +450,51 @@ void qemu_set_vnet_hdr_len(NetClientState *nc, int len)
     nc->info->set_vnet_hdr_len(nc, len);
 }
 
+bool qemu_can_set_net_aio_context(NetClientState *nc)
+{
+    return nc && nc->info->set_aio_context;
+}
+
+/*
+ * Moves the fd handlers of @nc to @ctx, or back to the main loop if @ctx is
+ * NULL.  The device that owns the peer of @nc must make sure that nothing
+ * else sends packets from or to @nc while it runs in @ctx.
+ */
+void qemu_set_net_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    if (!nc || !nc->info->set_aio_context) {
+        return;
+    }
+
+    nc->info->set_aio_context(nc, ctx);
+}
+
+/*
+ * Installs the fd handlers of a backend in the main loop or in the
+ * AioContext of @nc.  An AioContext has no equivalent of @fd_read_poll, so
+ * there @fd_read is called whenever @fd is readable; backends stop reading
+ * when qemu_send_packet_async() queues a packet and resume in its callback.
+ */
+void qemu_set_net_fd_handler(NetClientState *nc, int fd,
+                             IOCanReadHandler *fd_read_poll,
+                             IOHandler *fd_read,
+                             IOHandler *fd_write,
+                             void *opaque)
+{
+#ifdef CONFIG_POSIX
+    AioContext *ctx = nc->aio_context;
+
+    if (ctx) {
+        aio_context_acquire(ctx);
+        aio_set_fd_handler(ctx, fd, fd_read, fd_write, opaque);
+        aio_context_release(ctx);
+        return;
+    }
+#endif
+
+    qemu_set_fd_handler2(fd, fd_read_poll, fd_read, fd_write, opaque);
+}
+
 int qemu_can_send_packet(NetClientState *sender)
 {
     if (!sender->peer) {
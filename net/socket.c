@@ -46,6 +46,7 @@ typedef struct NetSocketState {
     IOHandler *send_fn;           /* differs between SOCK_STREAM/SOCK_DGRAM */
     bool read_poll;               /* waiting to receive data? */
     bool write_poll;              /* waiting to transmit data? */
+    QEMUBH *accept_bh;            /* waits for a new connection (listen) */
 } NetSocketState;
 
 static void net_socket_accept(void *opaque);
@@ -61,11 +62,11 @@ static int net_socket_can_send(void *opaque)
 
 static void net_socket_update_fd_handler(NetSocketState *s)
 {
-    qemu_set_fd_handler2(s->fd,
-                         s->read_poll  ? net_socket_can_send : NULL,
-                         s->read_poll  ? s->send_fn : NULL,
-                         s->write_poll ? net_socket_writable : NULL,
-                         s);
+    qemu_set_net_fd_handler(&s->nc, s->fd,
+                            s->read_poll  ? net_socket_can_send : NULL,
+                            s->read_poll  ? s->send_fn : NULL,
+                            s->write_poll ? net_socket_writable : NULL,
+                            s);
 }
 
 static void net_socket_read_poll(NetSocketState *s, bool enable)
@@ -80,6 +81,15 @@ static void net_socket_write_poll(NetSocketState *s, bool enable)
     net_socket_update_fd_handler(s);
 }
 
+static void net_socket_send_completed(NetClientState *nc, ssize_t len)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+
+    if (s->fd >= 0) {
+        net_socket_read_poll(s, true);
+    }
+}
+
 static void net_socket_writable(void *opaque)
 {
     NetSocketState *s = opaque;
@@ -161,7 +171,12 @@ static void net_socket_send(void *opaque)
         net_socket_read_poll(s, false);
         net_socket_write_poll(s, false);
         if (s->listen_fd != -1) {
-            qemu_set_fd_handler(s->listen_fd, net_socket_accept, NULL, s);
+            /* Main loop fd handlers can't be changed from an AioContext */
+            if (s->nc.aio_context) {
+                qemu_bh_schedule(s->accept_bh);
+            } else {
+                qemu_set_fd_handler(s->listen_fd, net_socket_accept, NULL, s);
+            }
         }
         closesocket(s->fd);
 
@@ -211,7 +226,10 @@ static void net_socket_send(void *opaque)
             buf += l;
             size -= l;
             if (s->index >= s->packet_len) {
-                qemu_send_packet(&s->nc, s->buf, s->packet_len);
+                if (qemu_send_packet_async(&s->nc, s->buf, s->packet_len,
+                                           net_socket_send_completed) == 0) {
+                    net_socket_read_poll(s, false);
+                }
                 s->index = 0;
                 s->state = 0;
             }
@@ -234,7 +252,10 @@ static void net_socket_send_dgram(void *opaque)
         net_socket_write_poll(s, false);
         return;
     }
-    qemu_send_packet(&s->nc, s->buf, size);
+    if (qemu_send_packet_async(&s->nc, s->buf, size,
+                               net_socket_send_completed) == 0) {
+        net_socket_read_poll(s, false);
+    }
 }
 
 static int net_socket_mcast_create(struct sockaddr_in *mcastaddr, struct in_addr *localaddr)
@@ -336,13 +357,37 @@ static void net_socket_cleanup(NetClientState *nc)
         closesocket(s->listen_fd);
         s->listen_fd = -1;
     }
+    if (s->accept_bh) {
+        qemu_bh_delete(s->accept_bh);
+        s->accept_bh = NULL;
+    }
+}
+
+#ifdef CONFIG_POSIX
+static void net_socket_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+    /* Until it is connected, a stream socket stays in the main loop */
+    bool connected = s->fd >= 0 && s->send_fn;
+
+    if (connected) {
+        qemu_set_net_fd_handler(nc, s->fd, NULL, NULL, NULL, NULL);
+    }
+    nc->aio_context = ctx;
+    if (connected) {
+        net_socket_update_fd_handler(s);
+    }
 }
+#endif
 
 static NetClientInfo net_dgram_socket_info = {
     .type = NET_CLIENT_OPTIONS_KIND_SOCKET,
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive_dgram,
     .cleanup = net_socket_cleanup,
+#ifdef CONFIG_POSIX
+    .set_aio_context = net_socket_set_aio_context,
+#endif
 };
 
 static NetSocketState *net_socket_fd_init_dgram(NetClientState *peer,
@@ -416,6 +461,9 @@ err:
 static void net_socket_connect(void *opaque)
 {
     NetSocketState *s = opaque;
+
+    /* From now on the fd may be polled in an AioContext */
+    qemu_set_fd_handler(s->fd, NULL, NULL, NULL);
     s->send_fn = net_socket_send;
     net_socket_read_poll(s, true);
 }
@@ -425,6 +473,9 @@ static NetClientInfo net_socket_info = {
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive,
     .cleanup = net_socket_cleanup,
+#ifdef CONFIG_POSIX
+    .set_aio_context = net_socket_set_aio_context,
+#endif
 };
 
 static NetSocketState *net_socket_fd_init_stream(NetClientState *peer,
@@ -507,6 +558,15 @@ static void net_socket_accept(void *opaque)
              inet_ntoa(saddr.sin_addr), ntohs(saddr.sin_port));
 }
 
+static void net_socket_accept_bh(void *opaque)
+{
+    NetSocketState *s = opaque;
+
+    if (s->listen_fd != -1 && s->fd == -1) {
+        qemu_set_fd_handler(s->listen_fd, net_socket_accept, NULL, s);
+    }
+}
+
 static int net_socket_listen_init(NetClientState *peer,
                                   const char *model,
                                   const char *name,
@@ -547,6 +607,7 @@ static int net_socket_listen_init(NetClientState *peer,
     s->fd = -1;
     s->listen_fd = fd;
     s->nc.link_down = true;
+    s->accept_bh = qemu_bh_new(net_socket_accept_bh, s);
 
     qemu_set_fd_handler(s->listen_fd, net_socket_accept, NULL, s);
     return 0;
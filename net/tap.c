@@ -67,11 +67,11 @@ static void tap_writable(void *opaque);
 
 static void tap_update_fd_handler(TAPState *s)
 {
-    qemu_set_fd_handler2(s->fd,
-                         s->read_poll && s->enabled ? tap_can_send : NULL,
-                         s->read_poll && s->enabled ? tap_send     : NULL,
-                         s->write_poll && s->enabled ? tap_writable : NULL,
-                         s);
+    qemu_set_net_fd_handler(&s->nc, s->fd,
+                            s->read_poll && s->enabled ? tap_can_send : NULL,
+                            s->read_poll && s->enabled ? tap_send     : NULL,
+                            s->write_poll && s->enabled ? tap_writable : NULL,
+                            s);
 }
 
 static void tap_read_poll(TAPState *s, bool enable)
@@ -190,7 +190,9 @@ static void tap_send(void *opaque)
     TAPState *s = opaque;
     int size;
 
-    while (qemu_can_send_packet(&s->nc)) {
+    /* tap_can_send() is not polled in an AioContext; read anyway and let
+     * the packet be queued, which stops reading until tap_send_completed() */
+    while (s->nc.aio_context || qemu_can_send_packet(&s->nc)) {
         uint8_t *buf = s->buf;
 
         size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
@@ -213,6 +215,15 @@ static void tap_send(void *opaque)
     }
 }
 
+static void tap_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+
+    qemu_set_net_fd_handler(nc, s->fd, NULL, NULL, NULL, NULL);
+    nc->aio_context = ctx;
+    tap_update_fd_handler(s);
+}
+
 static bool tap_has_ufo(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -323,6 +334,7 @@ static NetClientInfo net_tap_info = {
     .using_vnet_hdr = tap_using_vnet_hdr,
     .set_offload = tap_set_offload,
     .set_vnet_hdr_len = tap_set_vnet_hdr_len,
+    .set_aio_context = tap_set_aio_context,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
@@ -33,6 +33,14 @@
     do { } while (0)
 #endif
 
+/*
+ * The cache is PAGE_CACHE_WAYS-way set associative: a page may live in
+ * any way of the set selected by its page number.  On a miss the least
+ * recently used way of the set is replaced, so two hot pages that map to
+ * the same set no longer evict each other.
+ */
+#define PAGE_CACHE_WAYS 4
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
@@ -45,6 +53,8 @@ struct PageCache {
     CacheItem *page_cache;
     unsigned int page_size;
     int64_t max_num_items;
+    int64_t num_sets;
+    unsigned int num_ways;
     uint64_t max_item_age;
     int64_t num_items;
 };
@@ -75,8 +85,11 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     cache->num_items = 0;
     cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->num_ways = MIN(num_pages, PAGE_CACHE_WAYS);
+    cache->num_sets = num_pages / cache->num_ways;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %" PRId64 " (%" PRId64 " sets of %u)\n",
+            cache->max_num_items, cache->num_sets, cache->num_ways);
 
     /* We prefer not to abort if there is no memory */
     cache->page_cache = g_try_malloc((cache->max_num_items) *
@@ -112,55 +125,88 @@ void cache_fini(PageCache *cache)
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+/* Return the first way of the set @address maps to */
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t address)
 {
-    size_t pos;
+    size_t set;
 
-    g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+    g_assert(cache->num_sets);
+    set = (address / cache->page_size) & (cache->num_sets - 1);
+    return &cache->page_cache[set * cache->num_ways];
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr)
+static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set;
+    unsigned int i;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
+    set = cache_get_set(cache, addr);
+    for (i = 0; i < cache->num_ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
 
-    return (cache->page_cache[pos].it_addr == addr);
+    return NULL;
 }
 
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+/*
+ * Pick the way to store a new page @addr in: a free way of its set, or
+ * else the least recently used one.
+ */
+static CacheItem *cache_get_victim(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
-
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    CacheItem *set, *victim;
+    unsigned int i;
+
+    set = cache_get_set(cache, addr);
+    victim = &set[0];
+    for (i = 0; i < cache->num_ways; i++) {
+        if (!set[i].it_data) {
+            return &set[i];
+        }
+        if (set[i].it_age < victim->it_age) {
+            victim = &set[i];
+        }
+    }
 
-    pos = cache_get_cache_pos(cache, addr);
+    return victim;
+}
 
-    return &cache->page_cache[pos];
+bool cache_is_cached(const PageCache *cache, uint64_t addr)
+{
+    return cache_get_by_addr(cache, addr) != NULL;
 }
 
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    if (!it) {
+        return NULL;
+    }
+
+    it->it_age = ++cache->max_item_age;
+    return it->it_data;
 }
 
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
 {
 
     CacheItem *it = NULL;
+    int ret = 0;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
     /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
+    if (!it) {
+        it = cache_get_victim(cache, addr);
+    }
 
     /* allocate page */
     if (!it->it_data) {
@@ -170,6 +216,9 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
             return -1;
         }
         cache->num_items++;
+    } else if (it->it_addr != addr) {
+        DPRINTF("Evicting %" PRIx64 " for %" PRIx64 "\n", it->it_addr, addr);
+        ret = 1;
     }
 
     memcpy(it->it_data, pdata, cache->page_size);
@@ -177,7 +226,7 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
     it->it_age = ++cache->max_item_age;
     it->it_addr = addr;
 
-    return 0;
+    return ret;
 }
 
 int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
@@ -205,12 +254,15 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
         return -1;
     }
 
-    /* move all data from old cache */
+    /*
+     * Move all data from the old cache.  When a set of the new cache
+     * overflows, the least recently used pages are dropped, so a shrink
+     * keeps the hot part of the working set.
+     */
     for (i = 0; i < cache->max_num_items; i++) {
         old_it = &cache->page_cache[i];
         if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
+            new_it = cache_get_victim(new_cache, old_it->it_addr);
             if (new_it->it_data && new_it->it_age >= old_it->it_age) {
                 /* keep the MRU page */
                 g_free(old_it->it_data);
@@ -229,6 +281,8 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
     g_free(cache->page_cache);
     cache->page_cache = new_cache->page_cache;
     cache->max_num_items = new_cache->max_num_items;
+    cache->num_sets = new_cache->num_sets;
+    cache->num_ways = new_cache->num_ways;
     cache->num_items = new_cache->num_items;
 
     g_free(new_cache);
@@ -0,0 +1,516 @@
+/*
+ * Postcopy migration for RAM
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * Postcopy is a migration technique where the execution flips from the
+ * source to the destination before all the data has been copied.
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "qemu-common.h"
+#include "migration/migration.h"
+#include "migration/postcopy-ram.h"
+#include "sysemu/sysemu.h"
+#include "qemu/error-report.h"
+#include "exec/cpu-all.h"
+#include "trace.h"
+
+/* Postcopy needs to detect accesses to pages that haven't yet been copied
+ * across, and efficiently map new pages in, the techniques for doing this
+ * are target OS specific.
+ */
+#if defined(__linux__)
+
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <asm/types.h> /* for __u64 */
+#endif
+
+#if defined(__linux__) && defined(__NR_userfaultfd)
+#include <linux/userfaultfd.h>
+
+static bool ufd_version_check(int ufd)
+{
+    struct uffdio_api api_struct;
+    uint64_t ioctl_mask;
+
+    api_struct.api = UFFD_API;
+    api_struct.features = 0;
+    if (ioctl(ufd, UFFDIO_API, &api_struct)) {
+        error_report("postcopy_ram_supported_by_host: UFFDIO_API failed: %s",
+                     strerror(errno));
+        return false;
+    }
+
+    ioctl_mask = (__u64)1 << _UFFDIO_REGISTER |
+                 (__u64)1 << _UFFDIO_UNREGISTER;
+    if ((api_struct.ioctls & ioctl_mask) != ioctl_mask) {
+        error_report("Missing userfault features: %" PRIx64,
+                     (uint64_t)(~api_struct.ioctls & ioctl_mask));
+        return false;
+    }
+
+    return true;
+}
+
+bool postcopy_ram_supported_by_host(void)
+{
+    long pagesize = getpagesize();
+    RAMBlock *block;
+    int ufd = -1;
+    bool ret = false;
+
+    if (TARGET_PAGE_SIZE != pagesize) {
+        error_report("Target page size (%d) doesn't match host page size "
+                     "(%ld)", TARGET_PAGE_SIZE, pagesize);
+        goto out;
+    }
+
+    /* Pages of file backed RAM can't be dropped and refilled atomically */
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (block->fd >= 0) {
+            error_report("Postcopy doesn't support file backed RAM (%s)",
+                         block->idstr);
+            goto out;
+        }
+    }
+
+    ufd = syscall(__NR_userfaultfd, O_CLOEXEC);
+    if (ufd == -1) {
+        error_report("%s: userfaultfd not available: %s", __func__,
+                     strerror(errno));
+        goto out;
+    }
+
+    /* Version and features check */
+    if (!ufd_version_check(ufd)) {
+        goto out;
+    }
+
+    ret = true;
+out:
+    if (ufd != -1) {
+        close(ufd);
+    }
+    return ret;
+}
+
+/*
+ * Huge pages would populate the neighbours of a page that is written
+ * before its neighbours arrive, which then never fault; keep them off
+ * for as long as the destination may receive postcopy pages.
+ */
+int postcopy_ram_incoming_init(MigrationIncomingState *mis)
+{
+    RAMBlock *block;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        qemu_madvise(block->host, block->length, QEMU_MADV_NOHUGEPAGE);
+    }
+
+    return 0;
+}
+
+int postcopy_ram_discard_range(MigrationIncomingState *mis,
+                               const char *block_name,
+                               uint64_t start, uint64_t length)
+{
+    RAMBlock *block;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (!strncmp(block_name, block->idstr, sizeof(block->idstr))) {
+            break;
+        }
+    }
+    if (!block) {
+        error_report("postcopy_ram_discard_range: Unknown RAMBlock '%s'",
+                     block_name);
+        return -1;
+    }
+
+    if (start > block->length || length > block->length - start ||
+        (start | length) & ~TARGET_PAGE_MASK) {
+        error_report("postcopy_ram_discard_range: Bad range %s "
+                     "%" PRIx64 "+%" PRIx64, block_name, start, length);
+        return -1;
+    }
+
+    trace_postcopy_ram_discard_range(block_name, start, length);
+    if (qemu_madvise(block->host + start, length, QEMU_MADV_DONTNEED)) {
+        error_report("postcopy_ram_discard_range: MADV_DONTNEED failed: %s",
+                     strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * At the end of migration, undo the effects of init_range
+ */
+static int cleanup_range(MigrationIncomingState *mis, RAMBlock *block)
+{
+    struct uffdio_range range_struct;
+
+    /*
+     * We turned off hugepage for the precopy stage with postcopy enabled
+     * we can turn it back on now.
+     */
+    qemu_madvise(block->host, block->length, QEMU_MADV_HUGEPAGE);
+
+    /*
+     * We can also turn off userfault now since we should have all the
+     * pages.   It can be useful to leave it on to debug postcopy
+     * if you're not sure it's always getting every page.
+     */
+    range_struct.start = (uintptr_t)block->host;
+    range_struct.len = block->length;
+
+    if (ioctl(mis->userfault_fd, UFFDIO_UNREGISTER, &range_struct)) {
+        error_report("%s: userfault unregister %s", __func__,
+                     strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * At the end of a migration where postcopy_ram_incoming_init was called.
+ */
+int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
+{
+    RAMBlock *block;
+
+    trace_postcopy_ram_incoming_cleanup_entry();
+
+    if (mis->have_fault_thread) {
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            if (cleanup_range(mis, block)) {
+                return -1;
+            }
+        }
+        /* Tell the fault_thread to exit */
+        event_notifier_set(&mis->userfault_quit);
+        qemu_thread_join(&mis->fault_thread);
+        trace_postcopy_ram_incoming_cleanup_join();
+        event_notifier_cleanup(&mis->userfault_quit);
+        close(mis->userfault_fd);
+        mis->userfault_fd = -1;
+        mis->have_fault_thread = false;
+    }
+
+    if (mis->postcopy_tmp_page) {
+        munmap(mis->postcopy_tmp_page, getpagesize());
+        mis->postcopy_tmp_page = NULL;
+    }
+    trace_postcopy_ram_incoming_cleanup_exit();
+    return 0;
+}
+
+/* Find the RAMBlock holding @addr; the list doesn't change while incoming */
+static RAMBlock *postcopy_find_block(void *addr, ram_addr_t *offset)
+{
+    RAMBlock *block;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if ((uint8_t *)addr >= block->host &&
+            (uint8_t *)addr - block->host < block->length) {
+            *offset = (uint8_t *)addr - block->host;
+            return block;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Handle faults detected by the USERFAULT markings
+ */
+static void *postcopy_ram_fault_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    struct uffd_msg msg;
+    int ret;
+    RAMBlock *rb;
+    ram_addr_t rb_offset;
+
+    trace_postcopy_ram_fault_thread_entry();
+    while (true) {
+        struct pollfd pfd[2];
+
+        /*
+         * We're mainly waiting for the kernel to give us a faulting HVA,
+         * however we can be told to quit via userfault_quit.
+         */
+        pfd[0].fd = mis->userfault_fd;
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+        pfd[1].fd = event_notifier_get_fd(&mis->userfault_quit);
+        pfd[1].events = POLLIN; /* Waiting for eventfd to go positive */
+        pfd[1].revents = 0;
+
+        if (poll(pfd, 2, -1 /* Wait forever */) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("%s: userfault poll: %s", __func__, strerror(errno));
+            break;
+        }
+
+        if (pfd[1].revents) {
+            trace_postcopy_ram_fault_thread_quit();
+            break;
+        }
+
+        ret = read(mis->userfault_fd, &msg, sizeof(msg));
+        if (ret != sizeof(msg)) {
+            if (errno == EAGAIN) {
+                /*
+                 * if a wake up happens on the other thread just after
+                 * the poll, there is nothing to read.
+                 */
+                continue;
+            }
+            if (ret < 0) {
+                error_report("%s: Failed to read full userfault message: %s",
+                             __func__, strerror(errno));
+                break;
+            } else {
+                error_report("%s: Read %d bytes from userfaultfd expected %zd",
+                             __func__, ret, sizeof(msg));
+                break; /* Lost alignment, don't know what we'd read next */
+            }
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT) {
+            error_report("%s: Read unexpected event %u from userfaultfd",
+                         __func__, msg.event);
+            continue; /* It's not a page fault, shouldn't happen */
+        }
+
+        rb = postcopy_find_block((void *)(uintptr_t)msg.arg.pagefault.address,
+                                 &rb_offset);
+        if (!rb) {
+            error_report("postcopy_ram_fault_thread: Fault outside guest: %"
+                         PRIx64, (uint64_t)msg.arg.pagefault.address);
+            break;
+        }
+
+        rb_offset &= TARGET_PAGE_MASK;
+        trace_postcopy_ram_fault_thread_request(msg.arg.pagefault.address,
+                                                rb->idstr, rb_offset);
+
+        /*
+         * Send the request to the source - we want to request one
+         * of our host page sizes (which is >= TPS)
+         */
+        migrate_send_rp_req_pages(mis, rb->idstr, rb_offset,
+                                  TARGET_PAGE_SIZE);
+    }
+    trace_postcopy_ram_fault_thread_exit();
+    return NULL;
+}
+
+int postcopy_ram_enable_notify(MigrationIncomingState *mis)
+{
+    RAMBlock *block;
+
+    /* Open the fd for the kernel to give us userfaults */
+    mis->userfault_fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (mis->userfault_fd == -1) {
+        error_report("%s: Failed to open userfault fd: %s", __func__,
+                     strerror(errno));
+        return -1;
+    }
+
+    /*
+     * Although the host check already tested the API, we need to
+     * do the check again as an ABI handshake on the new fd.
+     */
+    if (!ufd_version_check(mis->userfault_fd)) {
+        close(mis->userfault_fd);
+        mis->userfault_fd = -1;
+        return -1;
+    }
+
+    /* Now an eventfd we use to tell the fault-thread to quit */
+    if (event_notifier_init(&mis->userfault_quit, false)) {
+        error_report("%s: Opening userfault_quit_fd: %s", __func__,
+                     strerror(errno));
+        close(mis->userfault_fd);
+        mis->userfault_fd = -1;
+        return -1;
+    }
+
+    /* Mark so that we get notified of accesses to unwritten areas */
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        struct uffdio_register reg_struct;
+
+        reg_struct.range.start = (uintptr_t)block->host;
+        reg_struct.range.len = block->length;
+        reg_struct.mode = UFFDIO_REGISTER_MODE_MISSING;
+
+        /* Now tell our userfault_fd that it's responsible for this area */
+        if (ioctl(mis->userfault_fd, UFFDIO_REGISTER, &reg_struct)) {
+            error_report("%s userfault register: %s", __func__,
+                         strerror(errno));
+            return -1;
+        }
+        if (!(reg_struct.ioctls & ((__u64)1 << _UFFDIO_COPY))) {
+            error_report("%s userfault: Region doesn't support COPY",
+                         __func__);
+            return -1;
+        }
+    }
+
+    qemu_thread_create(&mis->fault_thread, "postcopy/fault",
+                       postcopy_ram_fault_thread, mis, QEMU_THREAD_JOINABLE);
+    mis->have_fault_thread = true;
+
+    return 0;
+}
+
+/*
+ * Place a host page (from) at (host) atomically
+ * returns 0 on success
+ */
+int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from)
+{
+    struct uffdio_copy copy_struct;
+
+    copy_struct.dst = (uint64_t)(uintptr_t)host;
+    copy_struct.src = (uint64_t)(uintptr_t)from;
+    copy_struct.len = getpagesize();
+    copy_struct.mode = 0;
+
+    /* copy also acks to the kernel waking the stalled thread up */
+    if (ioctl(mis->userfault_fd, UFFDIO_COPY, &copy_struct)) {
+        int e = errno;
+
+        if (e == EEXIST) {
+            /* Already there, e.g. a page the guest wrote itself */
+            return 0;
+        }
+        error_report("%s: %s copy host: %p from: %p",
+                     __func__, strerror(e), host, from);
+        return -e;
+    }
+
+    trace_postcopy_place_page(host);
+    return 0;
+}
+
+/*
+ * Place a zero page at (host) atomically
+ * returns 0 on success
+ */
+int postcopy_place_page_zero(MigrationIncomingState *mis, void *host)
+{
+    struct uffdio_zeropage zero_struct;
+
+    zero_struct.range.start = (uint64_t)(uintptr_t)host;
+    zero_struct.range.len = getpagesize();
+    zero_struct.mode = 0;
+
+    if (ioctl(mis->userfault_fd, UFFDIO_ZEROPAGE, &zero_struct)) {
+        int e = errno;
+
+        if (e == EEXIST) {
+            return 0;
+        }
+        error_report("%s: %s zero host: %p",
+                     __func__, strerror(e), host);
+        return -e;
+    }
+
+    trace_postcopy_place_page_zero(host);
+    return 0;
+}
+
+/*
+ * Returns a target page of memory that can be mapped at a later point in time
+ * using postcopy_place_page
+ * The same address is used repeatedly, postcopy_place_page just takes the
+ * backing page away.
+ * Returns: Pointer to allocated page
+ *
+ */
+void *postcopy_get_tmp_page(MigrationIncomingState *mis)
+{
+    if (!mis->postcopy_tmp_page) {
+        mis->postcopy_tmp_page = mmap(NULL, getpagesize(),
+                             PROT_READ | PROT_WRITE, MAP_PRIVATE |
+                             MAP_ANONYMOUS, -1, 0);
+        if (mis->postcopy_tmp_page == MAP_FAILED) {
+            mis->postcopy_tmp_page = NULL;
+            error_report("%s: %s", __func__, strerror(errno));
+            return NULL;
+        }
+    }
+
+    return mis->postcopy_tmp_page;
+}
+
+#else
+/* No target OS support, stubs just fail */
+bool postcopy_ram_supported_by_host(void)
+{
+    error_report("%s: No OS support", __func__);
+    return false;
+}
+
+int postcopy_ram_incoming_init(MigrationIncomingState *mis)
+{
+    error_report("postcopy_ram_incoming_init: No OS support");
+    return -1;
+}
+
+int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
+{
+    assert(0);
+    return -1;
+}
+
+int postcopy_ram_discard_range(MigrationIncomingState *mis,
+                               const char *block_name,
+                               uint64_t start, uint64_t length)
+{
+    assert(0);
+    return -1;
+}
+
+int postcopy_ram_enable_notify(MigrationIncomingState *mis)
+{
+    assert(0);
+    return -1;
+}
+
+int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from)
+{
+    assert(0);
+    return -1;
+}
+
+int postcopy_place_page_zero(MigrationIncomingState *mis, void *host)
+{
+    assert(0);
+    return -1;
+}
+
+void *postcopy_get_tmp_page(MigrationIncomingState *mis)
+{
+    assert(0);
+    return NULL;
+}
+
+#endif
@@ -1,13 +1,17 @@
+#include <zlib.h>
 #include "qemu-common.h"
 #include "qemu/iov.h"
+#include "qemu/error-report.h"
 #include "qemu/sockets.h"
+#include "qemu/timer.h"
 #include "block/coroutine.h"
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
 #include "trace.h"
 
 #define IO_BUF_SIZE 32768
-#define MAX_IOV_SIZE MIN(IOV_MAX, 64)
+/* Enough for a bufferful of page headers, each followed by its page */
+#define MAX_IOV_SIZE MIN(IOV_MAX, 256)
 
 struct QEMUFile {
     const QEMUFileOps *ops;
@@ -26,6 +30,7 @@ struct QEMUFile {
     unsigned int iovcnt;
 
     int last_error;
+    int64_t write_time; /* ns spent in put_buffer/writev_buffer */
 };
 
 typedef struct QEMUFileStdio {
@@ -90,6 +95,49 @@ static int socket_close(void *opaque)
     return 0;
 }
 
+static int socket_shutdown(void *opaque)
+{
+    QEMUFileSocket *s = opaque;
+
+    if (shutdown(s->fd, SHUT_RDWR)) {
+        return -socket_error();
+    }
+    return 0;
+}
+
+static const QEMUFileOps socket_read_ops;
+static const QEMUFileOps socket_write_ops;
+
+/*
+ * Give a QEMUFile on a duplicate of the socket that runs in the opposite
+ * direction, so that the two ends can be closed independently.
+ */
+static QEMUFile *socket_get_return_path(void *opaque)
+{
+    QEMUFileSocket *forward = opaque;
+    QEMUFileSocket *reverse;
+    int fd;
+
+    if (qemu_file_get_error(forward->file)) {
+        /* If the forward file is in error, don't try to open a return */
+        return NULL;
+    }
+
+    fd = dup(forward->fd);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    reverse = g_malloc0(sizeof(QEMUFileSocket));
+    reverse->fd = fd;
+    if (forward->file->ops == &socket_write_ops) {
+        reverse->file = qemu_fopen_ops(reverse, &socket_read_ops);
+    } else {
+        reverse->file = qemu_fopen_ops(reverse, &socket_write_ops);
+    }
+    return reverse->file;
+}
+
 static int stdio_get_fd(void *opaque)
 {
     QEMUFileStdio *s = opaque;
@@ -337,13 +385,17 @@ QEMUFile *qemu_fdopen(int fd, const char *mode)
 static const QEMUFileOps socket_read_ops = {
     .get_fd =     socket_get_fd,
     .get_buffer = socket_get_buffer,
-    .close =      socket_close
+    .close =      socket_close,
+    .get_return_path = socket_get_return_path,
+    .shut_down =  socket_shutdown
 };
 
 static const QEMUFileOps socket_write_ops = {
     .get_fd =     socket_get_fd,
     .writev_buffer = socket_writev_buffer,
-    .close =      socket_close
+    .close =      socket_close,
+    .get_return_path = socket_get_return_path,
+    .shut_down =  socket_shutdown
 };
 
 bool qemu_file_mode_is_not_valid(const char *mode)
@@ -403,6 +455,75 @@ fail:
     return NULL;
 }
 
+typedef struct QEMUBuffer {
+    GByteArray *data;
+    QEMUFile *file;
+} QEMUBuffer;
+
+static int buf_put_buffer(void *opaque, const uint8_t *buf,
+                          int64_t pos, int size)
+{
+    QEMUBuffer *s = opaque;
+
+    g_byte_array_append(s->data, buf, size);
+    return size;
+}
+
+static int buf_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
+{
+    QEMUBuffer *s = opaque;
+
+    if (pos >= s->data->len) {
+        return 0;
+    }
+    size = MIN(size, s->data->len - pos);
+    memcpy(buf, s->data->data + pos, size);
+    return size;
+}
+
+static int buf_close(void *opaque)
+{
+    QEMUBuffer *s = opaque;
+
+    g_free(s);
+    return 0;
+}
+
+static const QEMUFileOps buf_read_ops = {
+    .get_buffer = buf_get_buffer,
+    .close =      buf_close
+};
+
+static const QEMUFileOps buf_write_ops = {
+    .put_buffer = buf_put_buffer,
+    .close =      buf_close
+};
+
+/*
+ * Open a QEMUFile on a memory buffer.  In "w" mode the data is appended to
+ * @data, in "r" mode it is read from the start of @data.  The caller keeps
+ * ownership of @data, which must outlive the QEMUFile.
+ */
+QEMUFile *qemu_bufopen(const char *mode, GByteArray *data)
+{
+    QEMUBuffer *s;
+
+    if (mode == NULL || (mode[0] != 'r' && mode[0] != 'w') || mode[1] != 0) {
+        error_report("qemu_bufopen: Argument validity check failed");
+        return NULL;
+    }
+
+    s = g_malloc0(sizeof(QEMUBuffer));
+    s->data = data;
+
+    if (mode[0] == 'r') {
+        s->file = qemu_fopen_ops(s, &buf_read_ops);
+    } else {
+        s->file = qemu_fopen_ops(s, &buf_write_ops);
+    }
+    return s->file;
+}
+
 QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops)
 {
     QEMUFile *f;
@@ -438,6 +559,30 @@ static inline bool qemu_file_is_writable(QEMUFile *f)
     return f->ops->writev_buffer || f->ops->put_buffer;
 }
 
+/*
+ * Result: QEMUFile* for a 'return path' for comms in the opposite direction
+ *         NULL if not available
+ */
+QEMUFile *qemu_file_get_return_path(QEMUFile *f)
+{
+    if (!f->ops->get_return_path) {
+        return NULL;
+    }
+    return f->ops->get_return_path(f->opaque);
+}
+
+/*
+ * Shut down the transport underneath @f, waking up any thread blocked on
+ * it.  Returns -ENOSYS if the transport cannot do that.
+ */
+int qemu_file_shutdown(QEMUFile *f)
+{
+    if (!f->ops->shut_down) {
+        return -ENOSYS;
+    }
+    return f->ops->shut_down(f->opaque);
+}
+
 /**
  * Flushes QEMUFile buffer
  *
@@ -447,11 +592,13 @@ static inline bool qemu_file_is_writable(QEMUFile *f)
 void qemu_fflush(QEMUFile *f)
 {
     ssize_t ret = 0;
+    int64_t start;
 
     if (!qemu_file_is_writable(f)) {
         return;
     }
 
+    start = get_clock();
     if (f->ops->writev_buffer) {
         if (f->iovcnt > 0) {
             ret = f->ops->writev_buffer(f->opaque, f->iov, f->iovcnt, f->pos);
@@ -461,6 +608,7 @@ void qemu_fflush(QEMUFile *f)
             ret = f->ops->put_buffer(f->opaque, f->buf, f->pos, f->buf_index);
         }
     }
+    f->write_time += get_clock() - start;
     if (ret >= 0) {
         f->pos += ret;
     }
@@ -833,6 +981,20 @@ void qemu_file_reset_rate_limit(QEMUFile *f)
     f->bytes_xfer = 0;
 }
 
+/* Count data sent outside of f, e.g. on a multifd channel, against the
+ * rate limit of f.
+ */
+void qemu_file_acct_rate_limit(QEMUFile *f, int64_t len)
+{
+    f->bytes_xfer += len;
+}
+
+/* Total time, in nanoseconds, spent writing out the data buffered in f */
+int64_t qemu_file_get_write_time(QEMUFile *f)
+{
+    return f->write_time;
+}
+
 void qemu_put_be16(QEMUFile *f, unsigned int v)
 {
     qemu_put_byte(f, v >> 8);
@@ -878,3 +1040,42 @@ uint64_t qemu_get_be64(QEMUFile *f)
     v |= qemu_get_be32(f);
     return v;
 }
+
+/* compress size bytes of data start at p with specific compression
+ * level and store the compressed data to the buffer of f.
+ *
+ * Returns the number of bytes added to f, or 0 if the data did not fit
+ * or could not be compressed.
+ */
+ssize_t qemu_put_compression_data(QEMUFile *f, const uint8_t *p, size_t size,
+                                  int level)
+{
+    uLongf blen = IO_BUF_SIZE - f->buf_index - sizeof(int32_t);
+
+    if (blen < compressBound(size)) {
+        return 0;
+    }
+    if (compress2(f->buf + f->buf_index + sizeof(int32_t), &blen,
+                  (Bytef *)p, size, level) != Z_OK) {
+        error_report("Compress Failed!");
+        return 0;
+    }
+    qemu_put_be32(f, blen);
+    f->buf_index += blen;
+    return blen + sizeof(int32_t);
+}
+
+/* Put the data in the buffer of f_src to the buffer of f_des, and
+ * then reset the buf_index of f_src to 0.
+ */
+int qemu_put_qemu_file(QEMUFile *f_des, QEMUFile *f_src)
+{
+    int len = 0;
+
+    if (f_src->buf_index > 0) {
+        len = f_src->buf_index;
+        qemu_put_buffer(f_des, f_src->buf, f_src->buf_index);
+        f_src->buf_index = 0;
+    }
+    return len;
+}
@@ -31,6 +31,7 @@
 #include "sysemu/sysemu.h"
 #include "block/block_int.h"
 #include "block/qapi.h"
+#include "qemu/timer.h"
 #include <getopt.h>
 #include <glib.h>
 
@@ -138,6 +139,9 @@ static void QEMU_NORETURN help(void)
            "  '--output' takes the format in which the output must be done (human or json)\n"
            "  '-n' skips the target volume creation (useful if the volume is created\n"
            "       prior to running qemu-img)\n"
+           "  '-m' number of parallel requests of convert (1 to 16, default 8)\n"
+           "  '-R' maximum size in bytes of a single convert request\n"
+           "  '-W' allows convert to write out of order\n"
            "\n"
            "Parameters to check subcommand:\n"
            "  '-r' tries to repair any inconsistencies that are found during the check.\n"
@@ -145,6 +149,13 @@ static void QEMU_NORETURN help(void)
            "       kinds of errors, with a higher risk of choosing the wrong fix or\n"
            "       hiding corruption that has already occurred.\n"
            "\n"
+           "Parameters to bench subcommand:\n"
+           "  '-c' number of requests to send (default 75000)\n"
+           "  '-d' number of requests in flight at the same time (default 64)\n"
+           "  '-r' uses random offsets instead of sequential ones\n"
+           "  '-s' size of each request in bytes (default 4k)\n"
+           "  '-w' sends write requests instead of read requests\n"
+           "\n"
            "Parameters to snapshot subcommand:\n"
            "  'snapshot' is the name of the snapshot to create, apply or delete\n"
            "  '-a' applies a snapshot (revert disk to saved state)\n"
@@ -1174,19 +1185,438 @@ out3:
     return ret;
 }
 
+#define CONVERT_MAX_COROUTINES    16
+#define CONVERT_DEFAULT_COROUTINES 8
+
+enum ImgConvertBlockStatus {
+    BLK_DATA,
+    BLK_ZERO,
+    BLK_BACKING_FILE,
+};
+
+/*
+ * State of a conversion.  The source is split into chunks of at most
+ * buf_sectors (or exactly one cluster when compressing) in order; up to
+ * num_coroutines coroutines each take the next chunk, read it and write it,
+ * so that several reads and writes are in flight at any time.  Unless
+ * wr_in_order is false, the writes are still issued in the order of the
+ * chunks.
+ */
+typedef struct ImgConvertState {
+    BlockDriverState **src;
+    int64_t *src_sectors;
+    int src_num;
+    int64_t total_sectors;
+    int64_t allocated_sectors;
+    int64_t allocated_done;
+    int64_t sector_num;
+    int64_t sector_next_status;
+    int64_t wr_offs;
+    enum ImgConvertBlockStatus status;
+    BlockDriverState *target;
+    bool has_zero_init;
+    bool target_has_backing;
+    bool wr_in_order;
+    bool compressed;
+    int min_sparse;
+    int cluster_sectors;
+    int buf_sectors;
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[CONVERT_MAX_COROUTINES];
+    int64_t wait_sector_num[CONVERT_MAX_COROUTINES];
+    CoMutex lock;
+    int ret;
+} ImgConvertState;
+
+static void convert_select_part(ImgConvertState *s, int64_t sector_num,
+                                int *src_cur, int64_t *src_cur_offset)
+{
+    *src_cur = 0;
+    *src_cur_offset = 0;
+    while (sector_num - *src_cur_offset >= s->src_sectors[*src_cur]) {
+        *src_cur_offset += s->src_sectors[*src_cur];
+        (*src_cur)++;
+        assert(*src_cur < s->src_num);
+    }
+}
+
+/*
+ * Returns the length of the chunk starting at sector_num and sets s->status
+ * to what has to be done with it, or a negative errno value.
+ */
+static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
+{
+    int64_t src_cur_offset;
+    int src_cur;
+    int ret, n;
+
+    assert(s->total_sectors > sector_num);
+
+    if (s->compressed) {
+        /* Compressed clusters are written whole, even across sources */
+        s->status = BLK_DATA;
+        return MIN(s->total_sectors - sector_num, s->cluster_sectors);
+    }
+
+    convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+    n = MIN(s->total_sectors - sector_num, INT_MAX);
+    n = MIN(n, s->src_sectors[src_cur] - (sector_num - src_cur_offset));
+
+    if (!s->has_zero_init && !s->target_has_backing) {
+        /* Everything has to be written */
+        s->status = BLK_DATA;
+        s->sector_next_status = sector_num + n;
+    } else if (s->sector_next_status <= sector_num) {
+        ret = bdrv_get_block_status(s->src[src_cur],
+                                    sector_num - src_cur_offset, n, &n);
+        if (ret < 0) {
+            return ret;
+        }
+
+        /* If the output image is being created as a copy on write image,
+         * sectors which are unallocated in the input image are present in
+         * both the output's and input's base images.  If it is zero
+         * initialized instead, zero areas of the input need no write. */
+        if (s->target_has_backing && !(ret & BDRV_BLOCK_DATA)) {
+            s->status = BLK_BACKING_FILE;
+        } else if (!s->target_has_backing && (ret & BDRV_BLOCK_ZERO)) {
+            s->status = BLK_ZERO;
+        } else {
+            s->status = BLK_DATA;
+        }
+
+        /* avoid redundant callouts to get_block_status */
+        s->sector_next_status = sector_num + n;
+    }
+
+    n = MIN(n, s->sector_next_status - sector_num);
+    if (s->status == BLK_DATA) {
+        n = MIN(n, s->buf_sectors);
+    }
+
+    /* Round down request length to an aligned sector, but do not bother
+     * doing this on short requests.  They happen when we found an all-zero
+     * area, and the next sector to write will not be sector_num + n. */
+    if (s->cluster_sectors > 0 && n >= s->cluster_sectors) {
+        int64_t next_aligned_sector = sector_num + n;
+        next_aligned_sector -= next_aligned_sector % s->cluster_sectors;
+        if (sector_num + n > next_aligned_sector) {
+            n = next_aligned_sector - sector_num;
+        }
+    }
+
+    return n;
+}
+
+static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
+                                        int nb_sectors, uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int64_t src_cur_offset;
+    int src_cur, n, ret;
+
+    /* Only a compressed cluster can span two source images */
+    while (nb_sectors > 0) {
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        n = MIN(nb_sectors,
+                s->src_sectors[src_cur] - (sector_num - src_cur_offset));
+
+        iov.iov_base = buf;
+        iov.iov_len = n * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = bdrv_co_readv(s->src[src_cur], sector_num - src_cur_offset,
+                            n, &qiov);
+        if (ret < 0) {
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
+                                         int nb_sectors, uint8_t *buf,
+                                         enum ImgConvertBlockStatus status)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret, n;
+
+    if (status != BLK_DATA) {
+        /* Zero initialized or covered by the backing file */
+        return 0;
+    }
+
+    if (s->compressed) {
+        if (buffer_is_zero(buf, nb_sectors * BDRV_SECTOR_SIZE)) {
+            return 0;
+        }
+        iov.iov_base = buf;
+        iov.iov_len = nb_sectors * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        return bdrv_co_write_compressed(s->target, sector_num, nb_sectors,
+                                        &qiov);
+    }
+
+    while (nb_sectors > 0) {
+        /* NOTE: at the same time we convert, we do not write zero sectors to
+         * have a chance to compress the image. */
+        n = nb_sectors;
+        if (!s->has_zero_init ||
+            is_allocated_sectors_min(buf, nb_sectors, &n, s->min_sparse)) {
+            iov.iov_base = buf;
+            iov.iov_len = n * BDRV_SECTOR_SIZE;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+
+            ret = bdrv_co_writev(s->target, sector_num, n, &qiov);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+
+    return 0;
+}
+
+typedef struct ConvertWriteCo {
+    ImgConvertState *s;
+    int64_t sector_num;
+    int nb_sectors;
+    uint8_t *buf;
+    enum ImgConvertBlockStatus status;
+    Coroutine *waiter;
+    bool done;
+    int ret;
+} ConvertWriteCo;
+
+static void coroutine_fn convert_co_write_entry(void *opaque)
+{
+    ConvertWriteCo *w = opaque;
+
+    w->ret = convert_co_write(w->s, w->sector_num, w->nb_sectors, w->buf,
+                              w->status);
+    w->done = true;
+    if (w->waiter) {
+        qemu_coroutine_enter(w->waiter, NULL);
+    }
+}
+
+/*
+ * Issues the write of a chunk in its own coroutine and returns as soon as
+ * the write has yielded, i.e. has been submitted.  Formats that allocate
+ * on write (in particular compressed qcow2 clusters) lay the chunks out in
+ * the order they are submitted, so this is the point where the next chunk
+ * may go ahead.
+ */
+static int coroutine_fn convert_co_write_in_order(ImgConvertState *s,
+                                                  int64_t sector_num, int n,
+                                                  uint8_t *buf,
+                                                  enum ImgConvertBlockStatus
+                                                  status)
+{
+    ConvertWriteCo w = {
+        .s          = s,
+        .sector_num = sector_num,
+        .nb_sectors = n,
+        .buf        = buf,
+        .status     = status,
+    };
+    Coroutine *co;
+    int i;
+
+    co = qemu_coroutine_create(convert_co_write_entry);
+    qemu_coroutine_enter(co, &w);
+
+    /* Wake up the coroutine holding the next chunk, if it is already
+     * waiting for us */
+    s->wr_offs = sector_num + n;
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+            qemu_coroutine_enter(s->co[i], NULL);
+            break;
+        }
+    }
+
+    if (!w.done) {
+        w.waiter = qemu_coroutine_self();
+        qemu_coroutine_yield();
+    }
+    return w.ret;
+}
+
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    uint8_t *buf;
+    int ret, i;
+    int index = -1;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    s->running_coroutines++;
+    buf = qemu_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    while (true) {
+        enum ImgConvertBlockStatus status;
+        int64_t sector_num;
+        int n;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        n = convert_iteration_sectors(s, s->sector_num);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            error_report("error while reading block status of sector %"
+                         PRId64 ": %s", s->sector_num, strerror(-n));
+            s->ret = n;
+            break;
+        }
+        sector_num = s->sector_num;
+        status = s->status;
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (status == BLK_DATA) {
+            s->allocated_done += n;
+            qemu_progress_print(100.0 * s->allocated_done /
+                                        s->allocated_sectors, 0);
+
+            ret = convert_co_read(s, sector_num, n, buf);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                s->ret = ret;
+                break;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* Wait until the writes of all earlier chunks are submitted */
+            while (s->wr_offs != sector_num) {
+                if (s->ret != -EINPROGRESS) {
+                    goto out;
+                }
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[index] = -1;
+
+            ret = convert_co_write_in_order(s, sector_num, n, buf, status);
+        } else {
+            ret = convert_co_write(s, sector_num, n, buf, status);
+        }
+        if (ret < 0) {
+            error_report("error while %s sector %" PRId64 ": %s",
+                         s->compressed ? "compressing" : "writing",
+                         sector_num, strerror(-ret));
+            s->ret = ret;
+            break;
+        }
+    }
+
+out:
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+
+    if (s->ret != -EINPROGRESS) {
+        /* Let coroutines waiting for their turn to write see the error */
+        for (i = 0; i < s->num_coroutines; i++) {
+            if (s->co[i] && s->wait_sector_num[i] != -1) {
+                s->wait_sector_num[i] = -1;
+                qemu_coroutine_enter(s->co[i], NULL);
+            }
+        }
+    } else if (!s->running_coroutines) {
+        /* The conversion finished successfully */
+        s->ret = 0;
+    }
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    int64_t sector_num = 0;
+    int i, n;
+
+    if (s->has_zero_init || s->target_has_backing) {
+        /* Find out how much data there is to copy, for the progress */
+        s->allocated_sectors = 0;
+        while (sector_num < s->total_sectors) {
+            n = convert_iteration_sectors(s, sector_num);
+            if (n < 0) {
+                error_report("error while reading block status of sector %"
+                             PRId64 ": %s", sector_num, strerror(-n));
+                return n;
+            }
+            if (s->status == BLK_DATA) {
+                s->allocated_sectors += n;
+            }
+            sector_num += n;
+        }
+        s->sector_next_status = 0;
+    } else {
+        s->allocated_sectors = s->total_sectors;
+    }
+
+    if (!s->allocated_sectors) {
+        /* Nothing to copy; avoid dividing by zero in the progress output */
+        s->allocated_sectors = 1;
+    }
+
+    s->ret = -EINPROGRESS;
+    s->sector_num = 0;
+    s->wr_offs = 0;
+    qemu_co_mutex_init(&s->lock);
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+        s->wait_sector_num[i] = -1;
+        qemu_coroutine_enter(s->co[i], s);
+    }
+
+    while (s->running_coroutines) {
+        main_loop_wait(false);
+    }
+
+    return s->ret;
+}
+
 static int img_convert(int argc, char **argv)
 {
-    int c, n, n1, bs_n, bs_i, compress, cluster_sectors, skip_create;
+    int c, bs_n, bs_i, compress, cluster_sectors, skip_create;
+    int num_coroutines = CONVERT_DEFAULT_COROUTINES;
+    int64_t request_size = 0;
+    bool wr_in_order = true;
     int64_t ret = 0;
     int progress = 0, flags;
     const char *fmt, *out_fmt, *cache, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
     BlockDriverState **bs = NULL, *out_bs = NULL;
-    int64_t total_sectors, nb_sectors, sector_num, bs_offset;
+    int64_t total_sectors;
     uint64_t bs_sectors;
-    uint8_t * buf = NULL;
+    int has_zero_init = 0;
     size_t bufsectors = IO_BUF_SIZE / BDRV_SECTOR_SIZE;
-    const uint8_t *buf1;
     BlockDriverInfo bdi;
     QemuOpts *opts = NULL;
     QemuOptsList *create_opts = NULL;
@@ -1197,6 +1627,7 @@ static int img_convert(int argc, char **argv)
     bool quiet = false;
     Error *local_err = NULL;
     QemuOpts *sn_opts = NULL;
+    ImgConvertState state;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -1205,7 +1636,7 @@ static int img_convert(int argc, char **argv)
     compress = 0;
     skip_create = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:qnl:");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:qnl:m:R:W");
         if (c == -1) {
             break;
         }
@@ -1292,6 +1723,36 @@ static int img_convert(int argc, char **argv)
         case 'n':
             skip_create = 1;
             break;
+        case 'm':
+        {
+            char *end;
+            long val = strtol(optarg, &end, 10);
+            if (*end || val < 1 || val > CONVERT_MAX_COROUTINES) {
+                error_report("Invalid number of parallel requests specified "
+                             "(must be 1 to %d)", CONVERT_MAX_COROUTINES);
+                ret = -1;
+                goto fail_getopt;
+            }
+            num_coroutines = val;
+            break;
+        }
+        case 'R':
+        {
+            char *end;
+            request_size = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (request_size < BDRV_SECTOR_SIZE || *end ||
+                request_size > 32 * 1024 * 1024 ||
+                request_size % BDRV_SECTOR_SIZE) {
+                error_report("Invalid request size specified (must be a "
+                             "multiple of 512 up to 32M)");
+                ret = -1;
+                goto fail_getopt;
+            }
+            break;
+        }
+        case 'W':
+            wr_in_order = false;
+            break;
         }
     }
 
@@ -1408,12 +1869,19 @@ static int img_convert(int argc, char **argv)
         const char *preallocation =
             qemu_opt_get(opts, BLOCK_OPT_PREALLOC);
 
-        if (!drv->bdrv_write_compressed) {
+        if (!bdrv_driver_can_write_compressed(drv)) {
             error_report("Compression not supported for this file format");
             ret = -1;
             goto out;
         }
 
+        if (!wr_in_order) {
+            error_report("Out of order write and compression are mutually "
+                         "exclusive");
+            ret = -1;
+            goto out;
+        }
+
         if (encryption) {
             error_report("Compression and encryption not supported at "
                          "the same time");
@@ -1455,19 +1923,17 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
-    bs_i = 0;
-    bs_offset = 0;
-    bdrv_get_geometry(bs[0], &bs_sectors);
-
     /* increase bufsectors from the default 4096 (2M) if opt_transfer_length
      * or discard_alignment of the out_bs is greater. Limit to 32768 (16MB)
-     * as maximum. */
-    bufsectors = MIN(32768,
-                     MAX(bufsectors, MAX(out_bs->bl.opt_transfer_length,
-                                         out_bs->bl.discard_alignment))
-                    );
-
-    buf = qemu_blockalign(out_bs, bufsectors * BDRV_SECTOR_SIZE);
+     * as maximum.  An explicit request size (-R) overrides this. */
+    if (request_size) {
+        bufsectors = request_size / BDRV_SECTOR_SIZE;
+    } else {
+        bufsectors = MIN(32768,
+                         MAX(bufsectors, MAX(out_bs->bl.opt_transfer_length,
+                                             out_bs->bl.discard_alignment))
+                        );
+    }
 
     if (skip_create) {
         int64_t output_length = bdrv_getlength(out_bs);
@@ -1496,79 +1962,15 @@ static int img_convert(int argc, char **argv)
     }
 
     if (compress) {
-        if (cluster_sectors <= 0 || cluster_sectors > bufsectors) {
+        if (cluster_sectors <= 0) {
             error_report("invalid cluster size");
             ret = -1;
             goto out;
         }
-        sector_num = 0;
-
-        nb_sectors = total_sectors;
-
-        for(;;) {
-            int64_t bs_num;
-            int remainder;
-            uint8_t *buf2;
-
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0)
-                break;
-            if (nb_sectors >= cluster_sectors)
-                n = cluster_sectors;
-            else
-                n = nb_sectors;
-
-            bs_num = sector_num - bs_offset;
-            assert (bs_num >= 0);
-            remainder = n;
-            buf2 = buf;
-            while (remainder > 0) {
-                int nlow;
-                while (bs_num == bs_sectors) {
-                    bs_i++;
-                    assert (bs_i < bs_n);
-                    bs_offset += bs_sectors;
-                    bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                    bs_num = 0;
-                    /* printf("changing part: sector_num=%" PRId64 ", "
-                       "bs_i=%d, bs_offset=%" PRId64 ", bs_sectors=%" PRId64
-                       "\n", sector_num, bs_i, bs_offset, bs_sectors); */
-                }
-                assert (bs_num < bs_sectors);
-
-                nlow = (remainder > bs_sectors - bs_num) ? bs_sectors - bs_num : remainder;
-
-                ret = bdrv_read(bs[bs_i], bs_num, buf2, nlow);
-                if (ret < 0) {
-                    error_report("error while reading sector %" PRId64 ": %s",
-                                 bs_num, strerror(-ret));
-                    goto out;
-                }
-
-                buf2 += nlow * 512;
-                bs_num += nlow;
-
-                remainder -= nlow;
-            }
-            assert (remainder == 0);
-
-            if (!buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)) {
-                ret = bdrv_write_compressed(out_bs, sector_num, buf, n);
-                if (ret != 0) {
-                    error_report("error while compressing sector %" PRId64
-                                 ": %s", sector_num, strerror(-ret));
-                    goto out;
-                }
-            }
-            sector_num += n;
-            qemu_progress_print(100.0 * sector_num / total_sectors, 0);
-        }
-        /* signal EOF to align */
-        bdrv_write_compressed(out_bs, 0, NULL, 0);
+        /* The clusters must be placed in order */
+        wr_in_order = true;
     } else {
-        int64_t sectors_to_read, sectors_read, sector_num_next_status;
-        bool count_allocated_sectors;
-        int has_zero_init = min_sparse ? bdrv_has_zero_init(out_bs) : 0;
+        has_zero_init = min_sparse ? bdrv_has_zero_init(out_bs) : 0;
 
         if (!has_zero_init && bdrv_can_write_zeroes_with_unmap(out_bs)) {
             ret = bdrv_make_zero(out_bs, BDRV_REQ_MAY_UNMAP);
@@ -1577,122 +1979,36 @@ static int img_convert(int argc, char **argv)
             }
             has_zero_init = 1;
         }
+    }
 
-        sectors_to_read = total_sectors;
-        count_allocated_sectors = progress && (out_baseimg || has_zero_init);
-restart:
-        sector_num = 0; // total number of sectors converted so far
-        sectors_read = 0;
-        sector_num_next_status = 0;
-
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                if (count_allocated_sectors) {
-                    sectors_to_read = sectors_read;
-                    count_allocated_sectors = false;
-                    goto restart;
-                }
-                ret = 0;
-                break;
-            }
-
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
-
-            if ((out_baseimg || has_zero_init) &&
-                sector_num >= sector_num_next_status) {
-                n = nb_sectors > INT_MAX ? INT_MAX : nb_sectors;
-                ret = bdrv_get_block_status(bs[bs_i], sector_num - bs_offset,
-                                            n, &n1);
-                if (ret < 0) {
-                    error_report("error while reading block status of sector %"
-                                 PRId64 ": %s", sector_num - bs_offset,
-                                 strerror(-ret));
-                    goto out;
-                }
-                /* If the output image is zero initialized, we are not working
-                 * on a shared base and the input is zero we can skip the next
-                 * n1 sectors */
-                if (has_zero_init && !out_baseimg && (ret & BDRV_BLOCK_ZERO)) {
-                    sector_num += n1;
-                    continue;
-                }
-                /* If the output image is being created as a copy on write
-                 * image, assume that sectors which are unallocated in the
-                 * input image are present in both the output's and input's
-                 * base images (no need to copy them). */
-                if (out_baseimg) {
-                    if (!(ret & BDRV_BLOCK_DATA)) {
-                        sector_num += n1;
-                        continue;
-                    }
-                    /* The next 'n1' sectors are allocated in the input image.
-                     * Copy only those as they may be followed by unallocated
-                     * sectors. */
-                    nb_sectors = n1;
-                }
-                /* avoid redundant callouts to get_block_status */
-                sector_num_next_status = sector_num + n1;
-            }
-
-            n = MIN(nb_sectors, bufsectors);
-
-            /* round down request length to an aligned sector, but
-             * do not bother doing this on short requests. They happen
-             * when we found an all-zero area, and the next sector to
-             * write will not be sector_num + n. */
-            if (cluster_sectors > 0 && n >= cluster_sectors) {
-                int64_t next_aligned_sector = (sector_num + n);
-                next_aligned_sector -= next_aligned_sector % cluster_sectors;
-                if (sector_num + n > next_aligned_sector) {
-                    n = next_aligned_sector - sector_num;
-                }
-            }
+    state = (ImgConvertState) {
+        .src                = bs,
+        .src_sectors        = g_new(int64_t, bs_n),
+        .src_num            = bs_n,
+        .total_sectors      = total_sectors,
+        .target             = out_bs,
+        .has_zero_init      = has_zero_init,
+        .target_has_backing = !compress && out_baseimg,
+        .wr_in_order        = wr_in_order,
+        .compressed         = compress,
+        .min_sparse         = min_sparse,
+        .cluster_sectors    = cluster_sectors,
+        .buf_sectors        = compress ? cluster_sectors : bufsectors,
+        .num_coroutines     = num_coroutines,
+    };
+    for (bs_i = 0; bs_i < bs_n; bs_i++) {
+        bdrv_get_geometry(bs[bs_i], &bs_sectors);
+        state.src_sectors[bs_i] = bs_sectors;
+    }
 
-            n = MIN(n, bs_sectors - (sector_num - bs_offset));
+    ret = total_sectors ? convert_do_copy(&state) : 0;
+    g_free(state.src_sectors);
 
-            sectors_read += n;
-            if (count_allocated_sectors) {
-                sector_num += n;
-                continue;
-            }
-
-            n1 = n;
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error_report("error while reading sector %" PRId64 ": %s",
-                             sector_num - bs_offset, strerror(-ret));
-                goto out;
-            }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                if (!has_zero_init ||
-                    is_allocated_sectors_min(buf1, n, &n1, min_sparse)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing sector %" PRId64
-                                     ": %s", sector_num, strerror(-ret));
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-            qemu_progress_print(100.0 * sectors_read / sectors_to_read, 0);
-        }
+    if (compress && !ret) {
+        /* signal EOF to align */
+        bdrv_write_compressed(out_bs, 0, NULL, 0);
     }
+
 out:
     if (!ret) {
         qemu_progress_print(100, 0);
@@ -1700,7 +2016,6 @@ out:
     qemu_progress_end();
     qemu_opts_del(opts);
     qemu_opts_free(create_opts);
-    qemu_vfree(buf);
     if (sn_opts) {
         qemu_opts_del(sn_opts);
     }
@@ -2686,6 +3001,236 @@ out:
     return 0;
 }
 
+typedef struct BenchData {
+    BlockDriverState *bs;
+    int bufsize;
+    int nrreq;
+    int n;
+    uint8_t *buf;
+    QEMUIOVector *qiov;
+    bool write;
+    bool random;
+    GRand *rand;
+    int in_flight;
+    int64_t image_size;
+    int64_t offset;
+    int ret;
+} BenchData;
+
+static int64_t bench_next_offset(BenchData *b)
+{
+    int64_t offset;
+
+    if (b->random) {
+        return (int64_t) g_rand_int_range(b->rand, 0,
+                                          b->image_size / b->bufsize) *
+               b->bufsize;
+    }
+
+    offset = b->offset;
+    b->offset += b->bufsize;
+    if (b->offset + b->bufsize > b->image_size) {
+        b->offset = 0;
+    }
+    return offset;
+}
+
+static void bench_cb(void *opaque, int ret)
+{
+    BenchData *b = opaque;
+    BlockDriverAIOCB *acb;
+    int64_t offset;
+
+    if (ret < 0) {
+        error_report("Failed request: %s", strerror(-ret));
+        b->ret = ret;
+        b->n = 0;
+    }
+    if (b->in_flight > 0) {
+        b->in_flight--;
+    }
+
+    while (b->n > 0 && b->in_flight < b->nrreq) {
+        offset = bench_next_offset(b);
+        if (b->write) {
+            acb = bdrv_aio_writev(b->bs, offset >> BDRV_SECTOR_BITS, b->qiov,
+                                  b->bufsize >> BDRV_SECTOR_BITS,
+                                  bench_cb, b);
+        } else {
+            acb = bdrv_aio_readv(b->bs, offset >> BDRV_SECTOR_BITS, b->qiov,
+                                 b->bufsize >> BDRV_SECTOR_BITS,
+                                 bench_cb, b);
+        }
+        if (!acb) {
+            error_report("Failed to issue request");
+            b->ret = -EIO;
+            b->n = 0;
+            break;
+        }
+        b->n--;
+        b->in_flight++;
+    }
+}
+
+static int img_bench(int argc, char **argv)
+{
+    int c, ret = 0, flags;
+    const char *fmt = NULL, *filename, *cache = BDRV_DEFAULT_CACHE;
+    bool quiet = false;
+    bool is_write = false;
+    bool is_random = false;
+    int count = 75000;
+    int depth = 64;
+    int bufsize = 4096;
+    BlockDriverState *bs = NULL;
+    BenchData data = {};
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int64_t image_size;
+    int64_t t;
+
+    for (;;) {
+        c = getopt(argc, argv, "hc:d:f:qrs:t:w");
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+        case 'h':
+        case '?':
+            help();
+            break;
+        case 'c':
+        {
+            char *end;
+            long val = strtol(optarg, &end, 10);
+            if (*end || val < 1 || val > INT_MAX) {
+                error_report("Invalid request count specified");
+                return 1;
+            }
+            count = val;
+            break;
+        }
+        case 'd':
+        {
+            char *end;
+            long val = strtol(optarg, &end, 10);
+            if (*end || val < 1 || val > INT_MAX) {
+                error_report("Invalid queue depth specified");
+                return 1;
+            }
+            depth = val;
+            break;
+        }
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'q':
+            quiet = true;
+            break;
+        case 'r':
+            is_random = true;
+            break;
+        case 's':
+        {
+            char *end;
+            int64_t sval = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (sval < BDRV_SECTOR_SIZE || *end ||
+                sval > 32 * 1024 * 1024 || sval % BDRV_SECTOR_SIZE) {
+                error_report("Invalid buffer size specified (must be a "
+                             "multiple of 512 up to 32M)");
+                return 1;
+            }
+            bufsize = sval;
+            break;
+        }
+        case 't':
+            cache = optarg;
+            break;
+        case 'w':
+            is_write = true;
+            break;
+        }
+    }
+
+    if (optind != argc - 1) {
+        error_exit("Expecting one image file name");
+    }
+    filename = argv[argc - 1];
+
+    flags = is_write ? BDRV_O_RDWR : 0;
+    ret = bdrv_parse_cache_flags(cache, &flags);
+    if (ret < 0) {
+        error_report("Invalid cache option: %s", cache);
+        return 1;
+    }
+
+    bs = bdrv_new_open("image", filename, fmt, flags, true, quiet);
+    if (!bs) {
+        return 1;
+    }
+
+    image_size = bdrv_getlength(bs);
+    if (image_size < 0) {
+        error_report("Could not get image size: %s", strerror(-image_size));
+        ret = -1;
+        goto out;
+    }
+    if (image_size < bufsize) {
+        error_report("Image is smaller than the buffer size");
+        ret = -1;
+        goto out;
+    }
+
+    data = (BenchData) {
+        .bs         = bs,
+        .bufsize    = bufsize,
+        .nrreq      = depth,
+        .n          = count,
+        .write      = is_write,
+        .random     = is_random,
+        .rand       = g_rand_new_with_seed(0),
+        .image_size = image_size,
+    };
+    qprintf(quiet, "Sending %d %s%s requests, %d bytes each, %d in parallel\n",
+            data.n, data.random ? "random " : "",
+            data.write ? "write" : "read", data.bufsize, data.nrreq);
+
+    data.buf = qemu_blockalign(bs, data.bufsize);
+    memset(data.buf, is_write ? 0xa5 : 0, data.bufsize);
+    iov.iov_base = data.buf;
+    iov.iov_len = data.bufsize;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    data.qiov = &qiov;
+
+    t = get_clock();
+    bench_cb(&data, 0);
+
+    while (data.n > 0 || data.in_flight > 0) {
+        main_loop_wait(false);
+    }
+    t = get_clock() - t;
+
+    if (data.ret < 0) {
+        ret = -1;
+    } else {
+        qprintf(quiet, "Run completed in %3.3f seconds, %.0f IOPS.\n",
+                t / 1e9, count / (t / 1e9));
+    }
+
+out:
+    if (data.rand) {
+        g_rand_free(data.rand);
+    }
+    qemu_vfree(data.buf);
+    bdrv_unref(bs);
+
+    if (ret) {
+        return 1;
+    }
+    return 0;
+}
+
 static int img_amend(int argc, char **argv)
 {
     int c, ret = 0;
@@ -661,6 +661,30 @@ Example:
 -> { "execute": "migrate_cancel" }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "migrate-start-postcopy",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_start_postcopy,
+    },
+
+SQMP
+migrate-start-postcopy
+----------------------
+
+Switch the current migration to post-copy mode.  The destination starts
+running the guest and requests missing pages from the source.  Requires
+the "postcopy-ram" capability to be enabled on the source before the
+migration is started.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "migrate-start-postcopy" }
+<- { "return": {} }
+
 EQMP
 {
         .name       = "migrate-set-cache-size",
@@ -1049,7 +1073,7 @@ EQMP
     {
         .name       = "drive-backup",
         .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
-                      "on-source-error:s?,on-target-error:s?",
+                      "bitmap:s?,on-source-error:s?,on-target-error:s?",
         .mhandler.cmd_new = qmp_marshal_input_drive_backup,
     },
 
@@ -1076,8 +1100,11 @@ Arguments:
             (json-string, optional)
 - "sync": what parts of the disk image should be copied to the destination;
   possibilities include "full" for all the disk, "top" for only the sectors
-  allocated in the topmost image, or "none" to only replicate new I/O
-  (MirrorSyncMode).
+  allocated in the topmost image, "none" to only replicate new I/O, or
+  "incremental" for only the sectors marked in "bitmap" (MirrorSyncMode).
+- "bitmap": the dirty bitmap to use with sync mode "incremental".  When the
+            backup succeeds, the bitmap is left with only the writes made
+            since it started (json-string, optional)
 - "mode": whether and how QEMU should create a new image
           (NewImageMode, optional, default 'absolute-paths')
 - "speed": the maximum speed, in bytes per second (json-int, optional)
@@ -1367,6 +1394,92 @@ Example:
                                                "format": "qcow2" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-add",
+        .args_type  = "node:s,name:s,granularity:i?,persistent:b?",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_add,
+    },
+
+SQMP
+block-dirty-bitmap-add
+----------------------
+
+Create a named dirty bitmap that tracks writes to a device or graph node,
+for incremental backups with drive-backup.
+
+Arguments:
+
+- "node": device or graph node name (json-string)
+- "name": name of the new bitmap (json-string)
+- "granularity": granularity of the bitmap in bytes, a power of 2 between
+                 512 and 64M (json-int, optional)
+- "persistent": save the bitmap in the image when it is closed, so that it
+                survives a restart of QEMU; needs a qcow2 image with
+                compat=1.1 (json-bool, optional, default false)
+
+The default granularity is the image cluster size, but at least 65536.
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-add", "arguments": { "node": "drive0",
+                                                         "name": "nightly",
+                                                         "persistent": true } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-remove",
+        .args_type  = "node:s,name:s",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_remove,
+    },
+
+SQMP
+block-dirty-bitmap-remove
+-------------------------
+
+Delete a named dirty bitmap, also from the image if it is persistent.  A
+bitmap that is in use by drive-backup cannot be removed.
+
+Arguments:
+
+- "node": device or graph node name (json-string)
+- "name": name of the bitmap (json-string)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-remove", "arguments": { "node": "drive0",
+                                                            "name": "nightly" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-clear",
+        .args_type  = "node:s,name:s",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_clear,
+    },
+
+SQMP
+block-dirty-bitmap-clear
+------------------------
+
+Mark a named dirty bitmap as clean.  A bitmap that is in use by
+drive-backup cannot be cleared.
+
+Arguments:
+
+- "node": device or graph node name (json-string)
+- "name": name of the bitmap (json-string)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-clear", "arguments": { "node": "drive0",
+                                                           "name": "nightly" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -2266,6 +2379,13 @@ Each json-object contain the following:
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
             (json-object, optional)
+- "metadata-caches": Statistics of the metadata caches of the image format,
+                     if it has any (json-array, optional). Each element is a
+                     json-object with:
+    - "name": cache name, e.g. "l2" or "refcount" for qcow2 (json-string)
+    - "size": cache size in bytes (json-int)
+    - "hits": lookups served from the cache (json-int)
+    - "misses": lookups that had to read or replace a table (json-int)
 
 Example:
 
@@ -3044,6 +3164,17 @@ The main json-object contains the following:
             but this way upper levels don't need to care about page
             size (json-int)
          - "dirty-sync-count": times that dirty ram was synchronized (json-int)
+         - "dirty-sync-time": time the last synchronization of dirty ram
+           took, in microseconds (json-int)
+- "cpu-throttle-percentage": percentage of time the vCPUs are throttled by
+  auto-converge, only present if "status" is "active" and auto-converge
+  is enabled (json-int)
+- "ram-block-sync": only present if "status" is "active", a json-array of
+  the RAM blocks with the following information from the last
+  synchronization of dirty ram:
+         - "name": RAM block name (json-string)
+         - "dirty-pages": pages of the block that became dirty (json-int)
+         - "sync-time": time spent on the block in microseconds (json-int)
 - "disk": only present if "status" is "active" and it is a block migration,
   it is a json-object with the following disk information:
          - "transferred": amount transferred in bytes (json-int)
@@ -3054,8 +3185,11 @@ The main json-object contains the following:
          - "cache-size": XBZRLE cache size in bytes
          - "bytes": number of bytes transferred for XBZRLE compressed pages
          - "pages": number of XBZRLE compressed pages
+         - "cache-hit": number of XBZRLE page cache hits
          - "cache-miss": number of XBRZRLE page cache misses
          - "cache-miss-rate": rate of XBRZRLE page cache misses
+         - "cache-eviction": number of pages evicted from the XBZRLE
+           page cache to make room for another page
          - "overflow": number of times XBZRLE overflows.  This means
            that the XBZRLE encoding was bigger than just sent the
            whole page, and then we sent the whole page instead (as as
@@ -3109,8 +3243,21 @@ Examples:
             "duplicate":123,
             "normal":123,
             "normal-bytes":123456,
-            "dirty-sync-count":15
-         }
+            "dirty-sync-count":15,
+            "dirty-sync-time":2100
+         },
+         "ram-block-sync":[
+            {
+               "name":"pc.ram",
+               "dirty-pages":4012,
+               "sync-time":1850
+            },
+            {
+               "name":"vga.vram",
+               "dirty-pages":16,
+               "sync-time":40
+            }
+         ]
       }
    }
 
@@ -3163,8 +3310,10 @@ Examples:
             "cache-size":67108864,
             "bytes":20971520,
             "pages":2444343,
+            "cache-hit":1523102,
             "cache-miss":2244,
             "cache-miss-rate":0.123,
+            "cache-eviction":1100,
             "overflow":34434
          }
       }
@@ -3225,6 +3374,120 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_migrate_capabilities,
     },
 
+SQMP
+migrate-set-parameters
+----------------------
+
+Set migration parameters
+
+- "compress-level": set compression level during migration (json-int)
+- "compress-threads": set compression thread count for migration (json-int)
+- "decompress-threads": set decompression thread count for migration (json-int)
+- "multifd-channels": set the number of multifd connections (json-int)
+- "file-threads": set the number of threads writing RAM to a file (json-int)
+
+Arguments:
+
+Example:
+
+-> { "execute": "migrate-set-parameters" , "arguments":
+      { "compress-level": 1 } }
+
+EQMP
+
+    {
+        .name       = "migrate-set-parameters",
+        .args_type  =
+            "compress-level:i?,compress-threads:i?,decompress-threads:i?,"
+            "multifd-channels:i?,file-threads:i?",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_parameters,
+    },
+SQMP
+query-migrate-parameters
+------------------------
+
+Query current migration parameters
+
+- "parameters": migration parameters value
+         - "compress-level" : compression level value (json-int)
+         - "compress-threads" : compression thread count value (json-int)
+         - "decompress-threads" : decompression thread count value (json-int)
+         - "multifd-channels" : number of multifd connections (json-int)
+         - "file-threads" : number of threads writing RAM to a file (json-int)
+
+Arguments:
+
+Example:
+
+-> { "execute": "query-migrate-parameters" }
+<- {
+      "return": {
+         "file-threads": 4,
+         "multifd-channels": 2,
+         "decompress-threads": 2,
+         "compress-threads": 8,
+         "compress-level": 1
+      }
+   }
+
+EQMP
+
+    {
+        .name       = "query-migrate-parameters",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_parameters,
+    },
+
+SQMP
+query-migrate-stats
+-------------------
+
+Show detailed statistics of the current or last outgoing migration.  They
+are reset when a new migration starts.
+
+- "phases": list of latency statistics, one per phase (json-array):
+         - "phase": "bitmap-sync", "ram-iterate", "xbzrle-encode",
+           "stream-write" or "stop-copy" (json-string)
+         - "count": number of occurrences (json-int)
+         - "total": total time in microseconds (json-int)
+         - "max": longest occurrence in microseconds (json-int)
+         - "histogram": occurrences by duration; element 0 counts those
+           below 1 microsecond, element i those from 2^(i-1) to 2^i
+           microseconds, the last one everything longer (json-array)
+- "pages": what RAM was sent as (json-object):
+         - "zero-pages", "zero-bytes": zero pages (json-int)
+         - "normal-pages", "normal-bytes": full pages (json-int)
+         - "xbzrle-pages", "xbzrle-bytes": XBZRLE encoded pages (json-int)
+         - "compressed-pages", "compressed-bytes": compressed pages
+           (json-int)
+         - "throttle-events": changes of the auto-converge CPU throttle
+           (json-int)
+
+Example:
+
+-> { "execute": "query-migrate-stats" }
+<- { "return": {
+        "phases": [
+           { "phase": "bitmap-sync", "count": 12, "total": 4210,
+             "max": 1210, "histogram": [0, 0, 0, 0, 0, 0, 0, 0, 6, 4, 1,
+                                        1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                        0, 0] },
+           ...
+        ],
+        "pages": { "zero-pages": 250012, "zero-bytes": 2250108,
+                   "normal-pages": 12244, "normal-bytes": 50151424,
+                   "xbzrle-pages": 0, "xbzrle-bytes": 0,
+                   "compressed-pages": 0, "compressed-bytes": 0,
+                   "throttle-events": 0 } } }
+
+EQMP
+
+    {
+        .name       = "query-migrate-stats",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_stats,
+    },
+
 SQMP
 query-balloon
 -------------
@@ -42,6 +42,9 @@
 #include "qemu/iov.h"
 #include "block/snapshot.h"
 #include "block/qapi.h"
+#include "qemu/bswap.h"
+#include "qemu/error-report.h"
+#include "migration/postcopy-ram.h"
 
 
 #ifndef ETH_P_RARP
@@ -596,6 +599,133 @@ bool qemu_savevm_state_blocked(Error **errp)
     return false;
 }
 
+/* Subcommands of QEMU_VM_COMMAND */
+enum qemu_vm_cmd {
+    MIG_CMD_INVALID = 0,           /* Must be 0 */
+    MIG_CMD_POSTCOPY_ADVISE,       /* Prior to any page transfers, just
+                                      warn we might want to do postcopy */
+    MIG_CMD_POSTCOPY_LISTEN,       /* Start listening for incoming
+                                      pages as it's running. */
+    MIG_CMD_POSTCOPY_RUN,          /* Start execution */
+    MIG_CMD_POSTCOPY_RAM_DISCARD,  /* A list of pages to discard that
+                                      were previously sent during
+                                      precopy but are dirty. */
+    MIG_CMD_PACKAGED,              /* Send a wrapped stream within this
+                                      stream */
+    MIG_CMD_MAX
+};
+
+#define MAX_VM_CMD_PACKAGED_SIZE (1ul << 24)
+
+/* Send a 'QEMU_VM_COMMAND' type element with the command and associated data.
+ *
+ * f: QEMUFile to send the command on
+ * command: Command type to send
+ * len: Length of associated data
+ * data: Data associated with command.
+ */
+static void qemu_savevm_command_send(QEMUFile *f,
+                                     enum qemu_vm_cmd command,
+                                     uint32_t len,
+                                     const uint8_t *data)
+{
+    trace_savevm_command_send(command, len);
+    qemu_put_byte(f, QEMU_VM_COMMAND);
+    qemu_put_be16(f, (uint16_t)command);
+    qemu_put_be32(f, len);
+    qemu_put_buffer(f, data, len);
+    qemu_fflush(f);
+}
+
+/* Tell the destination we might switch to postcopy later, and which page
+ * size we use so it can check it is able to.
+ */
+void qemu_savevm_send_postcopy_advise(QEMUFile *f)
+{
+    uint8_t buf[8];
+
+    stq_be_p(buf, TARGET_PAGE_SIZE);
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_ADVISE, sizeof(buf), buf);
+}
+
+/* Prior to running, to cause pages that have been dirtied after precopy
+ * started to be discarded on the destination.
+ * CMD_POSTCOPY_RAM_DISCARD consist of:
+ *      byte   Length of name field (not including 0)
+ *  n x byte   RAM block name
+ *      [n x be64 start, be64 length]  byte ranges within the block
+ *
+ *  name:  RAMBlock name that these entries are part of
+ *  len: Number of page entries
+ *  start_list: 'len' addresses
+ *  length_list: 'len' addresses
+ */
+void qemu_savevm_send_postcopy_ram_discard(QEMUFile *f, const char *name,
+                                           uint16_t len,
+                                           uint64_t *start_list,
+                                           uint64_t *length_list)
+{
+    uint8_t *buf;
+    size_t tmplen;
+    uint16_t t;
+    size_t name_len = strlen(name);
+
+    trace_qemu_savevm_send_postcopy_ram_discard(name, len);
+    assert(name_len < 256);
+    buf = g_malloc0(1 + name_len + len * 16);
+    buf[0] = name_len;
+    memcpy(buf + 1, name, name_len);
+    tmplen = 1 + name_len;
+
+    for (t = 0; t < len; t++) {
+        stq_be_p(buf + tmplen, start_list[t]);
+        tmplen += 8;
+        stq_be_p(buf + tmplen, length_list[t]);
+        tmplen += 8;
+    }
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_RAM_DISCARD, tmplen, buf);
+    g_free(buf);
+}
+
+/* Get the destination into a state where it can receive postcopy data. */
+void qemu_savevm_send_postcopy_listen(QEMUFile *f)
+{
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_LISTEN, 0, NULL);
+}
+
+/* Kick the destination into running */
+void qemu_savevm_send_postcopy_run(QEMUFile *f)
+{
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_RUN, 0, NULL);
+}
+
+/* We have a buffer of data to send; we don't want that all to be loaded
+ * by the command itself, so the command contains just the length of the
+ * extra buffer that we then send straight after it.
+ *
+ * Returns:
+ *    0 on success
+ *    -ve on error
+ */
+int qemu_savevm_send_packaged(QEMUFile *f, const uint8_t *buf, size_t len)
+{
+    uint8_t lenbuf[4];
+
+    if (len > MAX_VM_CMD_PACKAGED_SIZE) {
+        error_report("%s: Unreasonably large packaged state: %zu",
+                     __func__, len);
+        return -1;
+    }
+
+    stl_be_p(lenbuf, len);
+    trace_qemu_savevm_send_packaged();
+    qemu_savevm_command_send(f, MIG_CMD_PACKAGED, sizeof(lenbuf), lenbuf);
+    qemu_put_buffer(f, buf, len);
+    qemu_fflush(f);
+
+    return qemu_file_get_error(f);
+}
+
 void qemu_savevm_state_begin(QEMUFile *f,
                              const MigrationParams *params)
 {
@@ -690,15 +820,11 @@ int qemu_savevm_state_iterate(QEMUFile *f)
     return ret;
 }
 
-void qemu_savevm_state_complete(QEMUFile *f)
+static void qemu_savevm_state_complete_iterables(QEMUFile *f)
 {
     SaveStateEntry *se;
     int ret;
 
-    trace_savevm_state_complete();
-
-    cpu_synchronize_all_states();
-
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         if (!se->ops || !se->ops->save_live_complete) {
             continue;
@@ -720,6 +846,14 @@ void qemu_savevm_state_complete(QEMUFile *f)
             return;
         }
     }
+}
+
+/* Write the full state of every device that is not migrated iteratively */
+void qemu_savevm_state_devices(QEMUFile *f)
+{
+    SaveStateEntry *se;
+
+    cpu_synchronize_all_states();
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         int len;
@@ -743,6 +877,36 @@ void qemu_savevm_state_complete(QEMUFile *f)
         vmstate_save(f, se);
         trace_savevm_section_end(se->idstr, se->section_id);
     }
+}
+
+void qemu_savevm_state_complete(QEMUFile *f)
+{
+    trace_savevm_state_complete();
+
+    cpu_synchronize_all_states();
+
+    qemu_savevm_state_complete_iterables(f);
+    if (qemu_file_get_error(f)) {
+        return;
+    }
+    qemu_savevm_state_devices(f);
+
+    qemu_put_byte(f, QEMU_VM_EOF);
+    qemu_fflush(f);
+}
+
+/*
+ * Finish a postcopy migration: the device state has already been sent by
+ * postcopy_start(), so only the iterative sections remain.
+ */
+void qemu_savevm_state_complete_postcopy(QEMUFile *f)
+{
+    trace_savevm_state_complete_postcopy();
+
+    qemu_savevm_state_complete_iterables(f);
+    if (qemu_file_get_error(f)) {
+        return;
+    }
 
     qemu_put_byte(f, QEMU_VM_EOF);
     qemu_fflush(f);
@@ -871,39 +1035,329 @@ static SaveStateEntry *find_se(const char *idstr, int instance_id)
     return NULL;
 }
 
-typedef struct LoadStateEntry {
+struct LoadStateEntry {
     QLIST_ENTRY(LoadStateEntry) entry;
     SaveStateEntry *se;
     int section_id;
     int version_id;
-} LoadStateEntry;
+};
 
-int qemu_loadvm_state(QEMUFile *f)
+/* Returned by loadvm handlers when the main loadvm loop must stop early */
+#define LOADVM_QUIT     1
+
+static int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis);
+
+static void loadvm_free_handlers(MigrationIncomingState *mis)
 {
-    QLIST_HEAD(, LoadStateEntry) loadvm_handlers =
-        QLIST_HEAD_INITIALIZER(loadvm_handlers);
     LoadStateEntry *le, *new_le;
-    uint8_t section_type;
-    unsigned int v;
+
+    QLIST_FOREACH_SAFE(le, &mis->loadvm_handlers, entry, new_le) {
+        QLIST_REMOVE(le, entry);
+        g_free(le);
+    }
+}
+
+/*
+ * Triggered by a postcopy_listen command; this thread takes over reading
+ * the input stream, leaving the main thread free to carry on loading the
+ * rest of the device state (from RAM).
+ */
+static void *postcopy_ram_listen_thread(void *opaque)
+{
+    QEMUFile *f = opaque;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    int load_res;
+
+    load_res = qemu_loadvm_state_main(f, mis);
+    if (load_res == 0) {
+        load_res = qemu_file_get_error(f);
+    }
+    trace_postcopy_ram_listen_thread_exit(load_res);
+
+    if (load_res < 0) {
+        error_report("%s: loadvm failed: %d", __func__, load_res);
+        migrate_send_rp_shut(mis, 1);
+        /*
+         * The guest is already running here and parts of its RAM are
+         * still on the source, so there is nothing left to recover.
+         */
+        exit(EXIT_FAILURE);
+    }
+
+    postcopy_state_set(mis, POSTCOPY_INCOMING_END);
+    if (postcopy_ram_incoming_cleanup(mis)) {
+        migrate_send_rp_shut(mis, 1);
+        exit(EXIT_FAILURE);
+    }
+    migrate_send_rp_shut(mis, 0);
+
+    loadvm_free_handlers(mis);
+    qemu_fclose(mis->to_src_file);
+    mis->to_src_file = NULL;
+    qemu_fclose(f);
+    mis->from_src_file = NULL;
+    free_xbzrle_decoded_buf();
+    migrate_decompress_threads_join();
+
+    return NULL;
+}
+
+/* After this message we must be able to immediately receive postcopy data */
+static int loadvm_postcopy_handle_advise(MigrationIncomingState *mis,
+                                         uint64_t remote_pagesize)
+{
+    trace_loadvm_postcopy_handle_advise();
+    if (postcopy_state_get(mis) != POSTCOPY_INCOMING_NONE) {
+        error_report("CMD_POSTCOPY_ADVISE in wrong postcopy state (%d)",
+                     postcopy_state_get(mis));
+        return -1;
+    }
+
+    if (remote_pagesize != TARGET_PAGE_SIZE) {
+        error_report("Postcopy needs matching target page sizes (s=%" PRIu64
+                     " d=%d)", remote_pagesize, TARGET_PAGE_SIZE);
+        return -1;
+    }
+
+    if (!postcopy_ram_supported_by_host()) {
+        return -1;
+    }
+
+    if (postcopy_ram_incoming_init(mis)) {
+        return -1;
+    }
+
+    postcopy_state_set(mis, POSTCOPY_INCOMING_ADVISE);
+
+    return 0;
+}
+
+/* After postcopy we will be told to throw some pages away since they're
+ * dirty and will have to be demand fetched.  Must happen before CPU is
+ * started.
+ * There can be 0..many of these messages, each encoding multiple pages.
+ */
+static int loadvm_postcopy_ram_handle_discard(MigrationIncomingState *mis,
+                                              uint32_t len)
+{
+    PostcopyState ps = postcopy_state_get(mis);
+    char ramid[256];
     int ret;
+    uint8_t idlen;
 
-    if (qemu_savevm_state_blocked(NULL)) {
-        return -EINVAL;
+    trace_loadvm_postcopy_ram_handle_discard();
+
+    if (ps != POSTCOPY_INCOMING_ADVISE && ps != POSTCOPY_INCOMING_DISCARD) {
+        error_report("CMD_POSTCOPY_RAM_DISCARD in wrong postcopy state (%d)",
+                     ps);
+        return -1;
     }
+    postcopy_state_set(mis, POSTCOPY_INCOMING_DISCARD);
 
-    v = qemu_get_be32(f);
-    if (v != QEMU_VM_FILE_MAGIC) {
-        return -EINVAL;
+    if (len < 1) {
+        error_report("CMD_POSTCOPY_RAM_DISCARD invalid length (%d)", len);
+        return -1;
     }
+    idlen = qemu_get_byte(mis->from_src_file);
+    len--;
+    if (len < idlen || (len - idlen) % 16) {
+        error_report("CMD_POSTCOPY_RAM_DISCARD invalid length (%d)", len);
+        return -1;
+    }
+    qemu_get_buffer(mis->from_src_file, (uint8_t *)ramid, idlen);
+    ramid[idlen] = '\0';
+    len -= idlen;
 
-    v = qemu_get_be32(f);
-    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
-        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
-        return -ENOTSUP;
+    while (len) {
+        uint64_t start_addr, block_length;
+
+        start_addr = qemu_get_be64(mis->from_src_file);
+        block_length = qemu_get_be64(mis->from_src_file);
+        len -= 16;
+
+        ret = postcopy_ram_discard_range(mis, ramid, start_addr,
+                                         block_length);
+        if (ret) {
+            return ret;
+        }
     }
-    if (v != QEMU_VM_FILE_VERSION) {
-        return -ENOTSUP;
+    trace_loadvm_postcopy_ram_handle_discard_end();
+
+    return 0;
+}
+
+/* After this message we must be able to immediately receive postcopy data */
+static int loadvm_postcopy_handle_listen(MigrationIncomingState *mis)
+{
+    PostcopyState ps = postcopy_state_get(mis);
+
+    trace_loadvm_postcopy_handle_listen();
+    if (ps != POSTCOPY_INCOMING_ADVISE && ps != POSTCOPY_INCOMING_DISCARD) {
+        error_report("CMD_POSTCOPY_LISTEN in wrong postcopy state (%d)", ps);
+        return -1;
+    }
+
+    /* The listen thread reads the stream with blocking I/O */
+    qemu_set_block(qemu_get_fd(mis->from_src_file));
+    mis->to_src_file = qemu_file_get_return_path(mis->from_src_file);
+    if (!mis->to_src_file) {
+        error_report("Unable to open return path for postcopy");
+        return -1;
+    }
+
+    /*
+     * Sensitise RAM - can now generate requests for blocks that don't exist
+     * However, at this point the CPU shouldn't be running, and the IO
+     * shouldn't be doing anything yet so don't actually expect requests
+     */
+    if (postcopy_ram_enable_notify(mis)) {
+        return -1;
+    }
+
+    postcopy_state_set(mis, POSTCOPY_INCOMING_LISTENING);
+    qemu_thread_create(&mis->listen_thread, "postcopy/listen",
+                       postcopy_ram_listen_thread, mis->from_src_file,
+                       QEMU_THREAD_DETACHED);
+
+    return 0;
+}
+
+/* After all discards we can start running and asking for pages */
+static int loadvm_postcopy_handle_run(MigrationIncomingState *mis)
+{
+    Error *local_err = NULL;
+
+    trace_loadvm_postcopy_handle_run();
+    if (postcopy_state_get(mis) < POSTCOPY_INCOMING_LISTENING) {
+        error_report("CMD_POSTCOPY_RUN in wrong postcopy state (%d)",
+                     postcopy_state_get(mis));
+        return -1;
+    }
+
+    cpu_synchronize_all_post_init();
+
+    qemu_announce_self();
+
+    bdrv_clear_incoming_migration_all();
+    /* Make sure all file formats flush their mutable metadata */
+    bdrv_invalidate_cache_all(&local_err);
+    if (local_err) {
+        qerror_report_err(local_err);
+        error_free(local_err);
+        return -1;
+    }
+
+    if (autostart) {
+        /* Hold onto your hats, starting the CPU */
+        vm_start();
+    } else {
+        /* leave it paused and let management decide when to start the CPU */
+        runstate_set(RUN_STATE_PAUSED);
+    }
+
+    return 0;
+}
+
+/* Immediately following this command is a blob of data containing an embedded
+ * chunk of migration stream; read it and load it.
+ */
+static int loadvm_handle_cmd_packaged(MigrationIncomingState *mis,
+                                      uint32_t length)
+{
+    int ret;
+    size_t read;
+    GByteArray *data;
+    QEMUFile *packf;
+
+    if (length > MAX_VM_CMD_PACKAGED_SIZE) {
+        error_report("Unreasonably large packaged state: %u", length);
+        return -1;
+    }
+
+    data = g_byte_array_sized_new(length);
+    g_byte_array_set_size(data, length);
+    read = qemu_get_buffer(mis->from_src_file, data->data, length);
+    if (read != length) {
+        error_report("CMD_PACKAGED: Buffer receive fail ret=%zu length=%u",
+                     read, length);
+        g_byte_array_free(data, true);
+        return -EIO;
+    }
+    trace_loadvm_handle_cmd_packaged(length);
+
+    packf = qemu_bufopen("r", data);
+
+    ret = qemu_loadvm_state_main(packf, mis);
+    trace_loadvm_handle_cmd_packaged_main(ret);
+    qemu_fclose(packf);
+    g_byte_array_free(data, true);
+
+    if (ret == 0 &&
+        postcopy_state_get(mis) >= POSTCOPY_INCOMING_LISTENING) {
+        /* The listen thread has taken over the outer stream */
+        return LOADVM_QUIT;
     }
+    return ret;
+}
+
+/*
+ * Process an incoming 'QEMU_VM_COMMAND'
+ * negative return on error (will issue error message)
+ * 0   just a normal return
+ * LOADVM_QUIT All good, but exit the loop
+ */
+static int loadvm_process_command(QEMUFile *f)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    uint16_t cmd;
+    uint32_t len;
+
+    cmd = qemu_get_be16(f);
+    len = qemu_get_be32(f);
+
+    trace_loadvm_process_command(cmd, len);
+    switch (cmd) {
+    case MIG_CMD_POSTCOPY_ADVISE:
+        if (len != 8) {
+            break;
+        }
+        return loadvm_postcopy_handle_advise(mis, qemu_get_be64(f));
+
+    case MIG_CMD_PACKAGED:
+        if (len != 4) {
+            break;
+        }
+        return loadvm_handle_cmd_packaged(mis, qemu_get_be32(f));
+
+    case MIG_CMD_POSTCOPY_LISTEN:
+        if (len != 0) {
+            break;
+        }
+        return loadvm_postcopy_handle_listen(mis);
+
+    case MIG_CMD_POSTCOPY_RUN:
+        if (len != 0) {
+            break;
+        }
+        return loadvm_postcopy_handle_run(mis);
+
+    case MIG_CMD_POSTCOPY_RAM_DISCARD:
+        return loadvm_postcopy_ram_handle_discard(mis, len);
+
+    default:
+        error_report("VM_COMMAND 0x%x unknown (len 0x%x)", cmd, len);
+        return -EINVAL;
+    }
+
+    error_report("VM_COMMAND 0x%x received with bad length 0x%x", cmd, len);
+    return -EINVAL;
+}
+
+static int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis)
+{
+    LoadStateEntry *le;
+    uint8_t section_type;
+    int ret;
 
     while ((section_type = qemu_get_byte(f)) != QEMU_VM_EOF) {
         uint32_t instance_id, version_id, section_id;
@@ -926,72 +1380,114 @@ int qemu_loadvm_state(QEMUFile *f)
             se = find_se(idstr, instance_id);
             if (se == NULL) {
                 fprintf(stderr, "Unknown savevm section or instance '%s' %d\n", idstr, instance_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Validate version */
             if (version_id > se->version_id) {
                 fprintf(stderr, "savevm: unsupported version %d for '%s' v%d\n",
                         version_id, idstr, se->version_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
-            /* Add entry */
-            le = g_malloc0(sizeof(*le));
-
-            le->se = se;
-            le->section_id = section_id;
-            le->version_id = version_id;
-            QLIST_INSERT_HEAD(&loadvm_handlers, le, entry);
+            if (section_type == QEMU_VM_SECTION_START) {
+                /* Add entry; only started sections are referred to later,
+                 * and the postcopy listen thread may be walking the list
+                 * while the main thread loads full sections.
+                 */
+                le = g_malloc0(sizeof(*le));
+
+                le->se = se;
+                le->section_id = section_id;
+                le->version_id = version_id;
+                QLIST_INSERT_HEAD(&mis->loadvm_handlers, le, entry);
+            }
 
-            ret = vmstate_load(f, le->se, le->version_id);
+            ret = vmstate_load(f, se, version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state for instance 0x%x of device '%s'\n",
                         instance_id, idstr);
-                goto out;
+                return ret;
             }
             break;
         case QEMU_VM_SECTION_PART:
         case QEMU_VM_SECTION_END:
             section_id = qemu_get_be32(f);
 
-            QLIST_FOREACH(le, &loadvm_handlers, entry) {
+            QLIST_FOREACH(le, &mis->loadvm_handlers, entry) {
                 if (le->section_id == section_id) {
                     break;
                 }
             }
             if (le == NULL) {
                 fprintf(stderr, "Unknown savevm section %d\n", section_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state section id %d\n",
                         section_id);
-                goto out;
+                return ret;
+            }
+            break;
+        case QEMU_VM_COMMAND:
+            ret = loadvm_process_command(f);
+            if (ret < 0 || ret == LOADVM_QUIT) {
+                return ret;
             }
             break;
         default:
             fprintf(stderr, "Unknown savevm section type %d\n", section_type);
-            ret = -EINVAL;
-            goto out;
+            return -EINVAL;
         }
     }
 
-    cpu_synchronize_all_post_init();
+    return 0;
+}
 
-    ret = 0;
+int qemu_loadvm_state(QEMUFile *f)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    unsigned int v;
+    int ret;
 
-out:
-    QLIST_FOREACH_SAFE(le, &loadvm_handlers, entry, new_le) {
-        QLIST_REMOVE(le, entry);
-        g_free(le);
+    if (qemu_savevm_state_blocked(NULL)) {
+        return -EINVAL;
     }
 
+    v = qemu_get_be32(f);
+    if (v != QEMU_VM_FILE_MAGIC) {
+        return -EINVAL;
+    }
+
+    v = qemu_get_be32(f);
+    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
+        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
+        return -ENOTSUP;
+    }
+    if (v != QEMU_VM_FILE_VERSION) {
+        return -ENOTSUP;
+    }
+
+    mis->from_src_file = f;
+    ret = qemu_loadvm_state_main(f, mis);
+
+    if (postcopy_state_get(mis) >= POSTCOPY_INCOMING_LISTENING) {
+        /*
+         * The listen thread now owns the stream and the section list, and
+         * the CPUs were synchronized before the guest was started.
+         */
+        return ret == LOADVM_QUIT ? 0 : ret;
+    }
+
+    if (ret == 0) {
+        cpu_synchronize_all_post_init();
+    }
+
+    loadvm_free_handlers(mis);
+    mis->from_src_file = NULL;
+
     if (ret == 0) {
         ret = qemu_file_get_error(f);
     }
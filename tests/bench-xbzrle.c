@@ -0,0 +1,189 @@
+/*
+ * XBZRLE encoder/decoder and zero page scan benchmark
+ *
+ * Runs a short smoke test by default; use "gtester -m=perf" (or
+ * "make check-unit SPEED=perf") to get meaningful GB/s figures.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include <glib.h>
+#include <string.h>
+#include "qemu-common.h"
+#include "include/migration/migration.h"
+
+#define PAGE_SIZE 4096
+#define NR_PAGES  256
+
+typedef struct {
+    uint8_t *old;
+    uint8_t *new;
+    uint8_t *encoded;
+    int *encoded_len;
+} BenchPages;
+
+static unsigned bench_rounds(void)
+{
+    return g_test_perf() ? 4000 : 4;
+}
+
+static void bench_report(const char *what, unsigned rounds, double elapsed)
+{
+    double bytes = (double)rounds * NR_PAGES * PAGE_SIZE;
+
+    g_test_maximized_result(bytes / elapsed / 1e9, "%s: %.2f GB/s%s", what,
+                            bytes / elapsed / 1e9,
+                            host_has_avx2() ? " (AVX2)" : "");
+}
+
+/*
+ * Build NR_PAGES pairs of pages; every page of the new set differs from
+ * the old one in @nr_changes runs of @run_len bytes.
+ */
+static BenchPages *bench_pages_new(int nr_changes, int run_len)
+{
+    BenchPages *p = g_new0(BenchPages, 1);
+    int i, j;
+
+    p->old = qemu_memalign(PAGE_SIZE, NR_PAGES * PAGE_SIZE);
+    p->new = qemu_memalign(PAGE_SIZE, NR_PAGES * PAGE_SIZE);
+    p->encoded = g_malloc(NR_PAGES * PAGE_SIZE);
+    p->encoded_len = g_new0(int, NR_PAGES);
+
+    for (i = 0; i < NR_PAGES * PAGE_SIZE; i++) {
+        p->old[i] = g_test_rand_int_range(0, 256);
+    }
+    memcpy(p->new, p->old, NR_PAGES * PAGE_SIZE);
+
+    for (i = 0; i < NR_PAGES; i++) {
+        uint8_t *page = p->new + i * PAGE_SIZE;
+
+        for (j = 0; j < nr_changes; j++) {
+            int off = g_test_rand_int_range(0, PAGE_SIZE - run_len);
+            int k;
+
+            for (k = 0; k < run_len; k++) {
+                page[off + k] ^= 0xff;
+            }
+        }
+    }
+
+    return p;
+}
+
+static void bench_pages_free(BenchPages *p)
+{
+    qemu_vfree(p->old);
+    qemu_vfree(p->new);
+    g_free(p->encoded);
+    g_free(p->encoded_len);
+    g_free(p);
+}
+
+static void bench_encode(const char *what, int nr_changes, int run_len)
+{
+    BenchPages *p = bench_pages_new(nr_changes, run_len);
+    unsigned rounds = bench_rounds();
+    unsigned r;
+    int i;
+
+    g_test_timer_start();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < NR_PAGES; i++) {
+            p->encoded_len[i] =
+                xbzrle_encode_buffer(p->old + i * PAGE_SIZE,
+                                     p->new + i * PAGE_SIZE, PAGE_SIZE,
+                                     p->encoded + i * PAGE_SIZE, PAGE_SIZE);
+        }
+    }
+    bench_report(what, rounds, g_test_timer_elapsed());
+
+    /* make sure what we measured actually round-trips */
+    for (i = 0; i < NR_PAGES; i++) {
+        uint8_t *page = p->old + i * PAGE_SIZE;
+
+        g_assert(p->encoded_len[i] > 0);
+        g_assert(xbzrle_decode_buffer(p->encoded + i * PAGE_SIZE,
+                                      p->encoded_len[i], page, PAGE_SIZE) ==
+                 PAGE_SIZE);
+        g_assert(memcmp(page, p->new + i * PAGE_SIZE, PAGE_SIZE) == 0);
+    }
+
+    bench_pages_free(p);
+}
+
+static void bench_encode_sparse(void)
+{
+    bench_encode("encode, 4 runs of 8 bytes per page", 4, 8);
+}
+
+static void bench_encode_dense(void)
+{
+    bench_encode("encode, 64 runs of 16 bytes per page", 64, 16);
+}
+
+static void bench_decode(void)
+{
+    BenchPages *p = bench_pages_new(64, 16);
+    unsigned rounds = bench_rounds();
+    unsigned r;
+    int i;
+
+    for (i = 0; i < NR_PAGES; i++) {
+        p->encoded_len[i] =
+            xbzrle_encode_buffer(p->old + i * PAGE_SIZE,
+                                 p->new + i * PAGE_SIZE, PAGE_SIZE,
+                                 p->encoded + i * PAGE_SIZE, PAGE_SIZE);
+        g_assert(p->encoded_len[i] > 0);
+    }
+
+    g_test_timer_start();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < NR_PAGES; i++) {
+            xbzrle_decode_buffer(p->encoded + i * PAGE_SIZE,
+                                 p->encoded_len[i], p->old + i * PAGE_SIZE,
+                                 PAGE_SIZE);
+        }
+    }
+    bench_report("decode, 64 runs of 16 bytes per page", rounds,
+                 g_test_timer_elapsed());
+
+    g_assert(memcmp(p->old, p->new, NR_PAGES * PAGE_SIZE) == 0);
+    bench_pages_free(p);
+}
+
+static void bench_zero_scan(void)
+{
+    uint8_t *buf = qemu_memalign(PAGE_SIZE, NR_PAGES * PAGE_SIZE);
+    unsigned rounds = bench_rounds();
+    unsigned r;
+    int i, nonzero = 0;
+
+    memset(buf, 0, NR_PAGES * PAGE_SIZE);
+
+    g_test_timer_start();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < NR_PAGES; i++) {
+            if (buffer_find_nonzero_offset(buf + i * PAGE_SIZE,
+                                           PAGE_SIZE) != PAGE_SIZE) {
+                nonzero++;
+            }
+        }
+    }
+    bench_report("zero page scan", rounds, g_test_timer_elapsed());
+
+    g_assert(nonzero == 0);
+    qemu_vfree(buf);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/xbzrle/bench/encode_sparse", bench_encode_sparse);
+    g_test_add_func("/xbzrle/bench/encode_dense", bench_encode_dense);
+    g_test_add_func("/xbzrle/bench/decode", bench_decode);
+    g_test_add_func("/xbzrle/bench/zero_scan", bench_zero_scan);
+
+    return g_test_run();
+}
@@ -429,6 +429,209 @@ static void test_wait_event_notifier_noflush(void)
 
 #if !defined(_WIN32)
 
+typedef struct {
+    EventNotifier e;
+    int n;
+    bool ready;
+} PollTestData;
+
+static bool poll_test_poll(void *opaque)
+{
+    PollTestData *data = container_of(opaque, PollTestData, e);
+    return data->ready;
+}
+
+static void poll_test_read(EventNotifier *e)
+{
+    PollTestData *data = container_of(e, PollTestData, e);
+    event_notifier_test_and_clear(e);
+    data->ready = false;
+    data->n++;
+}
+
+static void test_poll_event_notifier(void)
+{
+    PollTestData data = { .n = 0, .ready = false };
+    event_notifier_init(&data.e, false);
+    aio_set_event_notifier(ctx, &data.e, poll_test_read);
+    aio_set_event_notifier_poll(ctx, &data.e, poll_test_poll);
+    aio_context_set_poll_params(ctx, 10 * SCALE_MS, 0, 0, &error_abort);
+    ctx->poll_ns = ctx->poll_max_ns;
+
+    /* Work that is only visible to the poll function, the notifier is
+     * never set.  A blocking aio_poll() must find it by polling.
+     */
+    data.ready = true;
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert(!data.ready);
+
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 1);
+
+    /* aio_notify() is seen by polling, too */
+    aio_notify(ctx);
+    g_assert(!aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+
+    aio_context_set_poll_params(ctx, 0, 0, 0, &error_abort);
+    aio_set_event_notifier(ctx, &data.e, NULL);
+    event_notifier_cleanup(&data.e);
+}
+
+/* More notifiers than EPOLL_ENABLE_THRESHOLD in aio-posix.c */
+#define EPOLL_TEST_NOTIFIERS 80
+
+static void epoll_test_other_cb(EventNotifier *e)
+{
+    EventNotifierTestData *data = container_of(e, EventNotifierTestData, e);
+    g_assert(event_notifier_test_and_clear(e));
+    data->n += 10;
+}
+
+static void test_epoll_event_notifiers(void)
+{
+    AioContext *ectx = aio_context_new();
+    GMainContext *gctx = g_main_context_new();
+    GSource *src = aio_get_g_source(ectx);
+    EventNotifierTestData data[EPOLL_TEST_NOTIFIERS];
+    EventNotifierTestData extra = { .n = 0, .active = 0 };
+    int i;
+
+    g_source_attach(src, gctx);
+
+    for (i = 0; i < EPOLL_TEST_NOTIFIERS; i++) {
+        data[i] = (EventNotifierTestData) { .n = 0, .active = 0 };
+        event_notifier_init(&data[i].e, false);
+        aio_set_event_notifier(ectx, &data[i].e, event_ready_cb);
+    }
+
+    /* The first aio_poll() sees enough fds to switch to epoll */
+    g_assert(!aio_poll(ectx, false));
+#ifdef CONFIG_EPOLL_CREATE1
+    g_assert(ectx->epoll_enabled);
+#endif
+
+    /* Each notifier dispatches its own handler and no other */
+    for (i = 0; i < EPOLL_TEST_NOTIFIERS; i += 7) {
+        event_notifier_set(&data[i].e);
+        g_assert(aio_poll(ectx, true));
+    }
+    for (i = 0; i < EPOLL_TEST_NOTIFIERS; i++) {
+        g_assert_cmpint(data[i].n, ==, i % 7 == 0);
+    }
+
+    /* A new handler is added to the epoll set... */
+    event_notifier_init(&extra.e, false);
+    aio_set_event_notifier(ectx, &extra.e, event_ready_cb);
+    event_notifier_set(&extra.e);
+    g_assert(aio_poll(ectx, true));
+    g_assert_cmpint(extra.n, ==, 1);
+
+    /* ...a changed one is modified in it... */
+    aio_set_event_notifier(ectx, &extra.e, epoll_test_other_cb);
+    event_notifier_set(&extra.e);
+    g_assert(aio_poll(ectx, true));
+    g_assert_cmpint(extra.n, ==, 11);
+
+    /* ...and a removed one is not dispatched any more */
+    aio_set_event_notifier(ectx, &extra.e, NULL);
+    event_notifier_set(&extra.e);
+    g_assert(!aio_poll(ectx, false));
+    g_assert_cmpint(extra.n, ==, 11);
+    event_notifier_cleanup(&extra.e);
+
+    /* Through the GSource, which only watches the epoll fd now */
+    event_notifier_set(&data[1].e);
+    while (g_main_context_iteration(gctx, false)) {
+        /* Do nothing */
+    }
+    g_assert_cmpint(data[1].n, ==, 1);
+    g_assert_cmpint(data[2].n, ==, 0);
+
+    for (i = 0; i < EPOLL_TEST_NOTIFIERS; i++) {
+        aio_set_event_notifier(ectx, &data[i].e, NULL);
+        event_notifier_cleanup(&data[i].e);
+    }
+    g_source_destroy(src);
+    g_source_unref(src);
+    aio_context_unref(ectx);
+    g_main_context_unref(gctx);
+}
+
+/* Benchmark: cost of one wakeup of a context that watches @nfds fds */
+
+#define BENCH_WAKEUPS 10000
+
+static void bench_read_cb(EventNotifier *e)
+{
+    event_notifier_test_and_clear(e);
+}
+
+static int64_t bench_wakeup(int nfds, bool allow_epoll, bool *used_epoll)
+{
+    AioContext *bctx = aio_context_new();
+    EventNotifier *e = g_new(EventNotifier, nfds);
+    int64_t start, ns = -1;
+    int i, n;
+
+#ifdef CONFIG_EPOLL_CREATE1
+    bctx->epoll_available &= allow_epoll;
+#endif
+
+    for (n = 0; n < nfds; n++) {
+        if (event_notifier_init(&e[n], false) < 0) {
+            goto out;
+        }
+        aio_set_event_notifier(bctx, &e[n], bench_read_cb);
+    }
+
+    /* The first aio_poll() picks ppoll() or epoll */
+    aio_poll(bctx, false);
+#ifdef CONFIG_EPOLL_CREATE1
+    *used_epoll = bctx->epoll_enabled;
+#else
+    *used_epoll = false;
+#endif
+
+    start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    for (i = 0; i < BENCH_WAKEUPS; i++) {
+        event_notifier_set(&e[i % nfds]);
+        aio_poll(bctx, true);
+    }
+    ns = (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start) / BENCH_WAKEUPS;
+
+out:
+    while (--n >= 0) {
+        aio_set_event_notifier(bctx, &e[n], NULL);
+        event_notifier_cleanup(&e[n]);
+    }
+    g_free(e);
+    aio_context_unref(bctx);
+    return ns;
+}
+
+static void test_bench_wakeup(void)
+{
+    static const int nfds[] = { 10, 100, 1000 };
+    bool used_epoll;
+    int64_t ppoll_ns, default_ns;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(nfds); i++) {
+        ppoll_ns = bench_wakeup(nfds[i], false, &used_epoll);
+        default_ns = bench_wakeup(nfds[i], true, &used_epoll);
+        if (ppoll_ns < 0 || default_ns < 0) {
+            g_test_message("%4d fds: not enough file descriptors", nfds[i]);
+            continue;
+        }
+        g_test_message("%4d fds: ppoll %" PRId64 " ns/wakeup, "
+                       "default (%s) %" PRId64 " ns/wakeup",
+                       nfds[i], ppoll_ns, used_epoll ? "epoll" : "ppoll",
+                       default_ns);
+    }
+}
+
 static void test_timer_schedule(void)
 {
     TimerTestData data = { .n = 0, .ctx = ctx, .ns = SCALE_MS * 750LL,
@@ -858,7 +1061,12 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
 #if !defined(_WIN32)
+    g_test_add_func("/aio/event/poll",              test_poll_event_notifier);
+    g_test_add_func("/aio/event/epoll",             test_epoll_event_notifiers);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
+    if (g_test_perf()) {
+        g_test_add_func("/aio/bench/wakeup",        test_bench_wakeup);
+    }
 #endif
 
     g_test_add_func("/aio-gsource/notify",                  test_source_notify);
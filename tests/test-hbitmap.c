@@ -295,6 +295,100 @@ static void test_hbitmap_set_overlap(TestHBitmapData *data,
     hbitmap_test_set(data, L3 - 1, L2);
 }
 
+static void test_hbitmap_set_word(TestHBitmapData *data,
+                                  const void *unused)
+{
+    static const size_t pos[] = { 0, 1, L1 + 7, L2 - 1, 1 };
+    static const unsigned long bits[] = {
+        1UL, ~0UL, 0x5aUL, 1UL << (BITS_PER_LONG - 1), 0x0fUL
+    };
+    unsigned expected;
+    int i;
+
+    hbitmap_test_init(data, L3, 0);
+    for (i = 0; i < G_N_ELEMENTS(pos); i++) {
+        expected = ctpopl(bits[i] & ~data->bits[pos[i]]);
+        g_assert_cmpint(hbitmap_set_word(data->hb, pos[i], bits[i]), ==,
+                        expected);
+        data->bits[pos[i]] |= bits[i];
+        hbitmap_test_check(data, 0);
+    }
+
+    /* Nothing new the second time around */
+    for (i = 0; i < G_N_ELEMENTS(pos); i++) {
+        g_assert_cmpint(hbitmap_set_word(data->hb, pos[i], bits[i]), ==, 0);
+    }
+    hbitmap_test_check(data, 0);
+    hbitmap_test_check(data, L1 * 2);
+}
+
+static void test_hbitmap_serialize(TestHBitmapData *data,
+                                   const void *unused)
+{
+    HBitmap *copy;
+    uint64_t len;
+    uint8_t *buf;
+
+    hbitmap_test_init(data, L2 + 3, 0);
+    len = hbitmap_serialization_size(data->hb);
+    g_assert_cmpint(len, ==, DIV_ROUND_UP(L2 + 3, 64) * 8);
+
+    hbitmap_test_set(data, 9, 1);
+    hbitmap_test_set(data, L1 + 2, L1);
+    hbitmap_test_set(data, L2, 3);
+
+    buf = g_malloc0(len);
+    hbitmap_serialize(data->hb, buf);
+
+    /* Bit N is bit N % 8 of byte N / 8, whatever the host */
+    g_assert_cmpint(buf[0], ==, 0);
+    g_assert_cmpint(buf[1], ==, 0x02);
+    g_assert_cmpint(buf[L2 / 8], ==, 0x07);
+
+    copy = hbitmap_alloc(L2 + 3, 0);
+    hbitmap_deserialize(copy, buf);
+    hbitmap_free(data->hb);
+    data->hb = copy;
+    hbitmap_test_check(data, 0);
+
+    /* Padding past the end of the bitmap is ignored */
+    buf[len - 1] = 0xff;
+    copy = hbitmap_alloc(L2 + 3, 0);
+    hbitmap_deserialize(copy, buf);
+    hbitmap_free(data->hb);
+    data->hb = copy;
+    hbitmap_test_check(data, 0);
+
+    g_free(buf);
+}
+
+static void test_hbitmap_merge(TestHBitmapData *data,
+                               const void *unused)
+{
+    HBitmap *other;
+
+    hbitmap_test_init(data, L3, 0);
+    hbitmap_test_set(data, 0, 10);
+    hbitmap_test_set(data, L2 - 1, 2);
+
+    other = hbitmap_alloc(L3, 0);
+    hbitmap_set(other, 5, 10);
+    hbitmap_set(other, L3 - 1, 1);
+    g_assert(hbitmap_merge(data->hb, other));
+    hbitmap_free(other);
+
+    hbitmap_test_set(data, 5, 10);
+    hbitmap_test_set(data, L3 - 1, 1);
+    hbitmap_test_check(data, 0);
+
+    /* Bitmaps of different size cannot be merged */
+    other = hbitmap_alloc(L2, 0);
+    hbitmap_set(other, 100, 1);
+    g_assert(!hbitmap_merge(data->hb, other));
+    hbitmap_free(other);
+    hbitmap_test_check(data, 0);
+}
+
 static void test_hbitmap_reset_empty(TestHBitmapData *data,
                                      const void *unused)
 {
@@ -392,6 +486,9 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/set/general", test_hbitmap_set);
     hbitmap_test_add("/hbitmap/set/twice", test_hbitmap_set_twice);
     hbitmap_test_add("/hbitmap/set/overlap", test_hbitmap_set_overlap);
+    hbitmap_test_add("/hbitmap/set/word", test_hbitmap_set_word);
+    hbitmap_test_add("/hbitmap/serialize", test_hbitmap_serialize);
+    hbitmap_test_add("/hbitmap/merge", test_hbitmap_merge);
     hbitmap_test_add("/hbitmap/reset/empty", test_hbitmap_reset_empty);
     hbitmap_test_add("/hbitmap/reset/general", test_hbitmap_reset);
     hbitmap_test_add("/hbitmap/granularity", test_hbitmap_granularity);
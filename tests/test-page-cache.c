@@ -0,0 +1,114 @@
+/*
+ * Page cache unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include <glib.h>
+#include <string.h>
+#include "qemu-common.h"
+#include "migration/page_cache.h"
+
+#define PAGE_SIZE 4096
+#define NUM_PAGES 64
+
+static uint8_t page[PAGE_SIZE];
+
+static uint8_t *fill_page(uint8_t val)
+{
+    memset(page, val, PAGE_SIZE);
+    return page;
+}
+
+static void test_insert_lookup(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE);
+    uint8_t *data;
+
+    g_assert(cache);
+    g_assert(!cache_is_cached(cache, 0));
+    g_assert(!get_cached_data(cache, 0));
+
+    g_assert_cmpint(cache_insert(cache, 0, fill_page(1)), ==, 0);
+    g_assert(cache_is_cached(cache, 0));
+    data = get_cached_data(cache, 0);
+    g_assert(data && data[0] == 1 && data[PAGE_SIZE - 1] == 1);
+
+    /* overwriting a cached page is not an eviction */
+    g_assert_cmpint(cache_insert(cache, 0, fill_page(2)), ==, 0);
+    g_assert(get_cached_data(cache, 0)[0] == 2);
+
+    cache_fini(cache);
+}
+
+static void test_colliding_pages(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE);
+    uint64_t stride = (uint64_t)NUM_PAGES * PAGE_SIZE;
+    int i;
+
+    /* pages a multiple of the cache size apart share a set */
+    g_assert_cmpint(cache_insert(cache, 0, fill_page(1)), ==, 0);
+    g_assert_cmpint(cache_insert(cache, stride, fill_page(2)), ==, 0);
+    g_assert(cache_is_cached(cache, 0));
+    g_assert(cache_is_cached(cache, stride));
+
+    /* fill the set up, keeping page 0 hot */
+    for (i = 2; i < 4; i++) {
+        g_assert(get_cached_data(cache, 0));
+        g_assert_cmpint(cache_insert(cache, i * stride, fill_page(i)), ==, 0);
+    }
+
+    /* the set is full now, so this evicts the least recently used page */
+    g_assert(get_cached_data(cache, 0));
+    g_assert_cmpint(cache_insert(cache, 4 * stride, fill_page(4)), ==, 1);
+    g_assert(cache_is_cached(cache, 0));
+    g_assert(!cache_is_cached(cache, stride));
+    g_assert(cache_is_cached(cache, 4 * stride));
+
+    cache_fini(cache);
+}
+
+static void test_resize(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE);
+    int i;
+
+    for (i = 0; i < NUM_PAGES; i++) {
+        g_assert_cmpint(cache_insert(cache, (uint64_t)i * PAGE_SIZE,
+                                     fill_page(i)), ==, 0);
+    }
+    /* touch the second half so it is the most recently used */
+    for (i = NUM_PAGES / 2; i < NUM_PAGES; i++) {
+        g_assert(get_cached_data(cache, (uint64_t)i * PAGE_SIZE));
+    }
+
+    g_assert_cmpint(cache_resize(cache, NUM_PAGES / 2), ==, NUM_PAGES / 2);
+
+    for (i = 0; i < NUM_PAGES / 2; i++) {
+        g_assert(!cache_is_cached(cache, (uint64_t)i * PAGE_SIZE));
+    }
+    for (i = NUM_PAGES / 2; i < NUM_PAGES; i++) {
+        uint8_t *data = get_cached_data(cache, (uint64_t)i * PAGE_SIZE);
+        g_assert(data && data[0] == i);
+    }
+
+    /* growing keeps everything */
+    g_assert_cmpint(cache_resize(cache, NUM_PAGES * 2), ==, NUM_PAGES * 2);
+    for (i = NUM_PAGES / 2; i < NUM_PAGES; i++) {
+        g_assert(cache_is_cached(cache, (uint64_t)i * PAGE_SIZE));
+    }
+
+    cache_fini(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page_cache/insert_lookup", test_insert_lookup);
+    g_test_add_func("/page_cache/colliding_pages", test_colliding_pages);
+    g_test_add_func("/page_cache/resize", test_resize);
+
+    return g_test_run();
+}
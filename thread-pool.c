@@ -198,6 +198,24 @@ restart:
     }
 }
 
+/* Checks for finished requests without reading the event notifier */
+static bool event_notifier_poll(void *opaque)
+{
+    ThreadPool *pool = container_of(opaque, ThreadPool, notifier);
+    ThreadPoolElement *elem;
+
+    QLIST_FOREACH(elem, &pool->head, all) {
+        enum ThreadState state = atomic_read(&elem->state);
+
+        if (state == THREAD_DONE || state == THREAD_CANCELED) {
+            /* Read state before ret, as in event_notifier_ready() */
+            smp_rmb();
+            return true;
+        }
+    }
+    return false;
+}
+
 static void thread_pool_cancel(BlockDriverAIOCB *acb)
 {
     ThreadPoolElement *elem = (ThreadPoolElement *)acb;
@@ -306,6 +324,7 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     QTAILQ_INIT(&pool->request_list);
 
     aio_set_event_notifier(ctx, &pool->notifier, event_notifier_ready);
+    aio_set_event_notifier_poll(ctx, &pool->notifier, event_notifier_poll);
 }
 
 ThreadPool *thread_pool_new(AioContext *ctx)
@@ -31,6 +31,15 @@
 #include "qemu/iov.h"
 #include "net/net.h"
 
+#ifdef CONFIG_AVX2_OPT
+#include <cpuid.h>
+#include <immintrin.h>
+
+#ifndef bit_AVX2
+#define bit_AVX2 (1 << 5)
+#endif
+#endif
+
 void strpadcpy(char *buf, int buf_size, const char *str, char pad)
 {
     int len = qemu_strnlen(str, buf_size);
@@ -186,14 +195,12 @@ int qemu_fdatasync(int fd)
  * If the buffer is all zero the return value is equal to len.
  */
 
-size_t buffer_find_nonzero_offset(const void *buf, size_t len)
+static size_t buffer_find_nonzero_offset_inner(const void *buf, size_t len)
 {
     const VECTYPE *p = buf;
     const VECTYPE zero = (VECTYPE){0};
     size_t i;
 
-    assert(can_use_buffer_find_nonzero_offset(buf, len));
-
     if (!len) {
         return 0;
     }
@@ -221,6 +228,94 @@ size_t buffer_find_nonzero_offset(const void *buf, size_t len)
     return i * sizeof(VECTYPE);
 }
 
+#if defined(CONFIG_AVX2_OPT) && defined(__SSE2__)
+/*
+ * Same as buffer_find_nonzero_offset_inner(), but ORs together a whole
+ * unrolled block with two pairs of 256-bit loads.  The buffer is only
+ * guaranteed to be aligned to sizeof(VECTYPE), so use unaligned loads.
+ */
+static size_t __attribute__((target("avx2")))
+buffer_find_nonzero_offset_avx2(const void *buf, size_t len)
+{
+    const VECTYPE *p = buf;
+    const VECTYPE zero = (VECTYPE){0};
+    size_t i;
+
+    if (!len) {
+        return 0;
+    }
+
+    for (i = 0; i < BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR; i++) {
+        if (!ALL_EQ(p[i], zero)) {
+            return i * sizeof(VECTYPE);
+        }
+    }
+
+    for (i = BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR;
+         i < len / sizeof(VECTYPE);
+         i += BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR) {
+        const __m256i *q = (const __m256i *)(p + i);
+        __m256i tmp0 = _mm256_or_si256(_mm256_loadu_si256(q + 0),
+                                       _mm256_loadu_si256(q + 1));
+        __m256i tmp1 = _mm256_or_si256(_mm256_loadu_si256(q + 2),
+                                       _mm256_loadu_si256(q + 3));
+        tmp0 = _mm256_or_si256(tmp0, tmp1);
+        if (!_mm256_testz_si256(tmp0, tmp0)) {
+            break;
+        }
+    }
+
+    return i * sizeof(VECTYPE);
+}
+#endif
+
+static size_t (*buffer_find_nonzero_offset_fn)(const void *buf, size_t len) =
+    buffer_find_nonzero_offset_inner;
+
+static void __attribute__((constructor)) init_buffer_find_nonzero_offset(void)
+{
+#if defined(CONFIG_AVX2_OPT) && defined(__SSE2__)
+    if (host_has_avx2()) {
+        buffer_find_nonzero_offset_fn = buffer_find_nonzero_offset_avx2;
+    }
+#endif
+}
+
+size_t buffer_find_nonzero_offset(const void *buf, size_t len)
+{
+    assert(can_use_buffer_find_nonzero_offset(buf, len));
+
+    return buffer_find_nonzero_offset_fn(buf, len);
+}
+
+bool host_has_avx2(void)
+{
+#ifdef CONFIG_AVX2_OPT
+    unsigned a, b, c, d;
+    int max = __get_cpuid_max(0, 0);
+
+    if (max < 7) {
+        return false;
+    }
+
+    __cpuid(1, a, b, c, d);
+    if (!(c & bit_OSXSAVE) || !(c & bit_AVX)) {
+        return false;
+    }
+
+    /* The OS must save and restore the YMM registers too */
+    asm("xgetbv" : "=a" (a), "=d" (d) : "c" (0));
+    if ((a & 6) != 6) {
+        return false;
+    }
+
+    __cpuid_count(7, 0, a, b, c, d);
+    return b & bit_AVX2;
+#else
+    return false;
+#endif
+}
+
 /*
  * Checks if a buffer is all zeroes
  *
@@ -274,6 +274,33 @@ void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count)
     hb_set_between(hb, HBITMAP_LEVELS - 1, start, last);
 }
 
+/* OR @bits into the @pos-th word of the last level */
+static unsigned hb_set_word(HBitmap *hb, size_t pos, unsigned long bits)
+{
+    unsigned long *elem = &hb->levels[HBITMAP_LEVELS - 1][pos];
+    unsigned long new_bits = bits & ~*elem;
+
+    assert(((uint64_t)pos << BITS_PER_LEVEL) < hb->size);
+
+    if (!new_bits) {
+        return 0;
+    }
+
+    /* Only the first bit set in a word changes the upper levels.  */
+    if (*elem == 0) {
+        hb_set_between(hb, HBITMAP_LEVELS - 2, pos, pos);
+    }
+    *elem |= new_bits;
+    hb->count += ctpopl(new_bits);
+    return ctpopl(new_bits);
+}
+
+unsigned hbitmap_set_word(HBitmap *hb, size_t pos, unsigned long bits)
+{
+    assert(hb->granularity == 0);
+    return hb_set_word(hb, pos, bits);
+}
+
 /* Resetting works the other way round: propagate up if the new
  * value is zero.
  */
@@ -362,6 +389,72 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
 }
 
+bool hbitmap_merge(HBitmap *a, const HBitmap *b)
+{
+    const unsigned long *bits = b->levels[HBITMAP_LEVELS - 1];
+    size_t nwords = DIV_ROUND_UP(b->size, BITS_PER_LONG);
+    size_t pos;
+
+    if (a->size != b->size || a->granularity != b->granularity) {
+        return false;
+    }
+
+    for (pos = 0; pos < nwords; pos++) {
+        if (bits[pos]) {
+            hb_set_word(a, pos, bits[pos]);
+        }
+    }
+    return true;
+}
+
+/* The serialized form is the last level as a little-endian array of bytes,
+ * padded to a multiple of 64 bits, so that it does not depend on the size
+ * of a long or on the host byte order.
+ */
+uint64_t hbitmap_serialization_size(const HBitmap *hb)
+{
+    return DIV_ROUND_UP(hb->size, 64) * 8;
+}
+
+void hbitmap_serialize(const HBitmap *hb, uint8_t *buf)
+{
+    const unsigned long *bits = hb->levels[HBITMAP_LEVELS - 1];
+    size_t nwords = DIV_ROUND_UP(hb->size, BITS_PER_LONG);
+    uint64_t len = hbitmap_serialization_size(hb);
+    uint64_t i;
+
+    for (i = 0; i < len; i++) {
+        size_t pos = i / sizeof(unsigned long);
+        unsigned shift = (i % sizeof(unsigned long)) * 8;
+
+        buf[i] = pos < nwords ? bits[pos] >> shift : 0;
+    }
+}
+
+void hbitmap_deserialize(HBitmap *hb, const uint8_t *buf)
+{
+    size_t nwords = DIV_ROUND_UP(hb->size, BITS_PER_LONG);
+    size_t pos;
+    unsigned i;
+
+    for (pos = 0; pos < nwords; pos++) {
+        unsigned long bits = 0;
+
+        for (i = 0; i < sizeof(unsigned long); i++) {
+            bits |= (unsigned long)buf[pos * sizeof(unsigned long) + i]
+                    << (i * 8);
+        }
+
+        /* Ignore padding bits past the end */
+        if (pos == nwords - 1 && (hb->size & (BITS_PER_LONG - 1))) {
+            bits &= (1UL << (hb->size & (BITS_PER_LONG - 1))) - 1;
+        }
+        if (bits) {
+            hb_set_word(hb, pos, bits);
+        }
+    }
+}
+
 void hbitmap_free(HBitmap *hb)
 {
     unsigned i;
@@ -11,8 +11,13 @@
  *
  */
 #include "qemu-common.h"
+#include "qemu/host-utils.h"
 #include "include/migration/migration.h"
 
+#ifdef CONFIG_AVX2_OPT
+#include <immintrin.h>
+#endif
+
 /*
   page = zrun nzrun
        | zrun nzrun page
@@ -23,17 +28,14 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+static int xbzrle_encode_buffer_generic(uint8_t *old_buf, uint8_t *new_buf,
+                                        int slen, uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
     long res;
     uint8_t *nzrun_start = NULL;
 
-    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
-               sizeof(long)));
-
     while (i < slen) {
         /* overflow */
         if (d + 2 > dlen) {
@@ -125,6 +127,193 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return d;
 }
 
+#ifdef __SSE2__
+/*
+ * The vector encoders produce exactly the same output as the generic one.
+ * They only differ in how the end of a run is found: compare a whole
+ * vector of bytes at once and locate the first byte that ends the run
+ * from the comparison mask.
+ */
+typedef int XBZRLEScanFunc(const uint8_t *old_buf, const uint8_t *new_buf,
+                           int i, int slen);
+
+static inline int xbzrle_encode_buffer_vec(uint8_t *old_buf,
+                                           uint8_t *new_buf, int slen,
+                                           uint8_t *dst, int dlen,
+                                           XBZRLEScanFunc *find_diff,
+                                           XBZRLEScanFunc *find_same)
+{
+    uint32_t zrun_len, nzrun_len;
+    int d = 0, i = 0, start;
+
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        start = i;
+        i = find_diff(old_buf, new_buf, i, slen);
+        zrun_len = i - start;
+
+        /* buffer unchanged */
+        if (zrun_len == slen) {
+            return 0;
+        }
+
+        /* skip last zero run */
+        if (i == slen) {
+            return d;
+        }
+
+        d += uleb128_encode_small(dst + d, zrun_len);
+
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        start = i;
+        i = find_same(old_buf, new_buf, i, slen);
+        nzrun_len = i - start;
+
+        d += uleb128_encode_small(dst + d, nzrun_len);
+        /* overflow */
+        if (d + nzrun_len > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + start, nzrun_len);
+        d += nzrun_len;
+    }
+
+    return d;
+}
+
+/* Return the index of the first byte from i on that differs */
+static inline int xbzrle_find_diff_sse2(const uint8_t *old_buf,
+                                        const uint8_t *new_buf,
+                                        int i, int slen)
+{
+    while (i + 16 <= slen) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) ^ 0xffff;
+
+        if (mask) {
+            return i + ctz32(mask);
+        }
+        i += 16;
+    }
+
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+/* Return the index of the first byte from i on that is unchanged */
+static inline int xbzrle_find_same_sse2(const uint8_t *old_buf,
+                                        const uint8_t *new_buf,
+                                        int i, int slen)
+{
+    while (i + 16 <= slen) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+
+        if (mask) {
+            return i + ctz32(mask);
+        }
+        i += 16;
+    }
+
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int xbzrle_encode_buffer_sse2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_buffer_vec(old_buf, new_buf, slen, dst, dlen,
+                                    xbzrle_find_diff_sse2,
+                                    xbzrle_find_same_sse2);
+}
+#endif
+
+#if defined(CONFIG_AVX2_OPT) && defined(__SSE2__)
+static inline int __attribute__((target("avx2")))
+xbzrle_find_diff_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                      int i, int slen)
+{
+    while (i + 32 <= slen) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t mask = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+        if (mask) {
+            return i + ctz32(mask);
+        }
+        i += 32;
+    }
+
+    return xbzrle_find_diff_sse2(old_buf, new_buf, i, slen);
+}
+
+static inline int __attribute__((target("avx2")))
+xbzrle_find_same_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                      int i, int slen)
+{
+    while (i + 32 <= slen) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+        if (mask) {
+            return i + ctz32(mask);
+        }
+        i += 32;
+    }
+
+    return xbzrle_find_same_sse2(old_buf, new_buf, i, slen);
+}
+
+static int __attribute__((target("avx2")))
+xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                          uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_buffer_vec(old_buf, new_buf, slen, dst, dlen,
+                                    xbzrle_find_diff_avx2,
+                                    xbzrle_find_same_avx2);
+}
+#endif
+
+static int (*xbzrle_encode_buffer_fn)(uint8_t *old_buf, uint8_t *new_buf,
+                                      int slen, uint8_t *dst, int dlen) =
+    xbzrle_encode_buffer_generic;
+
+static void __attribute__((constructor)) init_xbzrle_encode_buffer(void)
+{
+#ifdef __SSE2__
+    xbzrle_encode_buffer_fn = xbzrle_encode_buffer_sse2;
+#endif
+#if defined(CONFIG_AVX2_OPT) && defined(__SSE2__)
+    if (host_has_avx2()) {
+        xbzrle_encode_buffer_fn = xbzrle_encode_buffer_avx2;
+    }
+#endif
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
+               sizeof(long)));
+
+    return xbzrle_encode_buffer_fn(old_buf, new_buf, slen, dst, dlen);
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;